@@ -0,0 +1,256 @@
+/*
+ * The TCP Scanner (tcp-scan) is Copyright (C) 2003-2013 Roy Hills,
+ * NTA Monitor Ltd.
+ *
+ * This file is part of tcp-scan.
+ *
+ * tcp-scan is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * tcp-scan is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with tcp-scan.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * benchutils -- Microbenchmarks for the tcp-scan utility functions
+ *
+ * Usage: benchutils [<runs> [<name>]]
+ *
+ * This times the utility functions that are called for every probe or
+ * response: in_cksum(), printable(), make_message(), timeval_diff(),
+ * my_ntoa() and the str_to_*() option parsers.  Each benchmark has a
+ * fixed number of iterations per run.  It is run once to warm up the
+ * caches and branch predictors, and then <runs> times (default
+ * DEFAULT_RUNS).  If <name> is given, only that benchmark is run.
+ *
+ * The report has one line per benchmark with tab-separated fields, so
+ * that results from different builds can be compared with a script:
+ *
+ *	name iterations runs min_ns median_ns max_ns
+ *
+ * where the times are per call.  Compare the minimum or median between
+ * builds; the maximum shows how noisy the machine was.
+ */
+
+#include "tcp-scan.h"
+
+#define DEFAULT_RUNS 7
+
+typedef struct {
+   const char *name;			/* Benchmark name in the report */
+   unsigned iterations;			/* Calls per run */
+   void (*func)(unsigned);		/* Make the given number of calls */
+} benchmark;
+
+/*
+ * Results are accumulated here so that the compiler cannot discard the
+ * calls being timed.
+ */
+static volatile unsigned long sink;
+
+/* A SYN-ACK IP and TCP header with options, as sent or received */
+static uint16_t packet[1500/2];
+
+/* A typical banner, and a binary payload that needs escaping */
+static const unsigned char banner[] = "SSH-2.0-OpenSSH_9.6p1 Ubuntu-3ubuntu13\r\n";
+static unsigned char binary[256];
+
+static void
+bench_cksum_40(unsigned n) {
+   unsigned i;
+
+   for (i=0; i<n; i++) {
+      packet[0] = i;
+      sink += in_cksum(packet, 40);
+   }
+}
+
+static void
+bench_cksum_1500(unsigned n) {
+   unsigned i;
+
+   for (i=0; i<n; i++) {
+      packet[0] = i;
+      sink += in_cksum(packet, 1500);
+   }
+}
+
+static void
+bench_printable_banner(unsigned n) {
+   unsigned i;
+
+   for (i=0; i<n; i++) {
+      char *s = printable(banner, sizeof(banner) - 1);
+
+      sink += s[0];
+      free(s);
+   }
+}
+
+static void
+bench_printable_binary(unsigned n) {
+   unsigned i;
+
+   for (i=0; i<n; i++) {
+      char *s = printable(binary, sizeof(binary));
+
+      sink += s[0];
+      free(s);
+   }
+}
+
+static void
+bench_make_message(unsigned n) {
+   unsigned i;
+
+   for (i=0; i<n; i++) {
+      char *s = make_message("%s\t%u\t%s", "192.168.100.200", i & 0xffff,
+                             "OPEN");
+
+      sink += s[0];
+      free(s);
+   }
+}
+
+static void
+bench_timeval_diff(unsigned n) {
+   struct timeval a;
+   struct timeval b;
+   struct timeval diff;
+   unsigned i;
+
+   b.tv_sec = 1500000000;
+   b.tv_usec = 999999;
+   a.tv_sec = 1500000001;
+   for (i=0; i<n; i++) {
+      a.tv_usec = i % 1000000;
+      timeval_diff(&a, &b, &diff);
+      sink += diff.tv_usec;
+   }
+}
+
+static void
+bench_my_ntoa(unsigned n) {
+   ip_address addr;
+   unsigned i;
+
+   for (i=0; i<n; i++) {
+      addr.v4.s_addr = htonl(0xc0a80000 + i);
+      sink += my_ntoa(addr, 0)[0];
+   }
+}
+
+static void
+bench_str_to_interval(unsigned n) {
+   unsigned i;
+
+   for (i=0; i<n; i++)
+      sink += str_to_interval("250u");
+}
+
+static void
+bench_str_to_bandwidth(unsigned n) {
+   unsigned i;
+
+   for (i=0; i<n; i++)
+      sink += str_to_bandwidth("100M");
+}
+
+static void
+bench_str_to_size(unsigned n) {
+   unsigned i;
+
+   for (i=0; i<n; i++)
+      sink += str_to_size("64K");
+}
+
+static const benchmark benchmarks[] = {
+   {"in_cksum_40", 2000000, bench_cksum_40},
+   {"in_cksum_1500", 200000, bench_cksum_1500},
+   {"printable_banner", 1000000, bench_printable_banner},
+   {"printable_binary", 200000, bench_printable_binary},
+   {"make_message", 500000, bench_make_message},
+   {"timeval_diff", 10000000, bench_timeval_diff},
+   {"my_ntoa", 2000000, bench_my_ntoa},
+   {"str_to_interval", 2000000, bench_str_to_interval},
+   {"str_to_bandwidth", 2000000, bench_str_to_bandwidth},
+   {"str_to_size", 2000000, bench_str_to_size}
+};
+
+/*
+ *	monotonic_ns -- Return a monotonic time in nanoseconds
+ */
+static TCP_UINT64
+monotonic_ns(void) {
+   struct timespec ts;
+
+   if (clock_gettime(CLOCK_MONOTONIC, &ts) != 0)
+      err_sys("clock_gettime");
+   return (TCP_UINT64)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/*
+ *	ns_compare -- qsort() comparison function for run times
+ */
+static int
+ns_compare(const void *a, const void *b) {
+   TCP_UINT64 na = *(const TCP_UINT64 *) a;
+   TCP_UINT64 nb = *(const TCP_UINT64 *) b;
+
+   return na < nb ? -1 : na > nb;
+}
+
+int
+main(int argc, char *argv[]) {
+   unsigned runs = DEFAULT_RUNS;
+   const char *only = NULL;
+   TCP_UINT64 *times;
+   unsigned b;
+   unsigned i;
+
+   if (argc > 3) {
+      fprintf(stderr, "Usage: benchutils [<runs> [<name>]]\n");
+      return EXIT_FAILURE;
+   }
+   if (argc > 1)
+      runs = Strtoul(argv[1], 10);
+   if (argc > 2)
+      only = argv[2];
+   if (runs < 1)
+      err_msg("The number of runs must be at least 1");
+   times = Malloc(runs * sizeof(TCP_UINT64));
+
+   init_genrand(1);
+   for (i=0; i<sizeof(packet)/sizeof(packet[0]); i++)
+      packet[i] = genrand_int32();
+   for (i=0; i<sizeof(binary); i++)
+      binary[i] = i;
+
+   printf("# name\titerations\truns\tmin_ns\tmedian_ns\tmax_ns\n");
+   for (b=0; b<sizeof(benchmarks)/sizeof(benchmarks[0]); b++) {
+      const benchmark *bm = &benchmarks[b];
+
+      if (only && strcmp(only, bm->name) != 0)
+         continue;
+      bm->func(bm->iterations / 10 + 1);	/* Warm up */
+      for (i=0; i<runs; i++) {
+         TCP_UINT64 start = monotonic_ns();
+
+         bm->func(bm->iterations);
+         times[i] = monotonic_ns() - start;
+      }
+      qsort(times, runs, sizeof(TCP_UINT64), ns_compare);
+      printf("%s\t%u\t%u\t%.2f\t%.2f\t%.2f\n", bm->name, bm->iterations,
+             runs, (double) times[0] / bm->iterations,
+             (double) times[runs / 2] / bm->iterations,
+             (double) times[runs - 1] / bm->iterations);
+      fflush(stdout);
+   }
+   free(times);
+   return EXIT_SUCCESS;
+}
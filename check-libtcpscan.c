@@ -0,0 +1,345 @@
+/*
+ * The TCP Scanner (tcp-scan) is Copyright (C) 2003-2013 Roy Hills,
+ * NTA Monitor Ltd.
+ *
+ * This file is part of tcp-scan.
+ *
+ * tcp-scan is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * tcp-scan is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with tcp-scan.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * check-libtcpscan -- Check the tcp-scan library interface
+ *
+ *      Run --dryrun scans through libtcpscan: one with the targets from
+ *      an iterator and one with targets and options given to
+ *      tcpscan_new(), and check that the callback is given exactly one
+ *      reply for each target and that the decoded fields are consistent.
+ *      Then check that bad options and empty scans fail without exiting,
+ *      and that engines are independent: a scan on a second engine can
+ *      be run from the callback of the first, and scans on different
+ *      engines can run in different threads at the same time.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <arpa/inet.h>
+#if defined(HAVE_PTHREAD_H) && defined(HAVE_THREAD_LOCAL)
+#include <pthread.h>
+#endif
+
+#include "libtcpscan.h"
+
+#define HOSTS 3			/* Targets are 192.0.2.1 to 192.0.2.HOSTS */
+#define PORTS 100		/* on ports 1 to PORTS */
+#define MAX_WORDS 16		/* Words in an options line */
+#define THREADS 2		/* Engines run at once by the threads check */
+
+typedef struct {
+   unsigned next;		/* Index of the next target */
+} target_state;
+
+typedef struct {
+   unsigned replies;		/* Replies given to the callback */
+   unsigned open;		/* Replies with open set */
+   unsigned errors;		/* Inconsistent replies */
+   unsigned char seen[HOSTS][PORTS];	/* Replies for each target */
+   tcpscan_ctx *nested;		/* Run from the first reply, or NULL */
+   int nested_result;		/* What tcpscan_run(nested) returned */
+} reply_state;
+
+typedef struct {
+   tcpscan_ctx *ctx;		/* The scan run by the thread */
+   target_state ts;
+   reply_state rs;
+   int result;			/* What tcpscan_run() returned */
+} thread_state;
+
+/*
+ *	Split a line of options into words, in the argv form that the
+ *	library takes.  Returns the number of words.
+ */
+static int
+split_words(char *line, char *words[]) {
+   int n = 0;
+   char *word;
+
+   for (word = strtok(line, " "); word && n < MAX_WORDS - 1;
+        word = strtok(NULL, " "))
+      words[n++] = word;
+   words[n] = NULL;
+   return n;
+}
+
+static int
+next_target(void *arg, struct in_addr *addr, uint16_t *port) {
+   target_state *ts = arg;
+
+   if (ts->next >= HOSTS * PORTS)
+      return 0;
+   addr->s_addr = htonl(0xc0000201 + ts->next / PORTS);	/* 192.0.2.1 */
+   *port = ts->next % PORTS + 1;
+   ts->next++;
+   return 1;
+}
+
+static void
+handle_reply(void *arg, const tcpscan_reply *reply) {
+   reply_state *rs = arg;
+   unsigned host = ntohl(reply->addr.s_addr) - 0xc0000201;
+
+   rs->replies++;
+   if (reply->open)
+      rs->open++;
+   if (host >= HOSTS || reply->port < 1 || reply->port > PORTS ||
+       reply->addr.s_addr != reply->responder.s_addr ||
+       reply->open != ((reply->tcp_flags & 0x12) == 0x12) ||
+       reply->attempt < 1 || reply->duplicate ||
+       reply->packet_len < 40 || (reply->packet[0] >> 4) != 4) {
+      rs->errors++;
+      return;
+   }
+   if (rs->seen[host][reply->port - 1]++)
+      rs->errors++;
+   if (rs->nested) {
+      tcpscan_ctx *ctx = rs->nested;
+
+      rs->nested = NULL;
+      rs->nested_result = tcpscan_run(ctx);
+   }
+}
+
+/*
+ *	Create a scan of every target, with handle_reply() as the callback.
+ */
+static tcpscan_ctx *
+new_scan(tcpscan_engine *eng, target_state *ts, reply_state *rs) {
+   char empty_line[] = "job";
+   char *words[MAX_WORDS];
+   tcpscan_ctx *ctx;
+
+   memset(ts, '\0', sizeof(*ts));
+   memset(rs, '\0', sizeof(*rs));
+   if ((ctx = tcpscan_new(eng, split_words(empty_line, words), words)) == NULL)
+      return NULL;
+   if (tcpscan_set_targets(ctx, next_target, ts) != 0) {
+      tcpscan_free(ctx);
+      return NULL;
+   }
+   tcpscan_set_callback(ctx, handle_reply, rs);
+   return ctx;
+}
+
+/*
+ *	Check that a scan of every target got exactly one reply from each.
+ */
+static int
+check_replies(const char *name, int n, const reply_state *rs, int all_open) {
+   printf("%s\t%d returned, %u replies, %u open\t", name, n, rs->replies,
+          rs->open);
+   if (n != (int) rs->replies || rs->replies != HOSTS * PORTS || rs->errors ||
+       rs->open == 0 || (rs->open == rs->replies) != all_open) {
+      printf("ERROR: %u inconsistent replies\n", rs->errors);
+      return 1;
+   }
+   printf("ok\n");
+   return 0;
+}
+
+#if defined(HAVE_PTHREAD_H) && defined(HAVE_THREAD_LOCAL)
+static void *
+run_thread(void *arg) {
+   thread_state *th = arg;
+
+   th->result = tcpscan_run(th->ctx);
+   return NULL;
+}
+#endif
+
+int
+main() {
+   char init_line[] = "check-libtcpscan --dryrun=open=0.5 --interval=10u "
+                      "--retry=2 --timeout=50";
+   char open_init_line[] = "check-libtcpscan --dryrun=open=1 --interval=10u "
+                           "--timeout=50";
+   char open_line[] = "job --port=1-50 --openonly 192.0.2.2";
+   char busy_line[] = "job --port=1 192.0.2.1";
+   char bad_line[] = "job --sport=1 --port=1 192.0.2.1";
+   char empty_line[] = "job";
+   char help_line[] = "check-libtcpscan --help";
+   char version_line[] = "check-libtcpscan --version";
+   char *words[MAX_WORDS];
+   tcpscan_engine *eng;
+   tcpscan_engine *open_eng;
+   tcpscan_engine *bad_eng;
+   target_state ts;
+   target_state open_ts;
+   reply_state rs;
+   reply_state open_rs;
+   tcpscan_ctx *ctx;
+   tcpscan_ctx *open_ctx;
+   tcpscan_ctx *busy_ctx;
+   int n;
+   int error=0;
+
+   if ((eng = tcpscan_init(split_words(init_line, words), words)) == NULL ||
+       (open_eng = tcpscan_init(split_words(open_init_line, words),
+                                words)) == NULL) {
+      printf("tcpscan_init failed\n");
+      return EXIT_FAILURE;
+   }
+/*
+ *	Targets from an iterator, with every port answering.
+ */
+   if ((ctx = new_scan(eng, &ts, &rs)) == NULL) {
+      printf("iterator\tERROR: cannot create the scan\n");
+      return EXIT_FAILURE;
+   }
+   n = tcpscan_run(ctx);
+   tcpscan_free(ctx);
+   error += check_replies("iterator", n, &rs, 0);
+/*
+ *	Targets and options from tcpscan_new(), showing only open ports.
+ */
+   memset(&rs, '\0', sizeof(rs));
+   ctx = tcpscan_new(eng, split_words(open_line, words), words);
+   if (ctx == NULL) {
+      printf("openonly\tERROR: cannot create the scan\n");
+      return EXIT_FAILURE;
+   }
+   tcpscan_set_callback(ctx, handle_reply, &rs);
+   n = tcpscan_run(ctx);
+   tcpscan_free(ctx);
+   printf("openonly\t%d returned, %u replies, %u open\t", n, rs.replies,
+          rs.open);
+   if (n != (int) rs.replies || rs.open != rs.replies || rs.errors ||
+       rs.open == 0 || rs.open == 50) {
+      error++;
+      printf("ERROR\n");
+   } else {
+      printf("ok\n");
+   }
+/*
+ *	A scan on a second engine, run from the callback of the first, is
+ *	independent of it.  Another scan on the first engine is refused.
+ */
+   if ((ctx = new_scan(eng, &ts, &rs)) == NULL ||
+       (open_ctx = new_scan(open_eng, &open_ts, &open_rs)) == NULL ||
+       (busy_ctx = tcpscan_new(eng, split_words(busy_line, words),
+                               words)) == NULL) {
+      printf("nested\tERROR: cannot create the scans\n");
+      return EXIT_FAILURE;
+   }
+   rs.nested = open_ctx;
+   open_rs.nested = busy_ctx;
+   n = tcpscan_run(ctx);
+   error += check_replies("nested-outer", n, &rs, 0);
+   error += check_replies("nested-inner", rs.nested_result, &open_rs, 1);
+   printf("nested-busy\t%d returned\t", open_rs.nested_result);
+   if (open_rs.nested_result != -1) {
+      error++;
+      printf("ERROR\n");
+   } else {
+      printf("ok\n");
+   }
+   tcpscan_free(busy_ctx);
+   tcpscan_free(open_ctx);
+   tcpscan_free(ctx);
+#if defined(HAVE_PTHREAD_H) && defined(HAVE_THREAD_LOCAL)
+/*
+ *	Scans on different engines run in different threads at once.
+ */
+   {
+      tcpscan_engine *engs[THREADS];
+      thread_state th[THREADS];
+      pthread_t tid[THREADS];
+      char thread_line[THREADS][80] = {
+         "check-libtcpscan --dryrun=open=0.5 --interval=10u --timeout=50",
+         "check-libtcpscan --dryrun=open=1 --interval=10u --timeout=50"
+      };
+      int i;
+
+      for (i=0; i<THREADS; i++) {
+         if ((engs[i] = tcpscan_init(split_words(thread_line[i], words),
+                                     words)) == NULL ||
+             (th[i].ctx = new_scan(engs[i], &th[i].ts, &th[i].rs)) == NULL) {
+            printf("threads\tERROR: cannot create the scans\n");
+            return EXIT_FAILURE;
+         }
+      }
+      for (i=0; i<THREADS; i++) {
+         if (pthread_create(&tid[i], NULL, run_thread, &th[i]) != 0) {
+            printf("threads\tERROR: cannot create the threads\n");
+            return EXIT_FAILURE;
+         }
+      }
+      for (i=0; i<THREADS; i++) {
+         pthread_join(tid[i], NULL);
+         error += check_replies(i ? "thread-open" : "thread", th[i].result,
+                                &th[i].rs, i);
+         tcpscan_free(th[i].ctx);
+         tcpscan_close(engs[i]);
+      }
+   }
+#endif
+/*
+ *	Errors are returned to the caller.
+ */
+   ctx = tcpscan_new(eng, split_words(bad_line, words), words);
+   printf("bad-option\t%s\t", ctx ? "created" : "NULL");
+   if (ctx) {
+      error++;
+      printf("ERROR\n");
+      tcpscan_free(ctx);
+   } else {
+      printf("ok\n");
+   }
+   bad_eng = tcpscan_init(split_words(help_line, words), words);
+   printf("help\t%s\t", bad_eng ? "created" : "NULL");
+   if (bad_eng) {
+      error++;
+      printf("ERROR\n");
+      tcpscan_close(bad_eng);
+   } else {
+      printf("ok\n");
+   }
+   bad_eng = tcpscan_init(split_words(version_line, words), words);
+   printf("version\t%s\t", bad_eng ? "created" : "NULL");
+   if (bad_eng) {
+      error++;
+      printf("ERROR\n");
+      tcpscan_close(bad_eng);
+   } else {
+      printf("ok\n");
+   }
+   ctx = tcpscan_new(eng, split_words(empty_line, words), words);
+   n = ctx ? tcpscan_run(ctx) : 0;
+   tcpscan_free(ctx);
+   printf("no-targets\t%d returned\t", n);
+   if (n != -1) {
+      error++;
+      printf("ERROR\n");
+   } else {
+      printf("ok\n");
+   }
+   tcpscan_close(open_eng);
+   tcpscan_close(eng);
+
+   if (error)
+      return EXIT_FAILURE;
+   else
+      return EXIT_SUCCESS;
+}
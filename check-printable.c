@@ -0,0 +1,184 @@
+/*
+ * The TCP Scanner (tcp-scan) is Copyright (C) 2003-2008 Roy Hills,
+ * NTA Monitor Ltd.
+ *
+ * This file is part of tcp-scan.
+ *
+ * tcp-scan is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * tcp-scan is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with tcp-scan.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * check-printable -- Fuzz test printable() against a reference version
+ *
+ *      Compare the output of each printable() implementation that is
+ *      available on this system with the original isprint() and sprintf()
+ *      based version, using random inputs of random lengths.  Any
+ *      difference is reported and we return with a failure status.
+ */
+
+#include "tcp-scan.h"
+
+#define ITERATIONS 20000	/* Random inputs per implementation */
+#define MAX_INPUT 300		/* Longer than three AVX2 blocks */
+
+/*
+ *	printable_reference -- The original implementation of printable()
+ */
+static char *
+printable_reference(const unsigned char *string, size_t size) {
+   char *result;
+   char *r;
+   const unsigned char *cp;
+   size_t i;
+
+   if (string == NULL) {
+      result = Malloc(1);
+      result[0] = '\0';
+      return result;
+   }
+   if (!size)
+      size = strlen((const char *) string);
+
+   result = Malloc(4 * size + 1);
+   cp = string;
+   r = result;
+   for (i=0; i<size; i++) {
+      switch (*cp) {
+         case '\b':
+            *r++ = '\\';
+            *r++ = 'b';
+            break;
+         case '\f':
+            *r++ = '\\';
+            *r++ = 'f';
+            break;
+         case '\n':
+            *r++ = '\\';
+            *r++ = 'n';
+            break;
+         case '\r':
+            *r++ = '\\';
+            *r++ = 'r';
+            break;
+         case '\t':
+            *r++ = '\\';
+            *r++ = 't';
+            break;
+         case '\v':
+            *r++ = '\\';
+            *r++ = 'v';
+            break;
+         default:
+            if (isprint(*cp)) {
+               *r++ = *cp;
+            } else {
+               *r++ = '\\';
+               sprintf(r, "%.3o", *cp);
+               r += 3;
+            }
+            break;
+      }
+      cp++;
+   }
+   *r = '\0';
+   return result;
+}
+
+/*
+ *	check_one -- Compare printable() with the reference for one input
+ *
+ *	Returns 0 if they match, or 1 if they differ.
+ */
+static int
+check_one(const char *name, const unsigned char *input, size_t size) {
+   char *expect = printable_reference(input, size);
+   char *got = printable(input, size);
+   int error = 0;
+
+   if (strcmp(expect, got)) {
+      printf("%s: mismatch for %lu byte input\n  expect: %s\n  got:    %s\n",
+             name, (unsigned long) size, expect, got);
+      error = 1;
+   }
+   free(expect);
+   free(got);
+   return error;
+}
+
+int
+main() {
+   static const struct {
+      int impl;
+      const char *name;
+   } impls[] = {
+      {PRINTABLE_IMPL_SCALAR, "scalar"},
+      {PRINTABLE_IMPL_SSE2, "sse2"},
+      {PRINTABLE_IMPL_AVX2, "avx2"},
+      {PRINTABLE_IMPL_AUTO, "auto"}
+   };
+   unsigned char input[MAX_INPUT+1];
+   unsigned n;
+   unsigned i;
+   unsigned c;
+   int error=0;
+
+   for (n=0; n < sizeof(impls)/sizeof(impls[0]); n++) {
+      if (!printable_select(impls[n].impl)) {
+         printf("%s\tnot available\n", impls[n].name);
+         continue;
+      }
+      init_genrand(n + 1);
+      error += check_one(impls[n].name, NULL, 0);
+/*
+ *	Every single byte value, and a NUL-terminated string.
+ */
+      for (c=0; c<256; c++) {
+         input[0] = c;
+         error += check_one(impls[n].name, input, 1);
+      }
+      strcpy((char *) input, "Banner\r\n");
+      error += check_one(impls[n].name, input, 0);
+/*
+ *	Random inputs.  Most real payloads are mostly printable with an
+ *	occasional escape, so bias a third of the inputs that way, a third
+ *	to uniformly random bytes, and a third to only printable and
+ *	control characters near the 0x1f/0x20 and 0x7e/0x7f boundaries.
+ */
+      for (i=0; i<ITERATIONS; i++) {
+         size_t size = 1 + genrand_int32() % MAX_INPUT;
+         size_t j;
+
+         for (j=0; j<size; j++) {
+            unsigned long r = genrand_int32();
+
+            switch (i % 3) {
+               case 0:
+                  input[j] = (r & 0x1f00) ? 0x20 + (r % 95) : (r >> 16) & 0xff;
+                  break;
+               case 1:
+                  input[j] = r & 0xff;
+                  break;
+               default:
+                  input[j] = "\x1f\x20\x7e\x7f\x80\xff\n\t"[r & 7];
+                  break;
+            }
+         }
+         error += check_one(impls[n].name, input, size);
+      }
+      printf("%s\t%s\n", impls[n].name, error ? "ERROR" : "ok");
+   }
+
+   if (error)
+      return EXIT_FAILURE;
+   else
+      return EXIT_SUCCESS;
+}
@@ -0,0 +1,146 @@
+/*
+ * The TCP Scanner (tcp-scan) is Copyright (C) 2003-2008 Roy Hills,
+ * NTA Monitor Ltd.
+ *
+ * This file is part of tcp-scan.
+ *
+ * tcp-scan is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * tcp-scan is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with tcp-scan.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * check-tcpopt -- Check the TCP option decoder
+ *
+ *      Decode a set of well-formed and malformed TCP option lists and
+ *      check the formatted result, then decode random option bytes to
+ *      check that the decoder always stops within the data and that the
+ *      formatted string always fits in TCPOPT_STRLEN bytes.
+ */
+
+#include "tcp-scan.h"
+
+#define ITERATIONS 100000	/* Random option lists to decode */
+#define MAX_OPTLEN 40		/* Maximum TCP options length */
+
+static const struct {
+   const char *name;
+   unsigned len;
+   const char *data;
+   const char *expect;
+   unsigned flags;
+} vectors[] = {
+   {"linux", 20,
+    "\x02\x04\x05\xb4\x04\x02\x08\x0a\x00\x01\x02\x03\x00\x00\x00\x01"
+    "\x01\x03\x03\x07",
+    "MSS=1460,SACKOK,TIMESTAMP=66051,1,NOP,WSCALE=7", 0},
+   {"eol-padding", 8, "\x02\x04\x05\xb4\x01\x00\x00\x00",
+    "MSS=1460,NOP,EOL,EOL,EOL", 0},
+   {"unknown", 6, "\x1e\x04\xaa\xbb\x01\x01", "opt-30,NOP,NOP", 0},
+   {"zero-length", 8, "\x01\x1e\x00\x01\x01\x01\x01\x01",
+    "NOP,opt-30(badlen=0)", TCPOPT_F_BADLEN},
+   {"one-length", 4, "\x05\x01\x01\x01", "opt-5(badlen=1)", TCPOPT_F_BADLEN},
+   {"mss-badlen", 8, "\x02\x08\x05\xb4\x00\x00\x00\x00",
+    "opt-2(badlen=8)", TCPOPT_F_BADLEN},
+   {"past-end", 6, "\x01\x1e\x08\x00\x00\x00", "NOP", TCPOPT_F_TRUNCATED},
+   {"no-length", 2, "\x01\x02", "NOP", TCPOPT_F_TRUNCATED},
+   {"timestamp-short", 8, "\x08\x0a\x00\x00\x00\x01\x00\x00", "",
+    TCPOPT_F_TRUNCATED}
+};
+
+int
+main() {
+   tcp_options opts;
+   char str[TCPOPT_STRLEN+1];
+   unsigned char data[MAX_OPTLEN];
+   unsigned i;
+   int error=0;
+
+   for (i=0; i < sizeof(vectors)/sizeof(vectors[0]); i++) {
+      tcpopt_decode((const unsigned char *) vectors[i].data, vectors[i].len,
+                    &opts);
+      tcpopt_format(&opts, str, TCPOPT_STRLEN);
+      printf("%s\t<%s>\t", vectors[i].name, str);
+      if (strcmp(str, vectors[i].expect) || opts.flags != vectors[i].flags) {
+         error++;
+         printf("ERROR: expected <%s> flags %u, got flags %u\n",
+                vectors[i].expect, vectors[i].flags, opts.flags);
+      } else {
+         printf("ok\n");
+      }
+   }
+/*
+ *	The same layout, window and initial TTL should give the same
+ *	fingerprint regardless of the option values and hop count.
+ */
+   {
+      tcp_options other;
+      TCP_UINT64 fp1, fp2, fp3;
+
+      tcpopt_decode((const unsigned char *) vectors[0].data, vectors[0].len,
+                    &opts);
+      other = opts;
+      other.opt[0].val1 = 1400;
+      other.opt[2].val1 = 12345;
+      fp1 = tcpopt_fingerprint(&opts, 65160, 64);
+      fp2 = tcpopt_fingerprint(&other, 65160, 51);
+      fp3 = tcpopt_fingerprint(&opts, 65160, 128);
+      printf("fingerprint\t%.8lx%.8lx\t", (unsigned long) (fp1 >> 32),
+             (unsigned long) (fp1 & 0xffffffff));
+      if (fp1 != fp2 || fp1 == fp3) {
+         error++;
+         printf("ERROR\n");
+      } else {
+         printf("ok\n");
+      }
+   }
+/*
+ *	Random option lists.  Bias the kinds towards the ones we decode and
+ *	the lengths towards small values so that most lists contain several
+ *	options.
+ */
+   init_genrand(1);
+   for (i=0; i<ITERATIONS; i++) {
+      unsigned len = genrand_int32() % (MAX_OPTLEN + 1);
+      unsigned j;
+      size_t slen;
+      unsigned used;
+
+      for (j=0; j<len; j++) {
+         unsigned long r = genrand_int32();
+
+         data[j] = (r & 0x100) ? r % 12 : r & 0xff;
+      }
+      tcpopt_decode(data, len, &opts);
+      used = 0;
+      for (j=0; j<opts.count; j++)
+         used += opts.opt[j].len;
+      if (opts.count > TCPOPT_MAX_OPTS ||
+          (!(opts.flags & TCPOPT_F_BADLEN) && used > len)) {
+         error++;
+         printf("random\tERROR: decoded %u bytes from %u\n", used, len);
+         break;
+      }
+      str[TCPOPT_STRLEN] = 'X';
+      slen = tcpopt_format(&opts, str, TCPOPT_STRLEN);
+      if (str[TCPOPT_STRLEN] != 'X' || slen != strlen(str) ||
+          slen >= TCPOPT_STRLEN) {
+         error++;
+         printf("random\tERROR: formatted length %lu\n", (unsigned long) slen);
+         break;
+      }
+   }
+   printf("random\t%s\n", error ? "ERROR" : "ok");
+
+   if (error)
+      return EXIT_FAILURE;
+   else
+      return EXIT_SUCCESS;
+}
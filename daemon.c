@@ -0,0 +1,736 @@
+/*
+ * The TCP Scanner (tcp-scan) is Copyright (C) 2003-2013 Roy Hills,
+ * NTA Monitor Ltd.
+ *
+ * This file is part of tcp-scan.
+ *
+ * tcp-scan is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * tcp-scan is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with tcp-scan.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * daemon.c -- Scan job daemon for tcp-scan
+ *
+ * This file contains the --daemon server and its job scheduler.  The
+ * daemon keeps the raw socket, the capture and the probes from startup,
+ * and runs the jobs that arrive on its UNIX socket with them, up to
+ * --jobs at once.  Each job is a scan context of its own, and the jobs
+ * share one select() loop, see schedule_jobs().  The clients are
+ * written to without blocking, so that a slow client cannot hold up
+ * the other jobs.
+ */
+
+#include "tcp-scan.h"
+
+/*
+ *	run_daemon -- Run scan jobs from the --daemon UNIX socket
+ *
+ *	Inputs:
+ *
+ *	eng		The scan engine
+ *	sockfd		Raw IP socket, or -1 with --dryrun
+ *
+ *	Returns:
+ *
+ *	None (this function never returns).
+ *
+ *	This keeps the raw socket, the capture with its compiled filter and
+ *	the service names from startup, and runs up to --jobs jobs at once
+ *	with them, see schedule_jobs().  A job is one line of options and
+ *	targets, as they would be given on the command line, and the job's
+ *	output is written back on the same connection.  Up to DAEMON_BACKLOG
+ *	jobs that arrive while --jobs are running are read and queued, and
+ *	any more wait in the listen() backlog.  An error in a job ends that
+ *	job, and is reported to its client.
+ */
+void
+run_daemon(tcpscan_engine *eng, int sockfd) {
+#ifdef HAVE_SYS_UN_H
+   struct sockaddr_un sun;
+   struct stat path_stat;
+   int listen_fd;
+   unsigned i;
+
+   memset(&sun, '\0', sizeof(sun));
+   sun.sun_family = AF_UNIX;
+   if (strlen(eng->daemon_path) >= sizeof(sun.sun_path))
+      err_msg("Invalid --daemon UNIX socket path \"%s\"", eng->daemon_path);
+   strlcpy(sun.sun_path, eng->daemon_path, sizeof(sun.sun_path));
+   if ((listen_fd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0)
+      err_sys("socket");
+/*
+ *	Remove a stale socket left by a daemon that has exited, but nothing
+ *	else that may be at the path by mistake.
+ */
+   if (lstat(sun.sun_path, &path_stat) == 0) {
+      if (!S_ISSOCK(path_stat.st_mode))
+         err_msg("The --daemon path %s exists and is not a socket.",
+                 sun.sun_path);
+      if (unlink(sun.sun_path) < 0)
+         err_sys("unlink %s", sun.sun_path);
+   } else if (errno != ENOENT) {
+      err_sys("lstat %s", sun.sun_path);
+   }
+   if (bind(listen_fd, (struct sockaddr *) &sun, sizeof(sun)) < 0)
+      err_sys("bind %s", sun.sun_path);
+   if (listen(listen_fd, DAEMON_BACKLOG) < 0)
+      err_sys("listen");
+   if (fcntl(listen_fd, F_SETFL, O_NONBLOCK) < 0)
+      err_sys("fcntl");
+/*
+ *	A client that goes away only loses its own output.
+ */
+   fflush(stdout);
+   signal(SIGPIPE, SIG_IGN);
+   if (eng->verbose)
+      warn_msg("---\tWaiting for jobs on %s, running up to %u at once",
+               eng->daemon_path, eng->daemon_jobs);
+   eng->jobs = Malloc(eng->daemon_jobs * sizeof(tcpscan_ctx *));
+   memset(eng->jobs, '\0', eng->daemon_jobs * sizeof(tcpscan_ctx *));
+   eng->num_clients = eng->daemon_jobs + DAEMON_BACKLOG;
+   eng->clients = Malloc(eng->num_clients * sizeof(daemon_client));
+   memset(eng->clients, '\0', eng->num_clients * sizeof(daemon_client));
+   for (i=0; i<eng->num_clients; i++)
+      eng->clients[i].fd = -1;
+   eng->daemon_listen_fd = listen_fd;
+   schedule_jobs(eng, sockfd);
+#else
+   err_msg("UNIX sockets are not supported on this system");
+#endif
+}
+
+/*
+ *	schedule_jobs -- Run the --daemon jobs with weighted fair queueing
+ *
+ *	Inputs:
+ *
+ *	eng		The scan engine
+ *	sockfd		Raw IP socket, or -1 with --dryrun
+ *
+ *	Returns:
+ *
+ *	None (this function never returns).
+ *
+ *	The daemon's --interval or --bandwidth is the rate of the link, which
+ *	all of the jobs share.  Each time the link can take a probe, it goes
+ *	to the job with the lowest virtual time of those that are ready to
+ *	send, and that job's virtual time goes up by WFQ_SCALE / --weight.
+ *	So a job with --weight=3 gets three times the probes of one with the
+ *	default weight while both have probes to send, and a job that is
+ *	waiting for timeouts or is held back by its own --interval leaves
+ *	its share to the others.  Virtual times never fall behind the
+ *	system's, so a job cannot save up a burst while it is idle.
+ *
+ *	Each job sends from its own source port, source_port + its slot, so
+ *	callback() can tell which job a reply belongs to.
+ *
+ *	Nothing here waits for a client.  The client sockets are non-blocking
+ *	and are watched by the same select() as the capture, a job's output
+ *	is held in memory until its client reads it, and the job targets are
+ *	IP addresses, as names are resolved by --submit.  A client that does
+ *	not send its job line within DAEMON_READ_TIMEOUT seconds, or that
+ *	reads none of its output for DAEMON_WRITE_TIMEOUT seconds or lets
+ *	DAEMON_OUTPUT_MAX bytes of it build up, is dropped with its job.
+ */
+void
+schedule_jobs(tcpscan_engine *eng, int sockfd) {
+   struct timeval now;
+   struct timeval diff;
+   struct timeval link_last;	/* When the link last sent a probe */
+   TCP_UINT64 link_timediff;	/* Time since then in us */
+   TCP_UINT64 vtime = 0;	/* System virtual time */
+   unsigned link_interval;	/* Interval between probes on the link */
+   unsigned select_timeout;
+   unsigned running = 0;	/* Jobs in jobs[] */
+   unsigned next_slot = 0;	/* Where to look for a free slot */
+   unsigned slot;
+   unsigned i;
+
+   link_interval = eng->cli_scan.interval ? eng->cli_scan.interval :
+                   bandwidth_interval(&eng->cli_scan, eng->cli_scan.bandwidth);
+   timerclear(&link_last);
+   for (;;) {
+      unsigned char ready[MAX_DAEMON_JOBS];
+      tcpscan_ctx *next = NULL;
+      daemon_client *queued = NULL;
+      TCP_UINT64 now_ns = timestamp_ns();
+/*
+ *	Finish the jobs that have no entries left, and drop the clients
+ *	that have stalled, with their jobs.  A finished job's client is
+ *	closed once it has read all of the output.
+ */
+      for (i=0; i<eng->num_clients; i++) {
+         daemon_client *c = &eng->clients[i];
+
+         if (c->fd < 0)
+            continue;
+         if (c->out) {
+            fflush(c->out);
+            c->size = ftello(c->out);
+            if (c->sent == c->size)
+               c->deadline_ns = now_ns +
+                                (TCP_UINT64)DAEMON_WRITE_TIMEOUT*1000000000;
+         }
+         if (client_stalled(c, now_ns)) {
+            if (eng->verbose)
+               warn_msg("---\tDropping a --daemon client that has stalled");
+            if (c->job) {
+               finish_job(eng, c, 0);
+               running--;
+            }
+            close_client(c);
+         } else if (c->job && c->job->live_count == 0) {
+            finish_job(eng, c, 1);
+            running--;
+         } else if (c->out && !c->job && c->sent == c->size) {
+            close_client(c);
+         } else if (c->have_line && !c->out &&
+                    (!queued || c->seq < queued->seq)) {
+            queued = c;
+         }
+      }
+/*
+ *	Start the job that has waited longest if there is a free slot, or
+ *	wait for one if there are no jobs running.  The slots are used in
+ *	turn, so that a late reply to a finished job is unlikely to reach
+ *	the next one.
+ */
+      if (queued && running < eng->daemon_jobs) {
+         while (eng->jobs[next_slot])
+            next_slot = (next_slot + 1) % eng->daemon_jobs;
+         if (admit_job(eng, queued, next_slot)) {
+            eng->jobs[next_slot]->vtime = vtime;
+            next_slot = (next_slot + 1) % eng->daemon_jobs;
+            running++;
+         }
+         continue;
+      }
+      if (running == 0) {
+         daemon_poll(eng, 1000000);
+         continue;
+      }
+/*
+ *	recvfrom_wto() watches the clients, except with --dryrun, which
+ *	does not select(), so we poll them.
+ */
+      if (eng->dryrun_flag)
+         daemon_poll(eng, 0);
+/*
+ *	If the link can take a probe, give it to the ready job with the
+ *	lowest virtual time.  The other ready jobs have lost their turn,
+ *	so they must not try to make up for it afterwards.
+ */
+      engine_gettimeofday(eng, &now);
+      timeval_diff(&now, &link_last, &diff);
+      link_timediff = (TCP_UINT64)1000000*diff.tv_sec + diff.tv_usec;
+      if (link_timediff < link_interval) {
+         select_timeout = link_interval - link_timediff;
+      } else {
+         select_timeout = 1000000;	/* Reduced to the first wait below */
+         for (slot=0; slot<eng->daemon_jobs; slot++) {
+            tcpscan_ctx *job = eng->jobs[slot];
+            unsigned wait;
+
+            ready[slot] = 0;
+            if (!job)
+               continue;
+            if (job->vtime < vtime)
+               job->vtime = vtime;
+            if ((wait = job_wait(job, &now)) == 0) {
+               ready[slot] = 1;
+               if (!next || job->vtime < next->vtime)
+                  next = job;
+            } else if (wait < select_timeout) {
+               select_timeout = wait;
+            }
+         }
+         if (next) {
+            int sent = 0;
+
+            for (slot=0; slot<eng->daemon_jobs; slot++)
+               if (ready[slot] && eng->jobs[slot] != next)
+                  eng->jobs[slot]->reset_cum_err = 1;
+            scan_step(next, sockfd, &now, &sent);
+            if (sent) {
+               vtime = next->vtime;
+               next->vtime += WFQ_SCALE / next->weight;
+               link_last = now;
+               select_timeout = link_interval;
+            } else {
+               select_timeout = 0;	/* Entries timed out */
+            }
+         }
+      }
+/*
+ *	Replies are passed to the job that they belong to by callback().
+ */
+      recvfrom_wto(&eng->cli_scan, eng->pcap_fd, select_timeout);
+   }
+}
+
+/*
+ *	job_wait -- Find how long a scan must wait to step
+ *
+ *	Inputs:
+ *
+ *	scan		The scan context
+ *	now		The current time
+ *
+ *	Returns:
+ *
+ *	The time in us before scan_step() can send a probe or time out the
+ *	entry at the cursor, or 0 if it can now.
+ *
+ *	As in scan_step(), a scan that is waiting for an entry's timeout
+ *	does not count the wait as timing error.
+ */
+unsigned
+job_wait(tcpscan_ctx *scan, const struct timeval *now) {
+   struct timeval diff;
+   TCP_UINT64 timediff;
+
+   timeval_diff(now, &scan->last_packet_time, &diff);
+   timediff = (TCP_UINT64)1000000*diff.tv_sec + diff.tv_usec;
+   if (timediff < (unsigned)scan->req_interval)
+      return scan->req_interval - timediff;
+   timeval_diff(now, &((*scan->cursor)->last_send_time), &diff);
+   timediff = (TCP_UINT64)1000000*diff.tv_sec + diff.tv_usec;
+   if (timediff < (*scan->cursor)->timeout) {
+      scan->reset_cum_err = 1;
+      return (*scan->cursor)->timeout - timediff;
+   }
+   return 0;
+}
+
+/*
+ *	admit_job -- Set up the scan for a --daemon client's job line
+ *
+ *	Inputs:
+ *
+ *	eng		The scan engine
+ *	c		The client, which has read its job line
+ *	slot		The free slot in jobs[] to use
+ *
+ *	Returns:
+ *
+ *	1 if the job was added to jobs[], or 0 if it failed.
+ *
+ *	Each job has its own context, with the daemon's settings as the
+ *	defaults.  Errors in the job's options end the job rather than the
+ *	daemon, and are sent to its client as DAEMON_ERROR lines, followed
+ *	by a DAEMON_STATUS line with the exit status.  The job is run with
+ *	--numeric, so that a name lookup cannot hold up the other jobs.
+ */
+int
+admit_job(tcpscan_engine *eng, daemon_client *c, unsigned slot) {
+   char *words[MAXLINE/2+3];
+   char name[] = PACKAGE;
+   char numeric[] = "--numeric";
+   char errors[MAXLINE];
+   jmp_buf job_error;
+   tcpscan_ctx *ctx;
+   char *cp;
+   ssize_t n;
+   int error_pipe[2];
+   int saved_stderr;
+   int nwords = 0;
+
+   words[nwords++] = name;
+   words[nwords++] = numeric;
+   for (cp = strtok(c->line, " \t\r"); cp; cp = strtok(NULL, " \t\r"))
+      words[nwords++] = cp;
+   words[nwords] = NULL;
+   if ((c->out = open_memstream(&c->buf, &c->size)) == NULL)
+      err_sys("open_memstream");
+   c->deadline_ns = timestamp_ns() +
+                    (TCP_UINT64)DAEMON_WRITE_TIMEOUT*1000000000;
+/*
+ *	Set up the scan with errors going to a pipe, from which they are
+ *	passed to the client.  The pipe is non-blocking, so that errors
+ *	that do not fit are lost rather than stopping the daemon.
+ */
+   fflush(stderr);
+   if (pipe(error_pipe) < 0)
+      err_sys("pipe");
+   if (fcntl(error_pipe[1], F_SETFL, O_NONBLOCK) < 0 ||
+       fcntl(error_pipe[0], F_SETFL, O_NONBLOCK) < 0)
+      err_sys("fcntl");
+   if ((saved_stderr = dup(STDERR_FILENO)) < 0)
+      err_sys("dup");
+   if (dup2(error_pipe[1], STDERR_FILENO) < 0)
+      err_sys("dup2");
+   close(error_pipe[1]);
+   if ((ctx = tcpscan_new(eng, nwords, words)) != NULL) {
+      if (setjmp(job_error) == 0) {
+         error_jump = &job_error;
+         if (ctx->num_hosts == 0)
+            err_msg("No hosts to process.");
+         ctx->out = c->out;
+         ctx->sport = eng->source_port + slot;
+         prepare_list(ctx);
+      } else {
+         tcpscan_free(ctx);
+         ctx = NULL;
+      }
+      error_jump = NULL;
+   }
+   fflush(stderr);
+   if (dup2(saved_stderr, STDERR_FILENO) < 0)
+      err_sys("dup2");
+   close(saved_stderr);
+   while ((n = read(error_pipe[0], errors, sizeof(errors) - 1)) > 0) {
+      char *line;
+
+      errors[n] = '\0';
+      for (line = strtok(errors, "\n"); line; line = strtok(NULL, "\n"))
+         fprintf(c->out, "%s%s\n", DAEMON_ERROR, line);
+   }
+   close(error_pipe[0]);
+   if (ctx == NULL) {
+      fprintf(c->out, "%s%d\n", DAEMON_STATUS, EXIT_FAILURE);
+      return 0;
+   }
+   engine_gettimeofday(eng, &ctx->start_time);
+   fprintf(c->out, "Starting %s with %u ports\n", PACKAGE_STRING,
+           ctx->num_hosts);
+   c->job = ctx;
+   c->slot = slot;
+   eng->jobs[slot] = ctx;
+   return 1;
+}
+
+/*
+ *	finish_job -- Display the summary of a --daemon job and free it
+ *
+ *	Inputs:
+ *
+ *	eng		The scan engine
+ *	c		The job's client
+ *	complete	1 if the job has finished, or 0 if it is being dropped
+ *
+ *	Returns:
+ *
+ *	None.
+ *
+ *	The summary and a DAEMON_STATUS line go to the client's output,
+ *	which is left for it to read.
+ */
+void
+finish_job(tcpscan_engine *eng, daemon_client *c, int complete) {
+   tcpscan_ctx *ctx = c->job;
+   unsigned i;
+
+   if (complete) {
+      fprintf(ctx->out, "\n");	/* Ensure we have a blank line */
+      if (ctx->rtt_flag) {
+         hist_print(ctx->out, &ctx->rtt_hist, "RTT", 1000000.0, "ms", 1);
+         fprintf(ctx->out, "\n");
+      }
+      show_summary(ctx, &ctx->start_time);
+      fprintf(ctx->out, "%s%d\n", DAEMON_STATUS, EXIT_SUCCESS);
+   }
+/*
+ *	The job's probes that are still waiting for a TX timestamp point
+ *	into its host list, which is about to be freed.
+ */
+   for (i=0; i<TX_RING_SIZE; i++)
+      if (eng->tx_ring[i].he >= ctx->helist &&
+          eng->tx_ring[i].he < ctx->helist + ctx->num_hosts)
+         eng->tx_ring[i].he = NULL;
+   eng->jobs[c->slot] = NULL;
+   c->job = NULL;
+   tcpscan_free(ctx);
+}
+
+/*
+ *	accept_client -- Accept a --daemon client connection
+ *
+ *	Inputs:
+ *
+ *	eng		The scan engine
+ *
+ *	Returns:
+ *
+ *	None.
+ *
+ *	The client is given DAEMON_READ_TIMEOUT seconds to send its job
+ *	line, which read_client() reads as it arrives.
+ */
+void
+accept_client(tcpscan_engine *eng) {
+   daemon_client *c = NULL;
+   unsigned i;
+   int fd;
+
+   for (i=0; i<eng->num_clients; i++) {
+      if (eng->clients[i].fd < 0) {
+         c = &eng->clients[i];
+         break;
+      }
+   }
+   if (c == NULL)
+      return;
+   if ((fd = accept(eng->daemon_listen_fd, NULL, NULL)) < 0) {
+      if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR ||
+          errno == ECONNABORTED)
+         return;
+      err_sys("accept");
+   }
+   if (fcntl(fd, F_SETFL, O_NONBLOCK) < 0)
+      err_sys("fcntl");
+   memset(c, '\0', sizeof(*c));
+   c->fd = fd;
+   c->seq = eng->client_seq++;
+   c->deadline_ns = timestamp_ns() +
+                    (TCP_UINT64)DAEMON_READ_TIMEOUT*1000000000;
+}
+
+/*
+ *	read_client -- Read what a --daemon client has sent of its job line
+ *
+ *	Inputs:
+ *
+ *	c		The client
+ *
+ *	Returns:
+ *
+ *	None.
+ *
+ *	A client that closes the connection before it has sent the whole
+ *	line, or whose line is too long, is closed.
+ */
+void
+read_client(daemon_client *c) {
+   ssize_t n;
+   char *cp;
+
+   n = read(c->fd, c->line + c->len, sizeof(c->line) - 1 - c->len);
+   if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR))
+      return;
+   if (n <= 0) {
+      close_client(c);
+      return;
+   }
+   c->len += n;
+   c->line[c->len] = '\0';
+   if ((cp = memchr(c->line + c->len - n, '\n', n)) != NULL) {
+      *cp = '\0';
+      c->have_line = 1;
+   } else if (c->len == sizeof(c->line) - 1) {
+      close_client(c);
+   }
+}
+
+/*
+ *	write_client -- Send a --daemon client what it can take of its output
+ *
+ *	Inputs:
+ *
+ *	c		The client
+ *
+ *	Returns:
+ *
+ *	None.
+ *
+ *	Each write that makes progress gives the client another
+ *	DAEMON_WRITE_TIMEOUT seconds.  Once all of the output has been sent,
+ *	the buffer is reused for the next.
+ */
+void
+write_client(daemon_client *c) {
+   ssize_t n;
+
+   fflush(c->out);
+   c->size = ftello(c->out);
+   if (c->sent == c->size)
+      return;
+   n = write(c->fd, c->buf + c->sent, c->size - c->sent);
+   if (n < 0) {
+      if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+         c->failed = 1;
+      return;
+   }
+   c->sent += n;
+   c->deadline_ns = timestamp_ns() +
+                    (TCP_UINT64)DAEMON_WRITE_TIMEOUT*1000000000;
+   if (c->sent == c->size) {
+      fseeko(c->out, 0, SEEK_SET);
+      c->sent = c->size = 0;
+   }
+}
+
+/*
+ *	close_client -- Close a --daemon client and free its entry
+ *
+ *	Inputs:
+ *
+ *	c		The client
+ *
+ *	Returns:
+ *
+ *	None.
+ */
+void
+close_client(daemon_client *c) {
+   if (c->out)
+      fclose(c->out);
+   free(c->buf);
+   close(c->fd);
+   memset(c, '\0', sizeof(*c));
+   c->fd = -1;
+}
+
+/*
+ *	client_stalled -- Find whether a --daemon client should be dropped
+ *
+ *	Inputs:
+ *
+ *	c		The client
+ *	now_ns		The current time from timestamp_ns()
+ *
+ *	Returns:
+ *
+ *	1 if the client has not sent its job line in time, has stopped
+ *	reading its output, or has gone away, otherwise 0.
+ *
+ *	The deadlines are on the system's clock rather than the engine's,
+ *	as --dryrun time only moves with the scan.
+ */
+int
+client_stalled(daemon_client *c, TCP_UINT64 now_ns) {
+   if (c->failed)
+      return 1;
+   if (!c->out)
+      return !c->have_line && now_ns > c->deadline_ns;
+   if (c->size - c->sent > DAEMON_OUTPUT_MAX)
+      return 1;
+   return c->sent < c->size && now_ns > c->deadline_ns;
+}
+
+/*
+ *	daemon_fd_set -- Add the --daemon sockets to select() sets
+ *
+ *	Inputs:
+ *
+ *	eng		The scan engine
+ *	readset		Set for the sockets to read
+ *	writeset	Set for the sockets to write
+ *	maxfd		The highest descriptor in the sets so far
+ *
+ *	Returns:
+ *
+ *	The highest descriptor in the sets.
+ *
+ *	The UNIX socket is only watched while there is a free entry in
+ *	clients[] for the connection.
+ */
+int
+daemon_fd_set(tcpscan_engine *eng, fd_set *readset, fd_set *writeset,
+              int maxfd) {
+   int room = 0;
+   unsigned i;
+
+   for (i=0; i<eng->num_clients; i++) {
+      daemon_client *c = &eng->clients[i];
+
+      if (c->fd < 0) {
+         room = 1;
+         continue;
+      }
+      if (!c->out && !c->have_line)
+         FD_SET(c->fd, readset);
+      else if (c->out && c->sent < c->size)
+         FD_SET(c->fd, writeset);
+      else
+         continue;
+      if (c->fd > maxfd)
+         maxfd = c->fd;
+   }
+   if (room) {
+      FD_SET(eng->daemon_listen_fd, readset);
+      if (eng->daemon_listen_fd > maxfd)
+         maxfd = eng->daemon_listen_fd;
+   }
+   return maxfd;
+}
+
+/*
+ *	daemon_handle -- Serve the --daemon sockets that select() found ready
+ *
+ *	Inputs:
+ *
+ *	eng		The scan engine
+ *	readset		The sockets ready to read
+ *	writeset	The sockets ready to write
+ *
+ *	Returns:
+ *
+ *	None.
+ *
+ *	The sets must be from daemon_fd_set().  New connections are accepted
+ *	last, so that their descriptors are not taken for ones in the sets.
+ */
+void
+daemon_handle(tcpscan_engine *eng, const fd_set *readset,
+              const fd_set *writeset) {
+   unsigned i;
+
+   for (i=0; i<eng->num_clients; i++) {
+      daemon_client *c = &eng->clients[i];
+
+      if (c->fd < 0)
+         continue;
+      if (FD_ISSET(c->fd, readset))
+         read_client(c);
+      else if (FD_ISSET(c->fd, writeset))
+         write_client(c);
+   }
+   if (FD_ISSET(eng->daemon_listen_fd, readset))
+      accept_client(eng);
+}
+
+/*
+ *	daemon_poll -- Wait for the --daemon sockets and serve them
+ *
+ *	Inputs:
+ *
+ *	eng		The scan engine
+ *	timeout		The longest time to wait in us, or 0 to poll
+ *
+ *	Returns:
+ *
+ *	None.
+ *
+ *	This is for when recvfrom_wto() is not watching the sockets: when no
+ *	jobs are running, and with --dryrun.
+ */
+void
+daemon_poll(tcpscan_engine *eng, unsigned timeout) {
+   fd_set readset;
+   fd_set writeset;
+   struct timeval to;
+   int maxfd;
+   int n;
+
+   FD_ZERO(&readset);
+   FD_ZERO(&writeset);
+   maxfd = daemon_fd_set(eng, &readset, &writeset, -1);
+   to.tv_sec = timeout / 1000000;
+   to.tv_usec = timeout % 1000000;
+   n = select(maxfd+1, &readset, &writeset, NULL, &to);
+   if (n < 0) {
+      if (errno == EINTR)
+         return;
+      err_sys("select");
+   }
+   if (n > 0)
+      daemon_handle(eng, &readset, &writeset);
+}
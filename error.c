@@ -26,6 +26,20 @@
 #include "tcp-scan.h"
 
 int daemon_proc;	/* Non-zero if process is a daemon */
+THREAD_LOCAL jmp_buf *error_jump;	/* Fatal errors go here, not exit() */
+
+/*
+ *	Function to leave after a fatal error.  The --daemon job loop and
+ *	the library functions set error_jump so that an error does not stop
+ *	the process.  Each thread has its own, so that engines can be run
+ *	from different threads.
+ */
+void
+err_exit(void) {
+   if (error_jump)
+      longjmp(*error_jump, 1);
+   exit(EXIT_FAILURE);
+}
 
 /*
  *	Function to handle fatal system call errors.
@@ -37,7 +51,7 @@ err_sys(const char *fmt,...) {
    va_start(ap, fmt);
    err_print(1, fmt, ap);
    va_end(ap);
-   exit(EXIT_FAILURE);
+   err_exit();
 }
 
 /*
@@ -62,7 +76,7 @@ err_msg(const char *fmt,...) {
    va_start(ap, fmt);
    err_print(0, fmt, ap);
    va_end(ap);
-   exit(EXIT_FAILURE);
+   err_exit();
 }
 
 /*
@@ -0,0 +1,235 @@
+/*
+ * The TCP Scanner (tcp-scan) is Copyright (C) 2003-2013 Roy Hills,
+ * NTA Monitor Ltd.
+ *
+ * This file is part of tcp-scan.
+ *
+ * tcp-scan is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * tcp-scan is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with tcp-scan.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * hist.c -- Log-bucketed histograms for tcp-scan
+ *
+ * This file contains a fixed-size histogram of 64-bit values, normally
+ * durations in nanoseconds.  Values are counted in buckets whose width
+ * is proportional to the value: each power of two is split into
+ * HIST_SUB_BUCKETS linear sub-buckets, so the relative error of any
+ * recorded value or percentile is at most 1/HIST_SUB_BUCKETS.  Adding a
+ * value is a few integer operations and never allocates memory.
+ */
+
+#include "tcp-scan.h"
+
+/*
+ *	hist_bucket -- Return the bucket index for a value
+ *
+ *	Values below HIST_SUB_BUCKETS have a bucket each.  Above that, the
+ *	bucket is determined by the position of the highest set bit and the
+ *	HIST_SUB_BITS bits that follow it.
+ */
+static unsigned
+hist_bucket(TCP_UINT64 value) {
+   unsigned msb;
+
+   if (value < HIST_SUB_BUCKETS)
+      return value;
+   msb = 63 - __builtin_clzll(value);
+   return (msb - HIST_SUB_BITS + 1) * HIST_SUB_BUCKETS +
+          ((value >> (msb - HIST_SUB_BITS)) & (HIST_SUB_BUCKETS - 1));
+}
+
+/*
+ *	hist_bucket_high -- Return the highest value counted in a bucket
+ */
+static TCP_UINT64
+hist_bucket_high(unsigned bucket) {
+   unsigned shift;
+
+   if (bucket < HIST_SUB_BUCKETS)
+      return bucket;
+   shift = bucket / HIST_SUB_BUCKETS - 1;
+   return (((TCP_UINT64) (HIST_SUB_BUCKETS + bucket % HIST_SUB_BUCKETS)
+            << shift) + ((TCP_UINT64) 1 << shift)) - 1;
+}
+
+/*
+ *	hist_init -- Initialise a histogram
+ *
+ *	Inputs:
+ *
+ *	h	The histogram to initialise
+ *
+ *	Returns:
+ *
+ *	None.
+ */
+void
+hist_init(histogram *h) {
+   memset(h, '\0', sizeof(*h));
+   h->min = ~(TCP_UINT64) 0;
+}
+
+/*
+ *	hist_add -- Record a value in a histogram
+ *
+ *	Inputs:
+ *
+ *	h	The histogram
+ *	value	The value to record
+ *
+ *	Returns:
+ *
+ *	None.
+ */
+void
+hist_add(histogram *h, TCP_UINT64 value) {
+   h->counts[hist_bucket(value)]++;
+   h->count++;
+   h->sum += value;
+   if (value < h->min)
+      h->min = value;
+   if (value > h->max)
+      h->max = value;
+}
+
+/*
+ *	hist_merge -- Add the counts from one histogram to another
+ *
+ *	Inputs:
+ *
+ *	dst	The histogram to add to
+ *	src	The histogram to add
+ *
+ *	Returns:
+ *
+ *	None.
+ */
+void
+hist_merge(histogram *dst, const histogram *src) {
+   unsigned i;
+
+   if (!src->count)
+      return;
+   for (i=0; i<HIST_BUCKETS; i++)
+      dst->counts[i] += src->counts[i];
+   dst->count += src->count;
+   dst->sum += src->sum;
+   if (src->min < dst->min)
+      dst->min = src->min;
+   if (src->max > dst->max)
+      dst->max = src->max;
+}
+
+/*
+ *	hist_percentile -- Return a percentile from a histogram
+ *
+ *	Inputs:
+ *
+ *	h	The histogram
+ *	pct	The percentile, from 0 to 100
+ *
+ *	Returns:
+ *
+ *	The highest value in the bucket containing the requested percentile,
+ *	limited to the maximum recorded value, or zero if the histogram is
+ *	empty.
+ */
+TCP_UINT64
+hist_percentile(const histogram *h, double pct) {
+   TCP_UINT64 target;
+   TCP_UINT64 seen = 0;
+   unsigned i;
+
+   if (!h->count)
+      return 0;
+   target = (TCP_UINT64) (pct / 100.0 * h->count + 0.5);
+   if (target < 1)
+      target = 1;
+   if (target > h->count)
+      target = h->count;
+   for (i=0; i<HIST_BUCKETS; i++) {
+      seen += h->counts[i];
+      if (seen >= target) {
+         TCP_UINT64 value = hist_bucket_high(i);
+         return value < h->max ? value : h->max;
+      }
+   }
+   return h->max;
+}
+
+/*
+ *	hist_print -- Display a histogram summary
+ *
+ *	Inputs:
+ *
+ *	fp	Where to write the summary, e.g. stdout
+ *	h	The histogram
+ *	name	Name to display
+ *	scale	Divide values by this before displaying them, e.g. 1000000
+ *		to display nanoseconds as milliseconds
+ *	unit	Name of the displayed unit, e.g. "ms"
+ *	detail	If non-zero, also display the count for each power of two
+ *
+ *	Returns:
+ *
+ *	None.
+ */
+void
+hist_print(FILE *fp, const histogram *h, const char *name, double scale,
+           const char *unit, int detail) {
+   static const double pcts[] = {50.0, 90.0, 99.0, 99.9};
+   unsigned i;
+
+   if (!h->count) {
+      fprintf(fp, "%s: no samples\n", name);
+      return;
+   }
+   fprintf(fp, "%s: " TCP_UINT64_FORMAT " samples, min %.3f, mean %.3f, max %.3f %s\n",
+           name, h->count, h->min / scale,
+           (double) h->sum / h->count / scale, h->max / scale, unit);
+   fprintf(fp, "%s:", name);
+   for (i=0; i<sizeof(pcts)/sizeof(pcts[0]); i++)
+      fprintf(fp, " p%g=%.3f", pcts[i], hist_percentile(h, pcts[i]) / scale);
+   fprintf(fp, " %s\n", unit);
+
+   if (detail) {
+      TCP_UINT64 peak = 0;
+      TCP_UINT64 row[65];
+      unsigned b;
+
+      memset(row, '\0', sizeof(row));
+      for (b=0; b<HIST_BUCKETS; b++) {
+         if (h->counts[b]) {
+            TCP_UINT64 high = hist_bucket_high(b);
+            unsigned bits = high ? 64 - __builtin_clzll(high) : 0;
+            row[bits] += h->counts[b];
+         }
+      }
+      for (b=0; b<65; b++)
+         if (row[b] > peak)
+            peak = row[b];
+      for (b=0; b<65; b++) {
+         double limit = b < 64 ? (double) ((TCP_UINT64) 1 << b) :
+                                 18446744073709551616.0;
+         char count[24];
+         int bar;
+
+         if (!row[b])
+            continue;
+         snprintf(count, sizeof(count), TCP_UINT64_FORMAT, row[b]);
+         bar = (int) (row[b] * 40 / peak);
+         fprintf(fp, "  < %12.3f %s %10s %.*s\n",
+                 limit / scale, unit, count, bar ? bar : 1,
+                 "########################################");
+      }
+   }
+}
@@ -0,0 +1,446 @@
+/*
+ * The TCP Scanner (tcp-scan) is Copyright (C) 2003-2013 Roy Hills,
+ * NTA Monitor Ltd.
+ *
+ * This file is part of tcp-scan.
+ *
+ * tcp-scan is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * tcp-scan is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with tcp-scan.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * libtcpscan.c -- Library interface for tcp-scan
+ *
+ * This file contains the functions declared in libtcpscan.h, and
+ * submit_job(), which sends a job to a --daemon for the --submit option.
+ *
+ * Each engine and each context is separate, and the functions are
+ * given the one that they work on, so nothing is shared between
+ * engines.  Fatal errors return through error_jump, which each of
+ * these functions saves and restores, so that they can be called from
+ * a reply callback.  The function then returns NULL or -1.
+ */
+
+#include "tcp-scan.h"
+
+/*
+ *	reset_job_state -- Clear the statistics of the last scan
+ *
+ *	Inputs:
+ *
+ *	eng		The scan engine
+ *
+ *	Returns:
+ *
+ *	None.
+ *
+ *	This is used between library scans.  The results are in each scan's
+ *	own context, so this only zeros the counters for the socket and the
+ *	capture.  Replies that arrived after the last
+ *	scan finished are discarded, so that they cannot be matched to this
+ *	one.
+ */
+void
+reset_job_state(tcpscan_engine *eng) {
+   unsigned i;
+
+   eng->tx_stamped = 0;
+   memset(eng->tx_ring, '\0', sizeof(eng->tx_ring));
+   for (i=0; i<STAGE_COUNT; i++)
+      hist_init(&eng->stage_hist[i]);
+   eng->sendto_errors = 0;
+   eng->sendto_calls = 0;
+   eng->select_calls = 0;
+   eng->select_empty = 0;
+   eng->dispatch_calls = 0;
+   eng->dispatch_packets = 0;
+   eng->errqueue_reads = 0;
+   eng->dryrun_probes = 0;
+   eng->dryrun_lost = 0;
+   eng->dryrun_responses = 0;
+   eng->dryrun_queue_len = 0;
+   if (eng->pcap_handle)
+      while (pcap_dispatch(eng->pcap_handle, -1, discard_packet, NULL) > 0)
+         ;
+}
+
+/*
+ *	discard_packet -- pcap_dispatch() callback that ignores the packet
+ */
+void
+discard_packet(u_char *args ATTRIBUTE_UNUSED,
+               const struct pcap_pkthdr *header ATTRIBUTE_UNUSED,
+               const u_char *packet_in ATTRIBUTE_UNUSED) {
+}
+
+/*
+ *	tcpscan_init -- Create an engine with its socket, capture and probes
+ *
+ *	Inputs:
+ *
+ *	argc		Number of options, including argv[0]
+ *	argv		Options in the same form as the tcp-scan command line
+ *
+ *	Returns:
+ *
+ *	The new engine, or NULL on error.
+ *
+ *	The per-scan options given here are the defaults for tcpscan_new().
+ *	Options that split the scan or write files are not supported.
+ */
+tcpscan_engine *
+tcpscan_init(int argc, char *argv[]) {
+   jmp_buf init_error;
+   jmp_buf *saved_jump = error_jump;
+   tcpscan_engine *volatile eng = NULL;	/* Set after setjmp() */
+   unsigned i;
+
+   if (setjmp(init_error) != 0) {
+      error_jump = saved_jump;
+      tcpscan_close(eng);
+      return NULL;
+   }
+   error_jump = &init_error;
+   eng = Malloc(sizeof(*eng));
+   init_engine(eng);
+   printable_select(PRINTABLE_IMPL_AUTO);
+   optind = 0;		/* Make getopt_long_only() start again */
+   process_options(&eng->cli_scan, argc, argv, 0);
+   if (eng->workers > 1 || eng->shard_count || *eng->replay_file != '\0' ||
+       *eng->checkpoint_file != '\0' || *eng->previous_file != '\0' ||
+       *eng->pcap_savefile != '\0' || *eng->metrics_spec != '\0' ||
+       *eng->daemon_path != '\0' || *eng->submit_path != '\0' ||
+       eng->ipv6_flag)
+      err_msg("The library does not support --workers, --shard, --replay, "
+              "--checkpoint, --previous, --pcapsavefile, --metrics, "
+              "--daemon, --submit or IPv6.");
+   if (eng->dryrun_flag)
+      set_virtual_clock(eng, timestamp_ns());
+   eng->scan_start_ns = engine_time_ns(eng);
+   for (i=0; i<STAGE_COUNT; i++)
+      hist_init(&eng->stage_hist[i]);
+   if (!eng->dryrun_flag)
+      eng->sockfd = open_raw_socket(eng);
+   initialise(eng);
+   error_jump = saved_jump;
+   return eng;
+}
+
+/*
+ *	tcpscan_new -- Create a scan context
+ *
+ *	Inputs:
+ *
+ *	eng		The engine that will run the scan
+ *	argc		Number of words, including argv[0]
+ *	argv		Per-scan options and targets, as for a --daemon job
+ *
+ *	Returns:
+ *
+ *	The new context, or NULL on error.
+ */
+tcpscan_ctx *
+tcpscan_new(tcpscan_engine *eng, int argc, char *argv[]) {
+   jmp_buf new_error;
+   jmp_buf *saved_jump = error_jump;
+   tcpscan_ctx *volatile ctx = NULL;	/* Set after setjmp() */
+   int i;
+
+   if (setjmp(new_error) != 0) {
+      error_jump = saved_jump;
+      tcpscan_free(ctx);
+      return NULL;
+   }
+   error_jump = &new_error;
+   ctx = Malloc(sizeof(*ctx));
+   init_context(ctx, eng, &eng->cli_scan);
+   optind = 0;		/* Make getopt_long_only() start again */
+   process_options(ctx, argc, argv, 1);
+   if (optind < argc)
+      check_port_options(ctx);
+   for (i=optind; i<argc; i++)
+      add_host(ctx, argv[i], ctx->timeout);
+   error_jump = saved_jump;
+   return ctx;
+}
+
+/*
+ *	tcpscan_set_targets -- Add the targets from an iterator to a scan
+ *
+ *	Inputs:
+ *
+ *	ctx		The scan context
+ *	next		Function that returns the next address and port
+ *	arg		Argument for next()
+ *
+ *	Returns:
+ *
+ *	0 on success, or -1 on error.
+ *
+ *	The targets are added to any that were given to tcpscan_new().
+ */
+int
+tcpscan_set_targets(tcpscan_ctx *ctx, tcpscan_target_fn next, void *arg) {
+   jmp_buf targets_error;
+   jmp_buf *saved_jump = error_jump;
+   ip_address addr;
+   uint16_t port;
+
+   if (setjmp(targets_error) != 0) {
+      error_jump = saved_jump;
+      return -1;
+   }
+   error_jump = &targets_error;
+   memset(&addr, '\0', sizeof(addr));
+   while (next(arg, &addr.v4, &port)) {
+      if (port == 0)
+         err_msg("Invalid port number: 0.  Port must be in range 1-65535");
+      add_host_port(ctx, &addr, ctx->timeout, port);
+   }
+   error_jump = saved_jump;
+   return 0;
+}
+
+/*
+ *	tcpscan_set_callback -- Set the function that is given each reply
+ *
+ *	Inputs:
+ *
+ *	ctx		The scan context
+ *	fn		Reply callback, or NULL to display replies on stdout
+ *	arg		Argument for fn()
+ *
+ *	Returns:
+ *
+ *	None.
+ */
+void
+tcpscan_set_callback(tcpscan_ctx *ctx, tcpscan_reply_fn fn, void *arg) {
+   ctx->reply_fn = fn;
+   ctx->reply_arg = arg;
+}
+
+/*
+ *	tcpscan_run -- Scan the targets of a context
+ *
+ *	Inputs:
+ *
+ *	ctx		The scan context
+ *
+ *	Returns:
+ *
+ *	The number of replies given to the callback, or -1 on error.
+ *
+ *	This returns when every target has replied or timed out.  A context
+ *	can only be run once.  The engine's socket and capture are used by
+ *	one scan at a time, so a context cannot be run from the callback of
+ *	another context of the same engine.
+ */
+int
+tcpscan_run(tcpscan_ctx *ctx) {
+   tcpscan_engine *eng = ctx->engine;
+   jmp_buf run_error;
+   jmp_buf *saved_jump = error_jump;
+   struct timeval start_time;
+
+   if (eng->running) {
+      warn_msg("Another scan of this engine is running.");
+      return -1;
+   }
+   eng->running = 1;
+   if (setjmp(run_error) != 0) {
+      eng->running = 0;
+      error_jump = saved_jump;
+      return -1;
+   }
+   error_jump = &run_error;
+   if (ctx->num_hosts == 0)
+      err_msg("No hosts to process.");
+   if (ctx->helistptr)
+      err_msg("This scan has already been run.");
+   reset_job_state(eng);
+   prepare_list(ctx);
+   engine_gettimeofday(eng, &start_time);
+   scan_loop(ctx, eng->sockfd, &start_time);
+   eng->running = 0;
+   error_jump = saved_jump;
+   return ctx->replies_delivered;
+}
+
+/*
+ *	tcpscan_free -- Free a scan context
+ *
+ *	Inputs:
+ *
+ *	ctx		The scan context, which may be NULL
+ *
+ *	Returns:
+ *
+ *	None.
+ */
+void
+tcpscan_free(tcpscan_ctx *ctx) {
+   if (ctx == NULL)
+      return;
+   free(ctx->helist);
+   free(ctx->helistptr);
+   free(ctx->host_index);
+   free(ctx->host_stats);
+   free(ctx->local_data);
+   free(ctx);
+}
+
+/*
+ *	tcpscan_close -- Close the socket and capture of an engine and free it
+ *
+ *	Inputs:
+ *
+ *	eng		The engine, which may be NULL
+ *
+ *	Returns:
+ *
+ *	None.
+ *
+ *	The contexts of the engine must be freed first.
+ */
+void
+tcpscan_close(tcpscan_engine *eng) {
+   if (eng == NULL)
+      return;
+   if (eng->pcap_handle)
+      pcap_close(eng->pcap_handle);
+   if (eng->sockfd >= 0)
+      close(eng->sockfd);
+   if (eng->services)
+      service_db_free(eng->services);
+   free(eng->if_name);
+   free(eng->port_list);
+   free(eng->port_rank);
+   free(eng->discover_ports);
+   free(eng->dryrun_queue);
+   free(eng->cli_scan.local_data);
+   free(eng);
+}
+
+/*
+ *	submit_job -- Send a scan job to a --daemon and display the results
+ *
+ *	Inputs:
+ *
+ *	eng		The scan engine
+ *	argc		Command line arg count
+ *	argv		Command line args
+ *
+ *	Returns:
+ *
+ *	The job's exit status from the daemon.
+ *
+ *	The job is the command line without the --submit option.  The
+ *	daemon does not look up names, so that one job's lookup cannot hold
+ *	up the others, and the targets are resolved here instead.  The
+ *	results are copied to stdout, and DAEMON_ERROR lines to stderr,
+ *	until the DAEMON_STATUS line.  A connection that ends without it is
+ *	an error, as the job did not finish.
+ *
+ *	This must be called after process_options(), which leaves the
+ *	targets at argv[optind] onwards.
+ */
+int
+submit_job(tcpscan_engine *eng, int argc, char *argv[]) {
+#ifdef HAVE_SYS_UN_H
+   struct sockaddr_un sun;
+   char line[MAXLINE];
+   char *job = dupstr("");
+   char *cp;
+   FILE *in;
+   FILE *dest = stdout;
+   ssize_t n;
+   size_t len;
+   size_t done;
+   int line_start = 1;	/* line begins a line of the output */
+   int status = -1;	/* From the DAEMON_STATUS line */
+   int fd;
+   int i;
+
+   for (i=1; i<argc; i++) {
+      const char *name = argv[i] + strspn(argv[i], "-");
+      const char *word = argv[i];
+      int af = eng->ipv6_flag ? AF_INET6 : AF_INET;
+      ip_address addr;
+      char *ga_err_msg;
+
+      if (i < optind && argv[i][0] == '-' &&
+          strncmp(name, "submit", 6) == 0) {
+         if (name[6] == '\0')
+            i++;		/* Skip the separate socket path */
+         if (name[6] == '\0' || name[6] == '=')
+            continue;
+      }
+      if (i >= optind && !eng->cli_scan.numeric_flag &&
+          inet_pton(af, argv[i], &addr) <= 0) {
+         if (get_host_address(argv[i], af, &addr, &ga_err_msg) == NULL)
+            err_msg("get_host_address failed for \"%s\": %s", argv[i],
+                    ga_err_msg);
+         word = my_ntoa(addr, eng->ipv6_flag);
+      }
+      cp = job;
+      job = make_message("%s %s", cp, word);
+      free(cp);
+   }
+   memset(&sun, '\0', sizeof(sun));
+   sun.sun_family = AF_UNIX;
+   if (strlen(eng->submit_path) >= sizeof(sun.sun_path))
+      err_msg("Invalid --submit UNIX socket path \"%s\"", eng->submit_path);
+   strlcpy(sun.sun_path, eng->submit_path, sizeof(sun.sun_path));
+   if ((fd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0)
+      err_sys("socket");
+   if (connect(fd, (struct sockaddr *) &sun, sizeof(sun)) < 0)
+      err_sys("connect %s", eng->submit_path);
+   signal(SIGPIPE, SIG_IGN);	/* A daemon that goes away is an error */
+   cp = job;
+   job = make_message("%s\n", cp);
+   free(cp);
+   len = strlen(job);
+   for (done = 1; done < len; done += n)	/* Skip the leading space */
+      if ((n = write(fd, job + done, len - done)) < 0)
+         err_sys("write");
+   free(job);
+   if ((in = fdopen(fd, "r")) == NULL)
+      err_sys("fdopen");
+   while (status < 0 && fgets(line, sizeof(line), in) != NULL) {
+      const char *text = line;
+
+      if (line_start) {
+         dest = stdout;
+         if (strncmp(line, DAEMON_STATUS, strlen(DAEMON_STATUS)) == 0) {
+            status = atoi(line + strlen(DAEMON_STATUS));
+            break;
+         }
+         if (strncmp(line, DAEMON_ERROR, strlen(DAEMON_ERROR)) == 0) {
+            fflush(stdout);
+            dest = stderr;
+            text += strlen(DAEMON_ERROR);
+         }
+      }
+      fputs(text, dest);
+      line_start = strchr(line, '\n') != NULL;
+   }
+   if (ferror(in))
+      err_sys("read");
+   fclose(in);
+   if (status < 0)
+      err_msg("The --daemon connection ended before the job finished.");
+   return status;
+#else
+   err_msg("UNIX sockets are not supported on this system");
+   return EXIT_FAILURE;
+#endif
+}
@@ -0,0 +1,93 @@
+/*
+ * The TCP Scanner (tcp-scan) is Copyright (C) 2003-2013 Roy Hills,
+ * NTA Monitor Ltd.
+ *
+ * This file is part of tcp-scan.
+ *
+ * tcp-scan is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * tcp-scan is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with tcp-scan.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * libtcpscan.h -- Interface to the tcp-scan engine as a library
+ *
+ * A program that embeds the scanner creates an engine with
+ * tcpscan_init(), giving the options that set up the socket, the capture
+ * and the probes in the same form as the tcp-scan command line.  Each
+ * scan is then a context from tcpscan_new(), with its own options,
+ * targets and results:
+ *
+ *	eng = tcpscan_init(argc, argv);
+ *	ctx = tcpscan_new(eng, job_argc, job_argv);
+ *	tcpscan_set_targets(ctx, next_target, &state);
+ *	tcpscan_set_callback(ctx, handle_reply, &results);
+ *	tcpscan_run(ctx);
+ *	tcpscan_free(ctx);
+ *	tcpscan_close(eng);
+ *
+ * The callback is given each reply as a decoded tcpscan_reply, which
+ * points into the capture buffer rather than copying the packet, so it
+ * is only valid until the callback returns.  Errors are reported on
+ * stderr, and the function returns NULL or -1.
+ *
+ * Engines share no state, so scans on different engines can run in
+ * different threads, or one inside the callback of another.  The
+ * contexts of one engine share its socket and capture, so they are run
+ * one at a time.  tcpscan_init() and tcpscan_new() parse their options
+ * with getopt_long_only(), so they must not be called from two threads
+ * at once.
+ */
+
+#ifndef LIBTCPSCAN_H
+#define LIBTCPSCAN_H 1
+
+#include <stddef.h>
+#include <stdint.h>
+#include <netinet/in.h>
+
+typedef struct tcpscan_engine tcpscan_engine;
+typedef struct tcpscan_ctx tcpscan_ctx;
+
+/* A reply to a probe, given to the tcpscan_reply_fn callback */
+typedef struct {
+   struct in_addr addr;		/* Target address */
+   struct in_addr responder;	/* Source of the reply, normally addr */
+   uint16_t port;		/* Target port */
+   int open;			/* 1 for SYN-ACK, 0 for RST */
+   uint8_t tcp_flags;		/* TCP flags byte of the reply */
+   uint16_t window;		/* TCP window */
+   uint8_t ttl;			/* IP TTL */
+   unsigned attempt;		/* Probes sent to the port so far */
+   int duplicate;		/* Not the first reply from the port */
+   uint64_t rtt_ns;		/* Round trip time, or 0 if not known */
+   const unsigned char *packet;	/* The IP packet */
+   size_t packet_len;		/* Captured length of the IP packet */
+} tcpscan_reply;
+
+/*
+ * Target iterator: store the next address and port, and return 1, or
+ * return 0 when there are no more.
+ */
+typedef int (*tcpscan_target_fn)(void *arg, struct in_addr *addr,
+                                 uint16_t *port);
+
+/* Reply callback */
+typedef void (*tcpscan_reply_fn)(void *arg, const tcpscan_reply *reply);
+
+tcpscan_engine *tcpscan_init(int argc, char *argv[]);
+tcpscan_ctx *tcpscan_new(tcpscan_engine *eng, int argc, char *argv[]);
+int tcpscan_set_targets(tcpscan_ctx *ctx, tcpscan_target_fn next, void *arg);
+void tcpscan_set_callback(tcpscan_ctx *ctx, tcpscan_reply_fn fn, void *arg);
+int tcpscan_run(tcpscan_ctx *ctx);
+void tcpscan_free(tcpscan_ctx *ctx);
+void tcpscan_close(tcpscan_engine *eng);
+
+#endif	/* LIBTCPSCAN_H */
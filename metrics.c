@@ -0,0 +1,357 @@
+/*
+ * The TCP Scanner (tcp-scan) is Copyright (C) 2003-2013 Roy Hills,
+ * NTA Monitor Ltd.
+ *
+ * This file is part of tcp-scan.
+ *
+ * tcp-scan is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * tcp-scan is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with tcp-scan.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * metrics.c -- Prometheus metrics listener for tcp-scan
+ *
+ * This file contains a minimal HTTP server for the Prometheus text
+ * exposition format.  It listens on a UNIX socket or a TCP port and is
+ * driven from the tcp-scan select() loop, so it needs no threads and the
+ * counters that it reports need no locking.  Each connection is handled
+ * in turn: once the request headers have been read, the caller's format
+ * function writes the metrics, which are sent as the client reads them,
+ * and the connection is closed.  The request itself is not examined, so
+ * any path returns the metrics.  Nothing here blocks, so a slow client
+ * cannot hold up the scan.
+ */
+
+#include "tcp-scan.h"
+
+#include <fcntl.h>
+#ifdef HAVE_SYS_UN_H
+#include <sys/un.h>
+#endif
+
+#define METRICS_REQUEST_MAX 4096	/* Largest request header we read */
+#define METRICS_BACKLOG 4		/* listen() backlog */
+#define METRICS_TIMEOUT 5		/* Seconds to serve a connection */
+
+#ifndef MSG_NOSIGNAL
+#define MSG_NOSIGNAL 0			/* SO_NOSIGPIPE is used instead */
+#endif
+
+struct metrics_server {
+   int listen_fd;		/* Listening socket */
+   int client_fd;		/* Connection being served, or -1 */
+   time_t deadline;		/* When to drop the connection */
+   char request[METRICS_REQUEST_MAX+1];
+   size_t request_len;
+   char *response;		/* Response being sent, or NULL */
+   size_t response_len;
+   size_t response_sent;
+   char *unix_path;		/* UNIX socket path to remove, or NULL */
+};
+
+/*
+ *	metrics_open -- Create the metrics listener
+ *
+ *	Inputs:
+ *
+ *	spec	Where to listen: "unix:<path>" for a UNIX socket,
+ *		"<address>:<port>" for a TCP port on an IPv4 address, or
+ *		"<port>" for a TCP port on 127.0.0.1.
+ *
+ *	Returns:
+ *
+ *	A pointer to the new listener.  Errors are fatal.
+ */
+metrics_server *
+metrics_open(const char *spec) {
+   metrics_server *m = Malloc(sizeof(metrics_server));
+   const int on = 1;
+
+   m->client_fd = -1;
+   m->request_len = 0;
+   m->response = NULL;
+   m->unix_path = NULL;
+
+   if (strncmp(spec, "unix:", 5) == 0) {
+#ifdef HAVE_SYS_UN_H
+      struct sockaddr_un sun;
+      struct stat path_stat;
+
+      memset(&sun, '\0', sizeof(sun));
+      sun.sun_family = AF_UNIX;
+      if (strlen(spec + 5) == 0 || strlen(spec + 5) >= sizeof(sun.sun_path))
+         err_msg("Invalid --metrics UNIX socket path \"%s\"", spec + 5);
+      strlcpy(sun.sun_path, spec + 5, sizeof(sun.sun_path));
+      if ((m->listen_fd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0)
+         err_sys("socket");
+/*
+ *	Remove a stale socket left by an earlier scan, but nothing else that
+ *	may be at the path by mistake.  This runs as root.
+ */
+      if (lstat(sun.sun_path, &path_stat) == 0) {
+         if (!S_ISSOCK(path_stat.st_mode))
+            err_msg("The --metrics path %s exists and is not a socket.",
+                    sun.sun_path);
+         if (unlink(sun.sun_path) < 0)
+            err_sys("unlink %s", sun.sun_path);
+      } else if (errno != ENOENT) {
+         err_sys("lstat %s", sun.sun_path);
+      }
+      if (bind(m->listen_fd, (struct sockaddr *) &sun, sizeof(sun)) < 0)
+         err_sys("bind %s", sun.sun_path);
+      m->unix_path = dupstr(sun.sun_path);
+#else
+      err_msg("UNIX sockets are not supported on this system");
+#endif
+   } else {
+      struct sockaddr_in sin;
+      const char *colon = strrchr(spec, ':');
+      const char *port = colon ? colon + 1 : spec;
+      unsigned long port_no;
+      char *end;
+
+      memset(&sin, '\0', sizeof(sin));
+      sin.sin_family = AF_INET;
+      sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+      if (colon) {
+         char *addr = dupstr(spec);
+
+         addr[colon - spec] = '\0';
+         if (inet_pton(AF_INET, addr, &sin.sin_addr) != 1)
+            err_msg("Invalid --metrics address \"%s\"", addr);
+         free(addr);
+      }
+      port_no = strtoul(port, &end, 10);
+      if (*port == '\0' || *end != '\0' || port_no < 1 || port_no > 65535)
+         err_msg("Invalid --metrics port \"%s\"", port);
+      sin.sin_port = htons(port_no);
+      if ((m->listen_fd = socket(AF_INET, SOCK_STREAM, 0)) < 0)
+         err_sys("socket");
+      if (setsockopt(m->listen_fd, SOL_SOCKET, SO_REUSEADDR, &on,
+                     sizeof(on)) < 0)
+         err_sys("setsockopt");
+      if (bind(m->listen_fd, (struct sockaddr *) &sin, sizeof(sin)) < 0)
+         err_sys("bind %s", spec);
+   }
+   if (listen(m->listen_fd, METRICS_BACKLOG) < 0)
+      err_sys("listen");
+   if (fcntl(m->listen_fd, F_SETFL, O_NONBLOCK) < 0)
+      err_sys("fcntl");
+
+   return m;
+}
+
+/*
+ *	metrics_fd_set -- Add the listener's sockets to select() sets
+ *
+ *	Inputs:
+ *
+ *	m		The listener
+ *	readset		The read set to add to
+ *	writeset	The write set to add to
+ *	maxfd		The highest descriptor already in the sets
+ *
+ *	Returns:
+ *
+ *	The highest descriptor in the sets.
+ *
+ *	Only one connection is served at a time, so the listening socket is
+ *	not added while a connection is open.  The connection is in the read
+ *	set until the request has been read, and then in the write set.
+ */
+int
+metrics_fd_set(const metrics_server *m, fd_set *readset, fd_set *writeset,
+               int maxfd) {
+   int fd = m->client_fd >= 0 ? m->client_fd : m->listen_fd;
+
+   FD_SET(fd, m->response ? writeset : readset);
+   return fd > maxfd ? fd : maxfd;
+}
+
+/*
+ *	metrics_close_client -- Close the current connection
+ */
+static void
+metrics_close_client(metrics_server *m) {
+   close(m->client_fd);
+   m->client_fd = -1;
+   m->request_len = 0;
+   free(m->response);
+   m->response = NULL;
+}
+
+/*
+ *	metrics_respond -- Format the metrics for the current connection
+ *
+ *	The response is sent by metrics_send() as the client reads it.
+ */
+static void
+metrics_respond(metrics_server *m, void (*format)(FILE *, void *),
+                void *arg) {
+   char *body = NULL;
+   size_t body_len = 0;
+   FILE *fp;
+
+   if ((fp = open_memstream(&body, &body_len)) == NULL)
+      err_sys("open_memstream");
+   format(fp, arg);
+   if (fclose(fp))
+      err_sys("fclose");
+   m->response = make_message("HTTP/1.0 200 OK\r\n"
+                              "Content-Type: text/plain; version=0.0.4\r\n"
+                              "Content-Length: %lu\r\n"
+                              "Connection: close\r\n\r\n%s",
+                              (unsigned long) body_len, body);
+   m->response_len = strlen(m->response);
+   m->response_sent = 0;
+   free(body);
+}
+
+/*
+ *	metrics_send -- Send what the client can take of the response
+ *
+ *	MSG_NOSIGNAL stops a client that has gone away from killing the
+ *	process with SIGPIPE, as SIGPIPE is only ignored by --daemon.
+ */
+static void
+metrics_send(metrics_server *m) {
+   ssize_t n;
+
+   n = send(m->client_fd, m->response + m->response_sent,
+            m->response_len - m->response_sent, MSG_NOSIGNAL);
+   if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR))
+      return;
+   if (n > 0)
+      m->response_sent += n;
+   if (n <= 0 || m->response_sent == m->response_len) {
+      shutdown(m->client_fd, SHUT_WR);	/* Done, or client has gone away */
+      metrics_close_client(m);
+   }
+}
+
+/*
+ *	metrics_handle -- Service the listener after select() returns
+ *
+ *	Inputs:
+ *
+ *	m		The listener
+ *	readset		The read set returned by select()
+ *	writeset	The write set returned by select()
+ *	format		Function to write the metrics in Prometheus text format
+ *	arg		Argument for format()
+ *
+ *	Returns:
+ *
+ *	None.
+ *
+ *	A connection that has not been served within METRICS_TIMEOUT seconds
+ *	is dropped, so that the next scrape is not locked out.
+ */
+void
+metrics_handle(metrics_server *m, const fd_set *readset,
+               const fd_set *writeset, void (*format)(FILE *, void *),
+               void *arg) {
+#ifdef SO_NOSIGPIPE
+   const int on = 1;
+#endif
+   ssize_t n;
+
+   if (m->client_fd >= 0 && time(NULL) > m->deadline) {
+      metrics_close_client(m);
+      return;
+   }
+   if (m->client_fd < 0) {
+      if (!FD_ISSET(m->listen_fd, readset))
+         return;
+      if ((m->client_fd = accept(m->listen_fd, NULL, NULL)) < 0) {
+         m->client_fd = -1;	/* E.g. the client has gone away */
+         return;
+      }
+      if (fcntl(m->client_fd, F_SETFL, O_NONBLOCK) < 0)
+         err_sys("fcntl");
+#ifdef SO_NOSIGPIPE
+      setsockopt(m->client_fd, SOL_SOCKET, SO_NOSIGPIPE, &on, sizeof(on));
+#endif
+      m->deadline = time(NULL) + METRICS_TIMEOUT;
+   } else if (m->response) {
+      if (FD_ISSET(m->client_fd, writeset))
+         metrics_send(m);
+      return;
+   } else if (!FD_ISSET(m->client_fd, readset)) {
+      return;
+   }
+/*
+ *	Read what we can of the request, and respond once we have seen the
+ *	end of the headers.  A request that is too long, or a connection
+ *	that is closed first, gets the metrics anyway.
+ */
+   n = read(m->client_fd, m->request + m->request_len,
+            METRICS_REQUEST_MAX - m->request_len);
+   if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+      return;
+   if (n > 0) {
+      m->request_len += n;
+      m->request[m->request_len] = '\0';
+      if (!strstr(m->request, "\r\n\r\n") && !strstr(m->request, "\n\n") &&
+          m->request_len < METRICS_REQUEST_MAX)
+         return;
+   } else if (n < 0) {
+      metrics_close_client(m);
+      return;
+   }
+   metrics_respond(m, format, arg);
+   metrics_send(m);
+}
+
+/*
+ *	metrics_write -- Write one metric in Prometheus text format
+ *
+ *	Inputs:
+ *
+ *	fp	Where to write the metric
+ *	name	Metric name
+ *	type	"counter" or "gauge"
+ *	help	Description of the metric
+ *	value	The value
+ *
+ *	Returns:
+ *
+ *	None.
+ */
+void
+metrics_write(FILE *fp, const char *name, const char *type, const char *help,
+              double value) {
+   fprintf(fp, "# HELP %s %s\n# TYPE %s %s\n%s %.17g\n", name, help, name,
+           type, name, value);
+}
+
+/*
+ *	metrics_close -- Close the listener
+ *
+ *	Inputs:
+ *
+ *	m	The listener
+ *
+ *	Returns:
+ *
+ *	None.
+ */
+void
+metrics_close(metrics_server *m) {
+   if (m->client_fd >= 0)
+      metrics_close_client(m);
+   close(m->listen_fd);
+   if (m->unix_path) {
+      unlink(m->unix_path);
+      free(m->unix_path);
+   }
+   free(m);
+}
@@ -0,0 +1,220 @@
+/*
+ * The TCP Scanner (tcp-scan) is Copyright (C) 2003-2013 Roy Hills,
+ * NTA Monitor Ltd.
+ *
+ * This file is part of tcp-scan.
+ *
+ * tcp-scan is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * tcp-scan is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with tcp-scan.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * mkbenchpcap -- Generate a savefile of responses for tcp-scan --replay
+ *
+ * Usage: mkbenchpcap <pcap-file> <target-file> [<hosts> [<ports>]]
+ *
+ * This writes a classic pcap savefile containing a response from every
+ * port 1 to <ports> on <hosts> target addresses starting at 10.0.0.1,
+ * and a file listing the target addresses.  The responses are timed as
+ * if the probes were sent in list order every BENCH_INTERVAL ns, with
+ * a random round trip time of up to BENCH_MAX_RTT ns.  A quarter
+ * of the responses are SYN-ACKs with a typical set of TCP options, and
+ * the rest are RSTs.  The files are used by "make bench" to measure the
+ * tcp-scan receive pipeline with:
+ *
+ *	tcp-scan --replay=<pcap-file> --file=<target-file> --numeric \
+ *	         --port=1-<ports> --interval=10u
+ */
+
+#include "tcp-scan.h"
+
+#define DEFAULT_HOSTS 10000
+#define DEFAULT_PORTS 10
+#define BENCH_SPORT 40000		/* Destination port of the responses */
+#define BENCH_SEQ 0x12345678		/* Sequence number of the probes */
+#define BENCH_INTERVAL 10000		/* Time between probes in ns */
+#define BENCH_MIN_RTT 100000		/* Minimum round trip time in ns */
+#define BENCH_MAX_RTT 2000000		/* Maximum round trip time in ns */
+
+typedef struct {
+   TCP_UINT64 ts;			/* Response time in ns */
+   uint32_t n;				/* Host entry number, from 0 */
+} response;
+
+/*
+ *	response_compare -- qsort() comparison function for response times
+ */
+static int
+response_compare(const void *a, const void *b) {
+   const response *ra = a;
+   const response *rb = b;
+
+   if (ra->ts != rb->ts)
+      return ra->ts < rb->ts ? -1 : 1;
+   return ra->n < rb->n ? -1 : ra->n > rb->n;
+}
+
+/*
+ *	put16 and put32 -- Store values in network byte order
+ */
+static void
+put16(unsigned char *p, unsigned v) {
+   p[0] = (v >> 8) & 0xff;
+   p[1] = v & 0xff;
+}
+
+static void
+put32(unsigned char *p, uint32_t v) {
+   put16(p, v >> 16);
+   put16(p+2, v & 0xffff);
+}
+
+/*
+ *	put_le32 -- Store a value in the pcap file header byte order
+ *
+ *	We write the savefile in little-endian byte order.  Readers detect
+ *	the byte order from the magic number.
+ */
+static void
+put_le32(unsigned char *p, uint32_t v) {
+   p[0] = v & 0xff;
+   p[1] = (v >> 8) & 0xff;
+   p[2] = (v >> 16) & 0xff;
+   p[3] = (v >> 24) & 0xff;
+}
+
+/*
+ *	make_response -- Build one response frame
+ *
+ *	Returns the frame length.
+ */
+static unsigned
+make_response(unsigned char *frame, uint32_t addr, unsigned port, int open) {
+   static const unsigned char options[] = {
+      2, 4, 0x05, 0xb4,			/* MSS=1460 */
+      4, 2,				/* SACKOK */
+      8, 10, 0, 0, 0, 1, 0, 0, 0, 0,	/* TIMESTAMP=1,0 */
+      1,				/* NOP */
+      3, 3, 7				/* WSCALE=7 */
+   };
+   unsigned char *ip = frame + 14;
+   unsigned char *tcp = ip + 20;
+   unsigned tcp_len = open ? 20 + sizeof(options) : 20;
+
+   memset(frame, '\0', 14 + 20 + tcp_len);
+   frame[0] = 0x02;			/* Locally administered MACs */
+   frame[6] = 0x02;
+   frame[11] = 1;
+   put16(frame+12, 0x0800);		/* Ethertype IPv4 */
+
+   ip[0] = 0x45;			/* Version 4, 20 byte header */
+   put16(ip+2, 20 + tcp_len);
+   put16(ip+6, 0x4000);			/* DF */
+   ip[8] = 57;				/* TTL */
+   ip[9] = 6;				/* TCP */
+   put32(ip+12, addr);			/* Source is the target */
+   put32(ip+16, 0x0a000000);		/* Destination 10.0.0.0 */
+
+   put16(tcp, port);
+   put16(tcp+2, BENCH_SPORT);
+   put32(tcp+4, open ? 0x9abcdef0 : 0);
+   put32(tcp+8, BENCH_SEQ + 1);
+   tcp[12] = (tcp_len / 4) << 4;
+   if (open) {
+      tcp[13] = 0x12;			/* SYN, ACK */
+      put16(tcp+14, 65160);
+      memcpy(tcp+20, options, sizeof(options));
+   } else {
+      tcp[13] = 0x14;			/* RST, ACK */
+   }
+   return 14 + 20 + tcp_len;
+}
+
+int
+main(int argc, char *argv[]) {
+   unsigned hosts = DEFAULT_HOSTS;
+   unsigned ports = DEFAULT_PORTS;
+   response *order;
+   unsigned total;
+   unsigned i;
+   unsigned char buf[128];
+   TCP_UINT64 start = (TCP_UINT64) 1500000000 * 1000000000;
+   FILE *pcap;
+   FILE *targets;
+
+   if (argc < 3 || argc > 5) {
+      fprintf(stderr, "Usage: mkbenchpcap <pcap-file> <target-file> "
+                      "[<hosts> [<ports>]]\n");
+      return EXIT_FAILURE;
+   }
+   if (argc > 3)
+      hosts = Strtoul(argv[3], 10);
+   if (argc > 4)
+      ports = Strtoul(argv[4], 10);
+   if (hosts < 1 || hosts > 0xfffffe || ports < 1 || ports > 65535)
+      err_msg("Invalid number of hosts or ports");
+   if ((TCP_UINT64) hosts * ports > 0xffffffff)
+      err_msg("Too many responses");
+   total = hosts * ports;
+
+   if ((targets = fopen(argv[2], "w")) == NULL)
+      err_sys("fopen %s", argv[2]);
+   for (i=0; i<hosts; i++) {
+      uint32_t addr = 0x0a000001 + i;
+
+      fprintf(targets, "%u.%u.%u.%u\n", addr >> 24, (addr >> 16) & 0xff,
+              (addr >> 8) & 0xff, addr & 0xff);
+   }
+   if (fclose(targets))
+      err_sys("fclose %s", argv[2]);
+/*
+ *	Give each response a time, and sort them into arrival order.
+ */
+   order = Malloc(total * sizeof(response));
+   init_genrand(1);
+   for (i=0; i<total; i++) {
+      order[i].n = i;
+      order[i].ts = start + (TCP_UINT64) i * BENCH_INTERVAL + BENCH_MIN_RTT +
+                    genrand_int32() % (BENCH_MAX_RTT - BENCH_MIN_RTT);
+   }
+   qsort(order, total, sizeof(response), response_compare);
+
+   if ((pcap = fopen(argv[1], "wb")) == NULL)
+      err_sys("fopen %s", argv[1]);
+   put_le32(buf, 0xa1b23c4d);		/* Nanosecond timestamps */
+   put_le32(buf+4, 2 | 4 << 16);	/* Version 2.4 */
+   put_le32(buf+8, 0);			/* Timezone */
+   put_le32(buf+12, 0);			/* Timestamp accuracy */
+   put_le32(buf+16, 65535);		/* Snap length */
+   put_le32(buf+20, 1);			/* LINKTYPE_ETHERNET */
+   fwrite(buf, 1, 24, pcap);
+   for (i=0; i<total; i++) {
+      unsigned char hdr[16];
+      unsigned host = order[i].n / ports;
+      unsigned port = order[i].n % ports + 1;
+      unsigned len = make_response(buf, 0x0a000001 + host, port,
+                                   (order[i].n & 3) == 0);
+
+      put_le32(hdr, order[i].ts / 1000000000);
+      put_le32(hdr+4, order[i].ts % 1000000000);
+      put_le32(hdr+8, len);
+      put_le32(hdr+12, len);
+      fwrite(hdr, 1, sizeof(hdr), pcap);
+      fwrite(buf, 1, len, pcap);
+   }
+   if (fclose(pcap))
+      err_sys("fclose %s", argv[1]);
+   free(order);
+
+   printf("Wrote %u responses from %u hosts x %u ports to %s\n", total, hosts,
+          ports, argv[1]);
+   return EXIT_SUCCESS;
+}
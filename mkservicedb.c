@@ -0,0 +1,51 @@
+/*
+ * The TCP Scanner (tcp-scan) is Copyright (C) 2003-2013 Roy Hills,
+ * NTA Monitor Ltd.
+ *
+ * This file is part of tcp-scan.
+ *
+ * tcp-scan is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * tcp-scan is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with tcp-scan.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * mkservicedb -- Compile a services file into a tcp-scan service database
+ *
+ * Usage:
+ *    mkservicedb <services-file> <database-file>
+ *
+ * Description:
+ *
+ * This reads a services file in "/etc/services" format and writes the
+ * compiled service name database that tcp-scan maps at startup when the
+ * --portname option is used.  It is run by "make" to generate
+ * tcp-scan-services.db from tcp-scan-services.
+ */
+
+#include "tcp-scan.h"
+
+int
+main(int argc, char *argv[]) {
+   service_db *db;
+
+   if (argc != 3) {
+      fprintf(stderr, "Usage: mkservicedb <services-file> <database-file>\n");
+      exit(EXIT_FAILURE);
+   }
+
+   if ((db = service_db_load(argv[1])) == NULL)
+      err_sys("Cannot open services file %s", argv[1]);
+   service_db_save(db, argv[2]);
+   printf("%u services written to %s\n", service_db_count(db), argv[2]);
+   service_db_free(db);
+
+   return 0;
+}
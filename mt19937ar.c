@@ -41,21 +41,28 @@
    email: m-mat @ math.sci.hiroshima-u.ac.jp (remove space)
 */
 
-#include <stdio.h>
+#include "tcp-scan.h"	/* For mt_state */
 
 /* Period parameters */  
-#define N 624
+#define N MT_N
 #define M 397
 #define MATRIX_A 0x9908b0dfUL   /* constant vector a */
 #define UPPER_MASK 0x80000000UL /* most significant w-r bits */
 #define LOWER_MASK 0x7fffffffUL /* least significant r bits */
 
-static unsigned long mt[N]; /* the array for the state vector  */
-static int mti=N+1; /* mti==N+1 means mt[N] is not initialized */
+/* the state used by init_genrand() and genrand_*() */
+/* mti==N+1 means mt[N] is not initialized */
+static mt_state default_state = {{0}, N+1};
+
+/* tcp-scan: the _r versions use the state given, so that each scan */
+/* engine has its own generator */
 
 /* initializes mt[N] with a seed */
-void init_genrand(unsigned long s)
+void init_genrand_r(mt_state *st, unsigned long s)
 {
+    unsigned long *mt = st->mt;
+    int mti;
+
     mt[0]= s & 0xffffffffUL;
     for (mti=1; mti<N; mti++) {
         mt[mti] = 
@@ -67,6 +74,12 @@ void init_genrand(unsigned long s)
         mt[mti] &= 0xffffffffUL;
         /* for >32 bit machines */
     }
+    st->mti = mti;
+}
+
+void init_genrand(unsigned long s)
+{
+    init_genrand_r(&default_state, s);
 }
 
 /* initialize by an array with array-length */
@@ -75,6 +88,7 @@ void init_genrand(unsigned long s)
 /* slight change for C++, 2004/2/26 */
 void init_by_array(unsigned long init_key[], int key_length)
 {
+    unsigned long *mt = default_state.mt;
     int i, j, k;
     init_genrand(19650218UL);
     i=1; j=0;
@@ -99,17 +113,18 @@ void init_by_array(unsigned long init_key[], int key_length)
 }
 
 /* generates a random number on [0,0xffffffff]-interval */
-unsigned long genrand_int32(void)
+unsigned long genrand_int32_r(mt_state *st)
 {
+    unsigned long *mt = st->mt;
     unsigned long y;
-    static unsigned long mag01[2]={0x0UL, MATRIX_A};
+    static const unsigned long mag01[2]={0x0UL, MATRIX_A};
     /* mag01[x] = x * MATRIX_A  for x=0,1 */
 
-    if (mti >= N) { /* generate N words at one time */
+    if (st->mti >= N) { /* generate N words at one time */
         int kk;
 
-        if (mti == N+1)   /* if init_genrand() has not been called, */
-            init_genrand(5489UL); /* a default initial seed is used */
+        if (st->mti == N+1)   /* if init_genrand() has not been called, */
+            init_genrand_r(st, 5489UL); /* a default initial seed is used */
 
         for (kk=0;kk<N-M;kk++) {
             y = (mt[kk]&UPPER_MASK)|(mt[kk+1]&LOWER_MASK);
@@ -122,10 +137,10 @@ unsigned long genrand_int32(void)
         y = (mt[N-1]&UPPER_MASK)|(mt[0]&LOWER_MASK);
         mt[N-1] = mt[M-1] ^ (y >> 1) ^ mag01[y & 0x1UL];
 
-        mti = 0;
+        st->mti = 0;
     }
   
-    y = mt[mti++];
+    y = mt[st->mti++];
 
     /* Tempering */
     y ^= (y >> 11);
@@ -136,6 +151,11 @@ unsigned long genrand_int32(void)
     return y;
 }
 
+unsigned long genrand_int32(void)
+{
+    return genrand_int32_r(&default_state);
+}
+
 /* generates a random number on [0,0x7fffffff]-interval */
 long genrand_int31(void)
 {
@@ -150,12 +170,17 @@ double genrand_real1(void)
 }
 
 /* generates a random number on [0,1)-real-interval */
-double genrand_real2(void)
+double genrand_real2_r(mt_state *st)
 {
-    return genrand_int32()*(1.0/4294967296.0); 
+    return genrand_int32_r(st)*(1.0/4294967296.0); 
     /* divided by 2^32 */
 }
 
+double genrand_real2(void)
+{
+    return genrand_real2_r(&default_state);
+}
+
 /* generates a random number on (0,1)-real-interval */
 double genrand_real3(void)
 {
@@ -164,11 +189,16 @@ double genrand_real3(void)
 }
 
 /* generates a random number on [0,1) with 53-bit resolution*/
-double genrand_res53(void) 
+double genrand_res53_r(mt_state *st) 
 { 
-    unsigned long a=genrand_int32()>>5, b=genrand_int32()>>6; 
+    unsigned long a=genrand_int32_r(st)>>5, b=genrand_int32_r(st)>>6; 
     return(a*67108864.0+b)*(1.0/9007199254740992.0); 
 } 
+
+double genrand_res53(void) 
+{ 
+    return genrand_res53_r(&default_state);
+} 
 /* These real versions are due to Isaku Wada, 2002/01/09 added */
 
 #ifdef MT19937AR_TESTING
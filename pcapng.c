@@ -0,0 +1,392 @@
+/*
+ * The TCP Scanner (tcp-scan) is Copyright (C) 2003-2013 Roy Hills,
+ * NTA Monitor Ltd.
+ *
+ * This file is part of tcp-scan.
+ *
+ * tcp-scan is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * tcp-scan is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with tcp-scan.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * pcapng.c -- pcapng savefile writer for tcp-scan
+ *
+ * This file contains a small, self-contained writer for the pcapng
+ * savefile format.  It is used for the --pcapsavefile option instead of
+ * pcap_dump() because it allows nanosecond timestamps, per-packet
+ * direction flags, a comment recording the scan parameters, and rotation
+ * of the output file by size or by time.
+ *
+ * The file layout is one Section Header Block followed by one Interface
+ * Description Block per interface, then one Enhanced Packet Block per
+ * packet.  The header blocks are written again at the start of each new
+ * file when the output is rotated, so every file can be read on its own.
+ *
+ * All blocks are written in host byte order, which the pcapng byte-order
+ * magic in the section header allows readers to detect.
+ */
+
+#include "tcp-scan.h"
+
+/* pcapng block types and option codes */
+#define PCAPNG_SHB_TYPE		0x0A0D0D0A	/* Section Header Block */
+#define PCAPNG_IDB_TYPE		0x00000001	/* Interface Description Block */
+#define PCAPNG_EPB_TYPE		0x00000006	/* Enhanced Packet Block */
+#define PCAPNG_BYTE_ORDER_MAGIC	0x1A2B3C4D
+#define PCAPNG_OPT_ENDOFOPT	0
+#define PCAPNG_OPT_COMMENT	1
+#define PCAPNG_SHB_USERAPPL	4
+#define PCAPNG_IF_NAME		2
+#define PCAPNG_IF_TSRESOL	9
+#define PCAPNG_EPB_FLAGS	2
+
+#define PCAPNG_MAX_INTERFACES	4	/* Max interfaces per writer */
+
+struct pcapng_interface {
+   int linktype;
+   unsigned snaplen;
+   char *name;
+};
+
+struct pcapng_writer {
+   FILE *fp;				/* Current output file */
+   char *buf;				/* stdio buffer for fp */
+   char *basename;			/* Savefile name from the user */
+   char *comment;			/* Section header comment */
+   TCP_UINT64 rotate_size;		/* Rotate after this many bytes */
+   unsigned rotate_secs;		/* Rotate after this many seconds */
+   TCP_UINT64 file_bytes;		/* Bytes written to current file */
+   TCP_UINT64 file_start;		/* Time of first packet (seconds) */
+   int file_has_packets;		/* Current file has packet blocks */
+   unsigned file_no;			/* Sequence number of current file */
+   unsigned num_files;			/* Number of files opened */
+   TCP_UINT64 num_packets;		/* Packets written to all files */
+   unsigned num_interfaces;
+   struct pcapng_interface interfaces[PCAPNG_MAX_INTERFACES];
+};
+
+/*
+ *	pcapng_pad -- Return the number of bytes needed to pad to 32 bits
+ */
+static size_t
+pcapng_pad(size_t len) {
+   return (4 - (len & 3)) & 3;
+}
+
+/*
+ *	pcapng_put -- Write raw bytes to the current savefile
+ *
+ *	Writes go through a large stdio buffer, so this normally just
+ *	copies the data into memory.
+ */
+static void
+pcapng_put(pcapng_writer *w, const void *data, size_t len) {
+   static const unsigned char zeros[4] = {0, 0, 0, 0};
+
+   if (data == NULL)
+      data = zeros;	/* NULL means padding */
+   if (len && fwrite(data, len, 1, w->fp) != 1)
+      err_sys("pcapng write %s", w->basename);
+   w->file_bytes += len;
+}
+
+static void
+pcapng_put32(pcapng_writer *w, uint32_t value) {
+   pcapng_put(w, &value, sizeof(value));
+}
+
+static void
+pcapng_put16(pcapng_writer *w, uint16_t value) {
+   pcapng_put(w, &value, sizeof(value));
+}
+
+/*
+ *	pcapng_option_len -- Size of an option including header and padding
+ */
+static size_t
+pcapng_option_len(size_t len) {
+   return 4 + len + pcapng_pad(len);
+}
+
+/*
+ *	pcapng_put_option -- Write a single option with its padding
+ */
+static void
+pcapng_put_option(pcapng_writer *w, uint16_t code, const void *data,
+                  size_t len) {
+   pcapng_put16(w, code);
+   pcapng_put16(w, (uint16_t) len);
+   pcapng_put(w, data, len);
+   pcapng_put(w, NULL, pcapng_pad(len));
+}
+
+/*
+ *	pcapng_write_headers -- Write the section header and interface blocks
+ *
+ *	This is called at the start of every output file.
+ */
+static void
+pcapng_write_headers(pcapng_writer *w) {
+   uint32_t block_len;
+   size_t comment_len;
+   size_t appl_len;
+   unsigned i;
+
+   comment_len = w->comment ? strlen(w->comment) : 0;
+   if (comment_len > 0xffff)
+      comment_len = 0xffff;
+   appl_len = strlen(PACKAGE_STRING);
+/*
+ *	Section Header Block.  The section length is -1 (unspecified)
+ *	because we do not know it until the file is closed.
+ */
+   block_len = 28 + pcapng_option_len(appl_len) + 4;
+   if (comment_len)
+      block_len += pcapng_option_len(comment_len);
+   pcapng_put32(w, PCAPNG_SHB_TYPE);
+   pcapng_put32(w, block_len);
+   pcapng_put32(w, PCAPNG_BYTE_ORDER_MAGIC);
+   pcapng_put16(w, 1);		/* Major version */
+   pcapng_put16(w, 0);		/* Minor version */
+   pcapng_put32(w, 0xffffffff);	/* Section length (64 bits) */
+   pcapng_put32(w, 0xffffffff);
+   if (comment_len)
+      pcapng_put_option(w, PCAPNG_OPT_COMMENT, w->comment, comment_len);
+   pcapng_put_option(w, PCAPNG_SHB_USERAPPL, PACKAGE_STRING, appl_len);
+   pcapng_put32(w, PCAPNG_OPT_ENDOFOPT);
+   pcapng_put32(w, block_len);
+/*
+ *	Interface Description Blocks.  All interfaces use nanosecond
+ *	timestamp resolution (if_tsresol = 9).
+ */
+   for (i=0; i<w->num_interfaces; i++) {
+      const struct pcapng_interface *ifp = &w->interfaces[i];
+      size_t name_len = ifp->name ? strlen(ifp->name) : 0;
+      unsigned char tsresol = 9;
+
+      block_len = 20 + pcapng_option_len(1) + 4;
+      if (name_len)
+         block_len += pcapng_option_len(name_len);
+      pcapng_put32(w, PCAPNG_IDB_TYPE);
+      pcapng_put32(w, block_len);
+      pcapng_put16(w, (uint16_t) ifp->linktype);
+      pcapng_put16(w, 0);		/* Reserved */
+      pcapng_put32(w, ifp->snaplen);
+      if (name_len)
+         pcapng_put_option(w, PCAPNG_IF_NAME, ifp->name, name_len);
+      pcapng_put_option(w, PCAPNG_IF_TSRESOL, &tsresol, 1);
+      pcapng_put32(w, PCAPNG_OPT_ENDOFOPT);
+      pcapng_put32(w, block_len);
+   }
+   w->file_has_packets = 0;
+}
+
+/*
+ *	pcapng_open_file -- Open the next output file
+ *
+ *	If rotation is enabled, the files are named <basename>.00000,
+ *	<basename>.00001 and so on.  Otherwise the file name is exactly
+ *	as specified.
+ */
+static void
+pcapng_open_file(pcapng_writer *w) {
+   char *fn;
+
+   if (w->rotate_size || w->rotate_secs)
+      fn = make_message("%s.%.5u", w->basename, w->file_no);
+   else
+      fn = make_message("%s", w->basename);
+
+   if ((w->fp = fopen(fn, "wb")) == NULL)
+      err_sys("fopen %s", fn);
+   if (setvbuf(w->fp, w->buf, _IOFBF, PCAPNG_BUFSIZE) != 0)
+      err_sys("setvbuf");
+   free(fn);
+
+   w->file_bytes = 0;
+   w->num_files++;
+   pcapng_write_headers(w);
+}
+
+/*
+ *	pcapng_close_file -- Flush and close the current output file
+ */
+static void
+pcapng_close_file(pcapng_writer *w) {
+   if (w->fp == NULL)
+      return;
+   if (fclose(w->fp) != 0)
+      err_sys("fclose %s", w->basename);
+   w->fp = NULL;
+}
+
+/*
+ *	pcapng_open -- Create a pcapng savefile writer
+ *
+ *	Inputs:
+ *
+ *	fname		The savefile name.
+ *	comment		Comment for the section header, or NULL.
+ *	rotate_size	Start a new file when this many bytes have been
+ *			written to the current one.  Zero disables.
+ *	rotate_secs	Start a new file when this many seconds of packets
+ *			have been written to the current one.  Zero disables.
+ *
+ *	Returns:
+ *
+ *	Pointer to the new writer.
+ *
+ *	No file is created until the first packet is written, so that all
+ *	interfaces can be added with pcapng_add_interface() first.
+ */
+pcapng_writer *
+pcapng_open(const char *fname, const char *comment, TCP_UINT64 rotate_size,
+            unsigned rotate_secs) {
+   pcapng_writer *w;
+
+   w = Malloc(sizeof(pcapng_writer));
+   memset(w, '\0', sizeof(pcapng_writer));
+   w->basename = dupstr(fname);
+   w->comment = comment ? dupstr(comment) : NULL;
+   w->rotate_size = rotate_size;
+   w->rotate_secs = rotate_secs;
+   w->buf = Malloc(PCAPNG_BUFSIZE);
+
+   return w;
+}
+
+/*
+ *	pcapng_add_interface -- Add an interface to the savefile
+ *
+ *	Inputs:
+ *
+ *	w		The pcapng writer.
+ *	linktype	The pcap LINKTYPE_ value for the interface.
+ *	snaplen		The snap length for the interface.
+ *	name		The interface name, or NULL.
+ *
+ *	Returns:
+ *
+ *	The interface ID to pass to pcapng_write().
+ */
+unsigned
+pcapng_add_interface(pcapng_writer *w, int linktype, unsigned snaplen,
+                     const char *name) {
+   struct pcapng_interface *ifp;
+
+   if (w->num_interfaces >= PCAPNG_MAX_INTERFACES)
+      err_msg("pcapng_add_interface: too many interfaces");
+   if (w->fp != NULL)
+      err_msg("pcapng_add_interface: savefile already started");
+
+   ifp = &w->interfaces[w->num_interfaces];
+   ifp->linktype = linktype;
+   ifp->snaplen = snaplen;
+   ifp->name = name ? dupstr(name) : NULL;
+
+   return w->num_interfaces++;
+}
+
+/*
+ *	pcapng_write -- Write a packet to the savefile
+ *
+ *	Inputs:
+ *
+ *	w		The pcapng writer.
+ *	if_id		Interface ID from pcapng_add_interface().
+ *	ts_ns		Packet timestamp in nanoseconds since the epoch.
+ *	data		The packet data.
+ *	caplen		The number of bytes of data captured.
+ *	len		The original length of the packet.
+ *	direction	PCAPNG_INBOUND or PCAPNG_OUTBOUND.
+ *
+ *	Returns:
+ *
+ *	None.
+ *
+ *	The output file is rotated before the packet is written if it
+ *	would take the current file over the size limit, or if the time
+ *	limit has passed.  A file always gets at least one packet, so a
+ *	size limit smaller than a single packet cannot cause a loop.
+ */
+void
+pcapng_write(pcapng_writer *w, unsigned if_id, TCP_UINT64 ts_ns,
+             const unsigned char *data, unsigned caplen, unsigned len,
+             int direction) {
+   uint32_t block_len;
+   uint32_t flags;
+   TCP_UINT64 ts_secs = ts_ns / 1000000000;
+
+   if (if_id >= w->num_interfaces)
+      err_msg("pcapng_write: invalid interface ID %u", if_id);
+
+   block_len = 32 + caplen + pcapng_pad(caplen) + pcapng_option_len(4) + 4;
+
+   if (w->fp == NULL) {
+      pcapng_open_file(w);
+   } else if (w->file_has_packets &&
+              ((w->rotate_size && w->file_bytes + block_len > w->rotate_size) ||
+               (w->rotate_secs && ts_secs >= w->file_start + w->rotate_secs))) {
+      pcapng_close_file(w);
+      w->file_no++;
+      pcapng_open_file(w);
+   }
+   if (!w->file_has_packets) {
+      w->file_start = ts_secs;
+      w->file_has_packets = 1;
+   }
+
+   flags = direction;
+   pcapng_put32(w, PCAPNG_EPB_TYPE);
+   pcapng_put32(w, block_len);
+   pcapng_put32(w, if_id);
+   pcapng_put32(w, (uint32_t) (ts_ns >> 32));
+   pcapng_put32(w, (uint32_t) (ts_ns & 0xffffffff));
+   pcapng_put32(w, caplen);
+   pcapng_put32(w, len);
+   pcapng_put(w, data, caplen);
+   pcapng_put(w, NULL, pcapng_pad(caplen));
+   pcapng_put_option(w, PCAPNG_EPB_FLAGS, &flags, sizeof(flags));
+   pcapng_put32(w, PCAPNG_OPT_ENDOFOPT);
+   pcapng_put32(w, block_len);
+
+   w->num_packets++;
+}
+
+/*
+ *	pcapng_close -- Flush and close the savefile and free the writer
+ *
+ *	Inputs:
+ *
+ *	w		The pcapng writer.
+ *	verbose		Display a summary if non-zero.
+ *
+ *	Returns:
+ *
+ *	None.
+ */
+void
+pcapng_close(pcapng_writer *w, int verbose) {
+   unsigned i;
+
+   if (w->num_files == 0)
+      pcapng_open_file(w);	/* Create an empty savefile */
+   pcapng_close_file(w);
+   if (verbose)
+      warn_msg("--- Wrote " TCP_UINT64_FORMAT " packets to %u pcapng file%s",
+               w->num_packets, w->num_files, w->num_files == 1 ? "" : "s");
+   for (i=0; i<w->num_interfaces; i++)
+      free(w->interfaces[i].name);
+   free(w->comment);
+   free(w->basename);
+   free(w->buf);
+   free(w);
+}
@@ -0,0 +1,450 @@
+/*
+ * The TCP Scanner (tcp-scan) is Copyright (C) 2003-2013 Roy Hills,
+ * NTA Monitor Ltd.
+ *
+ * This file is part of tcp-scan.
+ *
+ * tcp-scan is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * tcp-scan is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with tcp-scan.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * services.c -- TCP service name database for tcp-scan
+ *
+ * This file contains the parser for services files, and the code to
+ * build, save and load the compiled service name database that is used
+ * to display port names with the --portname option.
+ *
+ * The compiled database is a single flat image that can be mapped
+ * read-only with mmap(), so loading it costs a few page faults rather
+ * than parsing several thousand lines, and the pages are shared by all
+ * tcp-scan processes on the system.  The layout is:
+ *
+ *	service_db_header	Magic, version and sizes
+ *	uint32_t[65536]		Offset of the name for each port in the blob
+ *	char[blob_len]		NUL-terminated names
+ *
+ * Offset zero means that the port has no name; the first byte of the
+ * blob is always NUL so that offset zero is never a valid name.
+ *
+ * The image is in host byte order, so it must be generated on a system
+ * with the same endian-ness as the one it is used on.
+ */
+
+#include "tcp-scan.h"
+
+#ifdef HAVE_STRINGS_H
+#include <strings.h>	/* For strcasecmp() */
+#endif
+
+#ifdef HAVE_SYS_MMAN_H
+#include <sys/mman.h>
+#endif
+
+#ifdef HAVE_SYS_STAT_H
+#include <sys/stat.h>
+#endif
+
+#ifdef HAVE_FCNTL_H
+#include <fcntl.h>
+#endif
+
+#define SERVICE_DB_MAGIC "TSSVCDB1"
+#define SERVICE_DB_VERSION 1
+#define SERVICE_DB_PORTS 65536
+
+typedef struct {
+   char magic[8];		/* SERVICE_DB_MAGIC, not NUL terminated */
+   uint32_t version;		/* SERVICE_DB_VERSION */
+   uint32_t num_entries;	/* Number of ports with a name */
+   uint32_t blob_len;		/* Length of the name blob in bytes */
+   uint32_t reserved;
+} service_db_header;
+
+struct service_db {
+   unsigned char *image;	/* Header, offsets and blob */
+   size_t image_len;
+   int mapped;			/* Non-zero if image is from mmap() */
+   const uint32_t *offsets;
+   const char *blob;
+   uint32_t num_entries;
+};
+
+/*
+ *	parse_service_line -- Parse one line of a services file
+ *
+ *	Inputs:
+ *
+ *	line		The line to parse.
+ *	name		Buffer for the service name.
+ *	name_len	Size of the name buffer.
+ *	port		Set to the port number.
+ *	proto		Buffer for the protocol name, e.g. "tcp".
+ *	proto_len	Size of the protocol buffer.
+ *
+ *	Returns:
+ *
+ *	1 if the line contains a valid entry, or 0 if it does not.
+ *
+ *	This accepts lines in the "/etc/services" format, which is also
+ *	the format used by strobe: a service name, whitespace and a
+ *	port/protocol pair, optionally followed by aliases or a comment.
+ *	Names that are too long for the buffer are truncated.  The port
+ *	number is not range checked, so that the caller can decide how
+ *	to report invalid values.
+ */
+int
+parse_service_line(const char *line, char *name, size_t name_len,
+                   unsigned *port, char *proto, size_t proto_len) {
+   const char *cp = line;
+   const char *start;
+   unsigned long value;
+   size_t len;
+
+   start = cp;
+   while (*cp != '\0' && !isspace((unsigned char)*cp))
+      cp++;
+   if (cp == start)
+      return 0;
+   len = cp - start;
+   if (len >= name_len)
+      len = name_len - 1;
+   memcpy(name, start, len);
+   name[len] = '\0';
+
+   while (*cp == ' ' || *cp == '\t')
+      cp++;
+   if (!isdigit((unsigned char)*cp))
+      return 0;
+   value = 0;
+   while (isdigit((unsigned char)*cp)) {
+      if (value <= 0xffffffffUL)
+         value = value * 10 + (*cp - '0');
+      cp++;
+   }
+   if (*cp++ != '/')
+      return 0;
+   *port = value > 0xffffffffUL ? 0xffffffffU : (unsigned) value;
+
+   start = cp;
+   while (*cp != '\0' && !isspace((unsigned char)*cp))
+      cp++;
+   if (cp == start)
+      return 0;
+   len = cp - start;
+   if (len >= proto_len)
+      len = proto_len - 1;
+   memcpy(proto, start, len);
+   proto[len] = '\0';
+
+   return 1;
+}
+
+/*
+ *	parse_service_weight -- Get the frequency from a services file line
+ *
+ *	Inputs:
+ *
+ *	line		A line that parse_service_line() accepted.
+ *
+ *	Returns:
+ *
+ *	The frequency, or 0 if the line does not have one.
+ *
+ *	A frequency is a non-negative number straight after the
+ *	port/protocol pair, as in the nmap-services file, which gives the
+ *	fraction of scanned hosts that had the port open.  An alias that
+ *	is not a number is not a frequency.
+ */
+double
+parse_service_weight(const char *line) {
+   const char *cp;
+   char *end;
+   double weight;
+
+   if ((cp = strchr(line, '/')) == NULL)
+      return 0;
+   while (*cp != '\0' && !isspace((unsigned char)*cp))
+      cp++;
+   while (*cp == ' ' || *cp == '\t')
+      cp++;
+   if (!isdigit((unsigned char)*cp) && *cp != '.')
+      return 0;
+   weight = strtod(cp, &end);
+   if (end == cp || (*end != '\0' && !isspace((unsigned char)*end)))
+      return 0;
+   return weight;
+}
+
+/*
+ *	service_db_set_image -- Point the lookup fields at the image
+ *
+ *	Returns zero if the image is not a valid service database.
+ */
+static int
+service_db_set_image(service_db *db) {
+   service_db_header hdr;
+   size_t min_len = sizeof(hdr) + SERVICE_DB_PORTS * sizeof(uint32_t);
+   unsigned i;
+
+   if (db->image_len < min_len)
+      return 0;
+   memcpy(&hdr, db->image, sizeof(hdr));
+   if (memcmp(hdr.magic, SERVICE_DB_MAGIC, sizeof(hdr.magic)) != 0 ||
+       hdr.version != SERVICE_DB_VERSION ||
+       hdr.blob_len == 0 || db->image_len - min_len != hdr.blob_len)
+      return 0;
+
+   db->offsets = (const uint32_t *) (db->image + sizeof(hdr));
+   db->blob = (const char *) (db->image + min_len);
+   db->num_entries = hdr.num_entries;
+/*
+ *	Check that all offsets are inside the blob, and that the blob is
+ *	NUL terminated, so that lookups can never run off the end.
+ */
+   if (db->blob[0] != '\0' || db->blob[hdr.blob_len-1] != '\0')
+      return 0;
+   for (i=0; i<SERVICE_DB_PORTS; i++)
+      if (db->offsets[i] >= hdr.blob_len)
+         return 0;
+
+   return 1;
+}
+
+/*
+ *	service_db_compile -- Build a service database from a services file
+ *
+ *	Inputs:
+ *
+ *	fp		The open services file.
+ *	fn		The file name, for messages.
+ *
+ *	Returns:
+ *
+ *	Pointer to the new database.
+ *
+ *	Only TCP entries are used.  If a port appears more than once, the
+ *	first name is used.
+ */
+static service_db *
+service_db_compile(FILE *fp, const char *fn) {
+   service_db *db;
+   service_db_header hdr;
+   uint32_t *offsets;
+   char *blob;
+   size_t blob_len;
+   size_t blob_size;
+   size_t name_len;
+   char lbuf[MAXLINE];
+   char name[MAXLINE];
+   char proto[MAXLINE];
+   unsigned port;
+   uint32_t num_entries = 0;
+
+   offsets = Malloc(SERVICE_DB_PORTS * sizeof(uint32_t));
+   memset(offsets, '\0', SERVICE_DB_PORTS * sizeof(uint32_t));
+   blob_size = 65536;
+   blob = Malloc(blob_size);
+   blob[0] = '\0';
+   blob_len = 1;
+
+   while (fgets(lbuf, MAXLINE, fp)) {
+/*
+ *	Ignore blank lines, lines starting with "#" and lines starting
+ *	with whitespace.
+ */
+      if (strchr("# \t\n", lbuf[0]))
+         continue;
+      if (!parse_service_line(lbuf, name, sizeof(name), &port,
+                              proto, sizeof(proto)))
+         continue;
+      if (strcasecmp(proto, "tcp") != 0)
+         continue;
+      if (port > 65535) {
+         warn_msg("WARNING: port number %u for service %s is out of range",
+                  port, name);
+         continue;
+      }
+      if (offsets[port])
+         continue;	/* Keep the first name for each port */
+
+      name_len = strlen(name) + 1;
+      if (blob_len + name_len > blob_size) {
+         blob_size *= 2;
+         blob = Realloc(blob, blob_size);
+      }
+      memcpy(blob + blob_len, name, name_len);
+      offsets[port] = blob_len;
+      blob_len += name_len;
+      num_entries++;
+   }
+   if (ferror(fp))
+      err_sys("Error reading services file %s", fn);
+/*
+ *	Assemble the image in exactly the layout of the compiled file, so
+ *	that lookups work the same way whichever way it was loaded.
+ */
+   memcpy(hdr.magic, SERVICE_DB_MAGIC, sizeof(hdr.magic));
+   hdr.version = SERVICE_DB_VERSION;
+   hdr.num_entries = num_entries;
+   hdr.blob_len = blob_len;
+   hdr.reserved = 0;
+
+   db = Malloc(sizeof(service_db));
+   db->mapped = 0;
+   db->image_len = sizeof(hdr) + SERVICE_DB_PORTS * sizeof(uint32_t) +
+                   blob_len;
+   db->image = Malloc(db->image_len);
+   memcpy(db->image, &hdr, sizeof(hdr));
+   memcpy(db->image + sizeof(hdr), offsets,
+          SERVICE_DB_PORTS * sizeof(uint32_t));
+   memcpy(db->image + sizeof(hdr) + SERVICE_DB_PORTS * sizeof(uint32_t),
+          blob, blob_len);
+   free(offsets);
+   free(blob);
+
+   if (!service_db_set_image(db))
+      err_msg("ERROR: internal error building service database from %s", fn);
+
+   return db;
+}
+
+/*
+ *	service_db_load -- Load a service database
+ *
+ *	Inputs:
+ *
+ *	fn		The file name.  This can be either a compiled
+ *			database or a services file in "/etc/services"
+ *			format.
+ *
+ *	Returns:
+ *
+ *	Pointer to the database, or NULL if the file cannot be opened.
+ *
+ *	A compiled database is mapped read-only.  A text services file is
+ *	compiled in memory, which is slower but gives the same result.
+ */
+service_db *
+service_db_load(const char *fn) {
+   service_db *db;
+   FILE *fp;
+   char magic[sizeof(SERVICE_DB_MAGIC)-1];
+   struct stat st;
+   void *image;
+   int fd;
+
+   if ((fd = open(fn, O_RDONLY)) < 0)
+      return NULL;
+   if (fstat(fd, &st) != 0)
+      err_sys("fstat %s", fn);
+
+   if (read(fd, magic, sizeof(magic)) == (ssize_t) sizeof(magic) &&
+       memcmp(magic, SERVICE_DB_MAGIC, sizeof(magic)) == 0) {
+      image = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+      if (image == MAP_FAILED)
+         err_sys("mmap %s", fn);
+      close(fd);
+      db = Malloc(sizeof(service_db));
+      db->image = image;
+      db->image_len = st.st_size;
+      db->mapped = 1;
+      if (!service_db_set_image(db))
+         err_msg("ERROR: %s is not a valid service database", fn);
+      return db;
+   }
+/*
+ *	Not a compiled database, so treat it as a services file.
+ */
+   if (lseek(fd, 0, SEEK_SET) != 0)
+      err_sys("lseek %s", fn);
+   if ((fp = fdopen(fd, "r")) == NULL)
+      err_sys("fdopen %s", fn);
+   db = service_db_compile(fp, fn);
+   fclose(fp);
+
+   return db;
+}
+
+/*
+ *	service_db_save -- Write a service database to a file
+ *
+ *	Inputs:
+ *
+ *	db		The database.
+ *	fn		The output file name.
+ *
+ *	Returns:
+ *
+ *	None.
+ *
+ *	The database is written to a temporary file which is then renamed,
+ *	so that processes which have the old file mapped are not affected.
+ */
+void
+service_db_save(const service_db *db, const char *fn) {
+   char *tmp_fn;
+   FILE *fp;
+
+   tmp_fn = make_message("%s.tmp", fn);
+   if ((fp = fopen(tmp_fn, "wb")) == NULL)
+      err_sys("fopen %s", tmp_fn);
+   if (fwrite(db->image, db->image_len, 1, fp) != 1)
+      err_sys("fwrite %s", tmp_fn);
+   if (fclose(fp) != 0)
+      err_sys("fclose %s", tmp_fn);
+   if (rename(tmp_fn, fn) != 0)
+      err_sys("rename %s", tmp_fn);
+   free(tmp_fn);
+}
+
+/*
+ *	service_db_lookup -- Return the name for a TCP port
+ *
+ *	Inputs:
+ *
+ *	db		The database.
+ *	port		The TCP port number.
+ *
+ *	Returns:
+ *
+ *	The service name, or NULL if the port has no name.
+ */
+const char *
+service_db_lookup(const service_db *db, unsigned port) {
+   uint32_t offset;
+
+   if (port >= SERVICE_DB_PORTS)
+      return NULL;
+   offset = db->offsets[port];
+
+   return offset ? db->blob + offset : NULL;
+}
+
+/*
+ *	service_db_count -- Return the number of named ports in the database
+ */
+unsigned
+service_db_count(const service_db *db) {
+   return db->num_entries;
+}
+
+/*
+ *	service_db_free -- Unmap or free a service database
+ */
+void
+service_db_free(service_db *db) {
+   if (db->mapped)
+      munmap(db->image, db->image_len);
+   else
+      free(db->image);
+   free(db);
+}
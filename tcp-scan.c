@@ -34,133 +34,206 @@
 
 #include "tcp-scan.h"
 
-/* Global variables */
-static unsigned retry = DEFAULT_RETRY;		/* Number of retries */
-static unsigned timeout = DEFAULT_TIMEOUT;	/* Per-host timeout */
-static float backoff_factor = DEFAULT_BACKOFF_FACTOR;	/* Backoff factor */
-static int snaplen = SNAPLEN;		/* Pcap snap length */
-static uint32_t seq_no;			/* Initial TCP sequence number */
-static uint32_t ack_no;			/* TCP acknowledgement number */
-static int seq_no_flag=0;
-static int ack_no_flag=0;
-static uint16_t source_port;		/* TCP Source Port */
-static int source_port_flag=0;
-static uint16_t window=DEFAULT_WINDOW;	/* TCP Window size */
-static uint16_t mss=DEFAULT_MSS;	/* TCP MSS. 0=Don't use MSS option */
-static int open_only=0;			/* Only show open ports? */
-static int wscale_flag=0;		/* Add wscale=0 TCP option? */
-static int sack_flag=0;			/* Add SACKOK TCP option? */
-static int timestamp_flag=0;		/* Add TIMESTAMP TCP option? */
-static int ip_ttl = DEFAULT_TTL;	/* IP TTL */
-static char *if_name=NULL;		/* Interface name, e.g. "eth0" */
-static int quiet_flag=0;		/* Don't decode the packet */
-static int ignore_dups=0;		/* Don't display duplicate packets */
-static int df_flag=DEFAULT_DF;		/* IP DF Flag */
-static int ip_tos=DEFAULT_TOS;		/* IP TOS Field */
-static int portname_flag=0;		/* Display port names */
-static int tcp_flags_flag=0;		/* Specify outbound TCP flags */
-static tcp_flags_struct tcp_flags;	/* Specified TCP flags */
-static char **portnames=NULL;
-static unsigned live_count;		/* Number of entries awaiting reply */
-static char service_file[MAXLINE];	/* TCP Service file name */
-static int verbose = 0;			/* Verbose level */
-static int debug = 0;			/* Debug flag */
-static char *local_data=NULL;		/* Local data from --port option */
-static host_entry *helist = NULL;	/* Array of host entries */
-static host_entry **helistptr;		/* Array of pointers to host entries */
-static unsigned num_hosts = 0;		/* Number of entries in the list */
-static unsigned max_iter;		/* Max iterations in find_host() */
-static pcap_t *pcap_handle;		/* pcap handle */
-static host_entry **cursor;		/* Pointer to current host entry ptr */
-static unsigned responders = 0;		/* Number of hosts which responded */
-static char filename[MAXLINE];
-static int filename_flag=0;
-static int random_flag=0;		/* Randomise the list */
-static int numeric_flag=0;		/* IP addresses only */
-static int ipv6_flag=0;			/* IPv6 */
-static unsigned bandwidth=DEFAULT_BANDWIDTH;	/* Bandwidth in bits per sec */
-static unsigned interval=0;
-static uint32_t source_address;		/* Source IP Address */
-static int pcap_fd;			/* pcap File Descriptor */
-static size_t ip_offset;		/* Offset to IP header in pcap pkt */
-static uint16_t *port_list=NULL;
-static char *ga_err_msg;		/* getaddrinfo error message */
-static char pcap_savefile[MAXLINE];	/* pcap savefile filename */
-static pcap_dumper_t *pcap_dump_handle = NULL;  /* pcap savefile handle */
+/*
+ * The scan state is kept in the engine and context structures, see
+ * tcp-scan.h.  The only variables here are constants and the flags set
+ * by the signal handlers, which cannot be given a context.
+ */
+static volatile sig_atomic_t interrupted=0;	/* SIGINT, SIGTERM or SIGHUP */
+static volatile sig_atomic_t stage_dump=0;	/* SIGUSR1 received */
+static const char *prev_names[] = {"NONE", "OPEN", "CLOSED"};
+/*
+ * The TCP ports most often found open on Internet hosts, most frequent
+ * first.  --top-ports scans the start of this list, and --priority scans
+ * these ports first unless the --servicefile gives frequencies.
+ */
+static const uint16_t common_ports[] = {
+   80, 23, 443, 21, 22, 25, 3389, 110, 445, 139,
+   143, 53, 135, 3306, 8080, 1723, 111, 995, 993, 5900,
+   1025, 587, 8888, 199, 1720, 465, 548, 113, 81, 6001,
+   10000, 514, 5060, 179, 1026, 2000, 8443, 8000, 32768, 554,
+   26, 1433, 49152, 2001, 515, 8008, 49154, 1027, 5666, 646,
+   5000, 5631, 631, 49153, 8081, 2049, 88, 79, 5800, 106,
+   2121, 1110, 49155, 6000, 513, 990, 5357, 427, 49156, 543,
+   544, 5101, 144, 7, 389, 8009, 3128, 444, 9999, 5009,
+   7070, 5190, 3000, 5432, 1900, 3986, 13, 1029, 9, 5051,
+   6646, 49157, 1028, 873, 1755, 2717, 4899, 9100, 119, 37
+};
+static const char *stage_names[STAGE_COUNT] = {
+   "send", "select", "dispatch", "match", "format", "write"
+};
 
+#ifndef TCPSCAN_LIBRARY
 int
 main(int argc, char *argv[]) {
    int sockfd;                  /* IP socket file descriptor */
-   struct timeval now;
-   struct timeval diff;         /* Difference between two timevals */
-   unsigned select_timeout;     /* Select timeout */
-   TCP_UINT64 loop_timediff;    /* Time since last packet sent in us */
-   TCP_UINT64 host_timediff; /* Time since last pkt sent to this host (us) */
-   struct timeval last_packet_time;     /* Time last packet was sent */
-   int req_interval;            /* Requested per-packet interval */
-   int cum_err=0;               /* Cumulative timing error */
+   TCP_UINT64 setup_start_ns;   /* Real time that tcp-scan started */
    struct timeval start_time;   /* Program start time */
-   struct timeval end_time;     /* Program end time */
-   struct timeval elapsed_time; /* Elapsed time as timeval */
-   double elapsed_seconds;      /* Elapsed time in seconds */
-   static int reset_cum_err;
-   static int pass_no;
-   int first_timeout=1;
-   const int on = 1;            /* For setsockopt */
+   tcpscan_engine *eng;		/* The engine, with the default settings */
+   tcpscan_ctx *scan;		/* The command line scan */
    unsigned i;
+
+   setup_start_ns = timestamp_ns();
+   eng = Malloc(sizeof(*eng));
+   init_engine(eng);
+   scan = &eng->cli_scan;
+/*
+ *	Save the command line so that it can be recorded in the pcapng
+ *	savefile.
+ */
+   eng->command_line = make_message("%s", argv[0]);
+   for (i=1; i<(unsigned)argc; i++) {
+      char *cp = eng->command_line;
+      eng->command_line = make_message("%s %s", cp, argv[i]);
+      free(cp);
+   }
 /*
- *	Initialise file names to the empty string.
+ *      Process options.  The per-scan settings are kept in the context
+ *      that the daemon uses as the defaults.
  */
-   service_file[0] = '\0';
-   pcap_savefile[0] = '\0';
+   process_options(scan, argc, argv, 0);
 /*
- *      Process options.
+ *      With --submit, pass the rest of the command line to a --daemon as
+ *      a job, and display the results.
  */
-   process_options(argc, argv);
+   if (*eng->submit_path != '\0')
+      return submit_job(eng, argc, argv);
+   if (*eng->daemon_path != '\0' &&
+       (eng->workers > 1 || eng->shard_count || *eng->replay_file != '\0' ||
+        *eng->checkpoint_file != '\0' || *eng->previous_file != '\0' ||
+        *eng->pcap_savefile != '\0' || *eng->metrics_spec != '\0'))
+      err_msg("You cannot use --workers, --shard, --replay, --checkpoint, "
+              "--previous, --pcapsavefile or --metrics with --daemon.");
+   if (eng->daemon_jobs && *eng->daemon_path == '\0')
+      err_msg("The --jobs option needs --daemon.");
+   if (*eng->daemon_path != '\0' && !eng->daemon_jobs)
+      eng->daemon_jobs = DEFAULT_DAEMON_JOBS;
+   if (*eng->discover_cache != '\0' && !eng->discover_count)
+      err_msg("The --discovercache option needs --discover.");
+   if (eng->discover_count &&
+       (*eng->daemon_path != '\0' || *eng->replay_file != '\0' ||
+        *eng->checkpoint_file != '\0' || *eng->previous_file != '\0'))
+      err_msg("You cannot use --daemon, --replay, --checkpoint or --previous "
+              "with --discover.");
+   if (*eng->discover_cache != '\0' && eng->workers > 1)
+      err_msg("You cannot use --discovercache with --workers.");
 /*
  *      Get program start time for statistics displayed on completion.
  */
-   Gettimeofday(&start_time);
-   if (debug) {print_times(); printf("main: Start\n");}
+   if (eng->dryrun_flag)
+      set_virtual_clock(eng, engine_time_ns(eng));
+   engine_gettimeofday(eng, &start_time);
+   eng->scan_start_ns = engine_time_ns(eng);
+   if (eng->debug) {print_times(); printf("main: Start\n");}
 /*
- *      Create raw IP socket and set IP_HDRINCL
+ *      Create raw IP socket and set IP_HDRINCL.  We don't need the socket
+ *      if we are replaying a savefile or simulating the network, so these
+ *      modes do not need root.
  */
-   if ((sockfd = socket(AF_INET, SOCK_RAW, IPPROTO_RAW)) < 0)
-      err_sys("socket");
-   if ((setsockopt(sockfd, IPPROTO_IP, IP_HDRINCL, &on, sizeof(on))) != 0)
-      err_sys("setsockopt");
-   if ((setsockopt(sockfd, SOL_SOCKET, SO_BROADCAST, &on, sizeof(on))) != 0)
-      err_sys("setsockopt");
+   for (i=0; i<STAGE_COUNT; i++)
+      hist_init(&eng->stage_hist[i]);
+   eng->stage_timing = eng->stagetimes_flag || *eng->replay_file != '\0';
+   if (eng->stagetimes_flag) {
+      struct sigaction sa;
+
+      memset(&sa, '\0', sizeof(sa));
+      sa.sa_handler = stage_signal;
+      sigemptyset(&sa.sa_mask);
+      sa.sa_flags = 0;		/* Interrupt select() so we dump promptly */
+      if (sigaction(SIGUSR1, &sa, NULL) < 0)
+         err_sys("sigaction");
+   }
+/*
+ *	With --checkpoint, an interrupted scan saves its state before it
+ *	exits.  With --resume, we need the saved random seed before
+ *	initialise() uses it.
+ */
+   if (*eng->checkpoint_file != '\0') {
+      struct sigaction sa;
+
+      if (*eng->replay_file != '\0')
+         err_msg("You cannot specify both --replay and --checkpoint.");
+      memset(&sa, '\0', sizeof(sa));
+      sa.sa_handler = checkpoint_signal;
+      sigemptyset(&sa.sa_mask);
+      sa.sa_flags = 0;		/* Interrupt select() so we stop promptly */
+      if (sigaction(SIGINT, &sa, NULL) < 0 ||
+          sigaction(SIGTERM, &sa, NULL) < 0 ||
+          sigaction(SIGHUP, &sa, NULL) < 0)
+         err_sys("sigaction");
+   }
+   if (eng->resume_flag) {
+      if (*eng->checkpoint_file == '\0')
+         err_msg("You must specify the --checkpoint file to --resume from.");
+      read_checkpoint(eng);
+   }
+/*
+ *	Start the --workers processes.  This only returns in the workers,
+ *	each of which then continues as a separate scan of its own shard.
+ */
+   if (eng->workers > 1)
+      start_workers(scan);
+   if (*eng->replay_file != '\0') {
+      if (*eng->pcap_savefile != '\0')
+         err_msg("You cannot specify both --replay and --pcapsavefile.");
+      if (eng->dryrun_flag)
+         err_msg("You cannot specify both --replay and --dryrun.");
+      if (*eng->metrics_spec != '\0')
+         err_msg("You cannot specify both --replay and --metrics.");
+      sockfd = -1;
+   } else if (eng->dryrun_flag) {
+      if (*eng->metrics_spec != '\0')
+         err_msg("You cannot specify both --dryrun and --metrics.");
+      sockfd = -1;
+   } else {
+      sockfd = open_raw_socket(eng);
+   }
 /*
  *      Call initialisation routine to perform initial setup.
  */
-   initialise();
+   initialise(eng);
 /*
  *      Drop privileges.
  */
    if ((setuid(getuid())) < 0) {
       err_sys("setuid");
    }
+/*
+ *      With --daemon, run the scan jobs that arrive on the UNIX socket
+ *      rather than a scan of the command line targets.
+ */
+   if (*eng->daemon_path != '\0') {
+      if (eng->filename_flag || argc > optind)
+         err_msg("The --daemon targets are given by each job, not on the command line.");
+      run_daemon(eng, sockfd);	/* Does not return */
+   }
 /*
  *      If we're not reading from a file, then we must have some hosts
  *      given as command line arguments.
  */
-   if (!filename_flag)
+   if (!eng->filename_flag)
       if ((argc - optind) < 1)
-         usage(EXIT_FAILURE, 0);
+         usage(scan, EXIT_FAILURE, 0);
+   check_port_options(scan);
 /*
  *      Populate the list from the specified file if --file was specified, or
  *      otherwise from the remaining command line arguments.
  */
-   if (filename_flag) { /* Populate list from file */
+   if (eng->filename_flag) { /* Populate list from file */
       FILE *fp;
       char line[MAXLINE];
       char *cp;
 
-      if ((strcmp(filename, "-")) == 0) {       /* Filename "-" means stdin */
-         fp = stdin;
+      if ((strcmp(eng->filename, "-")) == 0) {	/* "-" means stdin */
+         if (eng->stdin_targets_len) {	/* Read by start_workers() */
+            if ((fp = fmemopen(eng->stdin_targets, eng->stdin_targets_len,
+                               "r")) == NULL)
+               err_sys("fmemopen");
+         } else {
+            fp = stdin;
+         }
       } else {
-         if ((fp = fopen(filename, "r")) == NULL) {
+         if ((fp = fopen(eng->filename, "r")) == NULL) {
             err_sys("fopen");
          }
       }
@@ -170,1495 +243,4547 @@ main(int argc, char *argv[]) {
          while (!isspace(*cp) && *cp != '\0')
             cp++;
          *cp = '\0';
-         add_host(line, timeout);
+         add_host(scan, line, scan->timeout);
       }
       fclose(fp);
    } else {             /* Populate list from command line arguments */
       argv=&argv[optind];
       while (*argv) {
-         add_host(*argv, timeout);
+         add_host(scan, *argv, scan->timeout);
          argv++;
       }
    }
+   run_scan(scan, sockfd, &start_time, setup_start_ns);
+
+   if (sockfd >= 0)
+      close(sockfd);
+   clean_up(eng);
+   show_summary(scan, &start_time);
+   if (eng->debug) {print_times(); printf("main: End\n");}
+   return 0;
+}
+#endif	/* TCPSCAN_LIBRARY */
+
+/*
+ *	init_engine -- Initialise the settings and state of an engine
+ *
+ *	Inputs:
+ *
+ *	eng		The engine to initialise
+ *
+ *	Returns:
+ *
+ *	None.
+ *
+ *	The settings are the defaults before any options are processed,
+ *	and the command line scan has the default per-scan settings.
+ */
+void
+init_engine(tcpscan_engine *eng) {
+   memset(eng, '\0', sizeof(*eng));
+   eng->snaplen = SNAPLEN;
+   eng->window = DEFAULT_WINDOW;
+   eng->mss = DEFAULT_MSS;
+   eng->ip_ttl = DEFAULT_TTL;
+   eng->df_flag = DEFAULT_DF;
+   eng->ip_tos = DEFAULT_TOS;
+   eng->sockfd = -1;
+   eng->tx_sock = -1;
+   eng->rng.mti = MT_N + 1;	/* Not seeded yet */
+   eng->sample_rate = 1.0;
+   eng->daemon_listen_fd = -1;
+   eng->dryrun_rtt = DRYRUN_RTT;
+   eng->dryrun_open = DRYRUN_OPEN;
+   eng->dryrun_up = 1.0;
+   init_context(&eng->cli_scan, eng, NULL);
+}
+
+/*
+ *	init_context -- Initialise the settings and results of a scan
+ *
+ *	Inputs:
+ *
+ *	ctx		The context to initialise
+ *	eng		The engine that will run the scan
+ *	template	Context to copy the settings from, or NULL for the
+ *			defaults
+ *
+ *	Returns:
+ *
+ *	None.
+ *
+ *	The host list and the results are always empty, so a context made
+ *	from the command line scan before it starts has no targets.
+ */
+void
+init_context(tcpscan_ctx *ctx, tcpscan_engine *eng,
+             const tcpscan_ctx *template) {
+   memset(ctx, '\0', sizeof(*ctx));
+   ctx->engine = eng;
+   if (template) {
+      ctx->retry = template->retry;
+      ctx->host_retry = template->host_retry;
+      ctx->timeout = template->timeout;
+      ctx->backoff_factor = template->backoff_factor;
+      ctx->interval = template->interval;
+      ctx->bandwidth = template->bandwidth;
+      ctx->open_only = template->open_only;
+      ctx->random_flag = template->random_flag;
+      ctx->priority_flag = template->priority_flag;
+      ctx->numeric_flag = template->numeric_flag;
+      ctx->quiet_flag = template->quiet_flag;
+      ctx->portname_flag = template->portname_flag;
+      ctx->ignore_dups = template->ignore_dups;
+      ctx->rtt_flag = template->rtt_flag;
+      ctx->local_data = template->local_data ?
+                        dupstr(template->local_data) : NULL;
+      ctx->weight = template->weight;
+      ctx->sport = template->sport;
+      ctx->out = template->out;
+   } else {
+      ctx->retry = DEFAULT_RETRY;
+      ctx->timeout = DEFAULT_TIMEOUT;
+      ctx->backoff_factor = DEFAULT_BACKOFF_FACTOR;
+      ctx->bandwidth = DEFAULT_BANDWIDTH;
+      ctx->weight = DEFAULT_WEIGHT;
+      ctx->out = stdout;
+   }
+   hist_init(&ctx->rtt_hist);
+}
+
+/*
+ *	open_raw_socket -- Create the raw IP socket that probes are sent on
+ *
+ *	Inputs:
+ *
+ *	eng		The scan engine
+ *
+ *	Returns:
+ *
+ *	The socket file descriptor.
+ */
+int
+open_raw_socket(tcpscan_engine *eng) {
+   const int on = 1;            /* For setsockopt */
+   int sockfd;
+
+   if ((sockfd = socket(AF_INET, SOCK_RAW, IPPROTO_RAW)) < 0)
+      err_sys("socket");
+   if ((setsockopt(sockfd, IPPROTO_IP, IP_HDRINCL, &on, sizeof(on))) != 0)
+      err_sys("setsockopt");
+   if ((setsockopt(sockfd, SOL_SOCKET, SO_BROADCAST, &on, sizeof(on))) != 0)
+      err_sys("setsockopt");
+/*
+ *	Ask the kernel for transmit timestamps if we are measuring RTTs.
+ */
+   if (eng->cli_scan.rtt_flag || eng->autotimeout_flag)
+      enable_tx_timestamps(eng, sockfd);
+   return sockfd;
+}
+
+/*
+ *	run_scan -- Scan the entries in the host list
+ *
+ *	Inputs:
+ *
+ *	scan		The scan context
+ *	sockfd		Raw IP socket, or -1 with --replay or --dryrun
+ *	start_time	When the scan started
+ *	setup_start_ns	Real time that setup started, for dryrun_report()
+ *
+ *	Returns:
+ *
+ *	None.
+ *
+ *	This orders the list, sends the probes and processes the responses
+ *	until every entry has responded or timed out, and then displays
+ *	everything that comes before the final summary line.  It is called
+ *	once by main(), and once for each job by the --daemon.
+ */
+void
+run_scan(tcpscan_ctx *scan, int sockfd, const struct timeval *start_time,
+         TCP_UINT64 setup_start_ns) {
+   tcpscan_engine *eng = scan->engine;
+   TCP_UINT64 dryrun_start_ns;  /* Real time that the main loop started */
+   struct timeval now;
+
 /*
  *      Check that we have at least one entry in the list.
  */
-   if (!num_hosts)
+   if (!scan->num_hosts)
       err_msg("No hosts to process.");
 /*
- *      Check that the combination of specified options and arguments is
- *      valid.
+ *      Keep only this node's share of the list if --shard was given.
  */
-   if (interval && bandwidth != DEFAULT_BANDWIDTH)
-      err_msg("ERROR: You cannot specify both --bandwidth and --interval.");
+   if (eng->shard_count)
+      select_shard(scan);
 /*
- *      Create and initialise array of pointers to host entries.
+ *      Compare with the --previous results if required.  This puts the
+ *      ports that were open first, and drops the ones that --sample
+ *      leaves out.
+ */
+   if (*eng->previous_file != '\0')
+      select_previous(scan);
+   else if (eng->sample_rate < 1.0)
+      err_msg("The --sample option needs --previous.");
+/*
+ *      With --discover, remove the hosts that do not answer the discovery
+ *      probes before the full scan.
+ */
+   if (eng->discover_count)
+      discover_hosts(scan, sockfd);
+   prepare_list(scan);
+   if (eng->resume_flag)
+      apply_checkpoint(scan);
+/*
+ *      Create the pcapng savefile writer if the --pcapsavefile option was
+ *      specified.  We do this here rather than in initialise() so that
+ *      the savefile comment can record the final scan parameters.
  */
-   helistptr = Malloc(num_hosts * sizeof(host_entry *));
-   for (i=0; i<num_hosts; i++)
-      helistptr[i] = &helist[i];
+   if (*eng->pcap_savefile != '\0')
+      open_savefile(scan);
 /*
- *      Randomise the list if required.
+ *      Display initial message.  A worker flushes it at once, because
+ *      merge_worker_output() waits for it from every worker.
  */
-   if (random_flag) {
-      int r;
-      host_entry *temp;
+   if (eng->worker_no)
+      eng->worker_results[eng->worker_no-1].num_hosts = scan->num_hosts;
+   printf("Starting %s with %u ports\n", PACKAGE_STRING, scan->num_hosts);
+   if (eng->worker_no)
+      fflush(stdout);
+/*
+ *      Display the lists if verbose setting is 3 or more.
+ */
+   if (eng->verbose > 2)
+      dump_list(scan);
+   dryrun_start_ns = timestamp_ns();
+   scan_loop(scan, sockfd, start_time);
 
-      for (i=num_hosts-1; i>0; i--) {
-         r = (int)(genrand_real2() * i);	/* 0<=r<i */
-         temp = helistptr[i];
-         helistptr[i] = helistptr[r];
-         helistptr[r] = temp;
-      }
+   if (eng->progress_interval) {
+      engine_gettimeofday(eng, &now);
+      show_progress(scan, &now, start_time, 1);
+   }
+   if (*eng->checkpoint_file != '\0')
+      unlink(eng->checkpoint_file);	/* The scan is complete */
+   if (*eng->previous_file != '\0')
+      warn_msg("---\tChanges from %s: %u new open, %u newly closed, "
+               "%u vanished", eng->previous_file, scan->changed_open,
+               scan->changed_closed, scan->vanished);
+   if (scan->host_stats)
+      report_host_stats(scan);
+/*
+ *	Display the RTT histogram if required.  A worker leaves this and the
+ *	final summary to the parent, which merges the results of all workers.
+ */
+   if (eng->worker_no) {
+      eng->worker_results[eng->worker_no-1].responders = scan->responders;
+      eng->worker_results[eng->worker_no-1].rtt_hist = scan->rtt_hist;
+   } else {
+      printf("\n");        /* Ensure we have a blank line */
+   }
+   if (scan->rtt_flag && !eng->worker_no) {
+      hist_print(stdout, &scan->rtt_hist, "RTT", 1000000.0, "ms", 1);
+      printf("\n");
+   }
+   if (scan->rtt_flag && eng->verbose)
+      warn_msg("---\t%u probes used kernel transmit timestamps",
+               eng->tx_stamped);
+   if (eng->dryrun_flag)
+      dryrun_report(scan, dryrun_start_ns - setup_start_ns, dryrun_start_ns);
+   if (eng->verbose)
+      print_syscall_stats(scan);
+   if (eng->stagetimes_flag)
+      print_stage_times(scan, stderr);
+}
+
+/*
+ *	prepare_list -- Get the host list ready to scan
+ *
+ *	Inputs:
+ *
+ *	scan		The scan context
+ *
+ *	Returns:
+ *
+ *	None.
+ *
+ *	This builds the array of pointers that sets the order of the scan
+ *	and the find_host() index, orders the list by port priority or
+ *	randomises it if required, sets the cursor to the start and works
+ *	out the interval from the bandwidth if --interval was not given.
+ */
+void
+prepare_list(tcpscan_ctx *scan) {
+   unsigned i;
+
+/*
+ *      Create and initialise array of pointers to host entries.
+ */
+   scan->helistptr = Malloc(scan->num_hosts * sizeof(host_entry *));
+   for (i=0; i<scan->num_hosts; i++)
+      scan->helistptr[i] = &scan->helist[i];
+   build_host_index(scan);
+   if (scan->host_retry && scan->host_retry < scan->retry)
+      build_host_stats(scan);
+/*
+ *      Put the common ports first, or randomise the list if required.
+ */
+   if (scan->priority_flag) {
+      sort_by_priority(scan, 0, scan->previous_open);
+      sort_by_priority(scan, scan->previous_open, scan->num_hosts);
+   } else if (scan->random_flag) {
+      shuffle_hosts(scan, 0, scan->previous_open);
+      shuffle_hosts(scan, scan->previous_open, scan->num_hosts);
    }
 /*
- *      Set current host pointer (cursor) to start of list, zero
- *      last packet sent time, and set last receive time to now.
+ *      Set current host pointer (cursor) to start of list.
+ */
+   scan->live_count = scan->num_hosts;
+   scan->cursor = scan->helistptr;
+/*
+ *      Check that the combination of specified options is valid.
  */
-   live_count = num_hosts;
-   cursor = helistptr;
-   last_packet_time.tv_sec=0;
-   last_packet_time.tv_usec=0;
+   if (scan->interval && scan->bandwidth != DEFAULT_BANDWIDTH)
+      err_msg("ERROR: You cannot specify both --bandwidth and --interval.");
 /*
  *      Calculate the required interval to achieve the required outgoing
  *      bandwidth unless the interval was manually specified with --interval.
  */
-   if (!interval) {
-      size_t packet_out_len;
-
-      packet_out_len=send_packet(0, NULL, 1, NULL); /* Get packet size */
-      if (packet_out_len < MINIMUM_FRAME_SIZE)
-         packet_out_len = MINIMUM_FRAME_SIZE;   /* Adjust to minimum size */
-      packet_out_len += PACKET_OVERHEAD;        /* Add layer 2 overhead */
-      interval = ((TCP_UINT64)packet_out_len * 8 * 1000000) / bandwidth;
-      if (verbose) {
-         warn_msg("DEBUG: Ethernet frame len=%u bytes, bandwidth=%u bps, "
-                  "interval=%u us",
-                  packet_out_len, bandwidth, interval);
-      }
-   }
+   if (!scan->interval)
+      scan->interval = bandwidth_interval(scan, scan->bandwidth);
 /*
- *      Display initial message.
+ *      Start the send timing for scan_step().
  */
-   printf("Starting %s with %u ports\n", PACKAGE_STRING, num_hosts);
+   timerclear(&scan->last_packet_time);
+   scan->req_interval = scan->interval;
+   scan->reset_cum_err = 1;
+   scan->pass_no = 0;
+   scan->first_timeout = 1;
+}
+
 /*
- *      Display the lists if verbose setting is 3 or more.
+ *	bandwidth_interval -- Calculate the probe interval for a bandwidth
+ *
+ *	Inputs:
+ *
+ *	scan		The scan context
+ *	bandwidth	Outbound bandwidth in bits per second
+ *
+ *	Returns:
+ *
+ *	The interval between probes in us.
+ */
+unsigned
+bandwidth_interval(tcpscan_ctx *scan, unsigned bandwidth) {
+   tcpscan_engine *eng = scan->engine;
+   size_t packet_out_len;
+   unsigned interval;
+
+   packet_out_len=send_packet(scan, 0, NULL, 1, NULL); /* Get packet size */
+   if (packet_out_len < MINIMUM_FRAME_SIZE)
+      packet_out_len = MINIMUM_FRAME_SIZE;   /* Adjust to minimum size */
+   packet_out_len += PACKET_OVERHEAD;        /* Add layer 2 overhead */
+   interval = ((TCP_UINT64)packet_out_len * 8 * 1000000) / bandwidth;
+   if (eng->verbose) {
+      warn_msg("DEBUG: Ethernet frame len=%u bytes, bandwidth=%u bps, "
+               "interval=%u us", packet_out_len, bandwidth, interval);
+   }
+   return interval;
+}
+
+/*
+ *	scan_loop -- Send the probes and process the responses
+ *
+ *	Inputs:
+ *
+ *	scan		The scan context
+ *	sockfd		Raw IP socket, or -1 with --replay or --dryrun
+ *	start_time	When the scan started
+ *
+ *	Returns:
+ *
+ *	None.
+ *
+ *	This returns when every entry in the list has either responded or
+ *	timed out.
  */
-   if (verbose > 2)
-      dump_list();
+void
+scan_loop(tcpscan_ctx *scan, int sockfd, const struct timeval *start_time) {
+   tcpscan_engine *eng = scan->engine;
+   struct timeval now;
+   struct timeval next_progress; /* When to next call show_progress() */
+   struct timeval next_checkpoint; /* When to next call write_checkpoint() */
+   unsigned select_timeout;     /* Select timeout */
+   int sent;
+
 /*
  *      Main loop: send packets to all hosts in order until a response
  *      has been received or the host has exhausted its retry limit.
  *
  *      The loop exits when all hosts have either responded or timed out.
  */
-   reset_cum_err = 1;
-   req_interval = interval;
-   while (live_count) {
-      if (debug) {print_times(); printf("main: Top of loop.\n");}
+   if (*eng->stats_file != '\0' && !eng->progress_interval)
+      eng->progress_interval = DEFAULT_PROGRESS;	/* --statsfile only */
+   next_progress = *start_time;
+   next_progress.tv_sec += eng->progress_interval;
+   next_checkpoint = *start_time;
+   next_checkpoint.tv_sec += CHECKPOINT_INTERVAL;
+   if (*eng->replay_file != '\0') {
+      replay_packets(scan);
+      scan->live_count = 0;	/* Skip the main loop */
+   }
+   while (scan->live_count) {
+      if (eng->debug) {print_times(); printf("main: Top of loop.\n");}
 /*
  *      Obtain current time and calculate deltas since last packet and
  *      last packet to this host.
  */
-      Gettimeofday(&now);
+      engine_gettimeofday(eng, &now);
+/*
+ *      Display the progress if it is time to.  This uses the time that we
+ *      have just obtained, so it adds no system calls to the loop.
+ */
+      if (eng->progress_interval && timercmp(&now, &next_progress, >=)) {
+         show_progress(scan, &now, start_time, 0);
+         next_progress.tv_sec = now.tv_sec + eng->progress_interval;
+         next_progress.tv_usec = now.tv_usec;
+      }
+      if (stage_dump) {
+         stage_dump = 0;
+         print_stage_times(scan, stderr);
+      }
+      if (*eng->checkpoint_file != '\0') {
+         if (interrupted) {
+            write_checkpoint(scan);
+            warn_msg("---\tInterrupted: scan state saved in %s",
+                     eng->checkpoint_file);
+            clean_up(eng);
+            exit(EXIT_FAILURE);
+         }
+         if (timercmp(&now, &next_checkpoint, >=)) {
+            write_checkpoint(scan);
+            next_checkpoint.tv_sec = now.tv_sec + CHECKPOINT_INTERVAL;
+            next_checkpoint.tv_usec = now.tv_usec;
+         }
+      }
+      select_timeout = scan_step(scan, sockfd, &now, &sent);
+      recvfrom_wto(scan, eng->pcap_fd, select_timeout);
+   } /* End While */
+}
+
+/*
+ *	scan_step -- Send the next probe of a scan if it is time to
+ *
+ *	Inputs:
+ *
+ *	scan		The scan context
+ *	sockfd		Raw IP socket, or -1 with --dryrun
+ *	now		The current time
+ *	sent		Set to 1 if a probe was sent, otherwise unchanged
+ *
+ *	Returns:
+ *
+ *	How long to wait for responses, in us, before the next step.
+ *
+ *	This sends a probe to the entry at the cursor, or removes it if it
+ *	has run out of retries, provided that both the interval since the
+ *	last probe and the entry's timeout have passed.  The timing state is
+ *	kept in the scan's context, so that the --daemon can step several
+ *	scans in turn.
+ */
+unsigned
+scan_step(tcpscan_ctx *scan, int sockfd, const struct timeval *now, int *sent) {
+   tcpscan_engine *eng = scan->engine;
+   struct timeval diff;         /* Difference between two timevals */
+   unsigned select_timeout;     /* Select timeout */
+   TCP_UINT64 loop_timediff;    /* Time since last packet sent in us */
+   TCP_UINT64 host_timediff; /* Time since last pkt sent to this host (us) */
+
 /*
  *      If the last packet was sent more than interval us ago, then we can
  *      potentially send a packet to the current host.
  */
-      timeval_diff(&now, &last_packet_time, &diff);
-      loop_timediff = (TCP_UINT64)1000000*diff.tv_sec + diff.tv_usec;
-      if (loop_timediff >= (unsigned)req_interval) {
-         if (debug) {print_times(); printf("main: Can send packet now.  loop_timediff=" TCP_UINT64_FORMAT "\n", loop_timediff);}
+   timeval_diff(now, &scan->last_packet_time, &diff);
+   loop_timediff = (TCP_UINT64)1000000*diff.tv_sec + diff.tv_usec;
+   if (loop_timediff >= (unsigned)scan->req_interval) {
+      if (eng->debug) {print_times(); printf("main: Can send packet now.  loop_timediff=" TCP_UINT64_FORMAT "\n", loop_timediff);}
 /*
  *      If the last packet to this host was sent more than the current
  *      timeout for this host us ago, then we can potentially send a packet
  *      to it.
  */
-         timeval_diff(&now, &((*cursor)->last_send_time), &diff);
-         host_timediff = (TCP_UINT64)1000000*diff.tv_sec + diff.tv_usec;
-         if (host_timediff >= (*cursor)->timeout) {
-            if (reset_cum_err) {
-               if (debug) {print_times(); printf("main: Reset cum_err\n");}
-               cum_err = 0;
-               req_interval = interval;
-               reset_cum_err = 0;
+      timeval_diff(now, &((*scan->cursor)->last_send_time), &diff);
+      host_timediff = (TCP_UINT64)1000000*diff.tv_sec + diff.tv_usec;
+      if (host_timediff >= (*scan->cursor)->timeout) {
+         if (scan->reset_cum_err) {
+            if (eng->debug) {print_times(); printf("main: Reset cum_err\n");}
+            scan->cum_err = 0;
+            scan->req_interval = scan->interval;
+            scan->reset_cum_err = 0;
+         } else {
+            scan->cum_err += loop_timediff - scan->interval;
+            if (scan->req_interval >= scan->cum_err) {
+               scan->req_interval = scan->req_interval - scan->cum_err;
             } else {
-               cum_err += loop_timediff - interval;
-               if (req_interval >= cum_err) {
-                  req_interval = req_interval - cum_err;
-               } else {
-                  req_interval = 0;
-               }
+               scan->req_interval = 0;
             }
-            if (debug) {print_times(); printf("main: Can send packet to host %d now.  host_timediff=" TCP_UINT64_FORMAT ", timeout=%u, req_interval=%d, cum_err=%d\n", (*cursor)->n, host_timediff, (*cursor)->timeout, req_interval, cum_err);}
-            select_timeout = req_interval;
+         }
+         if (eng->debug) {print_times(); printf("main: Can send packet to host %d now.  host_timediff=" TCP_UINT64_FORMAT ", timeout=%u, req_interval=%d, cum_err=%d\n", (*scan->cursor)->n, host_timediff, (*scan->cursor)->timeout, scan->req_interval, scan->cum_err);}
+         select_timeout = scan->req_interval;
 /*
  *      If we've exceeded our retry limit, then this host has timed out so
  *      remove it from the list.  Otherwise, increase the timeout by the
  *      backoff factor if this is not the first packet sent to this host
  *      and send a packet.
  */
-            if (verbose && (*cursor)->num_sent > pass_no) {
-               warn_msg("---\tPass %d complete", pass_no+1);
-               pass_no = (*cursor)->num_sent;
-            }
-            if ((*cursor)->num_sent >= retry) {
-               if (verbose > 1)
-                  warn_msg("---\tRemoving host entry %u (%s) - Timeout", (*cursor)->n, my_ntoa((*cursor)->addr,ipv6_flag));
-               if (debug) {print_times(); printf("main: Timing out host %d.\n", (*cursor)->n);}
-               remove_host(cursor);     /* Automatically calls advance_cursor() */
-               if (first_timeout) {
-                  timeval_diff(&now, &((*cursor)->last_send_time), &diff);
+         if (eng->verbose && (*scan->cursor)->num_sent > scan->pass_no) {
+            warn_msg("---\tPass %d complete", scan->pass_no+1);
+            scan->pass_no = (*scan->cursor)->num_sent;
+         }
+         note_retry_timeout(scan, *scan->cursor);
+         if ((*scan->cursor)->num_sent >= retry_limit(scan, *scan->cursor)) {
+            if ((*scan->cursor)->num_sent < scan->retry)
+               scan->retries_skipped += scan->retry -
+                                        (*scan->cursor)->num_sent;
+            TCP_SCAN_PROBE5(scan->timeout, (*scan->cursor)->addr.v4.s_addr,
+                            (*scan->cursor)->dport,
+                            (*scan->cursor)->num_sent,
+                            (*scan->cursor)->send_ns,
+                            (TCP_UINT64) now->tv_sec * 1000000000 +
+                            now->tv_usec * 1000);
+            if (eng->verbose > 1)
+               warn_msg("---\tRemoving host entry %u (%s) - Timeout", (*scan->cursor)->n, my_ntoa((*scan->cursor)->addr,eng->ipv6_flag));
+            if ((*scan->cursor)->prev != PREV_NONE)
+               display_vanished(scan, *scan->cursor);
+            if (eng->debug) {print_times(); printf("main: Timing out host %d.\n", (*scan->cursor)->n);}
+            remove_host(scan, scan->cursor);	/* Calls advance_cursor() */
+            if (scan->first_timeout) {
+               timeval_diff(now, &((*scan->cursor)->last_send_time), &diff);
+               host_timediff = (TCP_UINT64)1000000*diff.tv_sec +
+                               diff.tv_usec;
+               while (host_timediff >= (*scan->cursor)->timeout &&
+                      scan->live_count) {
+                  if ((*scan->cursor)->live) {
+                     if ((*scan->cursor)->num_sent <
+                         retry_limit(scan, *scan->cursor))
+                        break;	/* Due a --hostretry retry, not timed out */
+                     note_retry_timeout(scan, *scan->cursor);
+                     if ((*scan->cursor)->num_sent < scan->retry)
+                        scan->retries_skipped += scan->retry -
+                                                 (*scan->cursor)->num_sent;
+                     TCP_SCAN_PROBE5(scan->timeout,
+                                     (*scan->cursor)->addr.v4.s_addr,
+                                     (*scan->cursor)->dport,
+                                     (*scan->cursor)->num_sent,
+                                     (*scan->cursor)->send_ns,
+                                     (TCP_UINT64) now->tv_sec * 1000000000 +
+                                     now->tv_usec * 1000);
+                     if (eng->verbose > 1)
+                        warn_msg("---\tRemoving host %u (%s) - Catch-Up Timeout", (*scan->cursor)->n, my_ntoa((*scan->cursor)->addr,eng->ipv6_flag));
+                     if ((*scan->cursor)->prev != PREV_NONE)
+                        display_vanished(scan, *scan->cursor);
+                     remove_host(scan, scan->cursor);
+                  } else {
+                     advance_cursor(scan);
+                  }
+                  timeval_diff(now, &((*scan->cursor)->last_send_time), &diff);
                   host_timediff = (TCP_UINT64)1000000*diff.tv_sec +
                                   diff.tv_usec;
-                  while (host_timediff >= (*cursor)->timeout && live_count) {
-                     if ((*cursor)->live) {
-                        if (verbose > 1)
-                           warn_msg("---\tRemoving host %u (%s) - Catch-Up Timeout", (*cursor)->n, my_ntoa((*cursor)->addr,ipv6_flag));
-                        remove_host(cursor);
-                     } else {
-                        advance_cursor();
-                     }
-                     timeval_diff(&now, &((*cursor)->last_send_time), &diff);
-                     host_timediff = (TCP_UINT64)1000000*diff.tv_sec +
-                                     diff.tv_usec;
-                  }
-                  first_timeout=0;
                }
-               Gettimeofday(&last_packet_time);
-            } else {    /* Retry limit not reached for this host */
-               if ((*cursor)->num_sent)
-                  (*cursor)->timeout *= backoff_factor;
-               send_packet(sockfd, *cursor, IP_PROTOCOL, &last_packet_time);
-               advance_cursor();
+               scan->first_timeout=0;
             }
-         } else {       /* We can't send a packet to this host yet */
+            engine_gettimeofday(eng, &scan->last_packet_time);
+         } else {    /* Retry limit not reached for this host */
+            if ((*scan->cursor)->num_sent)
+               (*scan->cursor)->timeout *= scan->backoff_factor;
+            else if (eng->autotimeout_flag &&
+                     scan->rtt_samples >= AUTOTIMEOUT_SAMPLES)
+               (*scan->cursor)->timeout = auto_timeout(scan);
+            send_packet(scan, sockfd, *scan->cursor, IP_PROTOCOL,
+                        &scan->last_packet_time);
+            if (scan->cursor - scan->helistptr >= (long) scan->first_pass)
+               scan->first_pass = scan->cursor - scan->helistptr + 1;
+            advance_cursor(scan);
+            *sent = 1;
+         }
+      } else {       /* We can't send a packet to this host yet */
 /*
  *      Note that there is no point calling advance_cursor() here because if
  *      host n is not ready to send, then host n+1 will not be ready either.
  */
-            select_timeout = (*cursor)->timeout - host_timediff;
-            reset_cum_err = 1;  /* Zero cumulative error */
-            if (debug) {print_times(); printf("main: Can't send packet to host %d yet. host_timediff=" TCP_UINT64_FORMAT "\n", (*cursor)->n, host_timediff);}
-         } /* End If */
-      } else {          /* We can't send a packet yet */
-         select_timeout = req_interval - loop_timediff;
-         if (debug) {print_times(); printf("main: Can't send packet yet.  loop_timediff=" TCP_UINT64_FORMAT "\n", loop_timediff);}
+         select_timeout = (*scan->cursor)->timeout - host_timediff;
+         scan->reset_cum_err = 1;  /* Zero cumulative error */
+         if (eng->debug) {print_times(); printf("main: Can't send packet to host %d yet. host_timediff=" TCP_UINT64_FORMAT "\n", (*scan->cursor)->n, host_timediff);}
       } /* End If */
+   } else {          /* We can't send a packet yet */
+      select_timeout = scan->req_interval - loop_timediff;
+      if (eng->debug) {print_times(); printf("main: Can't send packet yet.  loop_timediff=" TCP_UINT64_FORMAT "\n", loop_timediff);}
+   } /* End If */
+   return select_timeout;
+}
 
-      recvfrom_wto(pcap_fd, select_timeout);
-   } /* End While */
-
-   printf("\n");        /* Ensure we have a blank line */
-
-   close(sockfd);
-   clean_up();
+/*
+ *	show_summary -- Display the final summary line
+ *
+ *	Inputs:
+ *
+ *	scan		The scan context
+ *	start_time	When the scan started
+ *
+ *	Returns:
+ *
+ *	None.
+ *
+ *	A worker saves its elapsed time for the parent instead, which
+ *	displays one summary for all of the workers.
+ */
+void
+show_summary(tcpscan_ctx *scan, const struct timeval *start_time) {
+   tcpscan_engine *eng = scan->engine;
+   struct timeval end_time;
+   struct timeval elapsed_time; /* Elapsed time as timeval */
+   double elapsed_seconds;      /* Elapsed time in seconds */
 
-   Gettimeofday(&end_time);
-   timeval_diff(&end_time, &start_time, &elapsed_time);
+   engine_gettimeofday(eng, &end_time);
+   timeval_diff(&end_time, start_time, &elapsed_time);
    elapsed_seconds = (elapsed_time.tv_sec*1000 +
                       elapsed_time.tv_usec/1000) / 1000.0;
+   if (eng->worker_no) {
+      eng->worker_results[eng->worker_no-1].elapsed_seconds = elapsed_seconds;
+      return;
+   }
 
-   printf("Ending %s: %u ports scanned in %.3f seconds (%.2f ports/sec).  %u responded\n",
-          PACKAGE_STRING, num_hosts, elapsed_seconds, num_hosts/elapsed_seconds,
-          responders);
-   if (debug) {print_times(); printf("main: End\n");}
-   return 0;
+   fprintf(scan->out, "Ending %s: %u ports scanned in %.3f seconds (%.2f ports/sec).  %u responded\n",
+           PACKAGE_STRING, scan->num_hosts, elapsed_seconds,
+           scan->num_hosts ? scan->num_hosts/elapsed_seconds : 0.0,
+           scan->responders);
 }
 
 /*
- *	display_packet -- Check and display received packet
+ *	replay_packets -- Feed the --replay savefile through callback()
  *
  *	Inputs:
  *
- *	n		The length of the received packet in bytes.
- *			Note that this can be more or less than the IP packet
- *			size because of minimum frame sizes or snaplength
- *			cutoff respectively.
- *	packet_in	The received packet
- *	he		The host entry corresponding to the received packet
- *	recv_addr	IP address that the packet was received from
+ *	scan		The scan context
  *
- *      Returns:
+ *	Returns:
  *
- *      None.
+ *	None.
  *
- *      This checks the received packet and displays details of what
- *      was received in the format: <IP-Address><TAB><Details>.
+ *	This passes every packet in the savefile to callback(), as if it had
+ *	been captured during a scan of the host list, and then reports the
+ *	throughput, the time spent in each stage and the number of memory
+ *	allocations per packet on stderr.  Redirect stdout to /dev/null to
+ *	exclude the cost of writing the results to a terminal.
  */
 void
-display_packet(unsigned n, const unsigned char *packet_in,
-               const host_entry *he, const struct in_addr *recv_addr) {
-   const struct iphdr *iph;
-   const struct tcphdr *tcph;
-   char *msg;
-   char *cp;
-   char *flags;
-   int data_len;
-   unsigned data_offset;
-   const char *df;
-   int optlen;
-/*
- *	Set msg to the IP address of the host entry, plus the address of the
- *	responder if different, and a tab.
- */
-   msg = make_message("%s\t", my_ntoa(he->addr,ipv6_flag));
-   if ((he->addr).v4.s_addr != recv_addr->s_addr) {	/* XXXX */
-      cp = msg;
-      msg = make_message("%s(%s) ", cp, inet_ntoa(*recv_addr));
-      free(cp);
+replay_packets(tcpscan_ctx *scan) {
+   tcpscan_engine *eng = scan->engine;
+   struct pcap_pkthdr *header;
+   const u_char *packet_in;
+   TCP_UINT64 start_ns;
+   TCP_UINT64 read_ns=0;
+   TCP_UINT64 total_ns;
+   TCP_UINT64 start_allocs;
+   TCP_UINT64 allocs;
+   TCP_UINT64 match_ns;
+   TCP_UINT64 display_ns;
+   unsigned long packets=0;
+   double per_packet;
+   int result;
+
+   start_allocs = alloc_count();
+   start_ns = engine_time_ns(eng);
+   for (;;) {
+      TCP_UINT64 read_start = engine_time_ns(eng);
+
+      result = pcap_next_ex(eng->pcap_handle, &header, &packet_in);
+      read_ns += engine_time_ns(eng) - read_start;
+      if (result == -2)		/* End of savefile */
+         break;
+      if (result < 0)
+         err_msg("pcap_next_ex: %s\n", pcap_geterr(eng->pcap_handle));
+      if (result == 0)
+         continue;
+      packets++;
+      callback((u_char *) scan, header, packet_in);
    }
-/*
- *	Check that the packet is large enough to decode.
- *	This should never happen because the packet length should have
- *	already been checked in callback().
- */
-   if (n < ip_offset + sizeof(struct iphdr) + sizeof(struct tcphdr)) {
-      printf("%s%u byte packet too short to decode\n", msg, n);
-      free(msg);
+   fflush(stdout);
+   total_ns = engine_time_ns(eng) - start_ns;
+   allocs = alloc_count() - start_allocs;
+
+   if (!packets) {
+      warn_msg("---\tNo packets in %s", eng->replay_file);
       return;
    }
+   per_packet = 1.0 / packets;
+   warn_msg("---\tReplayed %lu packets in %.3f ms: %.0f packets/sec",
+            packets, total_ns / 1000000.0,
+            packets / (total_ns / 1000000000.0));
+   match_ns = eng->stage_hist[STAGE_MATCH].sum;
+   display_ns = eng->stage_hist[STAGE_FORMAT].sum +
+                eng->stage_hist[STAGE_WRITE].sum;
+   warn_msg("---\tns per packet: read %.0f, match %.0f, display %.0f, "
+            "other %.0f, total %.0f", read_ns * per_packet,
+            match_ns * per_packet, display_ns * per_packet,
+            (total_ns - read_ns - match_ns - display_ns) * per_packet,
+            total_ns * per_packet);
+   warn_msg("---\tAllocations per packet: %.2f, max find_host() iterations: %u",
+            allocs * per_packet, scan->max_iter);
+}
+
 /*
- *      Overlay IP and TCP headers on packet buffer.
- *      ip_offset is size of layer-2 header.
- *      Note that iph.ihl is in 32-bit units.  We multiply by 4 to get bytes.
- *      iph.lhl is normally 5, but can be larger if IP options are present.
- */
-   iph = (const struct iphdr *) (packet_in + ip_offset);
-   tcph = (const struct tcphdr *) (packet_in + ip_offset + 4*(iph->ihl));
-/*
- *	Add TCP port to message.
+ *	show_progress -- Display the scan progress and write the stats file
+ *
+ *	Inputs:
+ *
+ *	scan	The scan context
+ *	now	The current time
+ *	start	The time that the scan started
+ *	final	Non-zero for the call after the main loop has finished.
+ *		The rate displayed is then the average for the whole scan.
+ *
+ *	Returns:
+ *
+ *	None.
+ *
+ *	This is called from the main loop every progress_interval seconds.
+ *	The counters that it displays are simple increments in the send and
+ *	receive paths, so the only system calls are pcap_stats() and the
+ *	output itself.
+ *
+ *	The estimated time remaining is the time to send the first probe to
+ *	the remaining entries at the rate so far, plus the longest that an
+ *	entry can wait for a response with the configured timeout, backoff
+ *	and retries.
  */
-   cp = msg;
-   if (portname_flag) {
-      char *portname = portnames[ntohs(tcph->source)];
-      msg = make_message("%s%u (%s)\t", cp, ntohs(tcph->source),
-                         portname?portname:"unknown");
+void
+show_progress(tcpscan_ctx *scan, const struct timeval *now,
+              const struct timeval *start, int final) {
+   tcpscan_engine *eng = scan->engine;
+   struct timeval diff;
+   struct pcap_stat stats;
+   unsigned removed = scan->num_hosts - scan->live_count;
+   unsigned awaiting = scan->first_probes > removed ?
+                       scan->first_probes - removed : 0;
+   double elapsed;
+   double since_last;
+   double rate;
+   double tail = 0.0;
+   double step = scan->timeout / 1000.0;
+   double eta;
+   unsigned i;
+
+   timeval_diff(now, start, &diff);
+   elapsed = diff.tv_sec + diff.tv_usec / 1000000.0;
+   if (!scan->progress_time.tv_sec)
+      scan->progress_time = *start;
+   timeval_diff(now, &scan->progress_time, &diff);
+   since_last = diff.tv_sec + diff.tv_usec / 1000000.0;
+   if (final)		/* Average over the whole scan */
+      rate = elapsed > 0 ? scan->probes_sent / elapsed : 0.0;
+   else
+      rate = since_last > 0 ?
+             (scan->probes_sent - scan->progress_probes) / since_last : 0.0;
+   scan->progress_time = *now;
+   scan->progress_probes = scan->probes_sent;
+
+   for (i=0; i<scan->retry; i++) {
+      tail += step;
+      step *= scan->backoff_factor;
+   }
+   if (final) {
+      eta = 0.0;
+   } else if (scan->first_probes < scan->num_hosts) {
+      eta = tail;
+      if (scan->first_probes)
+         eta += (scan->num_hosts - scan->first_probes) * elapsed /
+                scan->first_probes;
    } else {
-      msg = make_message("%s%u\t", cp, ntohs(tcph->source));
+      timeval_diff(now, &scan->first_pass_end, &diff);
+      eta = tail - (diff.tv_sec + diff.tv_usec / 1000000.0);
+      if (eta < 0)
+         eta = 0.0;
    }
-   free(cp);
-/*
- *	Determine type of response: SYN-ACK, RST or something else and
- *	add to message.
- */
-   cp = msg;
-   if (tcph->syn && tcph->ack) {	/* SYN + ACK = Open */
-      msg = make_message("%sOPEN", cp);
-   } else if (tcph->rst) {		/* RST = Closed */
-      msg = make_message("%sCLOSED", cp);
-   } else {				/* Shouldn't happen */
-      msg = make_message("%sUNKNOWN", cp);
+   memset(&stats, '\0', sizeof(stats));
+   if (eng->pcap_handle && *eng->replay_file == '\0')
+      pcap_stats(eng->pcap_handle, &stats);
+
+   if (eng->progress_flag) {
+      warn_msg("---\tProgress %.0fs: " TCP_UINT64_FORMAT " probes (" 
+               TCP_UINT64_FORMAT " retries), %u responses (%u open, %u "
+               "closed), %.0f probes/sec, %u awaiting reply, %u live, "
+               "%u dropped, ETA %.0fs", elapsed, scan->probes_sent,
+               scan->probes_sent - scan->first_probes, scan->responders,
+               scan->open_count, scan->closed_count, rate, awaiting,
+               scan->live_count, stats.ps_drop, eta);
    }
-   free(cp);
-   if (!quiet_flag) {
-/*
- *	Add DF, TCP Flags, TTL, IPIP, and IP packet length to the message.
- */
-      flags = NULL;
-      if (tcph->cwr) {
-         if (flags) {
-            cp = flags;
-            flags = make_message("%s,CWR", cp);
-            free(cp);
-         } else {
-            flags = make_message("CWR");
-         }
-      }
-      if (tcph->ecn) {
-         if (flags) {
-            cp = flags;
-            flags = make_message("%s,ECN", cp);
-            free(cp);
-         } else {
-            flags = make_message("ECN");
-         }
-      }
-      if (tcph->urg) {
-         if (flags) {
-            cp = flags;
-            flags = make_message("%s,URG", cp);
-            free(cp);
-         } else {
-            flags = make_message("URG");
-         }
-      }
-      if (tcph->ack) {
-         if (flags) {
-            cp = flags;
-            flags = make_message("%s,ACK", cp);
-            free(cp);
-         } else {
-            flags = make_message("ACK");
-         }
-      }
-      if (tcph->psh) {
-         if (flags) {
-            cp = flags;
-            flags = make_message("%s,PSH", cp);
-            free(cp);
-         } else {
-            flags = make_message("PSH");
-         }
-      }
-      if (tcph->rst) {
-         if (flags) {
-            cp = flags;
-            flags = make_message("%s,RST", cp);
-            free(cp);
-         } else {
-            flags = make_message("RST");
-         }
-      }
-      if (tcph->syn) {
-         if (flags) {
-            cp = flags;
-            flags = make_message("%s,SYN", cp);
-            free(cp);
-         } else {
-            flags = make_message("SYN");
-         }
-      }
-      if (tcph->fin) {
-         if (flags) {
-            cp = flags;
-            flags = make_message("%s,FIN", cp);
-            free(cp);
-         } else {
-            flags = make_message("FIN");
-         }
-      }
-      if (!flags)
-         flags=make_message(""); /* Ensure flags not NULL if no TCP flags set */
-      if (ntohs(iph->frag_off) & 0x4000) {	/* If DF flag set */
-         df = "yes";
-      } else {
-         df = "no";
-      }
-      cp = msg;
-      msg=make_message("%s\tDF=%s TOS=%u flags=%s win=%u ttl=%u id=%u ip_len=%d",
-                       cp, df, iph->tos, flags, ntohs(tcph->window), iph->ttl,
-                       ntohs(iph->id), ntohs(iph->tot_len));
-      free(cp);
-      free(flags);
-/*
- *	Determine TCP options.
- */
-      optlen = 4*(tcph->doff) - sizeof(struct tcphdr);
-      if (optlen > 0) {
-         char *options=NULL;
-         int trunc=0;
-         const unsigned char *optptr=(const unsigned char *)
-                                                  (packet_in + ip_offset +
-                                                  4*(iph->ihl) +
-                                                  sizeof(struct tcphdr));
-         const uint16_t *sptr;	/* 16-bit ptr - used for MSS */
-         const uint32_t *lptr1;	/* 32-bit ptr - used for timestamp value */
-         const uint32_t *lptr2;	/* 32-bit ptr - used for timestamp value */
-         unsigned char uc;
-/*
- *	Check if options have been truncated.
- */
-         if (n - ip_offset - sizeof(struct iphdr) - sizeof(struct tcphdr)
-             < (unsigned)optlen) {
-            if (verbose)
-               warn_msg("---\tCaptured packet length %u is too short for calculated TCP options length %d.  Adjusting options length", n, optlen);
-            optlen = n - ip_offset - sizeof(struct iphdr) - sizeof(struct tcphdr);
-            trunc=1;
-         }
-         if (ntohs(iph->tot_len) - sizeof(struct iphdr) - sizeof(struct tcphdr)
-             < (unsigned)optlen) {
-            if (verbose)
-               warn_msg("---\tClaimed IP packet length %d is too short for calculated TCP options length %d.  Adjusting options length", ntohs(iph->tot_len), optlen);
-            optlen = ntohs(iph->tot_len) - sizeof(struct iphdr) -
-                     sizeof(struct tcphdr);
-            trunc=1;
-         }
+   if (*eng->stats_file != '\0') {
+      char *tmp_name = make_message("%s.tmp", eng->stats_file);
+      FILE *fp;
+
+      if ((fp = fopen(tmp_name, "w")) == NULL)
+         err_sys("fopen %s", tmp_name);
+      fprintf(fp, "elapsed_seconds %.3f\n", elapsed);
+      fprintf(fp, "probes_sent " TCP_UINT64_FORMAT "\n", scan->probes_sent);
+      fprintf(fp, "retries " TCP_UINT64_FORMAT "\n",
+              scan->probes_sent - scan->first_probes);
+      fprintf(fp, "responses %u\n", scan->responders);
+      fprintf(fp, "open %u\n", scan->open_count);
+      fprintf(fp, "closed %u\n", scan->closed_count);
+      fprintf(fp, "probes_per_second %.1f\n", rate);
+      fprintf(fp, "awaiting_reply %u\n", awaiting);
+      fprintf(fp, "live %u\n", scan->live_count);
+      fprintf(fp, "entries %u\n", scan->num_hosts);
+      fprintf(fp, "pcap_received %u\n", stats.ps_recv);
+      fprintf(fp, "pcap_dropped %u\n", stats.ps_drop);
+      fprintf(fp, "eta_seconds %.0f\n", eta);
+      fprintf(fp, "finished %d\n", final);
+      if (fclose(fp))
+         err_sys("fclose %s", tmp_name);
+      if (rename(tmp_name, eng->stats_file))
+         err_sys("rename %s", tmp_name);
+      free(tmp_name);
+   }
+}
 
-         while (optlen > 0) {
-            switch (*optptr) {
-               case TCPOPT_EOL:
-                  optlen--;
-                  optptr++;
-                  if (options) {
-                     cp = options;
-                     options = make_message("%s,EOL", cp);
-                     free(cp);
-                  } else {
-                     options = make_message("EOL");
-                  }
-                  break;
-               case TCPOPT_NOP:
-                  optlen--;
-                  optptr++;
-                  if (options) {
-                     cp = options;
-                     options = make_message("%s,NOP", cp);
-                     free(cp);
-                  } else {
-                     options = make_message("NOP");
-                  }
-                  break;
-               case TCPOPT_MAXSEG:
-                  optlen -= 4;
-                  sptr = (const uint16_t *) (optptr+2);
-                  optptr += 4;
-                  if (options) {
-                     cp = options;
-                     options = make_message("%s,MSS=%u", cp, ntohs(*sptr));
-                     free(cp);
-                  } else {
-                     options = make_message("MSS=%u", ntohs(*sptr));
-                  }
-                  break;
-               case TCPOPT_WINDOW:
-                  uc = *(optptr+2);
-                  optlen -= 3;
-                  optptr += 3;
-                  if (options) {
-                     cp = options;
-                     options = make_message("%s,WSCALE=%u", cp, uc);
-                     free(cp);
-                  } else {
-                     options = make_message("WSCALE=%u", uc);
-                  }
-                  break;
-               case TCPOPT_SACK_PERMITTED:
-                  optlen -= 2;
-                  optptr += 2;
-                  if (options) {
-                     cp = options;
-                     options = make_message("%s,SACKOK", cp);
-                     free(cp);
-                  } else {
-                     options = make_message("SACKOK");
-                  }
-                  break;
-               case TCPOPT_TIMESTAMP:
-                  optlen -= 10;
-                  lptr1 = (const uint32_t *) (optptr+2); /* TS Value */
-                  lptr2 = (const uint32_t *) (optptr+6); /* TS Echo Reply */
-                  optptr += 10;
-                  if (options) {
-                     cp = options;
-                     options = make_message("%s,TIMESTAMP=%u,%u", cp,
-                                            ntohl(*lptr1), ntohl(*lptr2));
-                     free(cp);
-                  } else {
-                     options = make_message("TIMESTAMP=%u,%u", ntohl(*lptr1),
-                                            ntohl(*lptr2));
-                  }
-                  break;
-               default:
-                  uc = *optptr;
-                  if (options) {
-                     cp = options;
-                     options = make_message("%s,opt-%u", cp, uc);
-                     free(cp);
-                  } else {
-                     options = make_message("opt-%u", uc);
-                  }
-                  uc = *(optptr+1);
-                  optlen -= uc;
-                  optptr += uc;
-                  break;
-            }
-         }
-         if (!options)
-            options=make_message("");	/* Ensure options not NULL */
-         cp = msg;
-         if (trunc) {
-            msg = make_message("%s <%s,...>", cp, options);
-         } else {
-            msg = make_message("%s <%s>", cp, options);
-         }
-         free(cp);
-         free(options);
-      }
 /*
- *	Determine length of TCP data.  If this is non-zero, then display the
- *	data.
+ *	metrics_format -- Write the --metrics counters
+ *
+ *	Inputs:
+ *
+ *	fp	Where to write the metrics
+ *	arg	The scan context
+ *
+ *	Returns:
+ *
+ *	None.
+ *
+ *	This is called by metrics_handle() when a client asks for the
+ *	metrics.  The listener is served from the main loop of the scan, so
+ *	the counters can be read directly.  The rates are averages since
+ *	the previous request.
  */
-      data_len = ntohs(iph->tot_len) - 4*(iph->ihl) - 4*(tcph->doff);
-      data_offset = ip_offset + 4*(iph->ihl) + 4*(tcph->doff);
-      if (data_len > 0) {
-         char *data_str;
+void
+metrics_format(FILE *fp, void *arg) {
+   tcpscan_ctx *scan = arg;
+   tcpscan_engine *eng = scan->engine;
+   TCP_UINT64 now = engine_time_ns(eng);
+   double since_last;
+   unsigned removed = scan->num_hosts - scan->live_count;
+   struct pcap_stat stats;
+   struct stat out_stat;
+   int backlog;
 
-         cp = msg;
-         if (n >= data_offset + data_len) {
-            data_str=printable(packet_in+data_offset, data_len);
-            msg = make_message("%s data_len=%d data=\"%s\"", cp, data_len,
-                               data_str);
-            free(data_str);
-         } else {
-            msg = make_message("%s data_len=%d data=(packet too short to decode)",
-                               cp, data_len);
-         }
-         free(cp);
-      }
+   if (!eng->metrics_last_ns)
+      eng->metrics_last_ns = eng->scan_start_ns;
+   since_last = (now - eng->metrics_last_ns) / 1000000000.0;
+   metrics_write(fp, "tcp_scan_probes_sent_total", "counter",
+                 "Probes sent, including retries.", scan->probes_sent);
+   metrics_write(fp, "tcp_scan_retries_total", "counter",
+                 "Probes sent to entries that had already been probed.",
+                 scan->probes_sent - scan->first_probes);
+   metrics_write(fp, "tcp_scan_responses_total", "counter",
+                 "Responses displayed.", scan->responders);
+   metrics_write(fp, "tcp_scan_open_total", "counter",
+                 "SYN-ACK responses displayed.", scan->open_count);
+   metrics_write(fp, "tcp_scan_closed_total", "counter",
+                 "RST responses displayed.", scan->closed_count);
+   metrics_write(fp, "tcp_scan_probes_per_second", "gauge",
+                 "Probe rate since the previous request.",
+                 since_last > 0 ? (scan->probes_sent -
+                                   eng->metrics_last_probes) / since_last : 0);
+   metrics_write(fp, "tcp_scan_responses_per_second", "gauge",
+                 "Response rate since the previous request.",
+                 since_last > 0 ? (scan->responders -
+                                   eng->metrics_last_responders) / since_last :
+                 0);
+   metrics_write(fp, "tcp_scan_sendto_errors_total", "counter",
+                 "Probes dropped because the interface queue was full.",
+                 eng->sendto_errors);
+   metrics_write(fp, "tcp_scan_find_host_calls_total", "counter",
+                 "Responses looked up in the host list.",
+                 scan->find_host_calls);
+   metrics_write(fp, "tcp_scan_find_host_iterations_total", "counter",
+                 "Host list entries examined by the lookups.",
+                 scan->find_host_iterations);
+   metrics_write(fp, "tcp_scan_find_host_iterations_max", "gauge",
+                 "Most entries examined by a single lookup.", scan->max_iter);
+   metrics_write(fp, "tcp_scan_sendto_calls_total", "counter",
+                 "Calls to sendto().", eng->sendto_calls);
+   metrics_write(fp, "tcp_scan_select_calls_total", "counter",
+                 "Calls to select() in the main loop.", eng->select_calls);
+   metrics_write(fp, "tcp_scan_select_empty_total", "counter",
+                 "Calls to select() that timed out.", eng->select_empty);
+   metrics_write(fp, "tcp_scan_pcap_dispatch_calls_total", "counter",
+                 "Calls to pcap_dispatch().", eng->dispatch_calls);
+   metrics_write(fp, "tcp_scan_pcap_dispatch_packets_total", "counter",
+                 "Packets processed by pcap_dispatch().",
+                 eng->dispatch_packets);
+   metrics_write(fp, "tcp_scan_errqueue_reads_total", "counter",
+                 "Calls to recvmsg() for transmit timestamps.",
+                 eng->errqueue_reads);
+   metrics_write(fp, "tcp_scan_clock_reads_total", "counter",
+                 "Reads of the system clock.", clock_count());
+   metrics_write(fp, "tcp_scan_entries", "gauge",
+                 "Host and port entries in the scan.", scan->num_hosts);
+   metrics_write(fp, "tcp_scan_live_entries", "gauge",
+                 "Entries that have not responded or timed out.",
+                 scan->live_count);
+   metrics_write(fp, "tcp_scan_awaiting_reply", "gauge",
+                 "Entries that have been probed and are still live.",
+                 scan->first_probes > removed ?
+                 scan->first_probes - removed : 0);
+   if (eng->pcap_handle && pcap_stats(eng->pcap_handle, &stats) == 0) {
+      metrics_write(fp, "tcp_scan_pcap_received_total", "counter",
+                    "Packets received by the pcap filter.", stats.ps_recv);
+      metrics_write(fp, "tcp_scan_pcap_dropped_total", "counter",
+                    "Packets dropped by the kernel.", stats.ps_drop);
+   }
 /*
- *	If the host entry is not live, then flag this as a duplicate.
+ *	The output backlog is the data written to the pipe or socket that
+ *	stdout is connected to and not yet read.  For a pipe this is what
+ *	FIONREAD returns, but on a socket FIONREAD gives the receive queue,
+ *	so we need SIOCOUTQ.  Other types of output have no backlog.  Data
+ *	still in the stdio buffer is not counted.
  */
-      if (!he->live) {
-         cp = msg;
-         msg = make_message("%s (DUP: %u)", cp, he->num_recv);
-         free(cp);
+   backlog = -1;
+   if (fstat(fileno(stdout), &out_stat) == 0) {
+      if (S_ISFIFO(out_stat.st_mode)) {
+         if (ioctl(fileno(stdout), FIONREAD, &backlog) != 0)
+            backlog = -1;
+#ifdef SIOCOUTQ
+      } else if (S_ISSOCK(out_stat.st_mode)) {
+         if (ioctl(fileno(stdout), SIOCOUTQ, &backlog) != 0)
+            backlog = -1;
+#endif
       }
-   }	/* End if (!quiet_flag) */
+   }
+   if (backlog >= 0)
+      metrics_write(fp, "tcp_scan_output_backlog_bytes", "gauge",
+                    "Output not yet read by the consumer of stdout.",
+                    backlog);
+   metrics_write(fp, "tcp_scan_elapsed_seconds", "gauge",
+                 "Time since the scan started.",
+                 (now - eng->scan_start_ns) / 1000000000.0);
+
+   eng->metrics_last_ns = now;
+   eng->metrics_last_probes = scan->probes_sent;
+   eng->metrics_last_responders = scan->responders;
+}
+
 /*
- *	Print the message.
+ *	stage_start and stage_end -- Time a stage for --stagetimes
+ *
+ *	stage_start() returns the time at the start of the stage, and
+ *	stage_end() adds the time since then to the histogram for the stage.
+ *	When the stages are not being timed, they do not read the clock.  We
+ *	use the real clock so that the times are also right with --dryrun.
  */
-   printf("%s\n", msg);
-   free(msg);
+static TCP_UINT64
+stage_start(tcpscan_engine *eng) {
+   return eng->stage_timing ? timestamp_ns() : 0;
+}
+
+static void
+stage_end(tcpscan_engine *eng, unsigned stage, TCP_UINT64 start_ns) {
+   if (eng->stage_timing)
+      hist_add(&eng->stage_hist[stage], timestamp_ns() - start_ns);
 }
 
 /*
- *	send_packet -- Construct and send a packet to the specified host
+ *	print_stage_times -- Display the --stagetimes histograms
  *
  *	Inputs:
  *
- *	s		IP socket file descriptor
- *	he		Host entry to send to. If NULL, then no packet is sent
- *	ip_protocol	IP Protocol to use
- *	last_packet_time	Time when last packet was sent
+ *	scan	The scan context
+ *	fp	Where to write the percentiles, normally stderr
  *
- *      Returns:
+ *	Returns:
  *
- *      The size of the packet that was sent.
+ *	None.
  *
- *      This constructs an appropriate packet and sends it to the host
- *      identified by "he" using the socket "s".
- *      It also updates the "last_send_time" field for this host entry.
+ *	The times are in microseconds.  The histograms are not reset, so
+ *	each display covers the scan so far.
  */
-int
-send_packet(int s, host_entry *he, int ip_protocol,
-            struct timeval *last_packet_time) {
-   struct sockaddr_in sa_peer;
-   char buf[MAXIP];
-   int buflen;
-   NET_SIZE_T sa_peer_len;
-   struct iphdr *iph = (struct iphdr *) buf;
-   struct tcphdr *tcph = (struct tcphdr *) (buf + sizeof(struct iphdr));
-   /* Position pseudo header just before the TCP header */
-   pseudo_hdr *pseudo = (pseudo_hdr *) (buf + sizeof(struct iphdr)
-   - sizeof(pseudo_hdr));
-   unsigned char *options = (unsigned char *) (buf + sizeof(struct iphdr) +
-                                              sizeof(struct tcphdr));
-   unsigned char *optptr;
-   size_t options_len=0;
+void
+print_stage_times(tcpscan_ctx *scan, FILE *fp) {
+   tcpscan_engine *eng = scan->engine;
+   unsigned i;
+
+   fflush(stdout);
+   fprintf(fp, "--- Stage times after " TCP_UINT64_FORMAT " probes:\n",
+           scan->probes_sent);
+   for (i=0; i<STAGE_COUNT; i++)
+      hist_print(fp, &eng->stage_hist[i], stage_names[i], 1000.0, "us", 0);
+   fflush(fp);
+}
+
 /*
- *	Determine length of TCP options.
- *	We do this early because we need it for the packet length.
+ *	print_syscall_stats -- Display the system calls and wakeups per probe
+ *
+ *	Inputs:
+ *
+ *	scan		The scan context
+ *
+ *	Returns:
+ *
+ *	None.
+ *
+ *	This is displayed at the end of the scan with --verbose.  The
+ *	counts are of the calls that tcp-scan makes in the main loop, so
+ *	they do not include the write() calls made by stdio for the output,
+ *	or the system calls that libpcap makes inside pcap_dispatch(), which
+ *	is one read for a normal capture or none for a memory-mapped ring
+ *	that select() has found ready.  A wakeup is a select() call that
+ *	returned because a socket was readable rather than a timeout.
  */
-   if (mss) {
-      options_len += 4;
+void
+print_syscall_stats(tcpscan_ctx *scan) {
+   tcpscan_engine *eng = scan->engine;
+   double per_probe = scan->probes_sent ? 1.0 / scan->probes_sent : 0.0;
+   TCP_UINT64 wakeups = eng->select_calls - eng->select_empty;
+
+   warn_msg("---\tPer probe: %.3f sendto(), %.3f select(), %.3f wakeups, "
+            "%.3f empty select(), %.3f pcap_dispatch(), %.3f TX timestamp "
+            "recvmsg(), %.3f clock reads", eng->sendto_calls * per_probe,
+            eng->select_calls * per_probe, wakeups * per_probe,
+            eng->select_empty * per_probe, eng->dispatch_calls * per_probe,
+            eng->errqueue_reads * per_probe, clock_count() * per_probe);
+   warn_msg("---\tPackets per pcap_dispatch(): %.2f, per wakeup: %.2f",
+            eng->dispatch_calls ?
+            (double) eng->dispatch_packets / eng->dispatch_calls : 0.0,
+            wakeups ? (double) eng->dispatch_packets / wakeups : 0.0);
+}
+
+/*
+ *	stage_signal -- SIGUSR1 handler for --stagetimes
+ *
+ *	This only sets a flag.  The main loop displays the stage times the
+ *	next time round, which is immediately because the signal interrupts
+ *	select().
+ */
+void
+stage_signal(int signo ATTRIBUTE_UNUSED) {
+   stage_dump = 1;
+}
+
+/*
+ *	checkpoint_signal -- Signal handler for SIGINT, SIGTERM and SIGHUP
+ *
+ *	Inputs:
+ *
+ *	signo	The signal number (unused)
+ *
+ *	Returns:
+ *
+ *	None.
+ *
+ *	This is installed with --checkpoint.  The main loop writes the
+ *	checkpoint and exits when it sees the flag.
+ */
+void
+checkpoint_signal(int signo ATTRIBUTE_UNUSED) {
+   interrupted = 1;
+}
+
+/*
+ *	list_hash -- Hash the addresses and ports of the host list
+ *
+ *	Inputs:
+ *
+ *	scan		The scan context
+ *
+ *	Returns:
+ *
+ *	The FNV-1a hash of the entries in scan order, so that a checkpoint
+ *	can only be applied to the list that it was written for.
+ */
+uint32_t
+list_hash(tcpscan_ctx *scan) {
+   tcpscan_engine *eng = scan->engine;
+   uint32_t hash = 2166136261U;
+   const unsigned char *p;
+   size_t len;
+   size_t j;
+   unsigned i;
+
+   for (i=0; i<scan->num_hosts; i++) {
+      if (eng->ipv6_flag) {
+         p = (const unsigned char *) &scan->helistptr[i]->addr.v6;
+         len = sizeof(scan->helistptr[i]->addr.v6);
+      } else {
+         p = (const unsigned char *) &scan->helistptr[i]->addr.v4;
+         len = sizeof(scan->helistptr[i]->addr.v4);
+      }
+      for (j=0; j<len; j++)
+         hash = (hash ^ p[j]) * 16777619U;
+      hash = (hash ^ (scan->helistptr[i]->dport & 0xff)) * 16777619U;
+      hash = (hash ^ (scan->helistptr[i]->dport >> 8)) * 16777619U;
    }
-   if (timestamp_flag) {
-      options_len += 12;
-   } else if (sack_flag) {
-      options_len += 4;
+   return hash;
+}
+
+/*
+ *	write_checkpoint -- Save the scan state in the --checkpoint file
+ *
+ *	Inputs:
+ *
+ *	scan		The scan context
+ *
+ *	Returns:
+ *
+ *	None.
+ *
+ *	The first pass sends to the entries in helistptr order, so the
+ *	entries before position first_pass have all been sent to and the
+ *	rest have not.  This is not the same as first_probes, which counts
+ *	first probes and is lowered by --resume for the entries whose first
+ *	probe is sent again.  Of the ones that have, we only need to record those
+ *	still awaiting a reply, with the number of probes sent to each, so
+ *	the file stays small however large the list is.  The random seed
+ *	and the counters are also saved.  The file is written to a
+ *	temporary name, synced and renamed, so a crash while writing it
+ *	leaves the previous checkpoint intact.
+ */
+void
+write_checkpoint(tcpscan_ctx *scan) {
+   tcpscan_engine *eng = scan->engine;
+   char *tmp_name = make_message("%s.tmp", eng->checkpoint_file);
+   FILE *fp;
+   unsigned i;
+
+   if ((fp = fopen(tmp_name, "w")) == NULL)
+      err_sys("fopen %s", tmp_name);
+   fprintf(fp, "tcp-scan-checkpoint %d\n", CHECKPOINT_VERSION);
+   fprintf(fp, "entries %u\n", scan->num_hosts);
+   fprintf(fp, "list_hash %08x\n", list_hash(scan));
+   fprintf(fp, "seed %lu\n", eng->random_seed);
+   fprintf(fp, "cursor %u\n", (unsigned) (scan->cursor - scan->helistptr));
+   fprintf(fp, "first_probes %u\n", scan->first_probes);
+   fprintf(fp, "first_pass %u\n", scan->first_pass);
+   fprintf(fp, "responses %u\n", scan->responders);
+   fprintf(fp, "open %u\n", scan->open_count);
+   fprintf(fp, "closed %u\n", scan->closed_count);
+   fprintf(fp, "probes_sent " TCP_UINT64_FORMAT "\n", scan->probes_sent);
+   for (i=0; i<scan->first_pass; i++)
+      if (scan->helistptr[i]->live)
+         fprintf(fp, "pending %u %u\n", i, scan->helistptr[i]->num_sent);
+   if (fflush(fp) || fsync(fileno(fp)))
+      err_sys("write %s", tmp_name);
+   if (fclose(fp))
+      err_sys("fclose %s", tmp_name);
+   if (rename(tmp_name, eng->checkpoint_file))
+      err_sys("rename %s", tmp_name);
+   free(tmp_name);
+}
+
+/*
+ *	read_checkpoint -- Read the --checkpoint file for --resume
+ *
+ *	Inputs:
+ *
+ *	eng		The scan engine
+ *
+ *	Returns:
+ *
+ *	None.  The state is stored in resume for initialise() and
+ *	apply_checkpoint().  Errors are fatal.
+ */
+void
+read_checkpoint(tcpscan_engine *eng) {
+   FILE *fp;
+   char line[MAXLINE];
+   char name[32];
+   unsigned long value;
+   unsigned pos;
+   unsigned sent;
+   unsigned size = 0;
+   int version;
+
+   if ((fp = fopen(eng->checkpoint_file, "r")) == NULL)
+      err_sys("fopen %s", eng->checkpoint_file);
+   if (!fgets(line, sizeof(line), fp) ||
+       sscanf(line, "tcp-scan-checkpoint %d", &version) != 1 ||
+       version != CHECKPOINT_VERSION)
+      err_msg("%s is not a tcp-scan checkpoint file.", eng->checkpoint_file);
+   memset(&eng->resume, '\0', sizeof(eng->resume));
+   while (fgets(line, sizeof(line), fp)) {
+      if (sscanf(line, "pending %u %u", &pos, &sent) == 2) {
+         if (eng->resume.num_pending == size) {
+            size = size ? size * 2 : 1024;
+            eng->resume.pending = Realloc(eng->resume.pending,
+                                          2 * size * sizeof(unsigned));
+         }
+         eng->resume.pending[2 * eng->resume.num_pending] = pos;
+         eng->resume.pending[2 * eng->resume.num_pending + 1] = sent;
+         eng->resume.num_pending++;
+      } else if (sscanf(line, "list_hash %lx", &value) == 1) {
+         eng->resume.list_hash = value;
+      } else if (sscanf(line, "%31s %lu", name, &value) == 2) {
+         if (strcmp(name, "entries") == 0)
+            eng->resume.entries = value;
+         else if (strcmp(name, "seed") == 0)
+            eng->resume.seed = value;
+         else if (strcmp(name, "cursor") == 0)
+            eng->resume.cursor = value;
+         else if (strcmp(name, "first_probes") == 0)
+            eng->resume.first_probes = value;
+         else if (strcmp(name, "first_pass") == 0)
+            eng->resume.first_pass = value;
+         else if (strcmp(name, "responses") == 0)
+            eng->resume.responders = value;
+         else if (strcmp(name, "open") == 0)
+            eng->resume.open_count = value;
+         else if (strcmp(name, "closed") == 0)
+            eng->resume.closed_count = value;
+         else if (strcmp(name, "probes_sent") == 0)
+            eng->resume.probes_sent = value;
+      }
    }
-   if (wscale_flag) {
-      options_len += 4;
+   fclose(fp);
+/*
+ *	Checkpoints written before first_pass was recorded are only valid
+ *	if the scan had not been resumed, when it equals first_probes.
+ */
+   if (!eng->resume.first_pass)
+      eng->resume.first_pass = eng->resume.first_probes;
+}
+
+/*
+ *	apply_checkpoint -- Restore the state read by read_checkpoint()
+ *
+ *	Inputs:
+ *
+ *	scan		The scan context
+ *
+ *	Returns:
+ *
+ *	None.
+ *
+ *	This is called once the host list has been built and put in scan
+ *	order.  Entries that had finished are removed from the list, and
+ *	entries that were awaiting a reply are sent their last probe again,
+ *	because the reply to it can no longer be received.  An entry may be
+ *	pending with no probes sent if it was resumed and then interrupted
+ *	again before its first probe was sent again.
+ */
+void
+apply_checkpoint(tcpscan_ctx *scan) {
+   tcpscan_engine *eng = scan->engine;
+   host_entry *he;
+   unsigned i;
+   unsigned k;
+
+   if (eng->resume.entries != scan->num_hosts ||
+       eng->resume.list_hash != list_hash(scan))
+      err_msg("The checkpoint %s is for a different list of hosts and "
+              "ports.", eng->checkpoint_file);
+   if (eng->resume.first_pass > scan->num_hosts ||
+       eng->resume.first_probes > eng->resume.first_pass ||
+       eng->resume.cursor >= scan->num_hosts)
+      err_msg("The checkpoint %s is invalid.", eng->checkpoint_file);
+   scan->first_probes = eng->resume.first_probes;
+   scan->first_pass = eng->resume.first_pass;
+   scan->responders = eng->resume.responders;
+   scan->open_count = eng->resume.open_count;
+   scan->closed_count = eng->resume.closed_count;
+   scan->probes_sent = eng->resume.probes_sent;
+   for (i=0; i<scan->first_pass; i++)
+      scan->helistptr[i]->live = 0;
+   scan->live_count = scan->num_hosts - scan->first_pass;
+   for (i=0; i<eng->resume.num_pending; i++) {
+      unsigned sent = eng->resume.pending[2 * i + 1];
+
+      if (eng->resume.pending[2 * i] >= eng->resume.first_pass)
+         err_msg("The checkpoint %s is invalid.", eng->checkpoint_file);
+      he = scan->helistptr[eng->resume.pending[2 * i]];
+      he->live = 1;
+      he->num_sent = sent ? sent - 1 : 0;
+      for (k=2; k<sent; k++)		/* main() applies the last backoff */
+         he->timeout *= scan->backoff_factor;
+      if (sent == 1)
+         scan->first_probes--;
+      scan->live_count++;
    }
+   scan->cursor = scan->helistptr + eng->resume.cursor;
+   if (scan->live_count && !(*scan->cursor)->live)
+      advance_cursor(scan);
+   if (eng->verbose)
+      warn_msg("---\tResuming from %s: %u entries finished, %u awaiting "
+               "reply, %u not yet sent", eng->checkpoint_file,
+               scan->num_hosts - scan->live_count, eng->resume.num_pending,
+               scan->num_hosts - eng->resume.first_pass);
+   free(eng->resume.pending);
+}
+
 /*
- *	If he is NULL, just return with the packet length.
+ *	set_virtual_clock, engine_gettimeofday and engine_time_ns -- The
+ *	clock of an engine
+ *
+ *	Once set_virtual_clock() has been called, engine_gettimeofday() and
+ *	engine_time_ns() return the simulated time instead of the system
+ *	time, which only changes when set_virtual_clock() is called again.
+ *	Each engine has its own clock, so a --dryrun scan does not move the
+ *	time of scans on other engines.
  */
-   if (he == NULL)
-      return sizeof(struct iphdr) + sizeof(struct tcphdr) + options_len;
+void
+set_virtual_clock(tcpscan_engine *eng, TCP_UINT64 now_ns) {
+   eng->virtual_clock = 1;
+   eng->virtual_now_ns = now_ns;
+}
+
+void
+engine_gettimeofday(const tcpscan_engine *eng, struct timeval *tv) {
+   if (eng->virtual_clock) {
+      tv->tv_sec = eng->virtual_now_ns / 1000000000;
+      tv->tv_usec = (eng->virtual_now_ns % 1000000000) / 1000;
+   } else {
+      Gettimeofday(tv);
+   }
+}
+
+TCP_UINT64
+engine_time_ns(const tcpscan_engine *eng) {
+   return eng->virtual_clock ? eng->virtual_now_ns : timestamp_ns();
+}
+
 /*
- *	Check that the host is live.  Complain if not.
+ *	parse_dryrun_model -- Parse the --dryrun network model
+ *
+ *	Inputs:
+ *
+ *	eng	The scan engine
+ *	model	Comma-separated list of <name>=<value> settings
+ *
+ *	Returns:
+ *
+ *	None.
+ *
+ *	The settings are loss, open, silent and up, which are fractions from
+ *	0 to 1, rtt and jitter, which are times in ms, and interrupt, which
+ *	is the number of probes after which tcp-scan sends itself SIGINT.
  */
-   if (!he->live) {
-      warn_msg("***\tsend_packet called on non-live host entry: SHOULDN'T HAPPEN");
-      return 0;
+void
+parse_dryrun_model(tcpscan_engine *eng, const char *model) {
+   char *copy = dupstr(model);
+   char *item;
+   char *saveptr;
+
+   for (item = strtok_r(copy, ",", &saveptr); item != NULL;
+        item = strtok_r(NULL, ",", &saveptr)) {
+      char *value = strchr(item, '=');
+      char *end;
+      double v;
+
+      if (value == NULL)
+         err_msg("Invalid --dryrun setting \"%s\"", item);
+      *value++ = '\0';
+      v = strtod(value, &end);
+      if (*end != '\0' || end == value || v < 0)
+         err_msg("Invalid --dryrun value \"%s\"", value);
+      if (strcmp(item, "loss") == 0 && v <= 1)
+         eng->dryrun_loss = v;
+      else if (strcmp(item, "open") == 0 && v <= 1)
+         eng->dryrun_open = v;
+      else if (strcmp(item, "silent") == 0 && v <= 1)
+         eng->dryrun_silent = v;
+      else if (strcmp(item, "up") == 0 && v <= 1)
+         eng->dryrun_up = v;
+      else if (strcmp(item, "rtt") == 0)
+         eng->dryrun_rtt = (unsigned) (v * 1000);
+      else if (strcmp(item, "jitter") == 0)
+         eng->dryrun_jitter = (unsigned) (v * 1000);
+      else if (strcmp(item, "interrupt") == 0)
+         eng->dryrun_interrupt = (TCP_UINT64) v;
+      else
+         err_msg("Invalid --dryrun setting \"%s=%s\"", item, value);
    }
+   free(copy);
+}
+
 /*
- *	Set up the sockaddr_in structure for the host.
+ *	dryrun_hash -- Hash a key to a value from 0 to 1
  */
-   memset(&sa_peer, '\0', sizeof(sa_peer));
-   sa_peer.sin_family = AF_INET;
-   sa_peer.sin_addr.s_addr = he->addr.v4.s_addr;
-   sa_peer_len = sizeof(sa_peer);
+static double
+dryrun_hash(TCP_UINT64 x) {
+   x ^= x >> 33;
+   x *= 0xff51afd7ed558ccdULL;
+   x ^= x >> 33;
+   x *= 0xc4ceb9fe1a85ec53ULL;
+   x ^= x >> 33;
+   return (x >> 11) * (1.0 / 9007199254740992.0);	/* 53 bits */
+}
+
 /*
- *	Update the last send times for this host.
- *	We do this here because we can also use this value for the TCP
- *	timestamp option.
+ *	dryrun_port_class -- Return how a simulated port responds
+ *
+ *	Inputs:
+ *
+ *	he	The host entry
+ *
+ *	Returns:
+ *
+ *	A value from 0 to 1 derived from the address and port, so that each
+ *	port behaves the same way on every probe.  Ports with values below
+ *	dryrun_silent never respond.  A fraction dryrun_open of the rest
+ *	are open, and the others are closed.
  */
-   Gettimeofday(last_packet_time);
-   he->last_send_time.tv_sec  = last_packet_time->tv_sec;
-   he->last_send_time.tv_usec = last_packet_time->tv_usec;
-   he->num_sent++;
+static double
+dryrun_port_class(const host_entry *he) {
+   return dryrun_hash((TCP_UINT64) ntohl(he->addr.v4.s_addr) << 16 |
+                      he->dport);
+}
+
+/*
+ *	dryrun_host_up -- Return whether a simulated host is up
+ *
+ *	Inputs:
+ *
+ *	eng	The scan engine
+ *	he	The host entry
+ *
+ *	Returns:
+ *
+ *	Non-zero for a fraction dryrun_up of the addresses.  Hosts that are
+ *	down never respond.
+ */
+static int
+dryrun_host_up(tcpscan_engine *eng, const host_entry *he) {
+   return eng->dryrun_up >= 1 ||
+          dryrun_hash((TCP_UINT64) 1 << 48 | ntohl(he->addr.v4.s_addr)) <
+          eng->dryrun_up;
+}
+
+/*
+ *	dryrun_send -- Simulate sending a probe
+ *
+ *	Inputs:
+ *
+ *	scan	The scan context
+ *	he	The host entry that the probe is sent to
+ *
+ *	Returns:
+ *
+ *	None.
+ *
+ *	Unless the host is down, the port is silent or the probe is lost,
+ *	this queues a response to arrive after the round trip time.  A
+ *	--discover ICMP echo request to a host that is up gets a reply.  The
+ *	queue is a binary heap ordered by arrival time, because the jitter
+ *	means that responses can arrive in a different order to the probes.
+ */
+void
+dryrun_send(tcpscan_ctx *scan, host_entry *he) {
+   tcpscan_engine *eng = scan->engine;
+   double class = dryrun_port_class(he);
+   dryrun_event ev;
+   unsigned i;
+
+   eng->dryrun_probes++;
+   if (eng->dryrun_probes == eng->dryrun_interrupt)
+      raise(SIGINT);		/* Simulate ^C for testing --checkpoint */
+   if (!dryrun_host_up(eng, he) || (he->dport && class < eng->dryrun_silent) ||
+       (eng->dryrun_loss > 0 &&
+        genrand_res53_r(&eng->rng) < eng->dryrun_loss)) {
+      eng->dryrun_lost++;
+      return;
+   }
+   ev.due_ns = engine_time_ns(eng) + (TCP_UINT64) 1000 * (eng->dryrun_rtt +
+               (eng->dryrun_jitter ?
+                genrand_int32_r(&eng->rng) % eng->dryrun_jitter : 0));
+   ev.addr = he->addr.v4.s_addr;
+   ev.dport = he->dport;
+   ev.sport = scan->sport;
+   ev.open = class < eng->dryrun_silent +
+                     eng->dryrun_open * (1 - eng->dryrun_silent);
+
+   if (eng->dryrun_queue_len == eng->dryrun_queue_size) {
+      eng->dryrun_queue_size = eng->dryrun_queue_size ?
+                               2 * eng->dryrun_queue_size : 1024;
+      eng->dryrun_queue = Realloc(eng->dryrun_queue,
+                                  eng->dryrun_queue_size *
+                                  sizeof(dryrun_event));
+   }
+   for (i = eng->dryrun_queue_len++; i > 0; i = (i - 1) / 2) {	/* Sift up */
+      if (eng->dryrun_queue[(i - 1) / 2].due_ns <= ev.due_ns)
+         break;
+      eng->dryrun_queue[i] = eng->dryrun_queue[(i - 1) / 2];
+   }
+   eng->dryrun_queue[i] = ev;
+}
+
+/*
+ *	dryrun_pop -- Remove the earliest response from the --dryrun queue
+ */
+static dryrun_event
+dryrun_pop(tcpscan_engine *eng) {
+   dryrun_event first = eng->dryrun_queue[0];
+   dryrun_event last = eng->dryrun_queue[--eng->dryrun_queue_len];
+   unsigned i = 0;
+   unsigned child;
+
+   while ((child = 2 * i + 1) < eng->dryrun_queue_len) {	/* Sift down */
+      if (child + 1 < eng->dryrun_queue_len &&
+          eng->dryrun_queue[child + 1].due_ns < eng->dryrun_queue[child].due_ns)
+         child++;
+      if (last.due_ns <= eng->dryrun_queue[child].due_ns)
+         break;
+      eng->dryrun_queue[i] = eng->dryrun_queue[child];
+      i = child;
+   }
+   eng->dryrun_queue[i] = last;
+   return first;
+}
+
+/*
+ *	dryrun_wait -- Simulate waiting for responses
+ *
+ *	Inputs:
+ *
+ *	scan	The scan context
+ *	tmo	Select timeout in us
+ *
+ *	Returns:
+ *
+ *	None.
+ *
+ *	This is the --dryrun equivalent of recvfrom_wto().  If a response is
+ *	due within tmo, the virtual clock is advanced to its arrival time and
+ *	it is passed to callback() along with any others due at the same
+ *	time.  Otherwise the clock is advanced by tmo.
+ */
+void
+dryrun_wait(tcpscan_ctx *scan, int tmo) {
+   tcpscan_engine *eng = scan->engine;
+   TCP_UINT64 now = engine_time_ns(eng);
+   TCP_UINT64 deadline = now + (tmo > 0 ? (TCP_UINT64) tmo * 1000 : 0);
+   unsigned char packet[sizeof(struct iphdr) + sizeof(struct tcphdr)];
+   struct iphdr *iph = (struct iphdr *) packet;
+   struct tcphdr *tcph = (struct tcphdr *) (packet + sizeof(struct iphdr));
+   struct pcap_pkthdr header;
+
+   if (!eng->dryrun_queue_len || eng->dryrun_queue[0].due_ns > deadline) {
+      set_virtual_clock(eng, deadline);
+      return;
+   }
+   if (eng->dryrun_queue[0].due_ns > now) {
+      now = eng->dryrun_queue[0].due_ns;
+      set_virtual_clock(eng, now);
+   }
+   header.ts.tv_sec = now / 1000000000;
+   header.ts.tv_usec = now % 1000000000;	/* pcap_tstamp_nano is set */
+   while (eng->dryrun_queue_len && eng->dryrun_queue[0].due_ns <= now) {
+      dryrun_event ev = dryrun_pop(eng);
+
+      memset(packet, '\0', sizeof(packet));
+      iph->ihl = 5;
+      iph->version = 4;
+      iph->ttl = DEFAULT_TTL;
+      iph->saddr = ev.addr;
+      iph->daddr = eng->source_address;
+      if (ev.dport == 0) {	/* ICMP echo reply */
+         unsigned char *icmp = packet + sizeof(struct iphdr);
+         uint16_t check;
+
+         header.caplen = header.len = sizeof(struct iphdr) + ICMP_ECHO_LEN;
+         iph->tot_len = htons(header.len);
+         iph->protocol = IPPROTO_ICMP;
+         icmp[0] = ICMP_ECHO_REPLY;
+         icmp[4] = ev.sport >> 8;
+         icmp[5] = ev.sport & 0xff;
+         check = in_cksum((uint16_t *) icmp, ICMP_ECHO_LEN);
+         memcpy(icmp + 2, &check, sizeof(check));
+         eng->dryrun_responses++;
+         callback((u_char *) scan, &header, packet);
+         continue;
+      }
+      header.caplen = header.len = sizeof(packet);
+      iph->tot_len = htons(sizeof(packet));
+      iph->protocol = IP_PROTOCOL;
+      tcph->source = htons(ev.dport);
+      tcph->dest = htons(ev.sport);
+      tcph->ack_seq = htonl(eng->seq_no + 1);
+      tcph->doff = sizeof(struct tcphdr) / 4;
+      tcph->ack = 1;
+      if (ev.open) {
+         tcph->syn = 1;
+         tcph->seq = htonl(genrand_int32_r(&eng->rng));
+         tcph->window = htons(DEFAULT_WINDOW);
+      } else {
+         tcph->rst = 1;
+      }
+      eng->dryrun_responses++;
+      callback((u_char *) scan, &header, packet);
+   }
+}
+
+/*
+ *	dryrun_report -- Display the --dryrun statistics
+ *
+ *	Inputs:
+ *
+ *	scan		The scan context
+ *	setup_ns	Real time taken before the main loop, mostly to build
+ *			the host list
+ *	start_ns	Real time that the main loop started
+ *
+ *	Returns:
+ *
+ *	None.
+ *
+ *	As well as the simulated network statistics, this reports the
+ *	memory high-water mark and the find_host() iteration counts, so
+ *	that the scheduler can be tested with very large host lists.
+ */
+void
+dryrun_report(tcpscan_ctx *scan, TCP_UINT64 setup_ns, TCP_UINT64 start_ns) {
+   tcpscan_engine *eng = scan->engine;
+   TCP_UINT64 real_ns = timestamp_ns() - start_ns;
+#ifdef HAVE_SYS_RESOURCE_H
+   struct rusage usage;
+#endif
+
+   warn_msg("---\tDry run: " TCP_UINT64_FORMAT " probes, " TCP_UINT64_FORMAT
+            " without response, " TCP_UINT64_FORMAT " responses delivered, "
+            "%u still in flight", eng->dryrun_probes, eng->dryrun_lost,
+            eng->dryrun_responses, eng->dryrun_queue_len);
+   warn_msg("---\tReal time %.3f ms: %.0f ns per probe, %.0f probes/sec",
+            real_ns / 1000000.0,
+            eng->dryrun_probes ? (double) real_ns / eng->dryrun_probes : 0.0,
+            real_ns ? eng->dryrun_probes / (real_ns / 1000000000.0) : 0.0);
+   warn_msg("---\tSetup %.3f ms for %u entries, find_host() iterations: "
+            "mean %.1f, max %u", setup_ns / 1000000.0, scan->num_hosts,
+            scan->find_host_calls ?
+            (double) scan->find_host_iterations / scan->find_host_calls : 0.0,
+            scan->max_iter);
+#ifdef HAVE_SYS_RESOURCE_H
+   if (getrusage(RUSAGE_SELF, &usage) == 0) {	/* ru_maxrss is in KB */
+      if (scan->num_hosts)
+         warn_msg("---\tMax RSS %ld KB, %.1f bytes per entry",
+                  usage.ru_maxrss, usage.ru_maxrss * 1024.0 / scan->num_hosts);
+      else			/* E.g. an empty --workers share */
+         warn_msg("---\tMax RSS %ld KB", usage.ru_maxrss);
+   }
+#endif
+   free(eng->dryrun_queue);
+   eng->dryrun_queue = NULL;
+   eng->dryrun_queue_len = 0;
+   eng->dryrun_queue_size = 0;
+}
+
+/*
+ *	display_packet -- Check and display received packet
+ *
+ *	Inputs:
+ *
+ *	scan		The scan context
+ *	n		The length of the received packet in bytes.
+ *			Note that this can be more or less than the IP packet
+ *			size because of minimum frame sizes or snaplength
+ *			cutoff respectively.
+ *	packet_in	The received packet
+ *	he		The host entry corresponding to the received packet
+ *	recv_addr	IP address that the packet was received from
+ *	rtt_ns		Round trip time in ns, or 0 if not known
+ *
+ *      Returns:
+ *
+ *      None.
+ *
+ *      This checks the received packet and displays details of what
+ *      was received in the format: <IP-Address><TAB><Details>.
+ */
+void
+display_packet(tcpscan_ctx *scan, unsigned n, const unsigned char *packet_in,
+               const host_entry *he, const struct in_addr *recv_addr,
+               TCP_UINT64 rtt_ns) {
+   tcpscan_engine *eng = scan->engine;
+   const struct iphdr *iph;
+   const struct tcphdr *tcph;
+   char *msg;
+   char *cp;
+   char *flags;
+   int data_len;
+   unsigned data_offset;
+   const char *df;
+   int optlen;
+   tcp_options opts;
+   TCP_UINT64 start_ns = stage_start(eng);
+/*
+ *	Set msg to the IP address of the host entry, plus the address of the
+ *	responder if different, and a tab.
+ */
+   msg = make_message("%s\t", my_ntoa(he->addr,eng->ipv6_flag));
+   if ((he->addr).v4.s_addr != recv_addr->s_addr) {	/* XXXX */
+      cp = msg;
+      msg = make_message("%s(%s) ", cp, inet_ntoa(*recv_addr));
+      free(cp);
+   }
+/*
+ *	Check that the packet is large enough to decode.
+ *	This should never happen because the packet length should have
+ *	already been checked in callback().
+ */
+   if (n < eng->ip_offset + sizeof(struct iphdr) + sizeof(struct tcphdr)) {
+      fprintf(scan->out, "%s%u byte packet too short to decode\n", msg, n);
+      free(msg);
+      return;
+   }
+/*
+ *      Overlay IP and TCP headers on packet buffer.
+ *      ip_offset is size of layer-2 header.
+ *      Note that iph.ihl is in 32-bit units.  We multiply by 4 to get bytes.
+ *      iph.lhl is normally 5, but can be larger if IP options are present.
+ */
+   iph = (const struct iphdr *) (packet_in + eng->ip_offset);
+   tcph = (const struct tcphdr *) (packet_in + eng->ip_offset + 4*(iph->ihl));
+/*
+ *	Add TCP port to message.
+ */
+   cp = msg;
+   if (scan->portname_flag) {
+      const char *portname = service_db_lookup(eng->services,
+                                               ntohs(tcph->source));
+      msg = make_message("%s%u (%s)\t", cp, ntohs(tcph->source),
+                         portname?portname:"unknown");
+   } else {
+      msg = make_message("%s%u\t", cp, ntohs(tcph->source));
+   }
+   free(cp);
+/*
+ *	Determine type of response: SYN-ACK, RST or something else and
+ *	add to message.
+ */
+   cp = msg;
+   if (tcph->syn && tcph->ack) {	/* SYN + ACK = Open */
+      msg = make_message("%sOPEN", cp);
+   } else if (tcph->rst) {		/* RST = Closed */
+      msg = make_message("%sCLOSED", cp);
+   } else {				/* Shouldn't happen */
+      msg = make_message("%sUNKNOWN", cp);
+   }
+   free(cp);
+   if (!scan->quiet_flag) {
+/*
+ *	Add DF, TCP Flags, TTL, IPIP, and IP packet length to the message.
+ */
+      flags = NULL;
+      if (tcph->cwr) {
+         if (flags) {
+            cp = flags;
+            flags = make_message("%s,CWR", cp);
+            free(cp);
+         } else {
+            flags = make_message("CWR");
+         }
+      }
+      if (tcph->ecn) {
+         if (flags) {
+            cp = flags;
+            flags = make_message("%s,ECN", cp);
+            free(cp);
+         } else {
+            flags = make_message("ECN");
+         }
+      }
+      if (tcph->urg) {
+         if (flags) {
+            cp = flags;
+            flags = make_message("%s,URG", cp);
+            free(cp);
+         } else {
+            flags = make_message("URG");
+         }
+      }
+      if (tcph->ack) {
+         if (flags) {
+            cp = flags;
+            flags = make_message("%s,ACK", cp);
+            free(cp);
+         } else {
+            flags = make_message("ACK");
+         }
+      }
+      if (tcph->psh) {
+         if (flags) {
+            cp = flags;
+            flags = make_message("%s,PSH", cp);
+            free(cp);
+         } else {
+            flags = make_message("PSH");
+         }
+      }
+      if (tcph->rst) {
+         if (flags) {
+            cp = flags;
+            flags = make_message("%s,RST", cp);
+            free(cp);
+         } else {
+            flags = make_message("RST");
+         }
+      }
+      if (tcph->syn) {
+         if (flags) {
+            cp = flags;
+            flags = make_message("%s,SYN", cp);
+            free(cp);
+         } else {
+            flags = make_message("SYN");
+         }
+      }
+      if (tcph->fin) {
+         if (flags) {
+            cp = flags;
+            flags = make_message("%s,FIN", cp);
+            free(cp);
+         } else {
+            flags = make_message("FIN");
+         }
+      }
+      if (!flags)
+         flags=make_message(""); /* Ensure flags not NULL if no TCP flags set */
+      if (ntohs(iph->frag_off) & 0x4000) {	/* If DF flag set */
+         df = "yes";
+      } else {
+         df = "no";
+      }
+      cp = msg;
+      msg=make_message("%s\tDF=%s TOS=%u flags=%s win=%u ttl=%u id=%u ip_len=%d",
+                       cp, df, iph->tos, flags, ntohs(tcph->window), iph->ttl,
+                       ntohs(iph->id), ntohs(iph->tot_len));
+      free(cp);
+      free(flags);
+/*
+ *	Determine TCP options.  The option length is limited to the amount
+ *	of data that was captured and the length claimed in the IP header.
+ */
+      optlen = 4*(tcph->doff) - sizeof(struct tcphdr);
+      opts.count = 0;
+      opts.flags = 0;
+      if (optlen > 0) {
+         char options[TCPOPT_STRLEN];
+         int trunc=0;
+         unsigned tcp_offset = eng->ip_offset + 4*(iph->ihl) +
+                               sizeof(struct tcphdr);
+         int avail;
+/*
+ *	Check if options have been truncated.
+ */
+         avail = (int) n - (int) tcp_offset;
+         if (avail < optlen) {
+            if (eng->verbose)
+               warn_msg("---\tCaptured packet length %u is too short for calculated TCP options length %d.  Adjusting options length", n, optlen);
+            optlen = avail;
+            trunc=1;
+         }
+         avail = ntohs(iph->tot_len) - 4*(iph->ihl) - (int) sizeof(struct tcphdr);
+         if (avail < optlen) {
+            if (eng->verbose)
+               warn_msg("---\tClaimed IP packet length %d is too short for calculated TCP options length %d.  Adjusting options length", ntohs(iph->tot_len), optlen);
+            optlen = avail;
+            trunc=1;
+         }
+         if (optlen > 0)
+            tcpopt_decode(packet_in + tcp_offset, optlen, &opts);
+         tcpopt_format(&opts, options, sizeof(options));
+         if (opts.flags & TCPOPT_F_TRUNCATED)
+            trunc=1;
+         cp = msg;
+         if (trunc) {
+            msg = make_message("%s <%s,...>", cp, options);
+         } else {
+            msg = make_message("%s <%s>", cp, options);
+         }
+         free(cp);
+      }
+/*
+ *	Add the TCP stack fingerprint if required.
+ */
+      if (eng->fingerprint_flag) {
+         TCP_UINT64 fp = tcpopt_fingerprint(&opts, ntohs(tcph->window),
+                                            iph->ttl);
+         cp = msg;
+         msg = make_message("%s fp=%.8lx%.8lx", cp,
+                            (unsigned long) (fp >> 32),
+                            (unsigned long) (fp & 0xffffffff));
+         free(cp);
+      }
+/*
+ *	Determine length of TCP data.  If this is non-zero, then display the
+ *	data.
+ */
+      data_len = ntohs(iph->tot_len) - 4*(iph->ihl) - 4*(tcph->doff);
+      data_offset = eng->ip_offset + 4*(iph->ihl) + 4*(tcph->doff);
+      if (data_len > 0) {
+         char *data_str;
+
+         cp = msg;
+         if (n >= data_offset + data_len) {
+            data_str=printable(packet_in+data_offset, data_len);
+            msg = make_message("%s data_len=%d data=\"%s\"", cp, data_len,
+                               data_str);
+            free(data_str);
+         } else {
+            msg = make_message("%s data_len=%d data=(packet too short to decode)",
+                               cp, data_len);
+         }
+         free(cp);
+      }
+/*
+ *	If the host entry is not live, then flag this as a duplicate.
+ */
+      if (!he->live) {
+         cp = msg;
+         msg = make_message("%s (DUP: %u)", cp, he->num_recv);
+         free(cp);
+      }
+   }	/* End if (!quiet_flag) */
+/*
+ *	Add the state in the --previous results.
+ */
+   if (*eng->previous_file != '\0') {
+      cp = msg;
+      msg = make_message("%s was=%s", cp, prev_names[he->prev]);
+      free(cp);
+   }
+/*
+ *	Add the round trip time if required.
+ */
+   if (scan->rtt_flag && rtt_ns) {
+      cp = msg;
+      msg = make_message("%s rtt=%.3fms", cp, rtt_ns / 1000000.0);
+      free(cp);
+   }
+/*
+ *	Print the message.  The write stage is usually a copy into the stdio
+ *	buffer, but includes the write() system call when the buffer fills.
+ */
+   stage_end(eng, STAGE_FORMAT, start_ns);
+   start_ns = stage_start(eng);
+   fprintf(scan->out, "%s\n", msg);
+   stage_end(eng, STAGE_WRITE, start_ns);
+   free(msg);
+}
+
+/*
+ *	deliver_reply -- Give a received packet to the library callback
+ *
+ *	Inputs:
+ *
+ *	scan		The scan context
+ *	he		The host entry corresponding to the received packet
+ *	recv_addr	IP address that the packet was received from
+ *	ip_packet	The IP packet, after the layer-2 header
+ *	len		The captured length of the IP packet
+ *	rtt_ns		Round trip time in ns, or 0 if not known
+ *
+ *	Returns:
+ *
+ *	None.
+ *
+ *	This is the tcpscan_set_callback() replacement for display_packet().
+ *	The reply points into the capture buffer, so nothing is copied.
+ */
+void
+deliver_reply(tcpscan_ctx *scan, const host_entry *he,
+              const struct in_addr *recv_addr, const unsigned char *ip_packet,
+              size_t len, TCP_UINT64 rtt_ns) {
+   const struct iphdr *iph = (const struct iphdr *) ip_packet;
+   const struct tcphdr *tcph =
+      (const struct tcphdr *) (ip_packet + 4*(iph->ihl));
+   tcpscan_reply r;
+
+   memset(&r, '\0', sizeof(r));
+   r.addr = he->addr.v4;
+   r.responder = *recv_addr;
+   r.port = he->dport;
+   if (iph->protocol == IP_PROTOCOL) {	/* Not a --discover echo reply */
+      r.open = tcph->syn && tcph->ack;
+      r.tcp_flags = ((const unsigned char *) tcph)[13];
+      r.window = ntohs(tcph->window);
+   }
+   r.ttl = iph->ttl;
+   r.attempt = he->num_sent;
+   r.duplicate = !he->live;
+   r.rtt_ns = rtt_ns;
+   r.packet = ip_packet;
+   r.packet_len = len;
+   scan->replies_delivered++;
+   scan->reply_fn(scan->reply_arg, &r);
+}
+
+/*
+ *	send_packet -- Construct and send a packet to the specified host
+ *
+ *	Inputs:
+ *
+ *	scan		The scan context
+ *	s		IP socket file descriptor
+ *	he		Host entry to send to. If NULL, then no packet is sent
+ *	ip_protocol	IP Protocol to use
+ *	last_packet_time	Time when last packet was sent
+ *
+ *      Returns:
+ *
+ *      The size of the packet that was sent.
+ *
+ *      This constructs an appropriate packet and sends it to the host
+ *      identified by "he" using the socket "s".
+ *      It also updates the "last_send_time" field for this host entry.
+ */
+int
+send_packet(tcpscan_ctx *scan, int s, host_entry *he, int ip_protocol,
+            struct timeval *last_packet_time) {
+   tcpscan_engine *eng = scan->engine;
+   struct sockaddr_in sa_peer;
+   char buf[MAXIP];
+   int buflen;
+   NET_SIZE_T sa_peer_len;
+   struct iphdr *iph = (struct iphdr *) buf;
+   struct tcphdr *tcph = (struct tcphdr *) (buf + sizeof(struct iphdr));
+   /* Position pseudo header just before the TCP header */
+   pseudo_hdr *pseudo = (pseudo_hdr *) (buf + sizeof(struct iphdr)
+   - sizeof(pseudo_hdr));
+   unsigned char *options = (unsigned char *) (buf + sizeof(struct iphdr) +
+                                              sizeof(struct tcphdr));
+   unsigned char *optptr;
+   size_t options_len=0;
+   TCP_UINT64 start_ns;
+/*
+ *	Determine length of TCP options.
+ *	We do this early because we need it for the packet length.
+ */
+   if (eng->mss) {
+      options_len += 4;
+   }
+   if (eng->timestamp_flag) {
+      options_len += 12;
+   } else if (eng->sack_flag) {
+      options_len += 4;
+   }
+   if (eng->wscale_flag) {
+      options_len += 4;
+   }
+/*
+ *	If he is NULL, just return with the packet length.
+ */
+   if (he == NULL)
+      return sizeof(struct iphdr) + sizeof(struct tcphdr) + options_len;
+/*
+ *	Check that the host is live.  Complain if not.
+ */
+   if (!he->live) {
+      warn_msg("***\tsend_packet called on non-live host entry: SHOULDN'T HAPPEN");
+      return 0;
+   }
+/*
+ *	Set up the sockaddr_in structure for the host.
+ */
+   memset(&sa_peer, '\0', sizeof(sa_peer));
+   sa_peer.sin_family = AF_INET;
+   sa_peer.sin_addr.s_addr = he->addr.v4.s_addr;
+   sa_peer_len = sizeof(sa_peer);
+/*
+ *	Update the last send times for this host.
+ *	We do this here because we can also use this value for the TCP
+ *	timestamp option.
+ */
+   engine_gettimeofday(eng, last_packet_time);
+   he->last_send_time.tv_sec  = last_packet_time->tv_sec;
+   he->last_send_time.tv_usec = last_packet_time->tv_usec;
+   he->num_sent++;
+   scan->probes_sent++;
+   if (he->num_sent == 1 && ++scan->first_probes == scan->num_hosts)
+      scan->first_pass_end = *last_packet_time;
+/*
+ *	Construct the pseudo header (for TCP checksum purposes).
+ *	Note that this overlaps the IP header and gets overwritten later.
+ */
+   memset(pseudo, '\0', sizeof(pseudo_hdr));
+   pseudo->s_addr = eng->source_address;
+   pseudo->d_addr = he->addr.v4.s_addr;
+   pseudo->proto  = ip_protocol;
+   pseudo->len    = htons(sizeof(struct tcphdr) + options_len);
+/*
+ *	Add TCP options.  We do this before the TCP header because the
+ *	options must be covered by the TCP checksum calculation.
+ *
+ *	We put the options in the same order, and with the same padding,
+ *	as Linux 2.4.24.
+ */
+   optptr = options;
+   if (eng->mss) {
+      *optptr++ = 2;		/* Kind=2 (MSS) */
+      *optptr++ = 4;		/* Len=4 Bytes */
+      *optptr++ = eng->mss / 256;	/* MSS high byte */
+      *optptr++ = eng->mss % 256;	/* MSS low byte */
+   }
+   if (eng->timestamp_flag) {
+      uint32_t tsval=htonl(last_packet_time->tv_sec);
+      if (eng->sack_flag) {
+         *optptr++ = 4;		/* Kind=4 (SACKOK) */
+         *optptr++ = 2;		/* Len=2 bytes */
+      } else {
+         *optptr++ = 1;		/* Kind=1 (NOP) - pad */
+         *optptr++ = 1;		/* Kind=1 (NOP) - pad */
+      }
+      *optptr++ = 8;		/* Kind=8 (TIMESTAMP) */
+      *optptr++ = 10;		/* Len=10 bytes */
+      memcpy(optptr, &tsval, sizeof(tsval));	/* TS Value */
+      optptr += sizeof(tsval);
+      *optptr++ = 0;		/* TS Echo Reply */
+      *optptr++ = 0;
+      *optptr++ = 0;
+      *optptr++ = 0;
+   } else if (eng->sack_flag) {
+      *optptr++ = 1;		/* Kind=1 (NOP) - pad */
+      *optptr++ = 1;		/* Kind=1 (NOP) - pad */
+      *optptr++ = 4;		/* Kind=4 (SACKOK) */
+      *optptr++ = 2;		/* Len=2 bytes */
+   }
+   if (eng->wscale_flag) {
+      *optptr++ = 1;		/* Kind=1 (NOP) - pad */
+      *optptr++ = 3;		/* Kind=3 (WSCALE) */
+      *optptr++ = 3;		/* Len=3 bytes */
+      *optptr++ = 0;		/* Value=0 */
+   }
+/*
+ *	Construct the TCP header.
+ */
+   memset(tcph, '\0', sizeof(struct tcphdr));
+   tcph->source = htons(scan->sport);
+   tcph->dest = htons(he->dport);
+   tcph->seq = htonl(eng->seq_no);
+   tcph->doff = (sizeof(struct tcphdr) + options_len) / 4;
+   if (eng->tcp_flags_flag) {	/* Set specified TCP flags */
+      if (eng->tcp_flags.cwr)
+         tcph->cwr = 1;
+      if (eng->tcp_flags.ecn)
+         tcph->ecn = 1;
+      if (eng->tcp_flags.urg)
+         tcph->urg = 1;
+      if (eng->tcp_flags.ack) {
+         tcph->ack = 1;
+         tcph->ack_seq = htonl(eng->ack_no);
+      }
+      if (eng->tcp_flags.psh)
+         tcph->psh = 1;
+      if (eng->tcp_flags.rst)
+         tcph->rst = 1;
+      if (eng->tcp_flags.syn)
+         tcph->syn = 1;
+      if (eng->tcp_flags.fin)
+         tcph->fin = 1;
+   } else {			/* Default: Set SYN flag */
+      tcph->syn = 1;
+   }
+   tcph->window = htons(eng->window);
+   tcph->check = in_cksum((uint16_t *)pseudo, sizeof(pseudo_hdr) +
+                 sizeof(struct tcphdr) + options_len);
+/*
+ *	Construct the IP Header.
+ *	This overwrites the now unneeded pseudo header.
+ */
+   memset(iph, '\0', sizeof(struct iphdr));
+   iph->ihl = 5;	/* 5 * 32-bit longwords = 20 bytes */
+   iph->version = 4;
+   iph->tos = eng->ip_tos;
+   iph->tot_len = sizeof(struct iphdr) + sizeof(struct tcphdr);
+   iph->id = 0;		/* Linux kernel fills this in */
+   if (eng->df_flag)
+      iph->frag_off = htons(0x4000);
+   else
+      iph->frag_off = htons(0x0);
+   iph->ttl = eng->ip_ttl;
+   iph->protocol = ip_protocol;
+   iph->check = 0;	/* Linux kernel fills this in */
+   iph->saddr = eng->source_address;
+   iph->daddr = he->addr.v4.s_addr;
+/*
+ *	Copy the required data into the output buffer "buf" and set "buflen"
+ *	to the number of bytes in this buffer.
+ */
+   buflen=sizeof(struct iphdr) + sizeof(struct tcphdr) + options_len;
+/*
+ *	A --discover entry for port 0 is sent an ICMP echo request instead.
+ */
+   if (he->dport == 0)
+      buflen = make_echo_request(scan, buf, he);
+/*
+ *	Send the packet.
+ */
+   if (eng->debug) {print_times(); printf("send_packet: #%u to host entry %u (%s) tmo %d\n", he->num_sent, he->n, my_ntoa(he->addr,eng->ipv6_flag), he->timeout);}
+   if (eng->verbose > 1)
+      warn_msg("---\tSending packet #%u to host entry %u (%s) tmo %d", he->num_sent, he->n, my_ntoa(he->addr,eng->ipv6_flag), he->timeout);
+   he->send_ns = engine_time_ns(eng);
+   TCP_SCAN_PROBE5(send, he->addr.v4.s_addr, he->dport, he->num_sent,
+                   he->send_ns, he->timeout);
+   start_ns = stage_start(eng);
+   if (eng->dryrun_flag) {
+      dryrun_send(scan, he);
+   } else {
+      eng->sendto_calls++;
+      if ((sendto(s, buf, buflen, 0, (struct sockaddr *) &sa_peer, sa_peer_len)) < 0) {
+/*
+ *	If the interface queue is full, count the probe as sent and let
+ *	the normal retry logic resend it.
+ */
+         if (errno != ENOBUFS && errno != EAGAIN)
+            err_sys("sendto");
+         eng->sendto_errors++;
+      }
+   }
+   stage_end(eng, STAGE_SEND, start_ns);
+/*
+ *	If kernel transmit timestamps are enabled, remember which host this
+ *	probe was sent to so that the timestamp can replace the user space
+ *	send time above.  The timestamp is normally queued by the time
+ *	sendto() returns, so collect it now.
+ */
+   if (s >= 0 && s == eng->tx_sock) {
+      unsigned slot = eng->tx_key % TX_RING_SIZE;
+
+      eng->tx_ring[slot].he = he;
+      eng->tx_ring[slot].key = eng->tx_key;
+      eng->tx_ring[slot].num_sent = he->num_sent;
+      eng->tx_key++;
+      read_tx_timestamps(eng, s);
+   }
+/*
+ *	Save the probe to the pcapng savefile if required.  The kernel
+ *	fills in the IP length and checksum for raw sockets, so we do the
+ *	same for the saved copy.
+ */
+   if (eng->pcapng_handle && eng->pcap_sent_flag) {
+      iph->tot_len = htons(buflen);
+      iph->check = in_cksum((uint16_t *)iph, sizeof(struct iphdr));
+      pcapng_write(eng->pcapng_handle, eng->pcapng_sent_if, engine_time_ns(eng),
+                   (unsigned char *)buf, buflen, buflen, PCAPNG_OUTBOUND);
+   }
+   return buflen;
+}
+
+/*
+ *	make_echo_request -- Replace a TCP probe with an ICMP echo request
+ *
+ *	Inputs:
+ *
+ *	scan		The scan context
+ *	buf		The packet built by send_packet()
+ *	he		Host entry that it is sent to
+ *
+ *	Returns:
+ *
+ *	The length of the packet.
+ *
+ *	The identifier is the source port, so that the capture filter and
+ *	echo_reply() can tell our replies from those to other programs.
+ */
+int
+make_echo_request(tcpscan_ctx *scan, char *buf, const host_entry *he) {
+   struct iphdr *iph = (struct iphdr *) buf;
+   unsigned char *icmp = (unsigned char *) (buf + sizeof(struct iphdr));
+   uint16_t check;
+
+   memset(icmp, '\0', ICMP_ECHO_LEN);
+   icmp[0] = ICMP_ECHO_REQUEST;
+   icmp[4] = scan->sport >> 8;		/* Identifier */
+   icmp[5] = scan->sport & 0xff;
+   icmp[6] = he->num_sent >> 8;		/* Sequence number */
+   icmp[7] = he->num_sent & 0xff;
+   check = in_cksum((uint16_t *) icmp, ICMP_ECHO_LEN);
+   memcpy(icmp + 2, &check, sizeof(check));
+   iph->protocol = IPPROTO_ICMP;
+   iph->tot_len = sizeof(struct iphdr) + ICMP_ECHO_LEN;
+   return sizeof(struct iphdr) + ICMP_ECHO_LEN;
+}
+
+/*
+ *      initialise -- initialisation routine.
+ *
+ *      Inputs:
+ *
+ *      eng     The scan engine
+ *
+ *      Returns:
+ *
+ *      None.
+ *
+ *      This is called once before any packets have been sent.  It can be
+ *      used to perform any required initialisation.  It does not have to
+ *      do anything.
+ */
+void
+initialise(tcpscan_engine *eng) {
+   struct timeval tv;
+/*
+ *	Seed PRNG.  A resumed scan uses the seed of the original, so that
+ *	--random gives the same order.
+ */
+   if (eng->resume_flag) {
+      eng->random_seed = eng->resume.seed;
+   } else if (eng->seed_flag) {
+      eng->random_seed = eng->seed;
+   } else {
+      engine_gettimeofday(eng, &tv);
+      eng->random_seed = tv.tv_usec ^ getpid();	/* Unpredictable value */
+   }
+   init_genrand_r(&eng->rng, eng->random_seed);
+/*
+ *	Set the sequence number, ack number and source port using random
+ *	values if they have not been set with command line options.
+ *	We set the top bit of source port to make sure that it's
+ *	above 32768 and therefore out of the way of reserved ports
+ *	(1-1024).
+ */
+   if (!eng->seq_no_flag)
+      eng->seq_no = genrand_int32_r(&eng->rng);
+   if (!eng->ack_no_flag)
+      eng->ack_no = genrand_int32_r(&eng->rng);
+   if (!eng->source_port_flag) {
+      eng->source_port = genrand_int32_r(&eng->rng) & 0x0000ffff;
+      eng->source_port |= 0x8000;
+      if (eng->daemon_jobs && eng->source_port + eng->daemon_jobs - 1 > 65535)
+         eng->source_port -= eng->daemon_jobs - 1;
+   } else if (eng->daemon_jobs &&
+              eng->source_port + eng->daemon_jobs - 1 > 65535) {
+      err_msg("The --sport value is too high for %u --jobs.", eng->daemon_jobs);
+   }
+   eng->cli_scan.sport = eng->source_port;
+/*
+ *	Open the packet source: either the network interface, or the
+ *	savefile given with --replay.
+ */
+   if (*eng->replay_file != '\0')
+      open_replay(eng);
+   else if (eng->dryrun_flag)
+      open_dryrun(eng);
+   else
+      open_capture(eng);
+/*
+ *	Start the metrics listener.  We do this before dropping privileges
+ *	in case it uses a reserved port.
+ */
+   if (*eng->metrics_spec != '\0')
+      eng->metrics = metrics_open(eng->metrics_spec);
+/*
+ *	If we are displaying portnames, then load the service database.
+ *	By default we use the compiled database installed with tcp-scan,
+ *	falling back to the text services file if it is not present.
+ */
+   if (eng->cli_scan.portname_flag) {
+      char *fn;
+
+      if (*eng->service_file == '\0') {	/* If service file not specified */
+         fn = make_message("%s/%s", DATADIR, SERVICE_DB_FILE);
+         if ((eng->services = service_db_load(fn)) == NULL) {
+            free(fn);
+            fn = make_message("%s/%s", DATADIR, SERVICE_FILE);
+            eng->services = service_db_load(fn);
+         }
+      } else {
+         fn = make_message("%s", eng->service_file);
+         eng->services = service_db_load(fn);
+      }
+      if (eng->services == NULL)
+         err_sys("Cannot open services file");
+      if (eng->verbose) {
+         warn_msg("--- %u services loaded from %s",
+                  service_db_count(eng->services), fn);
+      }
+      free(fn);
+   }
+}
+
+/*
+ *	open_capture -- Open the network interface for packet capture
+ *
+ *	Inputs:
+ *
+ *	eng		The scan engine
+ *
+ *	Returns:
+ *
+ *	None.
+ *
+ *	This determines the interface and source address to use, opens the
+ *	interface with pcap and sets the filter that selects the responses
+ *	to our probes.
+ */
+void
+open_capture(tcpscan_engine *eng) {
+   char errbuf[PCAP_ERRBUF_SIZE];
+   struct bpf_program filter;
+   char *filter_string;
+   char *port_filter;
+   bpf_u_int32 netmask;
+   bpf_u_int32 localnet;
+   int datalink;
+/*
+ *      Determine network interface to use and associated IP address.
+ *      If the interface was specified with the --interface option then use
+ *      that, otherwise use pcap_lookupdev() to pick a suitable interface.
+ */
+   if (!eng->if_name) { /* i/f not specified with --interface */
+      char *dev;
+
+      if (!(dev=pcap_lookupdev(errbuf))) {
+         err_msg("pcap_lookupdev: %s", errbuf);
+      }
+      eng->if_name = dupstr(dev);
+   }
+   eng->source_address = get_source_ip(eng->if_name);
+/*
+ *	Prepare pcap
+ */
+#ifdef HAVE_PCAP_SET_TSTAMP_PRECISION
+/*
+ *	Use pcap_create() and pcap_activate() rather than pcap_open_live()
+ *	so that we can ask for nanosecond timestamps.  We don't treat
+ *	failure to set the precision as an error: we just get microsecond
+ *	timestamps instead.
+ */
+   if (!(eng->pcap_handle=pcap_create(eng->if_name, errbuf)))
+      err_msg("pcap_create: %s\n", errbuf);
+   if ((pcap_set_snaplen(eng->pcap_handle, eng->snaplen)) < 0)
+      err_msg("pcap_set_snaplen: %s\n", pcap_geterr(eng->pcap_handle));
+   if ((pcap_set_promisc(eng->pcap_handle, PROMISC)) < 0)
+      err_msg("pcap_set_promisc: %s\n", pcap_geterr(eng->pcap_handle));
+   if ((pcap_set_timeout(eng->pcap_handle, TO_MS)) < 0)
+      err_msg("pcap_set_timeout: %s\n", pcap_geterr(eng->pcap_handle));
+   pcap_set_tstamp_precision(eng->pcap_handle, PCAP_TSTAMP_PRECISION_NANO);
+   if ((pcap_activate(eng->pcap_handle)) < 0)
+      err_msg("pcap_activate: %s\n", pcap_geterr(eng->pcap_handle));
+   eng->pcap_tstamp_nano = (pcap_get_tstamp_precision(eng->pcap_handle) ==
+                            PCAP_TSTAMP_PRECISION_NANO);
+#else
+   if (!(eng->pcap_handle=pcap_open_live(eng->if_name, eng->snaplen, PROMISC,
+                                         TO_MS, errbuf)))
+      err_msg("pcap_open_live: %s\n", errbuf);
+#endif
+   if ((datalink=pcap_datalink(eng->pcap_handle)) < 0)
+      err_msg("pcap_datalink: %s\n", pcap_geterr(eng->pcap_handle));
+   printf("Interface: %s, datalink type: %s (%s)\n", eng->if_name,
+          pcap_datalink_val_to_name(datalink),
+          pcap_datalink_val_to_description(datalink));
+   set_datalink(eng, datalink);
+   if ((eng->pcap_fd=pcap_get_selectable_fd(eng->pcap_handle)) < 0)
+      err_msg("pcap_fileno: %s\n", pcap_geterr(eng->pcap_handle));
+   if ((pcap_setnonblock(eng->pcap_handle, 1, errbuf)) < 0)
+      err_msg("pcap_setnonblock: %s\n", errbuf);
+   if (pcap_lookupnet(eng->if_name, &localnet, &netmask, errbuf) < 0)
+      err_msg("pcap_lookupnet: %s\n", errbuf);
+/*
+ *	The --daemon runs each job with its own source port, so it captures
+ *	the replies to all of them.
+ */
+   if (eng->daemon_jobs > 1)
+      port_filter=make_message("portrange %u-%u", eng->source_port,
+                               eng->source_port + eng->daemon_jobs - 1);
+   else
+      port_filter=make_message("port %u", eng->source_port);
+   if (eng->tcp_flags_flag && eng->tcp_flags.ack) {
+      filter_string=make_message("tcp dst %s and tcp[4:4] = %u",
+                                 port_filter, eng->ack_no);
+   } else {
+      filter_string=make_message("tcp dst %s and tcp[8:4] = %u",
+                                 port_filter, eng->seq_no+1);
+   }
+   free(port_filter);
+/*
+ *	The --discover ICMP echo requests have the source port as their ID.
+ */
+   if (eng->discover_icmp) {
+      char *tcp_filter = filter_string;
+
+      filter_string=make_message("(%s) or (icmp[icmptype] = icmp-echoreply "
+                                 "and icmp[4:2] = %u)", tcp_filter,
+                                 eng->source_port);
+      free(tcp_filter);
+   }
+   if ((pcap_compile(eng->pcap_handle, &filter, filter_string, OPTIMISE,
+                     netmask)) < 0)
+      err_msg("pcap_geterr: %s\n", pcap_geterr(eng->pcap_handle));
+   free(filter_string);
+   if ((pcap_setfilter(eng->pcap_handle, &filter)) < 0)
+      err_msg("pcap_setfilter: %s\n", pcap_geterr(eng->pcap_handle));
+}
+
+/*
+ *	open_replay -- Open the savefile given with --replay
+ *
+ *	Inputs:
+ *
+ *	eng		The scan engine
+ *
+ *	Returns:
+ *
+ *	None.
+ *
+ *	This opens the savefile with pcap_open_offline() in place of the
+ *	network interface.  No filter is set, because the savefile was
+ *	normally written by tcp-scan and only contains responses.
+ */
+void
+open_replay(tcpscan_engine *eng) {
+   char errbuf[PCAP_ERRBUF_SIZE];
+   int datalink;
+
+#ifdef HAVE_PCAP_SET_TSTAMP_PRECISION
+   if (!(eng->pcap_handle=pcap_open_offline_with_tstamp_precision(
+                                 eng->replay_file, PCAP_TSTAMP_PRECISION_NANO,
+                                 errbuf)))
+      err_msg("pcap_open_offline: %s\n", errbuf);
+   eng->pcap_tstamp_nano = (pcap_get_tstamp_precision(eng->pcap_handle) ==
+                            PCAP_TSTAMP_PRECISION_NANO);
+#else
+   if (!(eng->pcap_handle=pcap_open_offline(eng->replay_file, errbuf)))
+      err_msg("pcap_open_offline: %s\n", errbuf);
+#endif
+   if ((datalink=pcap_datalink(eng->pcap_handle)) < 0)
+      err_msg("pcap_datalink: %s\n", pcap_geterr(eng->pcap_handle));
+   printf("Replay file: %s, datalink type: %s (%s)\n", eng->replay_file,
+          pcap_datalink_val_to_name(datalink),
+          pcap_datalink_val_to_description(datalink));
+   set_datalink(eng, datalink);
+}
+
+/*
+ *	open_dryrun -- Set up the simulated network for --dryrun
+ *
+ *	Inputs:
+ *
+ *	eng		The scan engine
+ *
+ *	Returns:
+ *
+ *	None.
+ *
+ *	The simulated responses are raw IP packets from the target to
+ *	DRYRUN_SOURCE, with nanosecond timestamps from the virtual clock.
+ */
+void
+open_dryrun(tcpscan_engine *eng) {
+   if (!eng->if_name)
+      eng->if_name = dupstr("dryrun");
+   eng->source_address = htonl(DRYRUN_SOURCE);
+   eng->pcap_tstamp_nano = 1;
+   set_datalink(eng, DLT_RAW);
+   if (eng->worker_no <= 1)		/* Once for all the --workers */
+      printf("Dry run: loss %.3f, open %.3f, silent %.3f, up %.3f, "
+             "rtt %u us, jitter %u us\n", eng->dryrun_loss, eng->dryrun_open,
+             eng->dryrun_silent, eng->dryrun_up, eng->dryrun_rtt,
+             eng->dryrun_jitter);
+}
+
+/*
+ *	set_datalink -- Set the offset of the IP header for a datalink type
+ *
+ *	Inputs:
+ *
+ *	eng		The scan engine
+ *	datalink	The pcap datalink type of pcap_handle
+ *
+ *	Returns:
+ *
+ *	None.
+ */
+void
+set_datalink(tcpscan_engine *eng, int datalink) {
+   eng->pcap_linktype = datalink;
+   switch (datalink) {
+      case DLT_EN10MB:		/* Ethernet */
+         eng->ip_offset = 14;
+         break;
+      case DLT_LINUX_SLL:	/* PPP on Linux */
+         eng->ip_offset = 16;
+         break;
+      case DLT_RAW:		/* Raw IP, e.g. a TUN interface */
+         eng->ip_offset = 0;
+         eng->pcap_linktype = LINKTYPE_RAW;
+         break;
+      default:
+         err_msg("Unsupported datalink type");
+         break;
+   }
+}
+
+/*
+ *      clean_up -- Clean-Up routine.
+ *
+ *      Inputs:
+ *
+ *      eng     The scan engine
+ *
+ *      Returns:
+ *
+ *      None.
+ *
+ *      This is called once after all hosts have been processed.
+ */
+void
+clean_up(tcpscan_engine *eng) {
+   struct pcap_stat stats;
+
+   if (*eng->replay_file == '\0' && !eng->dryrun_flag) {	/* No stats */
+      if ((pcap_stats(eng->pcap_handle, &stats)) < 0)
+         err_msg("pcap_stats: %s\n", pcap_geterr(eng->pcap_handle));
+
+      printf("%u packets received by filter, %u packets dropped by kernel\n",
+             stats.ps_recv, stats.ps_drop);
+   }
+   if (eng->pcapng_handle)
+      pcapng_close(eng->pcapng_handle, eng->verbose);
+   if (eng->pcap_handle)
+      pcap_close(eng->pcap_handle);
+   if (eng->metrics)
+      metrics_close(eng->metrics);
+}
+
+/*
+ *	open_savefile -- Create the pcapng savefile writer
+ *
+ *	Inputs:
+ *
+ *	scan		The scan context
+ *
+ *	Returns:
+ *
+ *	None.
+ *
+ *	This creates the writer for the --pcapsavefile option, with one
+ *	interface for the received packets and, if --pcapsent was given,
+ *	another for the transmitted probes.  The section comment records
+ *	the command line and the scan parameters, including the random
+ *	values chosen by initialise(), so that the scan can be reproduced.
+ */
+void
+open_savefile(tcpscan_ctx *scan) {
+   tcpscan_engine *eng = scan->engine;
+   char *comment;
+   struct in_addr src;
+
+   src.s_addr = eng->source_address;
+   comment = make_message("Command line: %s\n"
+                          "Interface: %s, source address: %s, "
+                          "source port: %u, seq: %u, ack: %u\n"
+                          "Entries: %u, retry: %u, timeout: %u ms, "
+                          "backoff: %.2f, interval: %u us, bandwidth: %u bps",
+                          eng->command_line, eng->if_name, inet_ntoa(src),
+                          eng->source_port, eng->seq_no, eng->ack_no,
+                          scan->num_hosts, scan->retry, scan->timeout,
+                          scan->backoff_factor, scan->interval,
+                          scan->bandwidth);
+   eng->pcapng_handle = pcapng_open(eng->pcap_savefile, comment,
+                                    eng->pcap_rotate_size,
+                                    eng->pcap_rotate_secs);
+   free(comment);
+   eng->pcapng_recv_if = pcapng_add_interface(eng->pcapng_handle,
+                                              eng->pcap_linktype,
+                                              eng->snaplen, eng->if_name);
+   if (eng->pcap_sent_flag)
+      eng->pcapng_sent_if = pcapng_add_interface(eng->pcapng_handle,
+                                                 LINKTYPE_RAW, MAXIP,
+                                                 eng->if_name);
+}
+
+/*
+ *	pkthdr_ns -- Return the timestamp of a captured packet in nanoseconds
+ *
+ *	Inputs:
+ *
+ *	eng		The scan engine
+ *	header		pcap header structure
+ *
+ *	Returns:
+ *
+ *	The capture time in nanoseconds since the epoch.
+ *
+ *	The tv_usec field holds nanoseconds rather than microseconds if
+ *	initialise() was able to set nanosecond timestamp precision.
+ */
+TCP_UINT64
+pkthdr_ns(tcpscan_engine *eng, const struct pcap_pkthdr *header) {
+   TCP_UINT64 ns = (TCP_UINT64)header->ts.tv_sec * 1000000000;
+
+   if (eng->pcap_tstamp_nano)
+      return ns + header->ts.tv_usec;
+   else
+      return ns + (TCP_UINT64)header->ts.tv_usec * 1000;
+}
+
+/*
+ *	enable_tx_timestamps -- Request kernel transmit timestamps
+ *
+ *	Inputs:
+ *
+ *	eng	The scan engine
+ *	s	The raw IP socket used to send the probes
+ *
+ *	Returns:
+ *
+ *	None.
+ *
+ *	This asks the kernel to report a software timestamp on the socket
+ *	error queue when each probe is passed to the network device, which
+ *	is closer to the real send time than the user space time taken just
+ *	before sendto().  Each timestamp carries a counter that identifies
+ *	the probe (SOF_TIMESTAMPING_OPT_ID), and does not include a copy of
+ *	the packet (SOF_TIMESTAMPING_OPT_TSONLY).
+ *
+ *	If the kernel does not support this, we quietly use the user space
+ *	send times.
+ */
+void
+enable_tx_timestamps(tcpscan_engine *eng, int s) {
+#ifdef HAVE_TX_TIMESTAMPS
+   int flags = SOF_TIMESTAMPING_TX_SOFTWARE | SOF_TIMESTAMPING_SOFTWARE |
+               SOF_TIMESTAMPING_OPT_ID | SOF_TIMESTAMPING_OPT_TSONLY;
+
+   if ((setsockopt(s, SOL_SOCKET, SO_TIMESTAMPING, &flags,
+                   sizeof(flags))) != 0) {
+      if (eng->verbose)
+         warn_sys("---\tCannot enable kernel transmit timestamps");
+      return;
+   }
+   eng->tx_sock = s;
+   eng->tx_key = 0;
+#else
+   if (eng->verbose)
+      warn_msg("---\tKernel transmit timestamps are not supported on this system");
+#endif
+}
+
+/*
+ *	read_tx_timestamps -- Collect kernel transmit timestamps
+ *
+ *	Inputs:
+ *
+ *	eng	The scan engine
+ *	s	The socket that kernel transmit timestamps were enabled on
+ *
+ *	Returns:
+ *
+ *	None.
+ *
+ *	This reads all of the transmit timestamps on the socket error queue
+ *	without blocking, and stores each one as the send time of the host
+ *	that the probe was sent to.  Timestamps are ignored if the probe is
+ *	no longer in tx_ring, or if the host has been sent another probe
+ *	since.
+ */
+void
+read_tx_timestamps(tcpscan_engine *eng, int s) {
+#ifdef HAVE_TX_TIMESTAMPS
+   char control[256];
+   struct msghdr msg;
+   struct cmsghdr *cmsg;
+
+   for (;;) {
+      TCP_UINT64 ts_ns = 0;
+      const struct sock_extended_err *serr = NULL;
+      unsigned slot;
+
+      memset(&msg, '\0', sizeof(msg));
+      msg.msg_control = control;
+      msg.msg_controllen = sizeof(control);
+      eng->errqueue_reads++;
+      if (recvmsg(s, &msg, MSG_ERRQUEUE | MSG_DONTWAIT) < 0)
+         break;		/* Queue empty */
+
+      for (cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+         if (cmsg->cmsg_level == SOL_SOCKET &&
+             cmsg->cmsg_type == SCM_TIMESTAMPING) {
+            struct scm_timestamping tss;
+
+            memcpy(&tss, CMSG_DATA(cmsg), sizeof(tss));
+            ts_ns = (TCP_UINT64)tss.ts[0].tv_sec * 1000000000 +
+                    tss.ts[0].tv_nsec;
+         } else if (cmsg->cmsg_level == SOL_IP &&
+                    cmsg->cmsg_type == IP_RECVERR) {
+            serr = (const struct sock_extended_err *) CMSG_DATA(cmsg);
+            if (serr->ee_errno != ENOMSG ||
+                serr->ee_origin != SO_EE_ORIGIN_TIMESTAMPING)
+               serr = NULL;
+         }
+      }
+      if (!ts_ns || !serr)
+         continue;
+
+      slot = serr->ee_data % TX_RING_SIZE;
+      if (eng->tx_ring[slot].he && eng->tx_ring[slot].key == serr->ee_data &&
+          eng->tx_ring[slot].he->num_sent == eng->tx_ring[slot].num_sent) {
+         eng->tx_ring[slot].he->send_ns = ts_ns;
+         eng->tx_stamped++;
+      }
+      eng->tx_ring[slot].he = NULL;
+   }
+#else
+   (void) s;
+#endif
+}
+
+/*
+ *	update_rtt -- Update the smoothed RTT estimate
+ *
+ *	Inputs:
+ *
+ *	scan	The scan context
+ *	rtt_ns	Measured round trip time in ns
+ *
+ *	Returns:
+ *
+ *	None.
+ *
+ *	This uses the same calculation as TCP (RFC 6298), with the
+ *	smoothed RTT and RTT variation in microseconds.
+ */
+void
+update_rtt(tcpscan_ctx *scan, TCP_UINT64 rtt_ns) {
+   double r = rtt_ns / 1000.0;
+
+   if (!scan->rtt_samples) {
+      scan->srtt = r;
+      scan->rttvar = r / 2;
+   } else {
+      double delta = scan->srtt > r ? scan->srtt - r : r - scan->srtt;
+
+      scan->rttvar = 0.75 * scan->rttvar + 0.25 * delta;
+      scan->srtt = 0.875 * scan->srtt + 0.125 * r;
+   }
+   scan->rtt_samples++;
+}
+
+/*
+ *	auto_timeout -- Calculate the initial host timeout from the RTT
+ *
+ *	Inputs:
+ *
+ *	scan		The scan context
+ *
+ *	Returns:
+ *
+ *	The timeout in microseconds: srtt + 4 * rttvar, but no less than
+ *	AUTOTIMEOUT_MIN ms and no more than the --timeout value.
+ */
+unsigned
+auto_timeout(tcpscan_ctx *scan) {
+   double rto = scan->srtt + 4 * scan->rttvar;
+
+   if (rto < AUTOTIMEOUT_MIN * 1000.0)
+      rto = AUTOTIMEOUT_MIN * 1000.0;
+   if (rto > scan->timeout * 1000.0)
+      rto = scan->timeout * 1000.0;
+   return (unsigned) rto;
+}
+
+/*
+ *	usage -- display usage message and exit
+ *
+ *	Inputs:
+ *
+ *	scan		The scan context
+ *	status		Status value to pass to exit()
+ *	detailed	zero for brief output, non-zero for detailed output
+ *
+ *	Returns:
+ *
+ *	None (this function never returns).  It ends the process, or with
+ *	an error the --daemon job or library call that error_jump is set
+ *	for, even for --help.
+ */
+void
+usage(tcpscan_ctx *scan, int status, int detailed) {
+   fprintf(stderr, "Usage: tcp-scan [options] [hosts...]\n");
+   fprintf(stderr, "\n");
+   fprintf(stderr, "Target hosts are specified on the command line unless the --file option is used,\n");
+   fprintf(stderr, "in which case the targets are read from the specified file instead.\n");
+   fprintf(stderr, "\n");
+   fprintf(stderr, "The target hosts can be specified as IP addresses or hostnames.\n");
+   fprintf(stderr, "\n");
+   if (detailed) {
+      fprintf(stderr, "In the options below a letter or word in angle brackets like <f> denotes a\n");
+      fprintf(stderr, "value or string that must be supplied. The corresponding text should\n");
+      fprintf(stderr, "explain the meaning of this value or string. When supplying the value or\n");
+      fprintf(stderr, "string, do not include the angle brackets. Text in square brackets like [<f>]\n");
+      fprintf(stderr, "mean that the enclosed text is optional.\n");
+      fprintf(stderr, "\n");
+      fprintf(stderr, "Options:\n");
+      fprintf(stderr, "\n");
+      fprintf(stderr, "--help or -h\t\tDisplay this usage message and exit.\n");
+      fprintf(stderr, "\n--file=<fn> or -f <fn>\tRead hostnames or addresses from the specified file\n");
+      fprintf(stderr, "\t\t\tinstead of from the command line. One name or IP\n");
+      fprintf(stderr, "\t\t\taddress per line.  Use \"-\" for standard input.\n");
+      fprintf(stderr, "\n--retry=<n> or -r <n>\tSet total number of attempts per host to <n>,\n");
+      fprintf(stderr, "\t\t\tdefault=%d.\n", scan->retry);
+      fprintf(stderr, "\n--hostretry=<n>\t\tSet the number of attempts to <n> for the ports\n");
+      fprintf(stderr, "\t\t\tof a host that replies reliably: it has replied, and\n");
+      fprintf(stderr, "\t\t\tat most 1 in %u of %u or more first retries to its\n", HOSTRETRY_RATIO, HOSTRETRY_MIN_RETRIES);
+      fprintf(stderr, "\t\t\tports were answered.  On such a host a silent port is most\n");
+      fprintf(stderr, "\t\t\tlikely filtered.  1 in %u ports keep all retries to\n", HOSTRETRY_SAMPLE);
+      fprintf(stderr, "\t\t\tcheck this.  The default is to use --retry.\n");
+      fprintf(stderr, "\n--timeout=<n> or -t <n>\tSet initial per host timeout to <n> ms, default=%d.\n", scan->timeout);
+      fprintf(stderr, "\t\t\tThis timeout is for the first packet sent to each host.\n");
+      fprintf(stderr, "\t\t\tsubsequent timeouts are multiplied by the backoff\n");
+      fprintf(stderr, "\t\t\tfactor which is set with --backoff.\n");
+      fprintf(stderr, "\n--bandwidth=<n> or -B <n> Set desired outbound bandwidth to <n>, default=%u\n", DEFAULT_BANDWIDTH);
+      fprintf(stderr, "\t\t\tThe value is in bits per second by default.  If you\n");
+      fprintf(stderr, "\t\t\tappend \"K\" to the value, then the units are kilobits\n");
+      fprintf(stderr, "\t\t\tper sec; and if you append \"M\" to the value, the\n");
+      fprintf(stderr, "\t\t\tunits are megabits per second.\n");
+      fprintf(stderr, "\t\t\tThe \"K\" and \"M\" suffixes represent the decimal, not\n");
+      fprintf(stderr, "\t\t\tbinary, multiples.  So 64K is 64000, not 65536.\n");
+      fprintf(stderr, "\n--interval=<n> or -i <n> Set minimum packet interval to <n> ms.\n");
+      fprintf(stderr, "\t\t\tThe packet interval will be no smaller than this number.\n");
+      fprintf(stderr, "\t\t\tThe interval specified is in milliseconds by default.\n");
+      fprintf(stderr, "\t\t\tif \"u\" is appended to the value, then the interval\n");
+      fprintf(stderr, "\t\t\tis in microseconds, and if \"s\" is appended, the\n");
+      fprintf(stderr, "\t\t\tinterval is in seconds.\n");
+      fprintf(stderr, "\t\t\tIf you want to use up to a given bandwidth, then it is\n");
+      fprintf(stderr, "\t\t\teasier to use the --bandwidth option instead.\n");
+      fprintf(stderr, "\t\t\tYou cannot specify both --interval and --bandwidth\n");
+      fprintf(stderr, "\t\t\tbecause they are just different ways to change the\n");
+      fprintf(stderr, "\t\t\tsame underlying variable.\n");
+      fprintf(stderr, "\n--backoff=<b> or -b <b>\tSet timeout backoff factor to <b>, default=%.2f.\n", scan->backoff_factor);
+      fprintf(stderr, "\t\t\tThe per-host timeout is multiplied by this factor\n");
+      fprintf(stderr, "\t\t\tafter each timeout.  So, if the number of retrys\n");
+      fprintf(stderr, "\t\t\tis 3, the initial per-host timeout is 500ms and the\n");
+      fprintf(stderr, "\t\t\tbackoff factor is 1.5, then the first timeout will be\n");
+      fprintf(stderr, "\t\t\t500ms, the second 750ms and the third 1125ms.\n");
+      fprintf(stderr, "\n--verbose or -v\t\tDisplay verbose progress messages.\n");
+      fprintf(stderr, "\t\t\tUse more than once for greater effect:\n");
+      fprintf(stderr, "\t\t\t1 - Show when hosts are removed from the list and\n");
+      fprintf(stderr, "\t\t\t    when packets with invalid cookies are received,\n");
+      fprintf(stderr, "\t\t\t    and the system calls per probe at the end.\n");
+      fprintf(stderr, "\t\t\t2 - Show each packet sent and received.\n");
+      fprintf(stderr, "\t\t\t3 - Display the host list before\n");
+      fprintf(stderr, "\t\t\t    scanning starts.\n");
+      fprintf(stderr, "\n--version or -V\t\tDisplay program version and exit.\n");
+      fprintf(stderr, "\n--random or -R\t\tRandomise the host list.\n");
+      fprintf(stderr, "\n--priority\t\tScan the ports most likely to be open first, on all\n");
+      fprintf(stderr, "\t\t\thosts, then the next most likely, and so on.  The\n");
+      fprintf(stderr, "\t\t\torder is from the frequencies in the --servicefile if\n");
+      fprintf(stderr, "\t\t\tit has them, and otherwise from a built-in table.\n");
+      fprintf(stderr, "\t\t\tWith --random, the hosts for each port are shuffled.\n");
+      fprintf(stderr, "\n--shard=<i>/<N>\t\tScan only the ith of N equal shares of the host and\n");
+      fprintf(stderr, "\t\t\tport entries, for splitting a scan between N nodes\n");
+      fprintf(stderr, "\t\t\tthat are given the same targets, ports and --seed.\n");
+      fprintf(stderr, "\t\t\tThe shares are taken from a random permutation of\n");
+      fprintf(stderr, "\t\t\tthe entries, do not overlap, and differ in size by\n");
+      fprintf(stderr, "\t\t\tat most one.  Each share is scanned in its permuted\n");
+      fprintf(stderr, "\t\t\torder.  <i> counts from 1.\n");
+      fprintf(stderr, "\n--seed=<n>\t\tUse <n> as the --shard permutation key and to seed\n");
+      fprintf(stderr, "\t\t\tthe random number generator, default=0 for --shard\n");
+      fprintf(stderr, "\t\t\tand unpredictable otherwise.  This makes --random\n");
+      fprintf(stderr, "\t\t\tand the random sequence number and source port\n");
+      fprintf(stderr, "\t\t\trepeatable.\n");
+      fprintf(stderr, "\n--workers=<n>\t\tSplit the scan between <n> processes, to use more\n");
+      fprintf(stderr, "\t\t\tthan one CPU core.  Each worker scans one --shard of\n");
+      fprintf(stderr, "\t\t\tthe entries with its own socket, capture and source\n");
+      fprintf(stderr, "\t\t\tport, at 1/<n> of the --bandwidth or --interval rate,\n");
+      fprintf(stderr, "\t\t\tand their output is merged by lines.  This cannot be\n");
+      fprintf(stderr, "\t\t\tused with --replay, --pcapsavefile, --metrics,\n");
+      fprintf(stderr, "\t\t\t--statsfile, --progress or --checkpoint.  Maximum\n");
+      fprintf(stderr, "\t\t\t%u.\n", MAX_WORKERS);
+      fprintf(stderr, "\n--checkpoint=<f>\tSave the scan state in file <f> every %u seconds,\n", CHECKPOINT_INTERVAL);
+      fprintf(stderr, "\t\t\tand when tcp-scan is stopped by SIGINT, SIGTERM or\n");
+      fprintf(stderr, "\t\t\tSIGHUP.  The file is removed when the scan finishes.\n");
+      fprintf(stderr, "\n--resume\t\tContinue the scan saved in the --checkpoint file.\n");
+      fprintf(stderr, "\t\t\tThe targets and other options must be the same as\n");
+      fprintf(stderr, "\t\t\tfor the original scan.  Entries that had finished\n");
+      fprintf(stderr, "\t\t\tare not scanned again.\n");
+      fprintf(stderr, "\n--previous=<f>\t\tDisplay only the changes from the results in file\n");
+      fprintf(stderr, "\t\t\t<f>, which is the output of an earlier scan.  The\n");
+      fprintf(stderr, "\t\t\tports that were open are scanned first.  Changed\n");
+      fprintf(stderr, "\t\t\tports are displayed with their previous state, as\n");
+      fprintf(stderr, "\t\t\twas=OPEN, was=CLOSED or was=NONE for no response, and\n");
+      fprintf(stderr, "\t\t\tports that no longer respond as VANISHED.\n");
+      fprintf(stderr, "\n--sample=<f>\t\tWith --previous, scan only a random fraction <f> of\n");
+      fprintf(stderr, "\t\t\tthe ports that were not open, default=1.  The ports\n");
+      fprintf(stderr, "\t\t\tthat were open are always scanned.\n");
+      fprintf(stderr, "\n--discover[=<l>]\tFind the hosts that are up before the scan, and\n");
+      fprintf(stderr, "\t\t\tonly scan those.  <l> is a comma-separated list of\n");
+      fprintf(stderr, "\t\t\tprobes sent to each host: TCP ports, and icmp for an\n");
+      fprintf(stderr, "\t\t\tICMP echo request, default=%s.  A host is up\n", DEFAULT_DISCOVER);
+      fprintf(stderr, "\t\t\tif any probe gets a reply.  This cannot be used with\n");
+      fprintf(stderr, "\t\t\t--daemon, --replay, --checkpoint or --previous.\n");
+      fprintf(stderr, "\n--discovercache=<f>\tWith --discover, keep the host states in file <f>,\n");
+      fprintf(stderr, "\t\t\tand reuse those less than %u seconds old instead of\n", DISCOVER_CACHE_AGE);
+      fprintf(stderr, "\t\t\tprobing the hosts again.\n");
+      fprintf(stderr, "\n--daemon=<f>\t\tRun scan jobs that arrive on the UNIX socket <f>,\n");
+      fprintf(stderr, "\t\t\tinstead of scanning the command line targets.  The\n");
+      fprintf(stderr, "\t\t\tsocket, capture and service names are set up once and\n");
+      fprintf(stderr, "\t\t\tused for every job.  Up to --jobs jobs are run at once,\n");
+      fprintf(stderr, "\t\t\tsharing the daemon's --bandwidth or --interval rate by\n");
+      fprintf(stderr, "\t\t\ttheir --weight.  A job is one line of targets and\n");
+      fprintf(stderr, "\t\t\t--port, --retry, --hostretry, --timeout, --backoff,\n");
+      fprintf(stderr, "\t\t\t--interval, --bandwidth, --openonly, --random,\n");
+      fprintf(stderr, "\t\t\t--priority, --numeric, --quiet, --portname,\n");
+      fprintf(stderr, "\t\t\t--ignoredups, --weight or --rtt options, which\n");
+      fprintf(stderr, "\t\t\toverride the daemon's own for that job.  The targets\n");
+      fprintf(stderr, "\t\t\tmust be IP addresses.  The results are written back on\n");
+      fprintf(stderr, "\t\t\tthe connection, and a client that does not send its\n");
+      fprintf(stderr, "\t\t\tjob within %u seconds, or stops reading its results\n", DAEMON_READ_TIMEOUT);
+      fprintf(stderr, "\t\t\tfor %u seconds, is dropped.  This cannot be\n", DAEMON_WRITE_TIMEOUT);
+      fprintf(stderr, "\t\t\tused with --workers, --shard, --replay, --checkpoint,\n");
+      fprintf(stderr, "\t\t\t--previous, --pcapsavefile or --metrics.\n");
+      fprintf(stderr, "\n--jobs=<n>\t\tWith --daemon, run up to <n> jobs at once, default=%u.\n", DEFAULT_DAEMON_JOBS);
+      fprintf(stderr, "\t\t\tThe jobs use source ports --sport to --sport + <n> - 1.\n");
+      fprintf(stderr, "\n--weight=<n>\t\tSet the share of the --daemon rate that a job gets\n");
+      fprintf(stderr, "\t\t\twhile other jobs are sending, from 1 to %u, default=%u.\n", MAX_WEIGHT, DEFAULT_WEIGHT);
+      fprintf(stderr, "\n--submit=<f>\t\tSend the rest of the command line as a job to the\n");
+      fprintf(stderr, "\t\t\t--daemon listening on UNIX socket <f>, and display\n");
+      fprintf(stderr, "\t\t\tthe results.  Target names are looked up here, as the\n");
+      fprintf(stderr, "\t\t\tdaemon only takes IP addresses.  The job's errors go\n");
+      fprintf(stderr, "\t\t\tto stderr, and the exit status is 1 if the job fails\n");
+      fprintf(stderr, "\t\t\tor does not finish.  This does not need root\n");
+      fprintf(stderr, "\t\t\tprivileges.\n");
+      fprintf(stderr, "\n--numeric or -N\t\tIP addresses only, no hostnames.\n");
+      fprintf(stderr, "\t\t\tWith this option, all hosts must be specified as\n");
+      fprintf(stderr, "\t\t\tIP addresses.  Hostnames are not permitted.\n");
+   /*   fprintf(stderr, "\n--ipv6 or -6\t\tUse IPv6 protocol. Default is IPv4.\n"); */
+   /* scanner-specific help */
+      fprintf(stderr, "\n--port=<p> or -p <p>\tSpecify TCP destination port(s).\n");
+      fprintf(stderr, "\t\t\tThis option can be a single port, a list of ports\n");
+      fprintf(stderr, "\t\t\tseparated by commas, or an inclusive range with the\n");
+      fprintf(stderr, "\t\t\tbounds separated by \"-\".\n");
+      fprintf(stderr, "\n--sport=<p> or -s <p>\tSpecify TCP source port.\n");
+      fprintf(stderr, "\t\t\tThe default is a random port in the range 32678-65535.\n");
+      fprintf(stderr, "\n--seq=<s> or -e <s>\tSpecify initial sequence number.\n");
+      fprintf(stderr, "\t\t\tThe default initial sequence number is random.\n");
+      fprintf(stderr, "\n--ack=<a> or -c <a>\tSpecify initial acknowledgement number.\n");
+      fprintf(stderr, "\t\t\tThe default initial acknowledgement number is random.\n");
+      fprintf(stderr, "\t\t\tThis is only applicable when the ACK flag is set in\n");
+      fprintf(stderr, "\t\t\toutgoing packets.\n");
+      fprintf(stderr, "\n--window=<w> or -w <w>\tSpecify the TCP window size.\n");
+      fprintf(stderr, "\t\t\tThe default window size is %u.\n", DEFAULT_WINDOW);
+      fprintf(stderr, "\n--openonly or -o\tOnly display open ports.\n");
+      fprintf(stderr, "\t\t\tWith this option, closed ports are not displayed.\n");
+      fprintf(stderr, "\n--servicefile=<s> or -S <s> Use service file <s> for TCP ports.\n");
+      fprintf(stderr, "\t\t\tIf this option is specified, then the TCP ports to\n");
+      fprintf(stderr, "\t\t\tscan are read from the specified file.  The file is\n");
+      fprintf(stderr, "\t\t\tsame format as used by \"strobe\".  A number after\n");
+      fprintf(stderr, "\t\t\tthe port/protocol, as in nmap-services, is the port's\n");
+      fprintf(stderr, "\t\t\tfrequency, which sets the --priority order.\n");
+      fprintf(stderr, "\n--topports=<n>\t\tScan the <n> ports most likely to be open, from a\n");
+      fprintf(stderr, "\t\t\tbuilt-in table of %u, in --priority order.\n",
+              (unsigned) (sizeof(common_ports) / sizeof(common_ports[0])));
+      fprintf(stderr, "\n--mss=<n> or -m <n>\tUse TCP MSS <n>.  Default is %u\n",
+              DEFAULT_MSS);
+      fprintf(stderr, "\t\t\tA non-zero MSS adds the MSS TCP option to the SYN packet\n");
+      fprintf(stderr, "\t\t\twhich adds 4 bytes to the packet length.  If the MSS\n");
+      fprintf(stderr, "\t\t\tis specified as zero, then no MSS option is added.\n");
+      fprintf(stderr, "\n--wscale or -W\t\tAdd the WSCALE TCP option\n");
+      fprintf(stderr, "\t\t\tThis option adds 4 bytes to the packet length.\n");
+      fprintf(stderr, "\n--sack or -a\t\tAdd the SACKOK TCP option\n");
+      fprintf(stderr, "\t\t\tThis option adds 4 bytes to the packet length. However\n");
+      fprintf(stderr, "\t\t\tit does not increase packet size when used with the\n");
+      fprintf(stderr, "\t\t\t--timestamp option.\n");
+      fprintf(stderr, "\n--timestamp or -T\tAdd the TIMESTAMP TCP option\n");
+      fprintf(stderr, "\t\t\tThe number of seconds since midnight 1/1/1970 is used\n");
+      fprintf(stderr, "\t\t\tfor the timestamp value.\n");
+      fprintf(stderr, "\t\t\tThis option adds 12 bytes to the packet length.\n");
+      fprintf(stderr, "\n--snap=<s> or -n <s>\tSet the pcap snap length to <s>. Default=%d.\n", SNAPLEN);
+      fprintf(stderr, "\t\t\tThis specifies the frame capture length.  This\n");
+      fprintf(stderr, "\t\t\tlength includes the data-link header as well as the\n");
+      fprintf(stderr, "\t\t\tIP and transport headers.  The default is normally\n");
+      fprintf(stderr, "\t\t\tsufficient.\n");
+      fprintf(stderr, "\n--ttl=<t> or -l <t>\tSet the IP TTL to <t>. Default=%d.\n", DEFAULT_TTL);
+      fprintf(stderr, "\t\t\tYou can specify a higher value if the targets are\n");
+      fprintf(stderr, "\t\t\tmany hops away, or you can specify a lower value to\n");
+      fprintf(stderr, "\t\t\tlimit the scope to the local network.\n");
+      fprintf(stderr, "\n--interface=<i> or -I <u> Use network interface <i>.\n");
+      fprintf(stderr, "\t\t\tIf this option is not specified, tcp-scan will search\n");
+      fprintf(stderr, "\t\t\tthe system interface list for the lowest numbered,\n");
+      fprintf(stderr, "\t\t\tconfigured up interface (excluding loopback).\n");
+      fprintf(stderr, "\n--quiet or -q\t\tDon't decode the received packet.\n");
+      fprintf(stderr, "\t\t\tIf this option is specified, then only the minimum\n");
+      fprintf(stderr, "\t\t\tinformation is displayed.  This can be useful if you\n");
+      fprintf(stderr, "\t\t\tonly want to know if a port is open or not, or if\n");
+      fprintf(stderr, "\t\t\tstrange packets confuse the decoding process\n");
+      fprintf(stderr, "\n--ignoredups or -g\tDon't display duplicate packets.\n");
+      fprintf(stderr, "\t\t\tBy default, duplicate packets are displayed and flagged\n");
+      fprintf(stderr, "\t\t\twith \"(DUP: n)\" where n is the number of packets\n");
+      fprintf(stderr, "\t\t\treceived from that host so far.\n");
+      fprintf(stderr, "\n--df=<n> or -F <n>\tEnable (1) or disable (0) DF flag. Default=%d\n", DEFAULT_DF);
+      fprintf(stderr, "\t\t\tSetting this option to 1 sets the DF flag in the IP\n");
+      fprintf(stderr, "\t\t\theader of the outbound SYN packets.  Setting it to 0\n");
+      fprintf(stderr, "\t\t\tclears the DF flag.\n");
+      fprintf(stderr, "\n--tos=<n> or -O <n>\tSet IP TOS (Type of Service) to <n>. Default=%d\n", DEFAULT_TOS);
+      fprintf(stderr, "\t\t\tThis sets the TOS value in the IP header for outbound\n");
+      fprintf(stderr, "\t\t\tpackets.\n");
+      fprintf(stderr, "\n--portname or -P\tDisplay port names as well as numbers.\n");
+      fprintf(stderr, "\n--servicefile2=<f> or -E <f>\tUse TCP service filename <f>.\n");
+      fprintf(stderr, "\t\t\tThe service file is used when displaying TCP port names.\n");
+      fprintf(stderr, "\t\t\tIt is in the standard \"/etc/services\" file format, or\n");
+      fprintf(stderr, "\t\t\tis a compiled service database created by mkservicedb.\n");
+      fprintf(stderr, "\t\t\tBy default, the services file supplied with tcp-scan is\n");
+      fprintf(stderr, "\t\t\tused.\n");
+      fprintf(stderr, "\n--flags=<f> or -L <f>\tSpecify TCP flags to be set in outgoing packets.\n");
+      fprintf(stderr, "\t\t\tThe flags should be specified as a comma-separated list\n");
+      fprintf(stderr, "\t\t\tfrom the set of: CWR,ECN,URG,ACK,PSH,RST,SYN,FIN.\n");
+      fprintf(stderr, "\t\t\tIf this option is not specified, the flags default\n");
+      fprintf(stderr, "\t\t\tto SYN.\n");
+      fprintf(stderr, "\n--pcapsavefile=<p> or -C <p>\tWrite received packets to pcapng savefile <p>.\n");
+      fprintf(stderr, "\t\t\tThis option causes received TCP packets to be written\n");
+      fprintf(stderr, "\t\t\tto a pcapng savefile with the specified name.  This\n");
+      fprintf(stderr, "\t\t\tsavefile can be analyzed with programs that understand\n");
+      fprintf(stderr, "\t\t\tthe pcapng file format, such as \"tcpdump\" and \"wireshark\".\n");
+      fprintf(stderr, "\t\t\tTimestamps are recorded with nanosecond resolution, and\n");
+      fprintf(stderr, "\t\t\tthe scan parameters are saved as a file comment.\n");
+      fprintf(stderr, "\n--pcapsize=<n>\t\tStart a new pcapng savefile after <n> bytes.\n");
+      fprintf(stderr, "\t\t\tThe value may have a \"K\", \"M\" or \"G\" suffix.  When\n");
+      fprintf(stderr, "\t\t\tthe savefile is rotated, the files are named <p>.00000,\n");
+      fprintf(stderr, "\t\t\t<p>.00001 and so on, where <p> is the --pcapsavefile name.\n");
+      fprintf(stderr, "\n--pcaptime=<s>\t\tStart a new pcapng savefile every <s> seconds.\n");
+      fprintf(stderr, "\t\t\tThis can be combined with --pcapsize.\n");
+      fprintf(stderr, "\n--pcapsent\t\tAlso write transmitted probes to the pcapng savefile.\n");
+      fprintf(stderr, "\t\t\tThe probes are saved as raw IP packets on a separate\n");
+      fprintf(stderr, "\t\t\tinterface, so that whole scans can be analysed.\n");
+      fprintf(stderr, "\n--fingerprint\t\tDisplay a fingerprint of the responding TCP stack.\n");
+      fprintf(stderr, "\t\t\tThis is a 64-bit hash of the TCP option layout, the\n");
+      fprintf(stderr, "\t\t\twindow size and the initial TTL, displayed as fp=<hex>.\n");
+      fprintf(stderr, "\t\t\tResponses with the same fingerprint are likely to\n");
+      fprintf(stderr, "\t\t\tcome from the same type of TCP stack.\n");
+      fprintf(stderr, "\n--rtt\t\t\tDisplay the round trip time of each response as\n");
+      fprintf(stderr, "\t\t\trtt=<ms>, and a histogram of the round trip times\n");
+      fprintf(stderr, "\t\t\tat the end of the scan.  The send time is taken\n");
+      fprintf(stderr, "\t\t\tfrom kernel transmit timestamps where available, and\n");
+      fprintf(stderr, "\t\t\tthe receive time is the pcap capture timestamp.\n");
+      fprintf(stderr, "\n--autotimeout\t\tSet the initial timeout of hosts that have not yet\n");
+      fprintf(stderr, "\t\t\tbeen probed from the measured round trip times, using\n");
+      fprintf(stderr, "\t\t\tthe TCP retransmission timeout calculation.  The\n");
+      fprintf(stderr, "\t\t\tcalculated value is never more than --timeout, and\n");
+      fprintf(stderr, "\t\t\tis only used after %d responses have been measured.\n", AUTOTIMEOUT_SAMPLES);
+      fprintf(stderr, "\n--replay=<p>\t\tRead the responses from the pcap savefile <p>\n");
+      fprintf(stderr, "\t\t\tinstead of sending probes, and report the time spent\n");
+      fprintf(stderr, "\t\t\tin each receive stage.  The targets and ports must\n");
+      fprintf(stderr, "\t\t\tbe given as for a normal scan.  No probes are sent,\n");
+      fprintf(stderr, "\t\t\tso this option does not need root privileges.  This\n");
+      fprintf(stderr, "\t\t\tis intended for benchmarking the receive pipeline.\n");
+      fprintf(stderr, "\n--dryrun[=<m>]\t\tSimulate the network instead of sending probes.\n");
+      fprintf(stderr, "\t\t\tThe scan runs against a virtual clock, so it takes\n");
+      fprintf(stderr, "\t\t\tonly as long as tcp-scan needs to schedule the\n");
+      fprintf(stderr, "\t\t\tprobes and process the responses.  <m> is a comma-\n");
+      fprintf(stderr, "\t\t\tseparated list of settings for the network model:\n");
+      fprintf(stderr, "\t\t\tloss=<f> fraction of probes with no response (0),\n");
+      fprintf(stderr, "\t\t\tsilent=<f> fraction of ports that never respond (0),\n");
+      fprintf(stderr, "\t\t\tup=<f> fraction of hosts that respond at all (1),\n");
+      fprintf(stderr, "\t\t\topen=<f> fraction of the other ports that are open\n");
+      fprintf(stderr, "\t\t\t(%.1f), rtt=<ms> round trip time (%u) and\n", DRYRUN_OPEN, DRYRUN_RTT/1000);
+      fprintf(stderr, "\t\t\tjitter=<ms> maximum random extra round trip time (0)\n");
+      fprintf(stderr, "\t\t\tand interrupt=<n> send SIGINT to tcp-scan after <n>\n");
+      fprintf(stderr, "\t\t\tprobes, to test --checkpoint.\n");
+      fprintf(stderr, "\t\t\tE.g. --dryrun=loss=0.05,rtt=20,jitter=5.  This\n");
+      fprintf(stderr, "\t\t\toption does not need root privileges.\n");
+      fprintf(stderr, "\n--progress[=<s>]\tDisplay a progress line on stderr every <s> seconds,\n");
+      fprintf(stderr, "\t\t\tdefault=%u.  The line shows the probes sent and\n", DEFAULT_PROGRESS);
+      fprintf(stderr, "\t\t\tretries, the responses, the current send rate, the\n");
+      fprintf(stderr, "\t\t\tentries awaiting a response or retry, the entries\n");
+      fprintf(stderr, "\t\t\tnot yet finished, pcap drops and an estimate of the\n");
+      fprintf(stderr, "\t\t\ttime remaining.\n");
+      fprintf(stderr, "\n--statsfile=<f>\t\tWrite the progress counters to file <f> at each\n");
+      fprintf(stderr, "\t\t\t--progress interval, as <name> <value> lines.  The\n");
+      fprintf(stderr, "\t\t\tfile is replaced atomically, so it can be read at\n");
+      fprintf(stderr, "\t\t\tany time.  If --progress is not given, the interval\n");
+      fprintf(stderr, "\t\t\tis %u seconds and no progress line is displayed.\n", DEFAULT_PROGRESS);
+      fprintf(stderr, "\n--metrics=<a>\t\tServe the scan counters in Prometheus text format\n");
+      fprintf(stderr, "\t\t\tover HTTP on <a>, which is unix:<path> for a UNIX\n");
+      fprintf(stderr, "\t\t\tsocket, <address>:<port>, or <port> to listen on\n");
+      fprintf(stderr, "\t\t\t127.0.0.1.  This cannot be used with --dryrun or\n");
+      fprintf(stderr, "\t\t\t--replay.\n");
+      fprintf(stderr, "\n--stagetimes\t\tRecord how long each stage of the send and receive\n");
+      fprintf(stderr, "\t\t\tpaths takes, and display the percentiles on stderr\n");
+      fprintf(stderr, "\t\t\tat exit or when tcp-scan receives SIGUSR1.  The\n");
+      fprintf(stderr, "\t\t\tstages are send, select, dispatch, match, format\n");
+      fprintf(stderr, "\t\t\tand write.\n");
+   } else {
+      fprintf(stderr, "use \"tcp-scan --help\" for detailed information on the available options.\n");
+   }
+   fprintf(stderr, "\n");
+   fprintf(stderr, "Report bugs or send suggestions at %s\n", PACKAGE_BUGREPORT);
+   if (status != EXIT_SUCCESS || error_jump)
+      err_exit();	/* Ends only the job or the library call */
+   exit(status);
+}
+
 /*
- *	Construct the pseudo header (for TCP checksum purposes).
- *	Note that this overlaps the IP header and gets overwritten later.
+ *	add_host -- Add a new host to the list.
+ *
+ *	Inputs:
+ *
+ *	scan		The scan context
+ *	name		The Name or IP address of the host.
+ *	host_timeout	The initial host timeout in ms.
+ *
+ *	Returns:
+ *
+ *	None.
+ *
+ *	This function is called before the helistptr array is created, so
+ *	we use the helist array directly.
  */
-   memset(pseudo, '\0', sizeof(pseudo_hdr));
-   pseudo->s_addr = source_address;
-   pseudo->d_addr = he->addr.v4.s_addr;
-   pseudo->proto  = ip_protocol;
-   pseudo->len    = htons(sizeof(struct tcphdr) + options_len);
+void
+add_host(tcpscan_ctx *scan, const char *name, unsigned host_timeout) {
+   tcpscan_engine *eng = scan->engine;
+   char *cp;
+   ip_address addr;
+   char *ga_err_msg;
+   int result;
+
 /*
- *	Add TCP options.  We do this before the TCP header because the
- *	options must be covered by the TCP checksum calculation.
- *
- *	We put the options in the same order, and with the same padding,
- *	as Linux 2.4.24.
+ *	Resolve the name once, rather than once for each port.
  */
-   optptr = options;
-   if (mss) {
-      *optptr++ = 2;		/* Kind=2 (MSS) */
-      *optptr++ = 4;		/* Len=4 Bytes */
-      *optptr++ = mss / 256;	/* MSS high byte */
-      *optptr++ = mss % 256;	/* MSS low byte */
-   }
-   if (timestamp_flag) {
-      uint32_t tsval=htonl(last_packet_time->tv_sec);
-      if (sack_flag) {
-         *optptr++ = 4;		/* Kind=4 (SACKOK) */
-         *optptr++ = 2;		/* Len=2 bytes */
+   if (scan->numeric_flag) {
+      if (eng->ipv6_flag) {
+         result = inet_pton(AF_INET6, name, &(addr.v6));
       } else {
-         *optptr++ = 1;		/* Kind=1 (NOP) - pad */
-         *optptr++ = 1;		/* Kind=1 (NOP) - pad */
+         result = inet_pton(AF_INET, name, &(addr.v4));
       }
-      *optptr++ = 8;		/* Kind=8 (TIMESTAMP) */
-      *optptr++ = 10;		/* Len=10 bytes */
-      memcpy(optptr, &tsval, sizeof(tsval));	/* TS Value */
-      optptr += sizeof(tsval);
-      *optptr++ = 0;		/* TS Echo Reply */
-      *optptr++ = 0;
-      *optptr++ = 0;
-      *optptr++ = 0;
-   } else if (sack_flag) {
-      *optptr++ = 1;		/* Kind=1 (NOP) - pad */
-      *optptr++ = 1;		/* Kind=1 (NOP) - pad */
-      *optptr++ = 4;		/* Kind=4 (SACKOK) */
-      *optptr++ = 2;		/* Len=2 bytes */
-   }
-   if (wscale_flag) {
-      *optptr++ = 1;		/* Kind=1 (NOP) - pad */
-      *optptr++ = 3;		/* Kind=3 (WSCALE) */
-      *optptr++ = 3;		/* Len=3 bytes */
-      *optptr++ = 0;		/* Value=0 */
-   }
-/*
- *	Construct the TCP header.
- */
-   memset(tcph, '\0', sizeof(struct tcphdr));
-   tcph->source = htons(source_port);
-   tcph->dest = htons(he->dport);
-   tcph->seq = htonl(seq_no);
-   tcph->doff = (sizeof(struct tcphdr) + options_len) / 4;
-   if (tcp_flags_flag) {	/* Set specified TCP flags */
-      if (tcp_flags.cwr)
-         tcph->cwr = 1;
-      if (tcp_flags.ecn)
-         tcph->ecn = 1;
-      if (tcp_flags.urg)
-         tcph->urg = 1;
-      if (tcp_flags.ack) {
-         tcph->ack = 1;
-         tcph->ack_seq = htonl(ack_no);
+      if (result <= 0)
+         err_msg("\"%s\" is not an IP address, and names cannot be used "
+                 "with --numeric or in a --daemon job", name);
+   } else {
+      if (eng->ipv6_flag) {
+         result = get_host_address(name, AF_INET6, &addr, &ga_err_msg) != NULL;
+      } else {
+         result = get_host_address(name, AF_INET, &addr, &ga_err_msg) != NULL;
       }
-      if (tcp_flags.psh)
-         tcph->psh = 1;
-      if (tcp_flags.rst)
-         tcph->rst = 1;
-      if (tcp_flags.syn)
-         tcph->syn = 1;
-      if (tcp_flags.fin)
-         tcph->fin = 1;
-   } else {			/* Default: Set SYN flag */
-      tcph->syn = 1;
+      if (!result)
+         err_msg("get_host_address failed for \"%s\": %s", name, ga_err_msg);
    }
-   tcph->window = htons(window);
-   tcph->check = in_cksum((uint16_t *)pseudo, sizeof(pseudo_hdr) +
-                 sizeof(struct tcphdr) + options_len);
-/*
- *	Construct the IP Header.
- *	This overwrites the now unneeded pseudo header.
- */
-   memset(iph, '\0', sizeof(struct iphdr));
-   iph->ihl = 5;	/* 5 * 32-bit longwords = 20 bytes */
-   iph->version = 4;
-   iph->tos = ip_tos;
-   iph->tot_len = sizeof(struct iphdr) + sizeof(struct tcphdr);
-   iph->id = 0;		/* Linux kernel fills this in */
-   if (df_flag)
-      iph->frag_off = htons(0x4000);
-   else
-      iph->frag_off = htons(0x0);
-   iph->ttl = ip_ttl;
-   iph->protocol = ip_protocol;
-   iph->check = 0;	/* Linux kernel fills this in */
-   iph->saddr = source_address;
-   iph->daddr = he->addr.v4.s_addr;
+   if (scan->local_data) {	/* --port option specified */
 /*
- *	Copy the required data into the output buffer "buf" and set "buflen"
- *	to the number of bytes in this buffer.
+ *	Determine the ports in the port spec, and add a host entry for
+ *	each one.
  */
-   buflen=sizeof(struct iphdr) + sizeof(struct tcphdr) + options_len;
+      cp = scan->local_data;
+      while (*cp != '\0') {
+         unsigned port1;
+         unsigned port2;
+         unsigned i;
+   
+         port1=strtoul(cp, &cp, 10);
+         if (!port1 || (port1 & 0x80000000))	/* Zero or -ve */
+            err_msg("Invalid port specification: %s", scan->local_data);
+         if (*cp == ',' || *cp == '\0') {	/* Single port specification */
+            add_host_port(scan, &addr, host_timeout, port1);
+         } else if (*cp == '-') {		/* Inclusive range */
+            cp++;
+            port2=strtoul(cp, &cp, 10);
+            if (!port2 || port2 <= port1)	/* Missing end or empty range */
+               err_msg("Invalid port specification: %s", scan->local_data);
+            for (i=port1; i<=port2; i++)
+               add_host_port(scan, &addr, host_timeout, i);
+         } else {
+            err_msg("Invalid port specification: %s", scan->local_data);
+         }
+         if (*cp == ',')
+            cp++;  /* Move on to next entry */
+      }
+   } else {	/* --servicefile option specified */
 /*
- *	Send the packet.
+ *	Add a host entry for each port in the port list.
  */
-   if (debug) {print_times(); printf("send_packet: #%u to host entry %u (%s) tmo %d\n", he->num_sent, he->n, my_ntoa(he->addr,ipv6_flag), he->timeout);}
-   if (verbose > 1)
-      warn_msg("---\tSending packet #%u to host entry %u (%s) tmo %d", he->num_sent, he->n, my_ntoa(he->addr,ipv6_flag), he->timeout);
-   if ((sendto(s, buf, buflen, 0, (struct sockaddr *) &sa_peer, sa_peer_len)) < 0) {
-      err_sys("sendto");
+      int i=0;
+
+      while (eng->port_list[i])
+         add_host_port(scan, &addr, host_timeout, eng->port_list[i++]);
    }
-   return buflen;
 }
 
 /*
- *      initialise -- initialisation routine.
+ *	check_port_options -- Check that the ports to scan were given once
  *
- *      Inputs:
+ *	Inputs:
  *
- *      None.
+ *	scan		The scan context
  *
- *      Returns:
+ *	Returns:
  *
- *      None.
+ *	None.
  *
- *      This is called once before any packets have been sent.  It can be
- *      used to perform any required initialisation.  It does not have to
- *      do anything.
+ *	This is called before add_host(), which needs either the --port or
+ *	the --servicefile or --topports port list, but not both.
  */
 void
-initialise(void) {
-   char errbuf[PCAP_ERRBUF_SIZE];
-   struct bpf_program filter;
-   char *filter_string;
-   bpf_u_int32 netmask;
-   bpf_u_int32 localnet;
-   int datalink;
-   unsigned random_seed;
-   struct timeval tv;
-/*
- *	Seed PRNG.
- */
-   Gettimeofday(&tv);
-   random_seed = tv.tv_usec ^ getpid();	/* Unpredictable value */
-   init_genrand(random_seed);
-/*
- *	Set the sequence number, ack number and source port using random
- *	values if they have not been set with command line options.
- *	We set the top bit of source port to make sure that it's
- *	above 32768 and therefore out of the way of reserved ports
- *	(1-1024).
- */
-   if (!seq_no_flag)
-      seq_no = genrand_int32();
-   if (!ack_no_flag)
-      ack_no = genrand_int32();
-   if (!source_port_flag) {
-      source_port = genrand_int32() & 0x0000ffff;
-      source_port |= 0x8000;
+check_port_options(tcpscan_ctx *scan) {
+   tcpscan_engine *eng = scan->engine;
+   if (scan->local_data == NULL && eng->port_list == NULL) {
+      warn_msg("You must specify the TCP dest ports with either the --port option");
+      err_msg("or with the --servicefile or --topports option.");
    }
-/*
- *      Determine network interface to use and associated IP address.
- *      If the interface was specified with the --interface option then use
- *      that, otherwise use pcap_lookupdev() to pick a suitable interface.
- */
-   if (!if_name) { /* i/f not specified with --interface */
-      if (!(if_name=pcap_lookupdev(errbuf))) {
-         err_msg("pcap_lookupdev: %s", errbuf);
-      }
+
+   if (scan->local_data && eng->port_list) {
+      err_msg("You cannot specify both the --port and %s options.",
+              eng->top_ports ? "--topports" : "--servicefile");
    }
-   source_address = get_source_ip(if_name);
+}
+
 /*
- *	Prepare pcap
+ * 	remove_host -- Remove the specified host from the list
+ *
+ *	inputs:
+ *
+ *	he = Pointer to host entry to remove.
+ *
+ *	If the host being removed is the one pointed to by the cursor, this
+ *	function updates cursor so that it points to the next entry.
  */
-   if (!(pcap_handle=pcap_open_live(if_name, snaplen, PROMISC, TO_MS, errbuf)))
-      err_msg("pcap_open_live: %s\n", errbuf);
-   if ((datalink=pcap_datalink(pcap_handle)) < 0)
-      err_msg("pcap_datalink: %s\n", pcap_geterr(pcap_handle));
-   printf("Interface: %s, datalink type: %s (%s)\n", if_name,
-          pcap_datalink_val_to_name(datalink),
-          pcap_datalink_val_to_description(datalink));
-   switch (datalink) {
-      case DLT_EN10MB:		/* Ethernet */
-         ip_offset = 14;
-         break;
-      case DLT_LINUX_SLL:	/* PPP on Linux */
-         ip_offset = 16;
-         break;
-      default:
-         err_msg("Unsupported datalink type");
-         break;
-   }
-   if ((pcap_fd=pcap_get_selectable_fd(pcap_handle)) < 0)
-      err_msg("pcap_fileno: %s\n", pcap_geterr(pcap_handle));
-   if ((pcap_setnonblock(pcap_handle, 1, errbuf)) < 0)
-      err_msg("pcap_setnonblock: %s\n", errbuf);
-   if (pcap_lookupnet(if_name, &localnet, &netmask, errbuf) < 0)
-      err_msg("pcap_lookupnet: %s\n", errbuf);
-   if (tcp_flags_flag && tcp_flags.ack) {
-      filter_string=make_message("tcp dst port %u and tcp[4:4] = %u",
-                                 source_port, ack_no);
+void
+remove_host(tcpscan_ctx *scan, host_entry **he) {
+   tcpscan_engine *eng = scan->engine;
+   if ((*he)->live) {
+      TCP_SCAN_PROBE5(remove, (*he)->addr.v4.s_addr, (*he)->dport,
+                      (*he)->num_sent, (*he)->num_recv, (*he)->send_ns);
+      (*he)->live = 0;
+      scan->live_count--;
+      if (*he == *scan->cursor)
+         advance_cursor(scan);
+      if (eng->debug) {print_times(); printf("remove_host: live_count now %d\n", scan->live_count);}
    } else {
-      filter_string=make_message("tcp dst port %u and tcp[8:4] = %u",
-                                 source_port, seq_no+1);
-   }
-   if ((pcap_compile(pcap_handle, &filter, filter_string, OPTIMISE, netmask)) < 0)
-      err_msg("pcap_geterr: %s\n", pcap_geterr(pcap_handle));
-   free(filter_string);
-   if ((pcap_setfilter(pcap_handle, &filter)) < 0)
-      err_msg("pcap_setfilter: %s\n", pcap_geterr(pcap_handle));
-/*
- *      Open pcap savefile is the --pcapsavefile (-C) option was specified
- */
-   if (*pcap_savefile != '\0') {
-      if (!(pcap_dump_handle=pcap_dump_open(pcap_handle, pcap_savefile))) {
-         err_msg("pcap_dump_open: %s", pcap_geterr(pcap_handle));
-      }
+      if (eng->verbose > 1)
+         warn_msg("***\tremove_host called on non-live host entry: SHOULDN'T HAPPEN");
    }
+}
+
 /*
- *	If we are displaying portnames, then initialise portname array.
- */
-   if (portname_flag) {
-      FILE *fp;
-      char *fn;
-      int i;
-      char lbuf[MAXLINE];
-      char portname[MAXLINE];
-      char portstr[MAXLINE];
-      unsigned int port;
-      static const char *servent_pat_str = "^([^\t ]+)[\t ]+([0-9]+)/tcp";
-      regex_t servent_pat;
-      int result;
-      int num_entries=0;
-      regmatch_t pmatch[3];
-      size_t name_len;
-      size_t port_len;
-/*
- *	Compile service file regular expression.
- *	Die if any error occurs.
- */
-      if ((result=regcomp(&servent_pat, servent_pat_str, REG_EXTENDED|REG_ICASE))) {
-         char reg_errbuf[MAXLINE];
-         regerror(result, &servent_pat, reg_errbuf, MAXLINE);
-         err_msg("ERROR: cannot compile regex pattern \"%s\": %s",
-                 servent_pat_str, reg_errbuf);
-      }
-/*
- *	Determine the filename for the services file, and open this file
- *	for reading.
+ *	advance_cursor -- Advance the cursor to point at next live entry
+ *
+ *	Inputs:
+ *
+ *	scan		The scan context
+ *
+ *	Returns:
+ *
+ *	None.
+ *
+ *	Does nothing if there are no live entries in the list.
  */
-      if (*service_file == '\0') {	/* If service file not specified */
-         fn = make_message("%s/%s", DATADIR, SERVICE_FILE);
-      } else {
-         fn = make_message("%s", service_file);
-      }
-      if ((access(fn, R_OK)) != 0)
-         err_sys("Cannot open services file");
-      if (!(fp = fopen(fn, "r")))
-         err_sys("Cannot open services file");
+void
+advance_cursor(tcpscan_ctx *scan) {
+   tcpscan_engine *eng = scan->engine;
+   if (scan->live_count) {
+      do {
+         if (scan->cursor == (scan->helistptr+(scan->num_hosts-1)))
+            scan->cursor = scan->helistptr;	/* Wrap round to beginning */
+         else
+            scan->cursor++;
+      } while (!(*scan->cursor)->live);
+   } /* End If */
+   if (eng->debug) {print_times(); printf("advance_cursor: cursor now %d\n", (*scan->cursor)->n);}
+}
+
 /*
- *	Create a 65,536 element array of character pointers with each
- *	initialised to NULL.
+ *	recvfrom_wto -- Receive packet with timeout
+ *
+ *	Inputs:
+ *
+ *	scan	The scan context
+ *	s	Socket file descriptor.
+ *	tmo	Select timeout in us.
+ *
+ *	Returns:
+ *
+ *	None.
+ *
+ *	This calls pcap_dispatch() if data was successfully read from
+ *	the socket.
  */
-      portnames = Malloc(65536 * sizeof(char *));
-      for (i=0; i<65536; i++)
-         portnames[i] = NULL;
+void
+recvfrom_wto(tcpscan_ctx *scan, int s, int tmo) {
+   tcpscan_engine *eng = scan->engine;
+   fd_set readset;
+   fd_set writeset;
+   struct timeval to;
+   int maxfd;
+   int n;
+   TCP_UINT64 start_ns;
+
+   if (eng->dryrun_flag) {
+      dryrun_wait(scan, tmo);
+      return;
+   }
+   FD_ZERO(&readset);
+   FD_ZERO(&writeset);
+   FD_SET(s, &readset);
+   maxfd = s;
+   if (eng->metrics)
+      maxfd = metrics_fd_set(eng->metrics, &readset, &writeset, maxfd);
+   if (eng->clients)
+      maxfd = daemon_fd_set(eng, &readset, &writeset, maxfd);
+   to.tv_sec  = tmo/1000000;
+   to.tv_usec = (tmo - 1000000*to.tv_sec);
+   start_ns = stage_start(eng);
+   eng->select_calls++;
+   n = select(maxfd+1, &readset, &writeset, NULL, &to);
+   stage_end(eng, STAGE_SELECT, start_ns);
+   if (eng->debug) {print_times(); printf("recvfrom_wto: select end, tmo=%d, n=%d\n", tmo, n);}
+   if (n < 0) {
+      if (errno == EINTR)
+         return;	/* E.g. SIGUSR1 for --stagetimes */
+      err_sys("select");
+   } else if (n == 0) {
+      eng->select_empty++;
+      return;	/* Timeout */
+   }
+   if (eng->metrics) {
+      metrics_handle(eng->metrics, &readset, &writeset, metrics_format,
+                     scan);
+      if (!FD_ISSET(s, &readset))
+         return;
+   }
+   if (eng->clients) {
+      daemon_handle(eng, &readset, &writeset);
+      if (!FD_ISSET(s, &readset))
+         return;
+   }
+   start_ns = stage_start(eng);
+   eng->dispatch_calls++;
+   if ((n = pcap_dispatch(eng->pcap_handle, -1, callback, (u_char *) scan)) < 0)
+      err_sys("pcap_dispatch: %s\n", pcap_geterr(eng->pcap_handle));
+   eng->dispatch_packets += n;
+   stage_end(eng, STAGE_DISPATCH, start_ns);
+}
 
-      while (fgets(lbuf, MAXLINE, fp)) {
 /*
- *	Ignore blank lines, lines starting with "#" and lines starting
- *	with whitespace.
- */
-         if (strchr("# \t\n", lbuf[0]))
-             continue;
-/*
- *	Attempt to match the line against the service entry regular
- *	expression.  Ignore lines that don't match.  Die on error.
- */
-         result = regexec(&servent_pat, lbuf, 3, pmatch, 0);
-         if (result == REG_NOMATCH || pmatch[1].rm_so < 0 || pmatch[2].rm_so < 0) {
-            continue;
-         } else if (result != 0) {
-            char reg_errbuf[MAXLINE];
-            regerror(result, &servent_pat, reg_errbuf, MAXLINE);
-            err_msg("ERROR: backoff pattern match regexec failed: %s", reg_errbuf);
-         }
-/*
- *	Obtain the port name and port number using the pmatch offsets
- *	set by the regex match.
+ *	dump_list -- Display contents of host list for debugging
+ *
+ *	Inputs:
+ *
+ *	scan		The scan context
+ *
+ *	Returns:
+ *
+ *	None.
  */
-         name_len = pmatch[1].rm_eo - pmatch[1].rm_so;
-         if (name_len >= sizeof(portname)) {
-            name_len = sizeof(portname) - 1;
-         }
-         port_len = pmatch[2].rm_eo - pmatch[2].rm_so;
-            if (port_len >= sizeof(portstr)) {
-            port_len = sizeof(portstr) - 1;
-         }
-         memcpy(portname, lbuf+pmatch[1].rm_so, name_len);
-         portname[name_len] = '\0';
-         memcpy(portstr, lbuf+pmatch[2].rm_so, port_len);
-         portstr[port_len] = '\0';
-/*
- *	Convert the port number string to an integer, and check that it
- *	is in range.
- */
-         port = Strtoul(portstr, 10);
-         if (port > 65535) {
-            warn_msg("WARNING: port number %s for service %s is out of range",
-                     portstr, portname);
-            continue;
-         }
+void
+dump_list(tcpscan_ctx *scan) {
+   tcpscan_engine *eng = scan->engine;
+   unsigned i;
+
+   printf("Host List:\n\n");
+   printf("Entry\tIP Address\n");
+   for (i=0; i<scan->num_hosts; i++)
+      printf("%u\t%s\n", scan->helistptr[i]->n,
+             my_ntoa(scan->helistptr[i]->addr, eng->ipv6_flag));
+   printf("\nTotal of %u host entries.\n\n", scan->num_hosts);
+}
+
 /*
- *	Leave this entry unchanged if it already has an associated name.
+ *	add_host_port -- Add a host and port to the list
+ *
+ *	Inputs:
+ *
+ *	scan		The scan context
+ *	addr		IP address of target system
+ *	timeout		timeout for this host in milliseconds
+ *	port		TCP destination port
+ *
+ *	Returns:
+ *
+ *	None.
  */
-         if (portnames[port] != NULL) {
-            continue;
-         }
+void
+add_host_port(tcpscan_ctx *scan, const ip_address *addr,
+              unsigned host_timeout, unsigned port) {
+   tcpscan_engine *eng = scan->engine;
+   host_entry *he;
+
+   if (port > 65535)	/* Port 0 is a --discover ICMP echo */
+      err_msg("Invalid port number: %u.  Port must be in range 1-65535", port);
+
 /*
- *	Add a pointer to the port name to the appropriate entry in the
- *	port names array.
+ *	Grow the list by half its size each time, so that building a very
+ *	large list does not copy it many times.
  */
-         portnames[port] = make_message("%s", portname);
-         num_entries++;
-      }
-      fclose(fp);
-      if (verbose) {
-         warn_msg("--- %d services loaded from %s", num_entries, fn);
-      }
-      free(fn);
+   if (!scan->num_left) {	/* No entries left, allocate some more */
+      scan->num_left = scan->num_hosts / 2 > REALLOC_COUNT ?
+                       scan->num_hosts / 2 : REALLOC_COUNT;
+      if (scan->helist)
+         scan->helist=Realloc(scan->helist,
+                              ((size_t) scan->num_hosts + scan->num_left) *
+                              sizeof(host_entry));
+      else
+         scan->helist=Malloc(scan->num_left*sizeof(host_entry));
+   }
+
+   he = scan->helist + scan->num_hosts; /* Would array notation be better? */
+   scan->num_hosts++;
+   scan->num_left--;
+
+   he->n = scan->num_hosts;
+   if (eng->ipv6_flag) {
+      memcpy(&(he->addr.v6), &(addr->v6), sizeof(struct in6_addr));
+   } else {
+      memcpy(&(he->addr.v4), &(addr->v4), sizeof(struct in_addr));
    }
+   he->live = 1;
+   he->prev = PREV_NONE;
+   he->timeout = host_timeout * 1000;	/* Convert from ms to us */
+   he->num_sent = 0;
+   he->num_recv = 0;
+   he->last_send_time.tv_sec=0;
+   he->last_send_time.tv_usec=0;
+   he->send_ns=0;
+   he->dport=port;
 }
 
 /*
- *      clean_up -- Clean-Up routine.
+ *	get_source_ip	-- Get source IP address for the specified interface
  *
- *      Inputs:
+ *	Inputs:
  *
- *      None.
+ *	devname		The network interface name.
  *
- *      Returns:
+ *	Returns:
  *
- *      None.
+ *	The IP address of the specified interface as a 32-bit value.
  *
- *      This is called once after all hosts have been processed.
+ *	This function works for Linux.
  */
-void
-clean_up(void) {
-   struct pcap_stat stats;
+uint32_t
+get_source_ip(const char *devname) {
+   int sockfd;
+   struct ifreq ifconfig;
+   struct sockaddr_in sa;
+
+   strlcpy(ifconfig.ifr_name, devname, sizeof(ifconfig.ifr_name));
+
+/* Create UDP socket */
+   if ((sockfd=socket(PF_INET, SOCK_DGRAM, 0)) < 0) {
+      err_sys("socket");
+   }
+/* Obtain IP address for specified interface */
+   if ((ioctl(sockfd, SIOCGIFADDR, &ifconfig)) != 0) {
+      if (errno == EADDRNOTAVAIL) {
+         err_sys("Cannot obtain IP address for interface %s", devname);
+      } else {
+         err_sys("ioctl");
+      }
+   }
+/* Close the socket */
+   close(sockfd);
+
+   memcpy(&sa, &ifconfig.ifr_ifru.ifru_addr, sizeof(sa));
+   return sa.sin_addr.s_addr;
+}
 
-   if ((pcap_stats(pcap_handle, &stats)) < 0)
-      err_msg("pcap_stats: %s\n", pcap_geterr(pcap_handle));
+/*
+ *	host_index_slot -- Return the host index slot for an address and port
+ *
+ *	This is a multiplicative hash of the 48-bit address and port, using
+ *	the top bits of the product, which are the best mixed.
+ */
+static unsigned
+host_index_slot(tcpscan_ctx *scan, uint32_t addr, unsigned port) {
+   TCP_UINT64 key = ((TCP_UINT64) addr << 16) | port;
 
-   printf("%u packets received by filter, %u packets dropped by kernel\n",
-          stats.ps_recv, stats.ps_drop);
-   if (pcap_dump_handle)
-      pcap_dump_close(pcap_dump_handle);
-   pcap_close(pcap_handle);
+   return (unsigned) ((key * 0x9e3779b97f4a7c15ULL) >> 32) &
+          scan->host_index_mask;
 }
 
 /*
- *	usage -- display usage message and exit
+ *	select_shard -- Reduce the host list to this node's --shard
  *
  *	Inputs:
  *
- *	status		Status value to pass to exit()
- *	detailed	zero for brief output, non-zero for detailed output
+ *	scan		The scan context
  *
  *	Returns:
  *
- *	None (this function calls exit and never returns).
+ *	None.
+ *
+ *	Every node builds the same list from the same targets, and puts it
+ *	in the same order with permute_index() keyed by --seed.  Node i of N
+ *	keeps the ith of N consecutive runs of that order, so the shards
+ *	differ in size by at most one entry and between them cover the list
+ *	exactly once.  The kept entries are moved to a new list in the
+ *	permuted order, so each shard is also scanned in a random order.
+ *	Entry numbers are those in the full list.  If there are fewer
+ *	entries than nodes, some shards are empty, and those nodes display
+ *	a scan of no ports.
  */
 void
-usage(int status, int detailed) {
-   fprintf(stderr, "Usage: tcp-scan [options] [hosts...]\n");
-   fprintf(stderr, "\n");
-   fprintf(stderr, "Target hosts are specified on the command line unless the --file option is used,\n");
-   fprintf(stderr, "in which case the targets are read from the specified file instead.\n");
-   fprintf(stderr, "\n");
-   fprintf(stderr, "The target hosts can be specified as IP addresses or hostnames.\n");
-   fprintf(stderr, "\n");
-   if (detailed) {
-      fprintf(stderr, "In the options below a letter or word in angle brackets like <f> denotes a\n");
-      fprintf(stderr, "value or string that must be supplied. The corresponding text should\n");
-      fprintf(stderr, "explain the meaning of this value or string. When supplying the value or\n");
-      fprintf(stderr, "string, do not include the angle brackets. Text in square brackets like [<f>]\n");
-      fprintf(stderr, "mean that the enclosed text is optional.\n");
-      fprintf(stderr, "\n");
-      fprintf(stderr, "Options:\n");
-      fprintf(stderr, "\n");
-      fprintf(stderr, "--help or -h\t\tDisplay this usage message and exit.\n");
-      fprintf(stderr, "\n--file=<fn> or -f <fn>\tRead hostnames or addresses from the specified file\n");
-      fprintf(stderr, "\t\t\tinstead of from the command line. One name or IP\n");
-      fprintf(stderr, "\t\t\taddress per line.  Use \"-\" for standard input.\n");
-      fprintf(stderr, "\n--retry=<n> or -r <n>\tSet total number of attempts per host to <n>,\n");
-      fprintf(stderr, "\t\t\tdefault=%d.\n", retry);
-      fprintf(stderr, "\n--timeout=<n> or -t <n>\tSet initial per host timeout to <n> ms, default=%d.\n", timeout);
-      fprintf(stderr, "\t\t\tThis timeout is for the first packet sent to each host.\n");
-      fprintf(stderr, "\t\t\tsubsequent timeouts are multiplied by the backoff\n");
-      fprintf(stderr, "\t\t\tfactor which is set with --backoff.\n");
-      fprintf(stderr, "\n--bandwidth=<n> or -B <n> Set desired outbound bandwidth to <n>, default=%u\n", DEFAULT_BANDWIDTH);
-      fprintf(stderr, "\t\t\tThe value is in bits per second by default.  If you\n");
-      fprintf(stderr, "\t\t\tappend \"K\" to the value, then the units are kilobits\n");
-      fprintf(stderr, "\t\t\tper sec; and if you append \"M\" to the value, the\n");
-      fprintf(stderr, "\t\t\tunits are megabits per second.\n");
-      fprintf(stderr, "\t\t\tThe \"K\" and \"M\" suffixes represent the decimal, not\n");
-      fprintf(stderr, "\t\t\tbinary, multiples.  So 64K is 64000, not 65536.\n");
-      fprintf(stderr, "\n--interval=<n> or -i <n> Set minimum packet interval to <n> ms.\n");
-      fprintf(stderr, "\t\t\tThe packet interval will be no smaller than this number.\n");
-      fprintf(stderr, "\t\t\tThe interval specified is in milliseconds by default.\n");
-      fprintf(stderr, "\t\t\tif \"u\" is appended to the value, then the interval\n");
-      fprintf(stderr, "\t\t\tis in microseconds, and if \"s\" is appended, the\n");
-      fprintf(stderr, "\t\t\tinterval is in seconds.\n");
-      fprintf(stderr, "\t\t\tIf you want to use up to a given bandwidth, then it is\n");
-      fprintf(stderr, "\t\t\teasier to use the --bandwidth option instead.\n");
-      fprintf(stderr, "\t\t\tYou cannot specify both --interval and --bandwidth\n");
-      fprintf(stderr, "\t\t\tbecause they are just different ways to change the\n");
-      fprintf(stderr, "\t\t\tsame underlying variable.\n");
-      fprintf(stderr, "\n--backoff=<b> or -b <b>\tSet timeout backoff factor to <b>, default=%.2f.\n", backoff_factor);
-      fprintf(stderr, "\t\t\tThe per-host timeout is multiplied by this factor\n");
-      fprintf(stderr, "\t\t\tafter each timeout.  So, if the number of retrys\n");
-      fprintf(stderr, "\t\t\tis 3, the initial per-host timeout is 500ms and the\n");
-      fprintf(stderr, "\t\t\tbackoff factor is 1.5, then the first timeout will be\n");
-      fprintf(stderr, "\t\t\t500ms, the second 750ms and the third 1125ms.\n");
-      fprintf(stderr, "\n--verbose or -v\t\tDisplay verbose progress messages.\n");
-      fprintf(stderr, "\t\t\tUse more than once for greater effect:\n");
-      fprintf(stderr, "\t\t\t1 - Show when hosts are removed from the list and\n");
-      fprintf(stderr, "\t\t\t    when packets with invalid cookies are received.\n");
-      fprintf(stderr, "\t\t\t2 - Show each packet sent and received.\n");
-      fprintf(stderr, "\t\t\t3 - Display the host list before\n");
-      fprintf(stderr, "\t\t\t    scanning starts.\n");
-      fprintf(stderr, "\n--version or -V\t\tDisplay program version and exit.\n");
-      fprintf(stderr, "\n--random or -R\t\tRandomise the host list.\n");
-      fprintf(stderr, "\n--numeric or -N\t\tIP addresses only, no hostnames.\n");
-      fprintf(stderr, "\t\t\tWith this option, all hosts must be specified as\n");
-      fprintf(stderr, "\t\t\tIP addresses.  Hostnames are not permitted.\n");
-   /*   fprintf(stderr, "\n--ipv6 or -6\t\tUse IPv6 protocol. Default is IPv4.\n"); */
-   /* scanner-specific help */
-      fprintf(stderr, "\n--port=<p> or -p <p>\tSpecify TCP destination port(s).\n");
-      fprintf(stderr, "\t\t\tThis option can be a single port, a list of ports\n");
-      fprintf(stderr, "\t\t\tseparated by commas, or an inclusive range with the\n");
-      fprintf(stderr, "\t\t\tbounds separated by \"-\".\n");
-      fprintf(stderr, "\n--sport=<p> or -s <p>\tSpecify TCP source port.\n");
-      fprintf(stderr, "\t\t\tThe default is a random port in the range 32678-65535.\n");
-      fprintf(stderr, "\n--seq=<s> or -e <s>\tSpecify initial sequence number.\n");
-      fprintf(stderr, "\t\t\tThe default initial sequence number is random.\n");
-      fprintf(stderr, "\n--ack=<a> or -c <a>\tSpecify initial acknowledgement number.\n");
-      fprintf(stderr, "\t\t\tThe default initial acknowledgement number is random.\n");
-      fprintf(stderr, "\t\t\tThis is only applicable when the ACK flag is set in\n");
-      fprintf(stderr, "\t\t\toutgoing packets.\n");
-      fprintf(stderr, "\n--window=<w> or -w <w>\tSpecify the TCP window size.\n");
-      fprintf(stderr, "\t\t\tThe default window size is %u.\n", DEFAULT_WINDOW);
-      fprintf(stderr, "\n--openonly or -o\tOnly display open ports.\n");
-      fprintf(stderr, "\t\t\tWith this option, closed ports are not displayed.\n");
-      fprintf(stderr, "\n--servicefile=<s> or -S <s> Use service file <s> for TCP ports.\n");
-      fprintf(stderr, "\t\t\tIf this option is specified, then the TCP ports to\n");
-      fprintf(stderr, "\t\t\tscan are read from the specified file.  The file is\n");
-      fprintf(stderr, "\t\t\tsame format as used by \"strobe\".\n");
-      fprintf(stderr, "\n--mss=<n> or -m <n>\tUse TCP MSS <n>.  Default is %u\n",
-              DEFAULT_MSS);
-      fprintf(stderr, "\t\t\tA non-zero MSS adds the MSS TCP option to the SYN packet\n");
-      fprintf(stderr, "\t\t\twhich adds 4 bytes to the packet length.  If the MSS\n");
-      fprintf(stderr, "\t\t\tis specified as zero, then no MSS option is added.\n");
-      fprintf(stderr, "\n--wscale or -W\t\tAdd the WSCALE TCP option\n");
-      fprintf(stderr, "\t\t\tThis option adds 4 bytes to the packet length.\n");
-      fprintf(stderr, "\n--sack or -a\t\tAdd the SACKOK TCP option\n");
-      fprintf(stderr, "\t\t\tThis option adds 4 bytes to the packet length. However\n");
-      fprintf(stderr, "\t\t\tit does not increase packet size when used with the\n");
-      fprintf(stderr, "\t\t\t--timestamp option.\n");
-      fprintf(stderr, "\n--timestamp or -T\tAdd the TIMESTAMP TCP option\n");
-      fprintf(stderr, "\t\t\tThe number of seconds since midnight 1/1/1970 is used\n");
-      fprintf(stderr, "\t\t\tfor the timestamp value.\n");
-      fprintf(stderr, "\t\t\tThis option adds 12 bytes to the packet length.\n");
-      fprintf(stderr, "\n--snap=<s> or -n <s>\tSet the pcap snap length to <s>. Default=%d.\n", SNAPLEN);
-      fprintf(stderr, "\t\t\tThis specifies the frame capture length.  This\n");
-      fprintf(stderr, "\t\t\tlength includes the data-link header as well as the\n");
-      fprintf(stderr, "\t\t\tIP and transport headers.  The default is normally\n");
-      fprintf(stderr, "\t\t\tsufficient.\n");
-      fprintf(stderr, "\n--ttl=<t> or -l <t>\tSet the IP TTL to <t>. Default=%d.\n", DEFAULT_TTL);
-      fprintf(stderr, "\t\t\tYou can specify a higher value if the targets are\n");
-      fprintf(stderr, "\t\t\tmany hops away, or you can specify a lower value to\n");
-      fprintf(stderr, "\t\t\tlimit the scope to the local network.\n");
-      fprintf(stderr, "\n--interface=<i> or -I <u> Use network interface <i>.\n");
-      fprintf(stderr, "\t\t\tIf this option is not specified, tcp-scan will search\n");
-      fprintf(stderr, "\t\t\tthe system interface list for the lowest numbered,\n");
-      fprintf(stderr, "\t\t\tconfigured up interface (excluding loopback).\n");
-      fprintf(stderr, "\n--quiet or -q\t\tDon't decode the received packet.\n");
-      fprintf(stderr, "\t\t\tIf this option is specified, then only the minimum\n");
-      fprintf(stderr, "\t\t\tinformation is displayed.  This can be useful if you\n");
-      fprintf(stderr, "\t\t\tonly want to know if a port is open or not, or if\n");
-      fprintf(stderr, "\t\t\tstrange packets confuse the decoding process\n");
-      fprintf(stderr, "\n--ignoredups or -g\tDon't display duplicate packets.\n");
-      fprintf(stderr, "\t\t\tBy default, duplicate packets are displayed and flagged\n");
-      fprintf(stderr, "\t\t\twith \"(DUP: n)\" where n is the number of packets\n");
-      fprintf(stderr, "\t\t\treceived from that host so far.\n");
-      fprintf(stderr, "\n--df=<n> or -F <n>\tEnable (1) or disable (0) DF flag. Default=%d\n", DEFAULT_DF);
-      fprintf(stderr, "\t\t\tSetting this option to 1 sets the DF flag in the IP\n");
-      fprintf(stderr, "\t\t\theader of the outbound SYN packets.  Setting it to 0\n");
-      fprintf(stderr, "\t\t\tclears the DF flag.\n");
-      fprintf(stderr, "\n--tos=<n> or -O <n>\tSet IP TOS (Type of Service) to <n>. Default=%d\n", DEFAULT_TOS);
-      fprintf(stderr, "\t\t\tThis sets the TOS value in the IP header for outbound\n");
-      fprintf(stderr, "\t\t\tpackets.\n");
-      fprintf(stderr, "\n--portname or -P\tDisplay port names as well as numbers.\n");
-      fprintf(stderr, "\n--servicefile2=<f> or -E <f>\tUse TCP service filename <f>.\n");
-      fprintf(stderr, "\t\t\tThe service file is used when displaying TCP port names.\n");
-      fprintf(stderr, "\t\t\tIt is in the standard \"/etc/services\" file format.\n");
-      fprintf(stderr, "\t\t\tBy default, the services file supplied with tcp-scan is\n");
-      fprintf(stderr, "\t\t\tused.\n");
-      fprintf(stderr, "\n--flags=<f> or -L <f>\tSpecify TCP flags to be set in outgoing packets.\n");
-      fprintf(stderr, "\t\t\tThe flags should be specified as a comma-separated list\n");
-      fprintf(stderr, "\t\t\tfrom the set of: CWR,ECN,URG,ACK,PSH,RST,SYN,FIN.\n");
-      fprintf(stderr, "\t\t\tIf this option is not specified, the flags default\n");
-      fprintf(stderr, "\t\t\tto SYN.\n");
-      fprintf(stderr, "\n--pcapsavefile=<p> or -C <p>\tWrite received packets to pcap savefile <p>.\n");
-      fprintf(stderr, "\t\t\tThis option causes received TCP packets to be written\n");
-      fprintf(stderr, "\t\t\tto a pcap savefile with the specified name.  This\n");
-      fprintf(stderr, "\t\t\tsavefile can be analyzed with programs that understand\n");
-      fprintf(stderr, "\t\t\tthe pcap file format, such as \"tcpdump\" and \"wireshark\".\n");
-   } else {
-      fprintf(stderr, "use \"tcp-scan --help\" for detailed information on the available options.\n");
+select_shard(tcpscan_ctx *scan) {
+   tcpscan_engine *eng = scan->engine;
+   host_entry *shard;
+   TCP_UINT64 first;
+   TCP_UINT64 last;
+   uint32_t pos;
+   unsigned i;
+
+   first = (TCP_UINT64) scan->num_hosts * (eng->shard_index - 1) /
+           eng->shard_count;
+   last = (TCP_UINT64) scan->num_hosts * eng->shard_index / eng->shard_count;
+   if (eng->verbose)
+      warn_msg("---\tShard %u/%u: entries %llu to %llu of %u in permuted order",
+               eng->shard_index, eng->shard_count,
+               (unsigned long long) first + 1, (unsigned long long) last,
+               scan->num_hosts);
+   shard = Malloc((last - first) * sizeof(host_entry));
+   for (i=0; i<scan->num_hosts; i++) {
+      pos = permute_index(i, scan->num_hosts, eng->seed);
+      if (pos >= first && pos < last)
+         shard[pos - first] = scan->helist[i];
    }
-   fprintf(stderr, "\n");
-   fprintf(stderr, "Report bugs or send suggestions at %s\n", PACKAGE_BUGREPORT);
-   exit(status);
+   free(scan->helist);
+   scan->helist = shard;
+   scan->num_hosts = last - first;
 }
 
 /*
- *	add_host -- Add a new host to the list.
+ *	select_previous -- Apply the --previous results to the host list
  *
  *	Inputs:
  *
- *	name		The Name or IP address of the host.
- *	host_timeout	The initial host timeout in ms.
+ *	scan		The scan context
  *
  *	Returns:
  *
  *	None.
  *
- *	This function is called before the helistptr array is created, so
- *	we use the helist array directly.
+ *	This reads the output of an earlier scan and records the state of
+ *	each port in it in the matching host entries.  Lines that are not
+ *	OPEN or CLOSED results, such as the "Starting" and "Ending" lines,
+ *	and results for ports that are not in the list are ignored, so the
+ *	previous output can be used as it is.
+ *
+ *	The list is then rebuilt with the entries that were open first, so
+ *	that they are checked first, followed by a --sample of the others.
+ *	Both parts keep the list order.
  */
 void
-add_host(const char *name, unsigned host_timeout) {
-   static int first_time_through=1;
-   char *cp;
+select_previous(tcpscan_ctx *scan) {
+   tcpscan_engine *eng = scan->engine;
+   FILE *fp;
+   char line[MAXLINE];
+   host_entry *selected;
+   unsigned count = 0;
+   unsigned in_list = 0;
+   unsigned i;
+   int pass;
 
-   if (first_time_through) {
-      if (local_data == NULL && port_list == NULL) {
-         warn_msg("You must specify the TCP dest ports with either the --port option");
-         err_msg("or with the --servicefile option.");
-      }
+   if (eng->ipv6_flag)
+      err_msg("The --previous option does not support IPv6.");
+   if ((fp = fopen(eng->previous_file, "r")) == NULL)
+      err_sys("fopen %s", eng->previous_file);
+   build_host_index(scan);
+   while (fgets(line, sizeof(line), fp)) {
+      struct in_addr addr;
+      unsigned port;
+      unsigned state;
+      unsigned slot;
+      char *field;
+      char *tab;
+
+      if ((tab = strchr(line, '\t')) == NULL)
+         continue;
+      *tab = '\0';
+      if (inet_pton(AF_INET, line, &addr) != 1)
+         continue;
+      field = tab + 1;
+      if (*field == '(' && (field = strstr(field, ") ")) != NULL)
+         field += 2;		/* Skip a different responder address */
+      if (field == NULL || !isdigit((unsigned char) *field))
+         continue;
+      port = strtoul(field, &field, 10);
+      if ((field = strchr(field, '\t')) == NULL)
+         continue;
+      field++;
+      if (strncmp(field, "OPEN", 4) == 0)
+         state = PREV_OPEN;
+      else if (strncmp(field, "CLOSED", 6) == 0)
+         state = PREV_CLOSED;
+      else
+         continue;
+      for (slot = host_index_slot(scan, addr.s_addr, port);
+           scan->host_index[slot];
+           slot = (slot + 1) & scan->host_index_mask) {
+         host_entry *he = &scan->helist[scan->host_index[slot] - 1];
 
-      if (local_data && port_list) {
-         err_msg("You cannot specify both the --port and --servicefile options.");
+         if (he->addr.v4.s_addr == addr.s_addr && he->dport == port) {
+            if (he->prev == PREV_NONE)
+               in_list++;
+            he->prev = state;
+         }
       }
-      first_time_through=0;
    }
-   if (local_data) {	/* --port option specified */
+   fclose(fp);
+   free(scan->host_index);
+   scan->host_index = NULL;	/* prepare_list() builds it again */
 /*
- *	Determine the ports in the port spec, and add a host entry for
- *	each one.
+ *	Copy the previously open entries, then the sample of the rest.
  */
-      cp = local_data;
-      while (*cp != '\0') {
-         unsigned port1;
-         unsigned port2;
-         unsigned i;
-   
-         port1=strtoul(cp, &cp, 10);
-         if (!port1 || (port1 & 0x80000000))	/* Zero or -ve */
-            err_msg("Invalid port specification: %s", local_data);
-         if (*cp == ',' || *cp == '\0') {	/* Single port specification */
-            add_host_port(name, host_timeout, port1);
-         } else if (*cp == '-') {		/* Inclusive range */
-            cp++;
-            port2=strtoul(cp, &cp, 10);
-            if (!port2 || port2 <= port1)	/* Missing end or empty range */
-               err_msg("Invalid port specification: %s", local_data);
-            for (i=port1; i<=port2; i++)
-               add_host_port(name, host_timeout, i);
-         } else {
-            err_msg("Invalid port specification: %s", local_data);
-         }
-         if (*cp == ',')
-            cp++;  /* Move on to next entry */
+   selected = Malloc(scan->num_hosts * sizeof(host_entry));
+   for (pass=0; pass<2; pass++) {
+      for (i=0; i<scan->num_hosts; i++) {
+         if ((scan->helist[i].prev == PREV_OPEN) != (pass == 0))
+            continue;
+         if (pass == 1 && eng->sample_rate < 1.0 &&
+             genrand_res53_r(&eng->rng) >= eng->sample_rate)
+            continue;
+         selected[count++] = scan->helist[i];
       }
-   } else {	/* --servicefile option specified */
+      if (pass == 0)
+         scan->previous_open = count;
+   }
+   if (eng->verbose)
+      warn_msg("---\tPrevious results: %u of %u entries found, %u open; "
+               "scanning %u entries", in_list, scan->num_hosts,
+               scan->previous_open, count);
+   free(scan->helist);
+   scan->helist = selected;
+   scan->num_hosts = count;
+   if (!scan->num_hosts)
+      err_msg("No host entries were selected by --sample.");
+}
+
 /*
- *	Add a host entry for each port in the port list.
+ *	shuffle_hosts -- Randomise part of the helistptr array
+ *
+ *	Inputs:
+ *
+ *	scan	The scan context
+ *	first	Position of the first entry to shuffle
+ *	last	Position after the last entry to shuffle
+ *
+ *	Returns:
+ *
+ *	None.
  */
-      int i=0;
+void
+shuffle_hosts(tcpscan_ctx *scan, unsigned first, unsigned last) {
+   tcpscan_engine *eng = scan->engine;
+   host_entry *temp;
+   unsigned r;
+   unsigned i;
 
-      while (port_list[i])
-         add_host_port(name, host_timeout, port_list[i++]);
+   for (i=last-1; i>first && i<last; i--) {
+      /* first<=r<i */
+      r = first + (unsigned)(genrand_real2_r(&eng->rng) * (i - first));
+      temp = scan->helistptr[i];
+      scan->helistptr[i] = scan->helistptr[r];
+      scan->helistptr[r] = temp;
    }
 }
 
 /*
- * 	remove_host -- Remove the specified host from the list
+ *	build_port_rank -- Work out the --priority position of each port
  *
- *	inputs:
+ *	Inputs:
  *
- *	he = Pointer to host entry to remove.
+ *	eng		The scan engine
  *
- *	If the host being removed is the one pointed to by the cursor, this
- *	function updates cursor so that it points to the next entry.
+ *	Returns:
+ *
+ *	None.
+ *
+ *	The ports in the --servicefile come first, in order of frequency,
+ *	if the file gives frequencies, and otherwise the common_ports
+ *	table.  The other ports follow in numeric order, so each port has
+ *	a different rank from 0 to PORT_COUNT-1.
  */
 void
-remove_host(host_entry **he) {
-   if ((*he)->live) {
-      (*he)->live = 0;
-      live_count--;
-      if (*he == *cursor)
-         advance_cursor();
-      if (debug) {print_times(); printf("remove_host: live_count now %d\n", live_count);}
-   } else {
-      if (verbose > 1)
-         warn_msg("***\tremove_host called on non-live host entry: SHOULDN'T HAPPEN");
+build_port_rank(tcpscan_engine *eng) {
+   const uint16_t *list = common_ports;
+   unsigned count = sizeof(common_ports) / sizeof(common_ports[0]);
+   unsigned next = 0;
+   unsigned i;
+
+   if (eng->port_list_weighted) {
+      list = eng->port_list;
+      for (count=0; eng->port_list[count]; count++)
+         ;
    }
+   eng->port_rank = Malloc(PORT_COUNT * sizeof(unsigned));
+   for (i=0; i<PORT_COUNT; i++)
+      eng->port_rank[i] = PORT_COUNT;	/* Not ranked yet */
+   for (i=0; i<count; i++)
+      if (eng->port_rank[list[i]] == PORT_COUNT)
+         eng->port_rank[list[i]] = next++;
+   for (i=0; i<PORT_COUNT; i++)
+      if (eng->port_rank[i] == PORT_COUNT)
+         eng->port_rank[i] = next++;
 }
 
 /*
- *	advance_cursor -- Advance the cursor to point at next live entry
+ *	sort_by_priority -- Order part of the helistptr array by port
  *
  *	Inputs:
  *
- *	None.
+ *	scan	The scan context
+ *	first	Position of the first entry to sort
+ *	last	Position after the last entry to sort
  *
  *	Returns:
  *
  *	None.
  *
- *	Does nothing if there are no live entries in the list.
+ *	This puts the entries for the most common port on all hosts first,
+ *	then the next most common port, and so on, so that a scan that is
+ *	stopped early has covered the ports most likely to be open.  It is
+ *	a counting sort on the port rank, which keeps the host order for
+ *	each port.  With --random, the hosts for each port are shuffled.
  */
 void
-advance_cursor(void) {
-   if (live_count) {
-      do {
-         if (cursor == (helistptr+(num_hosts-1)))
-            cursor = helistptr;	/* Wrap round to beginning */
-         else
-            cursor++;
-      } while (!(*cursor)->live);
-   } /* End If */
-   if (debug) {print_times(); printf("advance_cursor: cursor now %d\n", (*cursor)->n);}
+sort_by_priority(tcpscan_ctx *scan, unsigned first, unsigned last) {
+   tcpscan_engine *eng = scan->engine;
+   host_entry **sorted;
+   unsigned *start;
+   unsigned run;
+   unsigned i;
+
+   if (last <= first)
+      return;
+   if (!eng->port_rank)
+      build_port_rank(eng);
+/*
+ *	Count the entries of each rank, and turn the counts into the
+ *	position of the first entry of each rank.
+ */
+   start = Malloc((PORT_COUNT + 1) * sizeof(unsigned));
+   memset(start, '\0', (PORT_COUNT + 1) * sizeof(unsigned));
+   for (i=first; i<last; i++)
+      start[eng->port_rank[scan->helistptr[i]->dport] + 1]++;
+   for (i=1; i<=PORT_COUNT; i++)
+      start[i] += start[i-1];
+   sorted = Malloc((last - first) * sizeof(host_entry *));
+   for (i=first; i<last; i++)
+      sorted[start[eng->port_rank[scan->helistptr[i]->dport]]++] =
+         scan->helistptr[i];
+   memcpy(scan->helistptr + first, sorted,
+          (last - first) * sizeof(host_entry *));
+   free(sorted);
+   free(start);
+
+   if (scan->random_flag) {
+      run = first;
+      for (i=first+1; i<=last; i++) {
+         if (i == last ||
+             scan->helistptr[i]->dport != scan->helistptr[run]->dport) {
+            shuffle_hosts(scan, run, i);
+            run = i;
+         }
+      }
+   }
 }
 
 /*
- *	recvfrom_wto -- Receive packet with timeout
+ *	display_vanished -- Display a --previous result that has gone away
  *
  *	Inputs:
  *
- *	s	Socket file descriptor.
- *	tmo	Select timeout in us.
+ *	scan	The scan context
+ *	he	The host entry, which has timed out
  *
  *	Returns:
  *
  *	None.
+ */
+void
+display_vanished(tcpscan_ctx *scan, const host_entry *he) {
+   tcpscan_engine *eng = scan->engine;
+   if (scan->open_only && he->prev != PREV_OPEN)
+      return;
+   scan->vanished++;
+   printf("%s\t%u\tVANISHED was=%s\n", my_ntoa(he->addr, eng->ipv6_flag),
+          he->dport, prev_names[he->prev]);
+}
+
+/*
+ *	parse_discover -- Parse the --discover probe list
  *
- *	This calls pcap_dispatch() if data was successfully read from
- *	the socket.
+ *	Inputs:
+ *
+ *	eng	The scan engine
+ *	list	Comma-separated list of TCP ports and "icmp"
+ *
+ *	Returns:
+ *
+ *	None.
+ *
+ *	Each item is a probe sent to every host: a SYN to a TCP port, or an
+ *	ICMP echo request for "icmp", which is stored as port 0.
  */
 void
-recvfrom_wto(int s, int tmo) {
-   fd_set readset;
-   struct timeval to;
-   int n;
+parse_discover(tcpscan_engine *eng, const char *list) {
+   char *copy = dupstr(list);
+   char *item;
+   char *saveptr;
 
-   FD_ZERO(&readset);
-   FD_SET(s, &readset);
-   to.tv_sec  = tmo/1000000;
-   to.tv_usec = (tmo - 1000000*to.tv_sec);
-   n = select(s+1, &readset, NULL, NULL, &to);
-   if (debug) {print_times(); printf("recvfrom_wto: select end, tmo=%d, n=%d\n", tmo, n);}
-   if (n < 0) {
-      err_sys("select");
-   } else if (n == 0) {
-      return;	/* Timeout */
+   free(eng->discover_ports);
+   eng->discover_ports = Malloc(MAX_DISCOVER_PORTS * sizeof(uint16_t));
+   eng->discover_count = 0;
+   eng->discover_icmp = 0;
+   for (item = strtok_r(copy, ",", &saveptr); item != NULL;
+        item = strtok_r(NULL, ",", &saveptr)) {
+      unsigned long port;
+      char *end;
+
+      if (eng->discover_count == MAX_DISCOVER_PORTS)
+         err_msg("The --discover option can have at most %u probes.",
+                 MAX_DISCOVER_PORTS);
+      if (strcmp(item, "icmp") == 0) {
+         port = 0;
+         eng->discover_icmp = 1;
+      } else {
+         port = strtoul(item, &end, 10);
+         if (*end != '\0' || end == item || port < 1 || port > 65535)
+            err_msg("Invalid --discover probe \"%s\"", item);
+      }
+      eng->discover_ports[eng->discover_count++] = port;
    }
-   if ((pcap_dispatch(pcap_handle, -1, callback, NULL)) < 0)
-      err_sys("pcap_dispatch: %s\n", pcap_geterr(pcap_handle));
+   if (!eng->discover_count)
+      err_msg("The --discover option needs at least one probe.");
+   free(copy);
 }
 
 /*
- *	dump_list -- Display contents of host list for debugging
+ *	discover_compare -- qsort() and bsearch() comparison for discover_host
+ */
+static int
+discover_compare(const void *a, const void *b) {
+   uint32_t aa = ((const discover_host *) a)->addr;
+   uint32_t ab = ((const discover_host *) b)->addr;
+
+   return aa < ab ? -1 : aa > ab;
+}
+
+/*
+ *	find_discover_host -- Find an address in the --discover host list
+ *
+ *	Inputs:
+ *
+ *	scan	The scan context
+ *	addr	IPv4 address in host byte order
+ *
+ *	Returns:
+ *
+ *	The entry for the address, or NULL if it is not a target.
+ */
+discover_host *
+find_discover_host(tcpscan_ctx *scan, uint32_t addr) {
+   discover_host key;
+
+   key.addr = addr;
+   return bsearch(&key, scan->discover_list, scan->discover_list_len,
+                  sizeof(discover_host), discover_compare);
+}
+
+/*
+ *	discover_hosts -- Remove the hosts that are down from the host list
  *
  *	Inputs:
  *
+ *	scan		The scan context
+ *	sockfd		Raw IP socket, or -1 with --dryrun
+ *
+ *	Returns:
+ *
  *	None.
  *
+ *	This is the --discover pre-pass.  Each target address that is not
+ *	in the --discovercache is sent the discovery probes, as a scan of
+ *	its own with the same timing, retry and bandwidth settings.  A host
+ *	is up if any probe gets a reply of any kind, and then its other
+ *	probes are not retried.  The entries for hosts that are down are
+ *	then removed, so the full scan only probes the hosts that are up.
+ *	Entry numbers are those in the full list.
+ */
+void
+discover_hosts(tcpscan_ctx *scan, int sockfd) {
+   tcpscan_engine *eng = scan->engine;
+   tcpscan_ctx disc;
+   struct timeval start;
+   ip_address addr;
+   unsigned cached = 0;
+   unsigned up = 0;
+   unsigned kept = 0;
+   time_t now;
+   unsigned i;
+   unsigned j;
+
+   if (eng->ipv6_flag)
+      err_msg("The --discover option does not support IPv6.");
+/*
+ *	Make a sorted list of the unique target addresses, and fill in the
+ *	states that are in the cache.
+ */
+   scan->discover_list = Malloc(scan->num_hosts * sizeof(discover_host));
+   for (i=0; i<scan->num_hosts; i++)
+      scan->discover_list[i].addr = ntohl(scan->helist[i].addr.v4.s_addr);
+   qsort(scan->discover_list, scan->num_hosts, sizeof(discover_host),
+         discover_compare);
+   for (i=0, j=0; i<scan->num_hosts; i++) {
+      if (j && scan->discover_list[j-1].addr == scan->discover_list[i].addr)
+         continue;
+      scan->discover_list[j].addr = scan->discover_list[i].addr;
+      scan->discover_list[j].state = DISCOVER_UNKNOWN;
+      scan->discover_list[j].when = 0;
+      j++;
+   }
+   scan->discover_list_len = j;
+   if (*eng->discover_cache != '\0')
+      cached = read_discover_cache(scan);
+/*
+ *	Probe the other hosts.  Any reply shows that a host is up, so the
+ *	discovery scan displays nothing and sees closed ports too.
+ */
+   init_context(&disc, eng, scan);
+   disc.open_only = 0;
+   disc.ignore_dups = 1;
+   disc.reply_fn = discover_reply;
+   disc.reply_arg = &disc;
+   disc.discover_list = scan->discover_list;	/* Updated by discover_reply() */
+   disc.discover_list_len = scan->discover_list_len;
+   memset(&addr, '\0', sizeof(addr));
+   for (i=0; i<scan->discover_list_len; i++) {
+      if (scan->discover_list[i].state != DISCOVER_UNKNOWN)
+         continue;
+      addr.v4.s_addr = htonl(scan->discover_list[i].addr);
+      for (j=0; j<eng->discover_count; j++)
+         add_host_port(&disc, &addr, disc.timeout, eng->discover_ports[j]);
+   }
+   if (disc.num_hosts) {
+      prepare_list(&disc);
+      engine_gettimeofday(eng, &start);
+      scan_loop(&disc, sockfd, &start);
+   }
+   for (i=0; i<TX_RING_SIZE; i++)
+      if (eng->tx_ring[i].he >= disc.helist &&
+          eng->tx_ring[i].he < disc.helist + disc.num_hosts)
+         eng->tx_ring[i].he = NULL;
+   free(disc.helist);
+   free(disc.helistptr);
+   free(disc.host_index);
+   free(disc.host_stats);
+   free(disc.local_data);
+/*
+ *	Hosts that did not reply are down.  Keep the entries for the hosts
+ *	that are up, in the same order.
+ */
+   now = time(NULL);
+   for (i=0; i<scan->discover_list_len; i++) {
+      if (scan->discover_list[i].state == DISCOVER_UNKNOWN) {
+         scan->discover_list[i].state = DISCOVER_DOWN;
+         scan->discover_list[i].when = now;
+      }
+      if (scan->discover_list[i].state == DISCOVER_UP)
+         up++;
+   }
+   for (i=0; i<scan->num_hosts; i++) {
+      if (find_discover_host(scan,
+                             ntohl(scan->helist[i].addr.v4.s_addr))->state ==
+          DISCOVER_UP)
+         scan->helist[kept++] = scan->helist[i];
+   }
+   scan->num_left += scan->num_hosts - kept;
+   scan->num_hosts = kept;
+   if (eng->verbose)
+      warn_msg("---\tDiscovery: %u of %u hosts up, %u from the cache, "
+               "%u entries to scan", up, scan->discover_list_len, cached,
+               kept);
+   if (*eng->discover_cache != '\0')
+      write_discover_cache(scan);
+   free(scan->discover_list);
+   scan->discover_list = NULL;
+   scan->discover_list_len = 0;
+}
+
+/*
+ *	discover_reply -- Record a reply to a --discover probe
+ *
+ *	Inputs:
+ *
+ *	arg		The discovery scan context
+ *	reply		The reply
+ *
  *	Returns:
  *
  *	None.
+ *
+ *	This is the reply callback of the discovery scan.  It marks the
+ *	host as up and removes its other probes, which need no retries.
  */
 void
-dump_list(void) {
+discover_reply(void *arg, const tcpscan_reply *reply) {
+   tcpscan_ctx *scan = arg;
+   tcpscan_engine *eng = scan->engine;
+   discover_host *dh = find_discover_host(scan, ntohl(reply->addr.s_addr));
    unsigned i;
 
-   printf("Host List:\n\n");
-   printf("Entry\tIP Address\n");
-   for (i=0; i<num_hosts; i++)
-      printf("%u\t%s\n", helistptr[i]->n, my_ntoa(helistptr[i]->addr,ipv6_flag));
-   printf("\nTotal of %u host entries.\n\n", num_hosts);
+   if (dh == NULL || dh->state == DISCOVER_UP)
+      return;
+   dh->state = DISCOVER_UP;
+   dh->when = time(NULL);
+   for (i=0; i<eng->discover_count; i++) {
+      host_entry *he;
+
+      if (eng->discover_ports[i] == reply->port)
+         continue;
+      he = lookup_host(scan, &reply->addr, eng->discover_ports[i]);
+      if (he && he->live)
+         remove_host(scan, &he);
+   }
 }
 
 /*
- *	add_host_port -- Add a host and port to the list
+ *	parse_discover_line -- Parse a line of the --discovercache file
  *
  *	Inputs:
  *
- *	name		Hostname or IP address of target system
- *	timeout		timeout for this host in milliseconds
- *	port		TCP destination port
+ *	line	The line, "<address> up|down <time>"
+ *	addr	Set to the address in host byte order
+ *	state	Set to DISCOVER_UP or DISCOVER_DOWN
+ *	when	Set to the time, in seconds since the epoch
+ *
+ *	Returns:
+ *
+ *	1 if the line is valid, otherwise 0.
+ */
+static int
+parse_discover_line(const char *line, uint32_t *addr, unsigned char *state,
+                    time_t *when) {
+   char addr_str[16];
+   char state_str[5];
+   unsigned long t;
+   struct in_addr in;
+
+   if (sscanf(line, "%15s %4s %lu", addr_str, state_str, &t) != 3 ||
+       inet_pton(AF_INET, addr_str, &in) <= 0)
+      return 0;
+   if (strcmp(state_str, "up") == 0)
+      *state = DISCOVER_UP;
+   else if (strcmp(state_str, "down") == 0)
+      *state = DISCOVER_DOWN;
+   else
+      return 0;
+   *addr = ntohl(in.s_addr);
+   *when = (time_t) t;
+   return 1;
+}
+
+/*
+ *	read_discover_cache -- Apply the --discovercache file to the hosts
+ *
+ *	Inputs:
+ *
+ *	scan		The scan context
+ *
+ *	Returns:
+ *
+ *	The number of hosts whose state was taken from the cache.
+ *
+ *	States older than DISCOVER_CACHE_AGE are ignored.  A missing file
+ *	is an empty cache.
+ */
+unsigned
+read_discover_cache(tcpscan_ctx *scan) {
+   tcpscan_engine *eng = scan->engine;
+   FILE *fp;
+   char line[MAXLINE];
+   time_t now = time(NULL);
+   unsigned count = 0;
+
+   if ((fp = fopen(eng->discover_cache, "r")) == NULL) {
+      if (errno != ENOENT)
+         err_sys("fopen %s", eng->discover_cache);
+      return 0;
+   }
+   while (fgets(line, sizeof(line), fp)) {
+      discover_host *dh;
+      uint32_t addr;
+      unsigned char state;
+      time_t when;
+
+      if (!parse_discover_line(line, &addr, &state, &when) ||
+          now - when >= DISCOVER_CACHE_AGE ||
+          (dh = find_discover_host(scan, addr)) == NULL ||
+          dh->state != DISCOVER_UNKNOWN)
+         continue;
+      dh->state = state;
+      dh->when = when;
+      count++;
+   }
+   fclose(fp);
+   return count;
+}
+
+/*
+ *	write_discover_cache -- Save the host states in the --discovercache
+ *
+ *	Inputs:
+ *
+ *	scan		The scan context
  *
  *	Returns:
  *
  *	None.
+ *
+ *	The states of this scan's hosts replace any in the file, and the
+ *	file's other states that are still current are kept, so one cache
+ *	can serve scans of different targets.  The file is written under a
+ *	temporary name, synced and renamed, like the --checkpoint file, so
+ *	a crash never leaves it incomplete.
  */
 void
-add_host_port(const char *name, unsigned host_timeout, unsigned port) {
-   ip_address *hp=NULL;
-   ip_address addr;
-   host_entry *he;
-   static int num_left=0;	/* Number of free entries left */
-   int result;
+write_discover_cache(tcpscan_ctx *scan) {
+   tcpscan_engine *eng = scan->engine;
+   char *tmp_name = make_message("%s.tmp", eng->discover_cache);
+   char line[MAXLINE];
+   time_t now = time(NULL);
+   FILE *in;
+   FILE *out;
+   unsigned i;
 
-   if (port < 1 || port > 65535)
-      err_msg("Invalid port number: %u.  Port must be in range 1-65535", port);
+   if ((out = fopen(tmp_name, "w")) == NULL)
+      err_sys("fopen %s", tmp_name);
+   if ((in = fopen(eng->discover_cache, "r")) != NULL) {
+      while (fgets(line, sizeof(line), in)) {
+         uint32_t addr;
+         unsigned char state;
+         time_t when;
 
-   if (numeric_flag) {
-      if (ipv6_flag) {
-         result = inet_pton(AF_INET6, name, &(addr.v6));
-      } else {
-         result = inet_pton(AF_INET, name, &(addr.v4));
-      }
-      if (result <= 0)
-         err_sys("inet_pton failed for \"%s\"", name);
-   } else {
-      if (ipv6_flag) {
-         hp = get_host_address(name, AF_INET6, &addr, &ga_err_msg);
-      } else {
-         hp = get_host_address(name, AF_INET, &addr, &ga_err_msg);
+         if (parse_discover_line(line, &addr, &state, &when) &&
+             now - when < DISCOVER_CACHE_AGE && !find_discover_host(scan, addr))
+            fputs(line, out);
       }
-      if (hp == NULL)
-         err_msg("get_host_address failed for \"%s\": %s", name, ga_err_msg);
+      fclose(in);
    }
+   for (i=0; i<scan->discover_list_len; i++) {
+      struct in_addr host_addr;
 
-   if (!num_left) {	/* No entries left, allocate some more */
-      if (helist)
-         helist=Realloc(helist, (num_hosts * sizeof(host_entry)) +
-                        REALLOC_COUNT*sizeof(host_entry));
-      else
-         helist=Malloc(REALLOC_COUNT*sizeof(host_entry));
-      num_left = REALLOC_COUNT;
+      host_addr.s_addr = htonl(scan->discover_list[i].addr);
+      fprintf(out, "%s\t%s\t%lu\n", inet_ntoa(host_addr),
+              scan->discover_list[i].state == DISCOVER_UP ? "up" : "down",
+              (unsigned long) scan->discover_list[i].when);
    }
+   if (fflush(out) || fsync(fileno(out)))
+      err_sys("write %s", tmp_name);
+   if (fclose(out) != 0)
+      err_sys("fclose %s", tmp_name);
+   if (rename(tmp_name, eng->discover_cache))
+      err_sys("rename %s", tmp_name);
+   free(tmp_name);
+}
+
+/*
+ *	start_workers -- Fork the --workers processes
+ *
+ *	Inputs:
+ *
+ *	scan		The scan context
+ *
+ *	Returns:
+ *
+ *	In each worker only.  The parent merges the output of the workers,
+ *	displays the summary of the whole scan and exits.
+ *
+ *	Each worker is a complete scan of one --shard of the host list,
+ *	subdividing this node's shard if --shard was given, with its own raw
+ *	socket, capture and output buffer, and its share of the bandwidth.
+ *	The workers use consecutive source ports, so the capture filter of
+ *	each sees only the replies to its own probes.  Their stdout goes to
+ *	a pipe each, which the parent copies to its own stdout a line at a
+ *	time, and their counters, RTT histogram and elapsed time come back
+ *	through shared memory.  The elapsed time of the whole scan is that
+ *	of the slowest worker.
+ */
+void
+start_workers(tcpscan_ctx *scan) {
+   tcpscan_engine *eng = scan->engine;
+   unsigned first_shard = eng->shard_count ? eng->shard_index : 1;
+   unsigned node_shards = eng->shard_count ? eng->shard_count : 1;
+   unsigned total_hosts = 0;
+   unsigned total_responders = 0;
+   int status = EXIT_SUCCESS;
+   struct timeval now;
+   double elapsed_seconds = 0.0;
+   int *fds;
+   pid_t *pids;
+   int wstatus;
+   unsigned w;
 
-   he = helist + num_hosts; /* Would array notation be better? */
-   num_hosts++;
-   num_left--;
+   if (*eng->replay_file != '\0' || *eng->pcap_savefile != '\0' ||
+       *eng->metrics_spec != '\0' || *eng->stats_file != '\0' ||
+       eng->progress_flag || *eng->checkpoint_file != '\0')
+      err_msg("You cannot use --workers with --replay, --pcapsavefile, "
+              "--metrics, --statsfile, --progress or --checkpoint.");
+   if ((TCP_UINT64) node_shards * eng->workers > 0xffffffff)
+      err_msg("Too many --shard nodes for %u --workers.", eng->workers);
+/*
+ *	Only one process can read the targets from stdin, so read them now
+ *	for each worker to parse.
+ */
+   if (eng->filename_flag && strcmp(eng->filename, "-") == 0) {
+      size_t size = 0;
+      ssize_t n;
 
-   he->n = num_hosts;
-   if (ipv6_flag) {
-      memcpy(&(he->addr.v6), &(addr.v6), sizeof(struct in6_addr));
-   } else {
-      memcpy(&(he->addr.v4), &(addr.v4), sizeof(struct in_addr));
+      do {
+         if (size - eng->stdin_targets_len < WORKER_READ_SIZE) {
+            size += WORKER_READ_SIZE;
+            eng->stdin_targets = Realloc(eng->stdin_targets, size);
+         }
+         n = read(STDIN_FILENO, eng->stdin_targets + eng->stdin_targets_len,
+                  size - eng->stdin_targets_len);
+         if (n < 0 && errno != EINTR)
+            err_sys("read");
+         if (n > 0)
+            eng->stdin_targets_len += n;
+      } while (n != 0);
    }
-   he->live = 1;
-   he->timeout = host_timeout * 1000;	/* Convert from ms to us */
-   he->num_sent = 0;
-   he->num_recv = 0;
-   he->last_send_time.tv_sec=0;
-   he->last_send_time.tv_usec=0;
-   he->dport=port;
+/*
+ *	Choose the first source port here, so that the workers' ports are
+ *	different.  Random ports are above 32767 as in initialise().
+ */
+   if (!eng->source_port_flag) {
+      engine_gettimeofday(eng, &now);
+      init_genrand_r(&eng->rng, eng->seed_flag ? eng->seed :
+                     (unsigned long) now.tv_usec ^ getpid());
+      eng->source_port = 0x8000 + genrand_int32_r(&eng->rng) %
+                                  (0x8000 - eng->workers + 1);
+      eng->source_port_flag = 1;
+   } else if (eng->source_port + eng->workers - 1 > 65535) {
+      err_msg("The --sport value is too high for %u --workers.", eng->workers);
+   }
+   eng->worker_results = mmap(NULL, eng->workers * sizeof(worker_result),
+                              PROT_READ | PROT_WRITE,
+                              MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+   if (eng->worker_results == MAP_FAILED)
+      err_sys("mmap");
+   fds = Malloc(eng->workers * sizeof(int));
+   pids = Malloc(eng->workers * sizeof(pid_t));
+   fflush(stdout);
+   fflush(stderr);
+   for (w=0; w<eng->workers; w++) {
+      int pipefd[2];
+      unsigned i;
+
+      if (pipe(pipefd) < 0)
+         err_sys("pipe");
+      if ((pids[w] = fork()) < 0)
+         err_sys("fork");
+      if (pids[w] == 0) {	/* Worker */
+         for (i=0; i<w; i++)
+            close(fds[i]);
+         close(pipefd[0]);
+         if (dup2(pipefd[1], STDOUT_FILENO) < 0)
+            err_sys("dup2");
+         close(pipefd[1]);
+         free(fds);
+         free(pids);
+         eng->worker_no = w + 1;
+         eng->shard_index = (first_shard - 1) * eng->workers + eng->worker_no;
+         eng->shard_count = node_shards * eng->workers;
+         eng->source_port += w;
+         if (scan->interval)
+            scan->interval *= eng->workers;
+         else if ((scan->bandwidth /= eng->workers) == 0)
+            scan->bandwidth = 1;
+         return;
+      }
+      close(pipefd[1]);
+      fds[w] = pipefd[0];
+   }
+/*
+ *	The parent needs no privileges to merge the output.
+ */
+   if ((setuid(getuid())) < 0)
+      err_sys("setuid");
+   merge_worker_output(eng, fds);
+   for (w=0; w<eng->workers; w++) {
+      while (waitpid(pids[w], &wstatus, 0) < 0)
+         if (errno != EINTR)
+            err_sys("waitpid");
+      if (!WIFEXITED(wstatus) || WEXITSTATUS(wstatus) != 0) {
+         warn_msg("Worker %u failed", w + 1);
+         status = EXIT_FAILURE;
+      }
+      total_hosts += eng->worker_results[w].num_hosts;
+      total_responders += eng->worker_results[w].responders;
+      if (eng->worker_results[w].elapsed_seconds > elapsed_seconds)
+         elapsed_seconds = eng->worker_results[w].elapsed_seconds;
+      hist_merge(&scan->rtt_hist, &eng->worker_results[w].rtt_hist);
+   }
+   printf("\n");
+   if (scan->rtt_flag) {
+      hist_print(stdout, &scan->rtt_hist, "RTT", 1000000.0, "ms", 1);
+      printf("\n");
+   }
+   printf("Ending %s: %u ports scanned in %.3f seconds (%.2f ports/sec).  %u responded\n",
+          PACKAGE_STRING, total_hosts, elapsed_seconds,
+          total_hosts/elapsed_seconds, total_responders);
+   exit(status);
 }
 
 /*
- *	in_cksum -- Internet checksum function
+ *	merge_worker_output -- Copy the output of the workers to stdout
  *
  *	Inputs:
  *
- *	ptr		Pointer to data
- *	nbytes		Number of bytes
+ *	eng	The scan engine
+ *	fds	The read ends of the workers' stdout pipes
  *
  *	Returns:
  *
- *	The checksum as a 16-bit unsigned value.
+ *	None, once every worker has closed its pipe.
  *
- *	This is the standard BSD internet checksum routine.
+ *	Output is only written in whole lines, so lines from different
+ *	workers are never mixed.  Each worker's "Starting" line is replaced
+ *	by one for the whole scan, which cannot be written until every
+ *	worker has built its list, so output is held until then.
  */
-uint16_t
-in_cksum(const uint16_t *ptr, int nbytes) {
-
-   register uint32_t sum;
-   uint16_t oddbyte;
-   register uint16_t answer;
+void
+merge_worker_output(tcpscan_engine *eng, const int *fds) {
+   struct {
+      int fd;			/* Read end of the pipe, or -1 at EOF */
+      int started;		/* "Starting" line seen, or EOF */
+      char *buf;		/* Output not yet written */
+      size_t len;
+      size_t size;
+   } *wo;
+   unsigned num_open = eng->workers;
+   unsigned num_started = 0;
+   fd_set readset;
+   int maxfd;
+   ssize_t n;
+   unsigned w;
 
+   wo = Malloc(eng->workers * sizeof(*wo));
+   for (w=0; w<eng->workers; w++) {
+      wo[w].fd = fds[w];
+      wo[w].started = 0;
+      wo[w].buf = NULL;
+      wo[w].len = 0;
+      wo[w].size = 0;
+   }
+   while (num_open) {
+      FD_ZERO(&readset);
+      maxfd = -1;
+      for (w=0; w<eng->workers; w++) {
+         if (wo[w].fd >= 0) {
+            FD_SET(wo[w].fd, &readset);
+            if (wo[w].fd > maxfd)
+               maxfd = wo[w].fd;
+         }
+      }
+      if (select(maxfd+1, &readset, NULL, NULL, NULL) < 0) {
+         if (errno == EINTR)
+            continue;
+         err_sys("select");
+      }
+      for (w=0; w<eng->workers; w++) {
+         if (wo[w].fd < 0 || !FD_ISSET(wo[w].fd, &readset))
+            continue;
+         if (wo[w].size - wo[w].len < WORKER_READ_SIZE) {
+            wo[w].size = wo[w].len + WORKER_READ_SIZE;
+            wo[w].buf = Realloc(wo[w].buf, wo[w].size);
+         }
+         n = read(wo[w].fd, wo[w].buf + wo[w].len, wo[w].size - wo[w].len);
+         if (n < 0) {
+            if (errno == EINTR)
+               continue;
+            err_sys("read");
+         }
+         if (n == 0) {
+            close(wo[w].fd);
+            wo[w].fd = -1;
+            num_open--;
+         }
+         wo[w].len += n;
 /*
- * Our algorithm is simple, using a 32-bit accumulator (sum),
- * we add sequential 16-bit words to it, and at the end, fold back
- * all the carry bits from the top 16 bits into the lower 16 bits.
+ *	Remove the worker's "Starting" line.  A worker that exits without
+ *	writing one counts as started, so that we don't wait for it.
  */
+         if (!wo[w].started) {
+            char *line = wo[w].buf;
+            char *end = wo[w].buf + wo[w].len;
+            char *nl;
 
-   sum = 0;
-   while (nbytes > 1)  {
-      sum += *ptr++;
-      nbytes -= 2;
-   }
-
-/* mop up an odd byte, if necessary */
-   if (nbytes == 1) {
-      oddbyte = 0;            /* make sure top half is zero */
-      *((u_char *) &oddbyte) = *(u_char *)ptr;   /* one byte only */
-      sum += oddbyte;
-   }
+            while (line < end && (nl = memchr(line, '\n', end - line))) {
+               if (nl - line >= 9 && strncmp(line, "Starting ", 9) == 0) {
+                  memmove(line, nl + 1, end - (nl + 1));
+                  wo[w].len -= nl + 1 - line;
+                  wo[w].started = 1;
+                  break;
+               }
+               line = nl + 1;
+            }
+            if (wo[w].fd < 0)
+               wo[w].started = 1;
+            if (wo[w].started && ++num_started == eng->workers) {
+               unsigned total_hosts = 0;
+               unsigned i;
 
+               for (i=0; i<eng->workers; i++)
+                  total_hosts += eng->worker_results[i].num_hosts;
+               printf("Starting %s with %u ports\n", PACKAGE_STRING,
+                      total_hosts);
+            }
+         }
+      }
+      if (num_started < eng->workers)
+         continue;
 /*
- * Add back carry outs from top 16 bits to low 16 bits.
+ *	Write the complete lines, or everything once the pipe is closed.
  */
+      for (w=0; w<eng->workers; w++) {
+         size_t out = wo[w].len;
 
-   sum  = (sum >> 16) + (sum & 0xffff);    /* add high-16 to low-16 */
-   sum += (sum >> 16);                     /* add carry */
-   answer = ~sum;          /* ones-complement, then truncate to 16 bits */
-   return(answer);
+         if (wo[w].fd >= 0)
+            while (out && wo[w].buf[out-1] != '\n')
+               out--;
+         if (out) {
+            fwrite(wo[w].buf, 1, out, stdout);
+            memmove(wo[w].buf, wo[w].buf + out, wo[w].len - out);
+            wo[w].len -= out;
+         }
+      }
+   }
+   fflush(stdout);
+   for (w=0; w<eng->workers; w++)
+      free(wo[w].buf);
+   free(wo);
 }
 
 /*
- *	get_source_ip	-- Get source IP address for the specified interface
+ *	build_host_index -- Build the hash index used by find_host()
  *
  *	Inputs:
  *
- *	devname		The network interface name.
+ *	scan		The scan context
  *
  *	Returns:
  *
- *	The IP address of the specified interface as a 32-bit value.
+ *	None.
  *
- *	This function works for Linux.
+ *	The index is an open addressing hash table with linear probing.
+ *	Each slot holds the position of an entry in helist plus one, or zero
+ *	if the slot is empty.  The table is a power of two at least 4/3 of
+ *	the number of entries, so it is at most three quarters full and
+ *	costs at most 5.3 bytes per entry on average.
  */
-uint32_t
-get_source_ip(const char *devname) {
-   int sockfd;
-   struct ifreq ifconfig;
-   struct sockaddr_in sa;
+void
+build_host_index(tcpscan_ctx *scan) {
+   size_t size = 16;
+   unsigned i;
 
-   strlcpy(ifconfig.ifr_name, devname, sizeof(ifconfig.ifr_name));
+   while (size < (size_t) scan->num_hosts + scan->num_hosts / 3)
+      size <<= 1;
+   scan->host_index = Malloc(size * sizeof(uint32_t));
+   memset(scan->host_index, '\0', size * sizeof(uint32_t));
+   scan->host_index_mask = size - 1;
 
-/* Create UDP socket */
-   if ((sockfd=socket(PF_INET, SOCK_DGRAM, 0)) < 0) {
-      err_sys("socket");
-   }
-/* Obtain IP address for specified interface */
-   if ((ioctl(sockfd, SIOCGIFADDR, &ifconfig)) != 0) {
-      if (errno == EADDRNOTAVAIL) {
-         err_sys("Cannot obtain IP address for interface %s", devname);
-      } else {
-         err_sys("ioctl");
-      }
-   }
-/* Close the socket */
-   close(sockfd);
+   for (i=0; i<scan->num_hosts; i++) {
+      unsigned slot = host_index_slot(scan, scan->helist[i].addr.v4.s_addr,
+                                      scan->helist[i].dport);
 
-   memcpy(&sa, &ifconfig.ifr_ifru.ifru_addr, sizeof(sa));
-   return sa.sin_addr.s_addr;
+      while (scan->host_index[slot])
+         slot = (slot + 1) & scan->host_index_mask;
+      scan->host_index[slot] = i + 1;
+   }
 }
 
 /*
@@ -1666,8 +4791,7 @@ get_source_ip(const char *devname) {
  *
  *	Inputs:
  *
- *	he 	Pointer to the current position in the list.  Search runs
- *		backwards starting from this point.
+ *	scan	The scan context
  *	addr 	The source IP address that the packet came from.
  *	packet_in The received packet data.
  *	n	The length of the received packet.
@@ -1676,19 +4800,23 @@ get_source_ip(const char *devname) {
  *
  *	a pointer to the host entry associated with the specified IP
  *	or NULL if no match found.
+ *
+ *	The entry is found with the hash index built by build_host_index(),
+ *	so the cost does not depend on the size of the list or on how far
+ *	the entry is from the cursor.  If the same address and port appear
+ *	more than once in the list, an entry that is still awaiting a reply
+ *	is preferred.
  */
 host_entry *
-find_host(host_entry **he, const struct in_addr *addr,
+find_host(tcpscan_ctx *scan, const struct in_addr *addr,
           const unsigned char *packet_in, unsigned n) {
-   host_entry **p;
-   int found = 0;
-   unsigned iterations = 0;	/* Used for debugging */
+   tcpscan_engine *eng = scan->engine;
    const struct iphdr *iph;
    const struct tcphdr *tcph;
 /*
  *      Don't try to match if packet is too short.
  */
-   if (n < ip_offset + sizeof(struct iphdr) + sizeof(struct tcphdr))
+   if (n < eng->ip_offset + sizeof(struct iphdr) + sizeof(struct tcphdr))
       return NULL;
 /*
  *      Overlay IP and TCP headers on packet buffer.
@@ -1696,41 +4824,216 @@ find_host(host_entry **he, const struct in_addr *addr,
  *      Note that iph.ihl is in 32-bit units.  We multiply by 4 to get bytes.
  *      iph.lhl is normally 5, but can be larger if IP options are present.
  */
-   iph = (const struct iphdr *) (packet_in + ip_offset);
-   tcph = (const struct tcphdr *) (packet_in + ip_offset + 4*(iph->ihl));
+   iph = (const struct iphdr *) (packet_in + eng->ip_offset);
+   tcph = (const struct tcphdr *) (packet_in + eng->ip_offset + 4*(iph->ihl));
+   return lookup_host(scan, addr, ntohs(tcph->source));
+}
+
 /*
- *      Don't try to match if host ptr is NULL.
- *      This should never happen, but we check just in case.
+ *	lookup_host -- Look up an address and port in the host list
+ *
+ *	Inputs:
+ *
+ *	scan	The scan context
+ *	addr	The IP address
+ *	port	The destination port of the entry, or 0 for a --discover
+ *		ICMP echo
+ *
+ *	Returns:
+ *
+ *	A pointer to the matching host entry, or NULL if there is none.
+ *
+ *	This is the index lookup for find_host() and echo_reply().
  */
-   if (*he == NULL)
-      return NULL;
+host_entry *
+lookup_host(tcpscan_ctx *scan, const struct in_addr *addr, unsigned port) {
+   tcpscan_engine *eng = scan->engine;
+   host_entry *found = NULL;
+   unsigned iterations = 0;	/* Used for debugging */
+   unsigned slot;
 /*
- *	Try to match against out host list.
+ *	Look up the address and port in the index.  We stop at the first
+ *	live match, or at an empty slot.
  */
-   p = he;
-   do {
+   slot = host_index_slot(scan, addr->s_addr, port);
+   while (scan->host_index[slot]) {
+      host_entry *p = &scan->helist[scan->host_index[slot] - 1];
+
       iterations++;
-      if (((*p)->addr.v4.s_addr == addr->s_addr) &&
-          (ntohs(tcph->source) == (*p)->dport)) {
-         found = 1;
-      } else {
-         if (p == helistptr) {
-            p = helistptr + (num_hosts-1); /* Wrap round to end */
-         } else {
-            p--;
+      if (p->addr.v4.s_addr == addr->s_addr && p->dport == port) {
+         if (p->live) {
+            found = p;
+            break;
          }
+         if (!found)
+            found = p;
       }
-   } while (!found && p != he);
+      slot = (slot + 1) & scan->host_index_mask;
+   }
 
-   if (debug) {print_times(); printf("find_host: found=%d, iterations=%u\n", found, iterations);}
+   if (eng->debug) {print_times(); printf("find_host: found=%d, iterations=%u\n", found != NULL, iterations);}
 
-   if (iterations > max_iter)
-      max_iter=iterations;
+   if (iterations > scan->max_iter)
+      scan->max_iter=iterations;
+   scan->find_host_calls++;
+   scan->find_host_iterations += iterations;
 
-   if (found)
-      return *p;
-   else
-      return NULL;
+   return found;
+}
+
+/*
+ *	build_host_stats -- Build the --hostretry table of target addresses
+ *
+ *	Inputs:
+ *
+ *	scan		The scan context
+ *
+ *	Returns:
+ *
+ *	None.
+ *
+ *	The table is keyed by address rather than stored in the host
+ *	entries, so it costs nothing per entry.  It is an open addressing
+ *	hash table like the find_host() index, grown by doubling so that it
+ *	is at most three quarters full.
+ */
+void
+build_host_stats(tcpscan_ctx *scan) {
+   unsigned size = 16;
+   unsigned i;
+
+   scan->host_stats = Malloc(size * sizeof(host_stats));
+   memset(scan->host_stats, '\0', size * sizeof(host_stats));
+   scan->host_stats_mask = size - 1;
+   scan->host_stats_count = 0;
+
+   for (i=0; i<scan->num_hosts; i++) {
+      uint32_t addr = scan->helist[i].addr.v4.s_addr;
+      host_stats *hs = find_host_stats(scan, addr);
+
+      if (hs->used)
+         continue;
+      if ((scan->host_stats_count + 1) * 4 > size * 3) {
+         host_stats *old = scan->host_stats;
+         unsigned j;
+
+         scan->host_stats = Malloc(2 * size * sizeof(host_stats));
+         memset(scan->host_stats, '\0', 2 * size * sizeof(host_stats));
+         scan->host_stats_mask = 2 * size - 1;
+         for (j=0; j<size; j++)
+            if (old[j].used)
+               *find_host_stats(scan, old[j].addr) = old[j];
+         free(old);
+         size *= 2;
+         hs = find_host_stats(scan, addr);
+      }
+      hs->addr = addr;
+      hs->used = 1;
+      scan->host_stats_count++;
+   }
+}
+
+/*
+ *	find_host_stats -- Find the --hostretry table slot of an address
+ *
+ *	Inputs:
+ *
+ *	scan	The scan context
+ *	addr	IPv4 address in network byte order
+ *
+ *	Returns:
+ *
+ *	The slot holding the address, or the empty slot where it belongs.
+ */
+host_stats *
+find_host_stats(tcpscan_ctx *scan, uint32_t addr) {
+   unsigned slot = (unsigned) (((TCP_UINT64) addr * 0x9e3779b97f4a7c15ULL)
+                               >> 32) & scan->host_stats_mask;
+
+   while (scan->host_stats[slot].used && scan->host_stats[slot].addr != addr)
+      slot = (slot + 1) & scan->host_stats_mask;
+   return &scan->host_stats[slot];
+}
+
+/*
+ *	host_reliable -- Check if a host has proven that it replies reliably
+ *
+ *	A host is reliable once it has replied on some port, at least
+ *	HOSTRETRY_MIN_RETRIES of the first retries to its ports have been
+ *	answered or timed out, and at most one in HOSTRETRY_RATIO of those
+ *	were answered.  Retries to its silent ports are then nearly always
+ *	wasted, because the ports are filtered rather than the probes lost.
+ *	Only first retries are counted, because a port that ignores two
+ *	probes is even less likely to answer a third, which would make a
+ *	host that loses probes look reliable.
+ */
+static int
+host_reliable(const host_stats *hs) {
+   return hs->replies && hs->retries >= HOSTRETRY_MIN_RETRIES &&
+          hs->rescued * HOSTRETRY_RATIO <= hs->retries;
+}
+
+/*
+ *	note_retry_timeout -- Count a first retry that was not answered
+ *
+ *	Inputs:
+ *
+ *	scan	The scan context
+ *	he	The host entry whose last probe has timed out
+ *
+ *	Returns:
+ *
+ *	None.
+ */
+void
+note_retry_timeout(tcpscan_ctx *scan, const host_entry *he) {
+   if (scan->host_stats && he->num_sent == 2)
+      find_host_stats(scan, he->addr.v4.s_addr)->retries++;
+}
+
+/*
+ *	retry_limit -- Return the number of probes to send to an entry
+ *
+ *	Inputs:
+ *
+ *	scan	The scan context
+ *	he	The host entry
+ *
+ *	Returns:
+ *
+ *	The --hostretry limit if the entry's host is reliable, otherwise
+ *	the --retry limit.  The host's state is checked each time, so a
+ *	host that becomes reliable during the scan gets fewer retries from
+ *	then on.  One in HOSTRETRY_SAMPLE entries always gets the --retry
+ *	limit, so that a host that starts to lose probes is noticed.
+ */
+unsigned
+retry_limit(tcpscan_ctx *scan, const host_entry *he) {
+   if (!scan->host_stats || he->num_sent < scan->host_retry ||
+       he->n % HOSTRETRY_SAMPLE == 0 ||
+       !host_reliable(find_host_stats(scan, he->addr.v4.s_addr)))
+      return scan->retry;
+   return scan->host_retry;
+}
+
+/*
+ *	report_host_stats -- Display the --hostretry statistics on stderr
+ *
+ *	This is only done with --verbose.
+ */
+void
+report_host_stats(tcpscan_ctx *scan) {
+   unsigned reliable = 0;
+   unsigned i;
+
+   if (!scan->engine->verbose)
+      return;
+   for (i=0; i<=scan->host_stats_mask; i++)
+      if (scan->host_stats[i].used && host_reliable(&scan->host_stats[i]))
+         reliable++;
+   warn_msg("---\tHost retry: %u of %u hosts reliable, " TCP_UINT64_FORMAT
+            " retries skipped", reliable, scan->host_stats_count,
+            scan->retries_skipped);
 }
 
 /*
@@ -1738,7 +5041,8 @@ find_host(host_entry **he, const struct in_addr *addr,
  *
  *	Inputs:
  *
- *	args		Special args (not used)
+ *	args		The scan context.  With --daemon, this is the command
+ *			line scan, and the reply is for one of the jobs.
  *	header		pcap header structure
  *	packet_in	The captured packet
  *
@@ -1747,17 +5051,38 @@ find_host(host_entry **he, const struct in_addr *addr,
  *	None.
  */
 void
-callback(u_char *args ATTRIBUTE_UNUSED,
-         const struct pcap_pkthdr *header, const u_char *packet_in) {
+callback(u_char *args, const struct pcap_pkthdr *header,
+         const u_char *packet_in) {
+   tcpscan_ctx *scan = (tcpscan_ctx *) args;
+   tcpscan_engine *eng = scan->engine;
    const struct iphdr *iph;
    const struct tcphdr *tcph;
    unsigned n = header->caplen;
    struct in_addr source_ip;
    host_entry *temp_cursor;
+   TCP_UINT64 rtt_ns = 0;
+   TCP_UINT64 start_ns;
+   int unchanged = 0;
+/*
+ *      Collect any outstanding transmit timestamps before we use the send
+ *      time of the matching probe.
+ */
+   if (eng->tx_sock >= 0)
+      read_tx_timestamps(eng, eng->tx_sock);
+/*
+ *      ICMP echo replies are for the --discover pre-pass.
+ */
+   if (eng->discover_icmp && n >= eng->ip_offset + sizeof(struct iphdr) &&
+       ((const struct iphdr *) (packet_in + eng->ip_offset))->protocol ==
+       IPPROTO_ICMP) {
+      echo_reply(scan, packet_in + eng->ip_offset, n - eng->ip_offset,
+                 pkthdr_ns(eng, header));
+      return;
+   }
 /*
  *      Check that the packet is large enough to decode.
  */
-   if (n < ip_offset + sizeof(struct iphdr) + sizeof(struct tcphdr)) {
+   if (n < eng->ip_offset + sizeof(struct iphdr) + sizeof(struct tcphdr)) {
       printf("%u byte packet too short to decode\n", n);
       return;
    }
@@ -1767,68 +5092,184 @@ callback(u_char *args ATTRIBUTE_UNUSED,
  *      Note that iph.ihl is in 32-bit units.  We multiply by 4 to get bytes.
  *      iph.lhl is normally 5, but can be larger if IP options are present.
  */
-   iph = (const struct iphdr *) (packet_in + ip_offset);
-   tcph = (const struct tcphdr *) (packet_in + ip_offset + 4*(iph->ihl));
+   iph = (const struct iphdr *) (packet_in + eng->ip_offset);
+   tcph = (const struct tcphdr *) (packet_in + eng->ip_offset + 4*(iph->ihl));
 /*
  *	Determine source IP address.
  */
    source_ip.s_addr = iph->saddr;
+/*
+ *	With --daemon, the destination port says which job it is for.
+ */
+   if (eng->jobs) {
+      unsigned slot = (uint16_t) (ntohs(tcph->dest) - eng->source_port);
+
+      if (slot >= eng->daemon_jobs || eng->jobs[slot] == NULL)
+         return;
+      scan = eng->jobs[slot];
+   }
 /*
  *	We've received a response.  Try to match up the packet by IP address
- *
- *	We should really start searching at the host before the cursor, as we
- *	know that the host to match cannot be the one at the cursor position
- *	because we call advance_cursor() after sending each packet.  However,
- *	the time saved is minimal, and it's not worth the extra complexity.
+ *	and port.
  */
-   temp_cursor=find_host(cursor, &source_ip, packet_in, n);
+   start_ns = stage_start(eng);
+   temp_cursor=find_host(scan, &source_ip, packet_in, n);
+   stage_end(eng, STAGE_MATCH, start_ns);
    if (temp_cursor) {
 /*
- *	We found an IP match for the packet. 
+ *	We found an IP match for the packet.  Count the first reply from
+ *	each entry towards its host's --hostretry reliability.
  */
-      if (verbose > 1)
+      if (scan->host_stats && temp_cursor->live) {
+         host_stats *hs = find_host_stats(scan, temp_cursor->addr.v4.s_addr);
+
+         hs->replies++;
+         if (temp_cursor->num_sent == 2) {
+            hs->retries++;
+            hs->rescued++;
+         }
+      }
+      TCP_SCAN_PROBE6(reply, temp_cursor->addr.v4.s_addr, temp_cursor->dport,
+                      temp_cursor->num_sent, temp_cursor->send_ns,
+                      pkthdr_ns(eng, header), ((const unsigned char *) tcph)[13]);
+      if (eng->verbose > 1)
          warn_msg("---\tReceived packet #%u from %s",temp_cursor->num_recv ,inet_ntoa(source_ip));
+/*
+ *	Calculate the round trip time from the send time of the last probe
+ *	to this host and the capture time of the reply.  Only the first
+ *	reply is added to the histogram, and only replies to hosts that have
+ *	been sent a single probe are used for --autotimeout, because we
+ *	cannot tell which probe a reply to a retransmission belongs to.
+ */
+      if (temp_cursor->num_sent && pkthdr_ns(eng, header) > temp_cursor->send_ns)
+         rtt_ns = pkthdr_ns(eng, header) - temp_cursor->send_ns;
+      if (rtt_ns && temp_cursor->live) {
+         hist_add(&scan->rtt_hist, rtt_ns);
+         if (temp_cursor->num_sent == 1)
+            update_rtt(scan, rtt_ns);
+      }
 /*
  *	Display the packet and increment the number of responders if we are
  *	counting all packets (open_only == 0) or if SYN and ACK are set and
- *	the entry is "live" or we are not ignoring duplicates.
+ *	the entry is "live" or we are not ignoring duplicates.  With
+ *	--previous, only changes are displayed, but all are counted and
+ *	saved.
  */
       temp_cursor->num_recv++;
-      if ((!open_only || (tcph->syn && tcph->ack)) &&
-          (temp_cursor->live || !ignore_dups)) {
-         if (pcap_dump_handle) {
-            pcap_dump((unsigned char *)pcap_dump_handle, header, packet_in);
+      if (*eng->previous_file != '\0' && temp_cursor->live) {
+         unsigned state = tcph->syn && tcph->ack ? PREV_OPEN :
+                          tcph->rst ? PREV_CLOSED : PREV_NONE;
+
+         if (state == temp_cursor->prev)
+            unchanged = 1;
+         else if (state == PREV_OPEN)
+            scan->changed_open++;
+         else if (state == PREV_CLOSED &&
+                  (!scan->open_only || temp_cursor->prev == PREV_OPEN))
+            scan->changed_closed++;
+      }
+      if (unchanged ||
+          ((!scan->open_only || (tcph->syn && tcph->ack) ||
+            (*eng->previous_file != '\0' && temp_cursor->prev == PREV_OPEN)) &&
+           (temp_cursor->live || !scan->ignore_dups))) {
+         if (eng->pcapng_handle) {
+            pcapng_write(eng->pcapng_handle, eng->pcapng_recv_if,
+                         pkthdr_ns(eng, header), packet_in, header->caplen,
+                         header->len, PCAPNG_INBOUND);
          }
-         display_packet(n, packet_in, temp_cursor, &source_ip);
-         responders++;
+         if (!unchanged) {
+            if (scan->reply_fn)
+               deliver_reply(scan, temp_cursor, &source_ip,
+                             packet_in + eng->ip_offset, n - eng->ip_offset,
+                             rtt_ns);
+            else
+               display_packet(scan, n, packet_in, temp_cursor, &source_ip, rtt_ns);
+         }
+         scan->responders++;
+         if (tcph->syn && tcph->ack)
+            scan->open_count++;
+         else if (tcph->rst)
+            scan->closed_count++;
       }
-      if (verbose > 1)
+      if (eng->verbose > 1)
          warn_msg("---\tRemoving host entry %u (%s) - Received %u bytes", temp_cursor->n, inet_ntoa(source_ip), n);
-      remove_host(&temp_cursor);
+      remove_host(scan, &temp_cursor);
    } else {
 /*
  *	The received packet is not from an IP address in the list
  *	Issue a message to that effect and ignore the packet.
  */
-      if (verbose)
+      if (eng->verbose)
          warn_msg("---\tIgnoring %u bytes from unknown host %s", n, inet_ntoa(source_ip));
    }
 }
 
+/*
+ *	echo_reply -- Process an ICMP echo reply to a --discover probe
+ *
+ *	Inputs:
+ *
+ *	scan		The scan context
+ *	ip_packet	The IP packet, after the layer-2 header
+ *	len		The captured length of the IP packet
+ *	recv_ns		Capture time of the packet in ns
+ *
+ *	Returns:
+ *
+ *	None.
+ *
+ *	The reply is matched to the port 0 entry of its source address,
+ *	and passed to the discovery scan's reply callback.
+ */
+void
+echo_reply(tcpscan_ctx *scan, const unsigned char *ip_packet, unsigned len,
+           TCP_UINT64 recv_ns) {
+   tcpscan_engine *eng = scan->engine;
+   const struct iphdr *iph = (const struct iphdr *) ip_packet;
+   const unsigned char *icmp = ip_packet + 4*(iph->ihl);
+   struct in_addr source_ip;
+   host_entry *he;
+   TCP_UINT64 rtt_ns = 0;
+
+   if (len < (unsigned) (4*(iph->ihl) + ICMP_ECHO_LEN) ||
+       icmp[0] != ICMP_ECHO_REPLY ||
+       (unsigned) (icmp[4] << 8 | icmp[5]) != scan->sport)
+      return;
+   source_ip.s_addr = iph->saddr;
+   if ((he = lookup_host(scan, &source_ip, 0)) == NULL || !he->live) {
+      if (eng->verbose)
+         warn_msg("---\tIgnoring ICMP echo reply from %s",
+                  inet_ntoa(source_ip));
+      return;
+   }
+   if (eng->verbose > 1)
+      warn_msg("---\tReceived ICMP echo reply from %s", inet_ntoa(source_ip));
+   he->num_recv++;
+   if (he->num_sent && recv_ns > he->send_ns)
+      rtt_ns = recv_ns - he->send_ns;
+   if (scan->reply_fn)
+      deliver_reply(scan, he, &source_ip, ip_packet, len, rtt_ns);
+   scan->responders++;
+   remove_host(scan, &he);
+}
+
 /*
  *	process_options	--	Process options and arguments.
  *
  *	Inputs:
  *
+ *	scan	The scan context
  *	argc	Command line arg count
  *	argv	Command line args
+ *	job	Non-zero for the options of a --daemon job
  *
  *	Returns:
  *
  *	None.
  */
 void
-process_options(int argc, char *argv[]) {
+process_options(tcpscan_ctx *scan, int argc, char *argv[], int job) {
+   tcpscan_engine *eng = scan->engine;
    struct option long_options[] = {
       {"file", required_argument, 0, 'f'},
       {"help", no_argument, 0, 'h'},
@@ -1858,6 +5299,23 @@ process_options(int argc, char *argv[]) {
       {"df", required_argument, 0, 'F'},
       {"tos", required_argument, 0, 'O'},
       {"random", no_argument, 0, 'R'},
+      {"shard", required_argument, 0, OPT_SHARD},
+      {"seed", required_argument, 0, OPT_SEED},
+      {"workers", required_argument, 0, OPT_WORKERS},
+      {"checkpoint", required_argument, 0, OPT_CHECKPOINT},
+      {"resume", no_argument, 0, OPT_RESUME},
+      {"previous", required_argument, 0, OPT_PREVIOUS},
+      {"sample", required_argument, 0, OPT_SAMPLE},
+      {"daemon", required_argument, 0, OPT_DAEMON},
+      {"submit", required_argument, 0, OPT_SUBMIT},
+      {"jobs", required_argument, 0, OPT_JOBS},
+      {"weight", required_argument, 0, OPT_WEIGHT},
+      {"discover", optional_argument, 0, OPT_DISCOVER},
+      {"discovercache", required_argument, 0, OPT_DISCOVERCACHE},
+      {"hostretry", required_argument, 0, OPT_HOSTRETRY},
+      {"priority", no_argument, 0, OPT_PRIORITY},
+      {"topports", required_argument, 0, OPT_TOPPORTS},
+      {"top-ports", required_argument, 0, OPT_TOPPORTS},
       {"numeric", no_argument, 0, 'N'},
       {"portname", no_argument, 0, 'P'},
       {"flags", required_argument, 0, 'L'},
@@ -1866,6 +5324,18 @@ process_options(int argc, char *argv[]) {
       {"ack", required_argument, 0, 'c'},
       {"servicefile2", required_argument, 0, 'E'},
       {"pcapsavefile", required_argument, 0, 'C'},
+      {"pcapsize", required_argument, 0, OPT_PCAPSIZE},
+      {"pcaptime", required_argument, 0, OPT_PCAPTIME},
+      {"pcapsent", no_argument, 0, OPT_PCAPSENT},
+      {"fingerprint", no_argument, 0, OPT_FINGERPRINT},
+      {"rtt", no_argument, 0, OPT_RTT},
+      {"autotimeout", no_argument, 0, OPT_AUTOTIMEOUT},
+      {"replay", required_argument, 0, OPT_REPLAY},
+      {"dryrun", optional_argument, 0, OPT_DRYRUN},
+      {"progress", optional_argument, 0, OPT_PROGRESS},
+      {"statsfile", required_argument, 0, OPT_STATSFILE},
+      {"metrics", required_argument, 0, OPT_METRICS},
+      {"stagetimes", no_argument, 0, OPT_STAGETIMES},
       {0, 0, 0, 0}
    };
    const char *short_options =
@@ -1874,44 +5344,52 @@ process_options(int argc, char *argv[]) {
    int options_index=0;
 
    while ((arg=getopt_long_only(argc, argv, short_options, long_options, &options_index)) != -1) {
+      if (job && !is_job_option(arg))
+         err_msg("A --daemon job can only have the --port, --retry, "
+                 "--hostretry, --timeout, --backoff, --interval, --bandwidth, "
+                 "--openonly, --random, --priority, --numeric, --quiet, "
+                 "--portname, --ignoredups, --weight and --rtt options.");
       switch (arg) {
          char *p1;
          char *p2;
 
          case 'f':	/* --file */
-            strlcpy(filename, optarg, sizeof(filename));
-            filename_flag=1;
+            strlcpy(eng->filename, optarg, sizeof(eng->filename));
+            eng->filename_flag=1;
             break;
          case 'h':	/* --help */
-            usage(EXIT_SUCCESS, 1);
+            usage(scan, EXIT_SUCCESS, 1);
             break;
          case 'r':	/* --retry */
-            retry=Strtoul(optarg, 10);
+            scan->retry=Strtoul(optarg, 10);
             break;
          case 't':	/* --timeout */
-            timeout=Strtoul(optarg, 10);
+            scan->timeout=Strtoul(optarg, 10);
             break;
          case 'i':	/* --interval */
-            interval=str_to_interval(optarg);
+            scan->interval=str_to_interval(optarg);
             break;
          case 'b':	/* --backoff */
-            backoff_factor=atof(optarg);
+            scan->backoff_factor=atof(optarg);
             break;
          case 'v':	/* --verbose */
-            verbose++;
+            eng->verbose++;
             break;
          case 'V':	/* --version */
             tcp_scan_version();
+            if (error_jump)
+               err_exit();	/* A library call returns an error */
             exit(0);
             break;
          case 'd':	/* --debug */
-            debug++;
+            eng->debug++;
             break;
          case 'D':	/* --data (depreciated) */
          case 'p':	/* --port */
-            local_data = Malloc(strlen(optarg)+1);
+            free(scan->local_data);
+            scan->local_data = Malloc(strlen(optarg)+1);
             p1 = optarg;
-            p2 = local_data;
+            p2 = scan->local_data;
             while (*p1 != '\0') {
                if (!isspace(*p1))
                   *p2++=*p1;
@@ -1920,98 +5398,244 @@ process_options(int argc, char *argv[]) {
             *p2 = '\0';
             break;
          case 's':	/* --sport */
-            source_port=Strtoul(optarg, 0);
-            source_port_flag=1;
+            eng->source_port=Strtoul(optarg, 0);
+            eng->source_port_flag=1;
             break;
          case 'e':	/* --seq */
-            seq_no=Strtoul(optarg, 0);
-            seq_no_flag=1;
+            eng->seq_no=Strtoul(optarg, 0);
+            eng->seq_no_flag=1;
             break;
          case 'w':	/* --window */
-            window=Strtoul(optarg, 0);
+            eng->window=Strtoul(optarg, 0);
             break;
          case 'o':	/* --openonly */
-            open_only=1;
+            scan->open_only=1;
             break;
          case 'S':	/* --servicefile */
-            create_port_list(optarg);
+            create_port_list(eng, optarg);
             break;
          case 'm':	/* --mss */
-            mss=Strtoul(optarg, 0);
+            eng->mss=Strtoul(optarg, 0);
             break;
          case 'W':	/* --wscale */
-            wscale_flag=1;
+            eng->wscale_flag=1;
             break;
          case 'a':	/* --sack */
-            sack_flag=1;
+            eng->sack_flag=1;
             break;
          case 'T':	/* --timestamp */
-            timestamp_flag=1;
+            eng->timestamp_flag=1;
             break;
          case 'n':	/* --snap */
-            snaplen=Strtol(optarg, 0);
+            eng->snaplen=Strtol(optarg, 0);
             break;
          case 'l':	/* --ttl */
-            ip_ttl=Strtol(optarg, 0);
-            if (ip_ttl < 0 || ip_ttl > 255)
+            eng->ip_ttl=Strtol(optarg, 0);
+            if (eng->ip_ttl < 0 || eng->ip_ttl > 255)
                err_msg("The --ttl option must be in the range 0 to 255.");
             break;
          case 'I':	/* --interface */
-            if_name = make_message("%s", optarg);
+            eng->if_name = make_message("%s", optarg);
             break;
          case 'q':	/* --quiet */
-            quiet_flag=1;
+            scan->quiet_flag=1;
             break;
          case 'g':	/* --ignoredups */
-            ignore_dups=1;
+            scan->ignore_dups=1;
             break;
          case 'F':	/* --df */
-            df_flag = Strtol(optarg, 0);
-            if (df_flag < 0 || df_flag > 1)
+            eng->df_flag = Strtol(optarg, 0);
+            if (eng->df_flag < 0 || eng->df_flag > 1)
                err_msg("The --df option must be 0 (DF off) or 1 (DF on).");
             break;
          case 'O':	/* --tos */
-            ip_tos = Strtol(optarg, 0);
-            if (ip_tos < 0 || ip_tos > 255)
+            eng->ip_tos = Strtol(optarg, 0);
+            if (eng->ip_tos < 0 || eng->ip_tos > 255)
                err_msg("The --tos option must be in the range 0 to 255.");
             break;
          case 'R':	/* --random */
-            random_flag=1;
+            scan->random_flag=1;
+            break;
+         case OPT_SHARD: {	/* --shard */
+            char *slash;
+
+            eng->shard_index = strtoul(optarg, &slash, 10);
+            if (slash == optarg || *slash != '/')
+               err_msg("The --shard option must be of the form i/N.");
+            eng->shard_count = Strtoul(slash + 1, 10);
+            if (eng->shard_count < 1 || eng->shard_index < 1 ||
+                eng->shard_index > eng->shard_count)
+               err_msg("The --shard option must be i/N with 1 <= i <= N.");
+            break;
+         }
+         case OPT_SEED:	/* --seed */
+            eng->seed = Strtoul(optarg, 0);
+            eng->seed_flag = 1;
+            break;
+         case OPT_WORKERS:	/* --workers */
+            eng->workers = Strtoul(optarg, 10);
+            if (eng->workers < 1 || eng->workers > MAX_WORKERS)
+               err_msg("The --workers option must be in the range 1 to %u.",
+                       MAX_WORKERS);
+            break;
+         case OPT_CHECKPOINT:	/* --checkpoint */
+            strlcpy(eng->checkpoint_file, optarg, sizeof(eng->checkpoint_file));
+            break;
+         case OPT_RESUME:	/* --resume */
+            eng->resume_flag = 1;
+            break;
+         case OPT_PREVIOUS:	/* --previous */
+            strlcpy(eng->previous_file, optarg, sizeof(eng->previous_file));
+            break;
+         case OPT_SAMPLE: {	/* --sample */
+            char *end;
+
+            eng->sample_rate = strtod(optarg, &end);
+            if (*end != '\0' || end == optarg || eng->sample_rate < 0 ||
+                eng->sample_rate > 1)
+               err_msg("The --sample option must be a fraction from 0 to 1.");
+            break;
+         }
+         case OPT_DAEMON:	/* --daemon */
+            strlcpy(eng->daemon_path, optarg, sizeof(eng->daemon_path));
+            break;
+         case OPT_SUBMIT:	/* --submit */
+            strlcpy(eng->submit_path, optarg, sizeof(eng->submit_path));
+            break;
+         case OPT_JOBS:	/* --jobs */
+            eng->daemon_jobs=Strtoul(optarg, 10);
+            if (eng->daemon_jobs < 1 || eng->daemon_jobs > MAX_DAEMON_JOBS)
+               err_msg("The --jobs option must be from 1 to %u.",
+                       MAX_DAEMON_JOBS);
+            break;
+         case OPT_WEIGHT:	/* --weight */
+            scan->weight=Strtoul(optarg, 10);
+            if (scan->weight < 1 || scan->weight > MAX_WEIGHT)
+               err_msg("The --weight option must be from 1 to %u.",
+                       MAX_WEIGHT);
+            break;
+         case OPT_HOSTRETRY:	/* --hostretry */
+            scan->host_retry=Strtoul(optarg, 10);
+            if (scan->host_retry < 1)
+               err_msg("The --hostretry option must be at least 1.");
+            break;
+         case OPT_PRIORITY:	/* --priority */
+            scan->priority_flag=1;
+            break;
+         case OPT_TOPPORTS:	/* --topports */
+            create_top_ports(eng, Strtoul(optarg, 10));
+            scan->priority_flag=1;
+            break;
+         case OPT_DISCOVER:	/* --discover */
+            parse_discover(eng, optarg ? optarg : DEFAULT_DISCOVER);
+            break;
+         case OPT_DISCOVERCACHE:	/* --discovercache */
+            strlcpy(eng->discover_cache, optarg, sizeof(eng->discover_cache));
             break;
          case 'N':	/* --numeric */
-            numeric_flag=1;
+            scan->numeric_flag=1;
             break;
          case 'P':	/* --portname */
-            portname_flag=1;
+            scan->portname_flag=1;
             break;
          case 'L':	/* --flags */
-            tcp_flags_flag=1;
-            process_tcp_flags(optarg);
+            eng->tcp_flags_flag=1;
+            process_tcp_flags(eng, optarg);
 /* CWR,ECN,URG,ACK,PSH,RST,SYN,FIN */
             break;
          case '6':	/* --ipv6 */
-            ipv6_flag=1;
+            eng->ipv6_flag=1;
             break;
          case 'B':      /* --bandwidth */
-            bandwidth=str_to_bandwidth(optarg);
+            scan->bandwidth=str_to_bandwidth(optarg);
             break;
          case 'c':	/* --ack */
-            ack_no=Strtoul(optarg, 0);
-            ack_no_flag=1;
+            eng->ack_no=Strtoul(optarg, 0);
+            eng->ack_no_flag=1;
             break;
          case 'E':	/* --servicefile2 */
-            strlcpy(service_file, optarg, sizeof(service_file));
+            strlcpy(eng->service_file, optarg, sizeof(eng->service_file));
             break;
          case 'C':	/* --pcapsavefile */
-            strlcpy(pcap_savefile, optarg, sizeof(pcap_savefile));
+            strlcpy(eng->pcap_savefile, optarg, sizeof(eng->pcap_savefile));
+            break;
+         case OPT_PCAPSIZE:	/* --pcapsize */
+            eng->pcap_rotate_size=str_to_size(optarg);
+            break;
+         case OPT_PCAPTIME:	/* --pcaptime */
+            eng->pcap_rotate_secs=Strtoul(optarg, 10);
+            break;
+         case OPT_PCAPSENT:	/* --pcapsent */
+            eng->pcap_sent_flag=1;
+            break;
+         case OPT_FINGERPRINT:	/* --fingerprint */
+            eng->fingerprint_flag=1;
+            break;
+         case OPT_RTT:		/* --rtt */
+            scan->rtt_flag=1;
+            break;
+         case OPT_AUTOTIMEOUT:	/* --autotimeout */
+            eng->autotimeout_flag=1;
+            break;
+         case OPT_REPLAY:	/* --replay */
+            strlcpy(eng->replay_file, optarg, sizeof(eng->replay_file));
+            break;
+         case OPT_PROGRESS:	/* --progress */
+            eng->progress_flag = 1;
+            eng->progress_interval = optarg ? Strtoul(optarg, 10) :
+                                         DEFAULT_PROGRESS;
+            if (!eng->progress_interval)
+               err_msg("The --progress interval must be at least 1 second");
+            break;
+         case OPT_STATSFILE:	/* --statsfile */
+            strlcpy(eng->stats_file, optarg, sizeof(eng->stats_file));
+            break;
+         case OPT_METRICS:	/* --metrics */
+            strlcpy(eng->metrics_spec, optarg, sizeof(eng->metrics_spec));
+            break;
+         case OPT_STAGETIMES:	/* --stagetimes */
+            eng->stagetimes_flag = 1;
+            break;
+         case OPT_DRYRUN:	/* --dryrun */
+            eng->dryrun_flag = 1;
+            if (optarg)
+               parse_dryrun_model(eng, optarg);
             break;
          default:	/* Unknown option */
-            usage(EXIT_FAILURE, 0);
+            usage(scan, EXIT_FAILURE, 0);
             break;
       }
    }
 }
 
+/*
+ *	is_job_option -- Check if a --daemon job can have an option
+ *
+ *	Inputs:
+ *
+ *	arg	The option, as returned by getopt_long_only()
+ *
+ *	Returns:
+ *
+ *	Non-zero if the option only affects the job's own scan.
+ *
+ *	The other options set up the socket, the capture and the probe
+ *	contents, which the daemon shares between all of its jobs.
+ */
+int
+is_job_option(int arg) {
+   static const int job_options[] = {
+      'p', 'D', 'r', 't', 'b', 'i', 'B', 'o', 'R', 'N', 'q', 'P', 'g', OPT_RTT,
+      OPT_WEIGHT, OPT_HOSTRETRY, OPT_PRIORITY
+   };
+   unsigned i;
+
+   for (i=0; i<sizeof(job_options)/sizeof(job_options[0]); i++)
+      if (arg == job_options[i])
+         return 1;
+   return 0;
+}
+
 /*
  *	tcp_scan_version -- display version information
  *
@@ -2037,11 +5661,27 @@ tcp_scan_version (void) {
    fprintf(stderr, "%s\n", pcap_lib_version());
 }
 
+/*
+ *	weight_compare -- qsort() comparison function for port frequencies
+ *
+ *	Most frequent first, and in file order for equal frequencies.
+ */
+static int
+weight_compare(const void *a, const void *b) {
+   const port_weight *pa = a;
+   const port_weight *pb = b;
+
+   if (pa->weight != pb->weight)
+      return pa->weight > pb->weight ? -1 : 1;
+   return pa->line < pb->line ? -1 : pa->line > pb->line;
+}
+
 /*
  *	create_port_list	-- Create TCP port list from services file
  *
  *	Inputs:
  *
+ *	eng		The scan engine
  *	serv_file	The services file name
  *
  *	Returns:
@@ -2049,41 +5689,42 @@ tcp_scan_version (void) {
  *	None.
  *
  *	This function creates the TCP port list from the specified services
- *	file.  It uses the same code as strobe for this so that the service
- *	file formats are compatible.  However, it is fussier than strobe
- *	regarding invalid names and port numbers.
+ *	file.  The file is in the same format as used by strobe, and is
+ *	parsed with the same code as the service name database.  However,
+ *	it is fussier than strobe regarding invalid names and port numbers.
+ *
+ *	If any entry has a frequency, as in the nmap-services file, the
+ *	list is sorted by frequency, most frequent first, and --priority
+ *	uses this order rather than the common_ports table.
  */
 void
-create_port_list(const char *serv_file) {
+create_port_list(tcpscan_engine *eng, const char *serv_file) {
    FILE *fh;
    char lbuf[1024];
-   char desc[256];
-   char portname[17];
+   char portname[MAXLINE];
    unsigned int port;
-   char prot[4];
+   char prot[MAXLINE];
+   port_weight *ports=NULL;
    int nports=0;
+   int i;
 
-   if (port_list)
+   if (eng->port_list && eng->top_ports)
+      err_msg("You cannot specify both the --servicefile and --topports options.");
+   if (eng->port_list)
       err_msg("Service file has already been specified");
 
-   prot[3]='\0';
    if ((access(serv_file, R_OK)) != 0)
       err_sys("fopen %s", serv_file);
    if (!(fh = fopen (serv_file, "r")))
       err_sys("fopen %s", serv_file);
 
    while (fgets (lbuf, sizeof (lbuf), fh)) {
-      char *p;
-      int n;
-
       if (strchr("*# \t\n", lbuf[0]))
           continue;
-      if (!(p = strchr (lbuf, '/')))
+      if (!strchr (lbuf, '/'))
           continue;
-      *p = ' ';
-      desc[0]='\0';
-      n=sscanf(lbuf, "%16s %u %3s %255[^\r\n]", portname, &port, prot, desc);
-      if (n < 3) {
+      if (!parse_service_line(lbuf, portname, sizeof(portname), &port,
+                              prot, sizeof(prot))) {
          warn_msg("Ignoring invalid entry: %s", lbuf);
          continue;
       }
@@ -2095,19 +5736,51 @@ create_port_list(const char *serv_file) {
          err_msg("Invalid port number: %u.  Port must be in range 1-65535",
                  port);
       nports++;
-      if (port_list) {
-         port_list=Realloc(port_list, nports * sizeof(uint16_t));
+      if (ports) {
+         ports=Realloc(ports, nports * sizeof(port_weight));
       } else {
-         port_list=Malloc(sizeof(uint16_t));
+         ports=Malloc(sizeof(port_weight));
       }
-      port_list[nports-1] = port;
-   }
-   if (port_list) {
-      port_list=Realloc(port_list, (nports+1) * sizeof(uint16_t));
-   } else {
-      port_list=Malloc(sizeof(uint16_t));
+      ports[nports-1].port = port;
+      ports[nports-1].line = nports-1;
+      ports[nports-1].weight = parse_service_weight(lbuf);
+      if (ports[nports-1].weight > 0)
+         eng->port_list_weighted=1;
    }
-   port_list[nports] = 0;	/* Mark end of list with zero */
+   fclose(fh);
+   if (eng->port_list_weighted)
+      qsort(ports, nports, sizeof(port_weight), weight_compare);
+   eng->port_list=Malloc((nports+1) * sizeof(uint16_t));
+   for (i=0; i<nports; i++)
+      eng->port_list[i] = ports[i].port;
+   eng->port_list[nports] = 0;	/* Mark end of list with zero */
+   free(ports);
+}
+
+/*
+ *	create_top_ports -- Create TCP port list from the common ports
+ *
+ *	Inputs:
+ *
+ *	eng	The scan engine
+ *	count	The number of ports, from the start of common_ports
+ *
+ *	Returns:
+ *
+ *	None.
+ */
+void
+create_top_ports(tcpscan_engine *eng, unsigned count) {
+   unsigned max = sizeof(common_ports) / sizeof(common_ports[0]);
+
+   if (eng->port_list)
+      err_msg("You cannot specify both the --servicefile and --topports options.");
+   if (count < 1 || count > max)
+      err_msg("The --top-ports option must be from 1 to %u.", max);
+   eng->port_list=Malloc((count+1) * sizeof(uint16_t));
+   memcpy(eng->port_list, common_ports, count * sizeof(uint16_t));
+   eng->port_list[count] = 0;	/* Mark end of list with zero */
+   eng->top_ports = count;
 }
 
 /*
@@ -2115,6 +5788,7 @@ create_port_list(const char *serv_file) {
  *
  *	Inputs:
  *
+ *	eng		The scan engine
  *	flagstr		Pointer to the --flags option argument.
  *
  *	Returns:
@@ -2126,13 +5800,13 @@ create_port_list(const char *serv_file) {
  *	the specified TCP flags should be used.
  */
 void
-process_tcp_flags(const char *flagstr) {
+process_tcp_flags(tcpscan_engine *eng, const char *flagstr) {
    const char *cp1;
    char *cp2;
    int count;
    char flag_list[MAXLINE];
 
-   tcp_flags_flag=1;
+   eng->tcp_flags_flag=1;
    count=0;
    cp1 = flagstr;
    cp2 = flag_list;
@@ -2146,35 +5820,35 @@ process_tcp_flags(const char *flagstr) {
    *cp2 = '\0';
 
    if (strstr(flag_list, "cwr"))
-      tcp_flags.cwr = 1;
+      eng->tcp_flags.cwr = 1;
    else
-      tcp_flags.cwr = 0;
+      eng->tcp_flags.cwr = 0;
    if (strstr(flag_list, "ecn"))
-      tcp_flags.ecn = 1;
+      eng->tcp_flags.ecn = 1;
    else
-      tcp_flags.ecn = 0;
+      eng->tcp_flags.ecn = 0;
    if (strstr(flag_list, "urg"))
-      tcp_flags.urg = 1;
+      eng->tcp_flags.urg = 1;
    else
-      tcp_flags.urg = 0;
+      eng->tcp_flags.urg = 0;
    if (strstr(flag_list, "ack"))
-      tcp_flags.ack = 1;
+      eng->tcp_flags.ack = 1;
    else
-      tcp_flags.ack = 0;
+      eng->tcp_flags.ack = 0;
    if (strstr(flag_list, "psh"))
-      tcp_flags.psh = 1;
+      eng->tcp_flags.psh = 1;
    else
-      tcp_flags.psh = 0;
+      eng->tcp_flags.psh = 0;
    if (strstr(flag_list, "rst"))
-      tcp_flags.rst = 1;
+      eng->tcp_flags.rst = 1;
    else
-      tcp_flags.rst = 0;
+      eng->tcp_flags.rst = 0;
    if (strstr(flag_list, "syn"))
-      tcp_flags.syn = 1;
+      eng->tcp_flags.syn = 1;
    else
-      tcp_flags.syn = 0;
+      eng->tcp_flags.syn = 0;
    if (strstr(flag_list, "fin"))
-      tcp_flags.fin = 1;
+      eng->tcp_flags.fin = 1;
    else
-      tcp_flags.fin = 0;
+      eng->tcp_flags.fin = 0;
 }
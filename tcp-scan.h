@@ -38,6 +38,8 @@
 #include <ctype.h>
 #include <stdarg.h>
 #include <errno.h>
+#include <signal.h>
+#include <setjmp.h>
 #else
 #error This program requires the ANSI C Headers
 #endif
@@ -90,10 +92,6 @@
 #include <arpa/inet.h>
 #endif
 
-#ifdef HAVE_REGEX_H
-#include <regex.h>	/* Posix regular expression support */
-#endif
-
 #ifdef HAVE_PCAP_H
 #include <pcap.h>
 #endif
@@ -110,8 +108,65 @@
 #include <sys/utsname.h>
 #endif
 
+#ifdef HAVE_SYS_RESOURCE_H
+#include <sys/resource.h>	/* For getrusage() */
+#endif
+
+#ifdef HAVE_SYS_MMAN_H
+#include <sys/mman.h>		/* For the --workers results */
+#endif
+
+#ifdef HAVE_SYS_WAIT_H
+#include <sys/wait.h>
+#endif
+
+#ifdef HAVE_SYS_UN_H
+#include <sys/un.h>		/* For the --daemon socket */
+#endif
+
+#ifdef HAVE_SYS_STAT_H
+#include <sys/stat.h>		/* For fstat() and lstat() */
+#endif
+
+#ifdef HAVE_FCNTL_H
+#include <fcntl.h>		/* For the --daemon client sockets */
+#endif
+
+#ifdef HAVE_LINUX_SOCKIOS_H
+#include <linux/sockios.h>	/* For SIOCOUTQ */
+#endif
+
+#if defined(HAVE_LINUX_NET_TSTAMP_H) && defined(HAVE_LINUX_ERRQUEUE_H)
+#include <linux/net_tstamp.h>	/* For SO_TIMESTAMPING flags */
+#include <linux/errqueue.h>	/* For struct scm_timestamping */
+#if defined(SO_TIMESTAMPING) && HAVE_DECL_SOF_TIMESTAMPING_OPT_TSONLY
+#define HAVE_TX_TIMESTAMPS 1	/* Kernel transmit timestamps */
+#endif
+#endif
+
+/*
+ * USDT static probes for perf and bpftrace, see tcp-scan.bt.  Each probe
+ * is a single nop when nothing is attached, and the macros expand to
+ * nothing if we don't have <sys/sdt.h>.
+ */
+#ifdef HAVE_SYS_SDT_H
+#include <sys/sdt.h>
+#define TCP_SCAN_PROBE5(name, a1, a2, a3, a4, a5) \
+   DTRACE_PROBE5(tcp_scan, name, a1, a2, a3, a4, a5)
+#define TCP_SCAN_PROBE6(name, a1, a2, a3, a4, a5, a6) \
+   DTRACE_PROBE6(tcp_scan, name, a1, a2, a3, a4, a5, a6)
+#else
+#define TCP_SCAN_PROBE5(name, a1, a2, a3, a4, a5)
+#define TCP_SCAN_PROBE6(name, a1, a2, a3, a4, a5, a6)
+#endif
+
+#ifdef TCPSCAN_LIBRARY
+#include "tcpscan-names.h"	/* Prefix the internal names */
+#endif
+
 #include "ip.h"
 #include "tcp.h"
+#include "libtcpscan.h"
 
 /* Defines */
 
@@ -136,6 +191,101 @@
 #define DEFAULT_DF 1			/* IP DF Flag */
 #define DEFAULT_TOS 0			/* IP TOS Field */
 #define SERVICE_FILE "tcp-scan-services"
+#define SERVICE_DB_FILE "tcp-scan-services.db"
+#define PCAPNG_BUFSIZE 1048576		/* Write buffer for pcapng savefile */
+#define PCAPNG_INBOUND 1		/* pcapng epb_flags: inbound packet */
+#define PCAPNG_OUTBOUND 2		/* pcapng epb_flags: outbound packet */
+#define LINKTYPE_RAW 101		/* pcap link type for raw IP packets */
+#define TX_RING_SIZE 4096		/* Probes awaiting a TX timestamp */
+#define MT_N 624			/* Words of MT19937 state */
+#define AUTOTIMEOUT_SAMPLES 8		/* RTT samples before --autotimeout */
+#define AUTOTIMEOUT_MIN 10		/* Minimum --autotimeout in ms */
+#define DRYRUN_SOURCE 0xc0000201	/* --dryrun source 192.0.2.1 */
+#define DRYRUN_RTT 10000		/* Default --dryrun RTT in us */
+#define DRYRUN_OPEN 0.1			/* Default --dryrun open fraction */
+#define DEFAULT_PROGRESS 10		/* Default --progress interval in s */
+#define WORKER_READ_SIZE 65536		/* --workers output read() size */
+#define MAX_WORKERS 256			/* Maximum --workers value */
+#define CHECKPOINT_INTERVAL 60		/* --checkpoint interval in s */
+#define CHECKPOINT_VERSION 1		/* --checkpoint file format */
+#define DAEMON_BACKLOG 16		/* --daemon jobs waiting to be run */
+#define DAEMON_READ_TIMEOUT 10		/* Seconds to wait for a job line */
+#define DAEMON_WRITE_TIMEOUT 60		/* Seconds a client can stop reading */
+#define DAEMON_OUTPUT_MAX 16777216	/* Job output held for its client */
+#define DAEMON_ERROR "%error "		/* Starts a job error line */
+#define DAEMON_STATUS "%status "	/* Starts the last line of a job */
+#define DEFAULT_DAEMON_JOBS 8		/* Default --jobs run at once */
+#define MAX_DAEMON_JOBS 256		/* Maximum --jobs value */
+#define DEFAULT_WEIGHT 1		/* Default --weight of a job */
+#define MAX_WEIGHT 1000			/* Maximum --weight value */
+#define WFQ_SCALE 1000000		/* Virtual time of one probe at weight 1 */
+#define DEFAULT_DISCOVER "icmp,22,80,443"	/* Default --discover probes */
+#define MAX_DISCOVER_PORTS 32		/* Maximum --discover probes per host */
+#define DISCOVER_CACHE_AGE 3600		/* --discovercache entry lifetime in s */
+/* Host states found by discover_hosts(), values of discover_host.state */
+#define DISCOVER_UNKNOWN 0
+#define DISCOVER_UP 1
+#define DISCOVER_DOWN 2
+#define ICMP_ECHO_REQUEST 8		/* ICMP type of a --discover echo */
+#define ICMP_ECHO_REPLY 0		/* ICMP type of its reply */
+#define ICMP_ECHO_LEN 8			/* ICMP echo header length */
+#define HOSTRETRY_MIN_RETRIES 16	/* Retries before --hostretry applies */
+#define HOSTRETRY_RATIO 50		/* Retries per answered retry, at least */
+#define HOSTRETRY_SAMPLE 16		/* 1 in n entries keep all retries */
+#define PORT_COUNT 65536		/* Number of TCP port numbers */
+/* Port states in the --previous results, values of host_entry.prev */
+#define PREV_NONE 0			/* No response */
+#define PREV_OPEN 1
+#define PREV_CLOSED 2
+#define HIST_SUB_BITS 4			/* Histogram precision in bits */
+#define HIST_SUB_BUCKETS (1 << HIST_SUB_BITS)
+#define HIST_BUCKETS ((65 - HIST_SUB_BITS) * HIST_SUB_BUCKETS)
+/* Stages timed by --stagetimes, indexes into stage_hist[] */
+#define STAGE_SEND 0			/* sendto() of one probe */
+#define STAGE_SELECT 1			/* select() wait for a packet */
+#define STAGE_DISPATCH 2		/* pcap_dispatch() including callback() */
+#define STAGE_MATCH 3			/* find_host() for one packet */
+#define STAGE_FORMAT 4			/* Building one output line */
+#define STAGE_WRITE 5			/* Writing one output line to stdout */
+#define STAGE_COUNT 6
+#define TCPOPT_MAX_OPTS 40		/* Max options in 40 bytes of options */
+#define TCPOPT_STRLEN 256		/* Buffer size for tcpopt_format() */
+#define TCPOPT_F_TRUNCATED 1		/* Last option runs past end of data */
+#define TCPOPT_F_BADLEN 2		/* Option with an invalid length */
+/* Implementations of printable() for printable_select() */
+#define PRINTABLE_IMPL_AUTO 0		/* Fastest supported version */
+#define PRINTABLE_IMPL_SCALAR 1
+#define PRINTABLE_IMPL_SSE2 2
+#define PRINTABLE_IMPL_AVX2 3
+/* Values for long options that have no single-letter equivalent */
+#define OPT_PCAPSIZE 256
+#define OPT_PCAPTIME 257
+#define OPT_PCAPSENT 258
+#define OPT_FINGERPRINT 259
+#define OPT_RTT 260
+#define OPT_AUTOTIMEOUT 261
+#define OPT_REPLAY 262
+#define OPT_DRYRUN 263
+#define OPT_PROGRESS 264
+#define OPT_STATSFILE 265
+#define OPT_METRICS 266
+#define OPT_STAGETIMES 267
+#define OPT_SHARD 268
+#define OPT_SEED 269
+#define OPT_WORKERS 270
+#define OPT_CHECKPOINT 271
+#define OPT_RESUME 272
+#define OPT_PREVIOUS 273
+#define OPT_SAMPLE 274
+#define OPT_DAEMON 275
+#define OPT_SUBMIT 276
+#define OPT_JOBS 277
+#define OPT_WEIGHT 278
+#define OPT_DISCOVER 279
+#define OPT_DISCOVERCACHE 280
+#define OPT_HOSTRETRY 281
+#define OPT_PRIORITY 282
+#define OPT_TOPPORTS 283
 
 /* Structures */
 
@@ -149,12 +299,22 @@ typedef struct {
    unsigned timeout;            /* Timeout for this host in us */
    ip_address addr;             /* Host IP address */
    struct timeval last_send_time; /* Time when last packet sent to this addr */
+   TCP_UINT64 send_ns;          /* Transmit time of last packet in ns */
    unsigned short num_sent;     /* Number of packets sent */
    unsigned short num_recv;     /* Number of packets received */
    uint16_t dport;              /* Destination port */
    unsigned char live;          /* Set when awaiting response */
+   unsigned char prev;          /* PREV_* state in --previous results */
 } host_entry;
 
+typedef struct {
+   TCP_UINT64 due_ns;           /* When the response arrives */
+   uint32_t addr;               /* Address that the probe was sent to */
+   uint16_t dport;              /* Port that the probe was sent to */
+   uint16_t sport;              /* Source port of the probe */
+   int open;                    /* SYN-ACK if set, otherwise RST */
+} dryrun_event;
+
 typedef struct {
    int cwr;
    int ecn;
@@ -166,6 +326,186 @@ typedef struct {
    int fin;
 } tcp_flags_struct;
 
+/* Log-bucketed histogram, see hist.c */
+typedef struct {
+   TCP_UINT64 count;		/* Number of values recorded */
+   TCP_UINT64 sum;		/* Sum of values, for the mean */
+   TCP_UINT64 min;
+   TCP_UINT64 max;
+   TCP_UINT64 counts[HIST_BUCKETS];
+} histogram;
+
+/* What a --workers process reports to the parent, see start_workers() */
+typedef struct {
+   unsigned num_hosts;		/* Entries in the worker's shard */
+   unsigned responders;		/* Entries that responded */
+   histogram rtt_hist;		/* RTTs of first replies for --rtt */
+   double elapsed_seconds;	/* Duration of the worker's scan */
+} worker_result;
+
+/* A target address in the --discover pre-pass, see discover_hosts() */
+typedef struct {
+   uint32_t addr;		/* IPv4 address in host byte order */
+   unsigned char state;		/* DISCOVER_* state */
+   time_t when;			/* When the state was found */
+} discover_host;
+
+/* Replies from one target address, for --hostretry */
+typedef struct {
+   uint32_t addr;		/* Address in network byte order */
+   int used;			/* Non-zero if the slot holds addr */
+   unsigned replies;		/* Entries that replied */
+   unsigned retries;		/* First retries answered or timed out */
+   unsigned rescued;		/* Of those, first retries answered */
+} host_stats;
+
+/* A --servicefile port and its frequency, see create_port_list() */
+typedef struct {
+   uint16_t port;		/* TCP port */
+   unsigned line;		/* Position in the file */
+   double weight;		/* Frequency, or 0 if not given */
+} port_weight;
+
+/*
+ * A --daemon client connection, see schedule_jobs().  It is reading its
+ * job line until have_line is set, then waiting for a slot until job is
+ * set, and then sending the rest of out after the job finishes.
+ */
+typedef struct {
+   int fd;			/* Client socket, or -1 if not in use */
+   unsigned long seq;		/* Order of arrival */
+   char line[MAXLINE];		/* The job line read so far */
+   size_t len;			/* Bytes in line */
+   int have_line;		/* line holds the whole job line */
+   tcpscan_ctx *job;		/* The running job, or NULL */
+   unsigned slot;		/* The job's slot in jobs[] */
+   FILE *out;			/* The job's output, in memory */
+   char *buf;			/* open_memstream() buffer for out */
+   size_t size;			/* Bytes in buf at the last flush */
+   size_t sent;			/* Bytes of buf written to fd */
+   TCP_UINT64 deadline_ns;	/* Drop the client if still stalled */
+   int failed;			/* Writing to the client failed */
+} daemon_client;
+
+/* Scan state read from a --checkpoint file by read_checkpoint() */
+typedef struct {
+   unsigned entries;		/* Number of host entries */
+   uint32_t list_hash;		/* list_hash() of the host list */
+   unsigned long seed;		/* Seed given to init_genrand() */
+   unsigned cursor;		/* Position of the cursor in helistptr */
+   unsigned first_probes;	/* Entries sent at least once */
+   unsigned first_pass;		/* Position reached by the first pass */
+   unsigned responders;
+   unsigned open_count;
+   unsigned closed_count;
+   TCP_UINT64 probes_sent;
+   unsigned num_pending;	/* Entries awaiting a reply */
+   unsigned *pending;		/* Position and probes sent, in pairs */
+} checkpoint_state;
+
+/*
+ * The state of one scan, see libtcpscan.h.  The functions in tcp-scan.c
+ * are given the context that they work on, and reach the socket, the
+ * capture and the probe settings through its engine.
+ */
+struct tcpscan_ctx {
+   tcpscan_engine *engine;	/* The engine that runs the scan */
+/* Settings, from the options or copied from the defaults */
+   unsigned retry;		/* Number of retries */
+   unsigned host_retry;		/* --hostretry limit, or 0 */
+   unsigned timeout;		/* Per-host timeout in ms */
+   float backoff_factor;	/* Backoff factor */
+   unsigned interval;		/* Interval between probes in us */
+   unsigned bandwidth;		/* Bandwidth in bits per sec */
+   int open_only;		/* Only show open ports? */
+   int random_flag;		/* Randomise the list */
+   int priority_flag;		/* Scan the common ports first */
+   int numeric_flag;		/* IP addresses only */
+   int quiet_flag;		/* Don't decode the packet */
+   int portname_flag;		/* Display port names */
+   int ignore_dups;		/* Don't display duplicate packets */
+   int rtt_flag;		/* Display round trip times */
+   char *local_data;		/* Port list from --port option */
+   unsigned weight;		/* --weight share of the --daemon link */
+   uint16_t sport;		/* TCP source port of the probes */
+   FILE *out;			/* Where the replies are displayed */
+   tcpscan_reply_fn reply_fn;	/* Reply callback, or NULL to display */
+   void *reply_arg;		/* Argument for reply_fn */
+/* Send timing, see scan_step() and schedule_jobs() */
+   struct timeval start_time;	/* When the scan started */
+   struct timeval last_packet_time;	/* Time last packet was sent */
+   int req_interval;		/* Requested per-packet interval */
+   int cum_err;			/* Cumulative timing error */
+   int reset_cum_err;		/* Zero cum_err before the next probe */
+   int pass_no;			/* Pass through the list, for -v */
+   int first_timeout;		/* No entry has timed out yet */
+   TCP_UINT64 vtime;		/* Virtual finish time for --jobs */
+/* The host list */
+   host_entry *helist;		/* Array of host entries */
+   host_entry **helistptr;	/* Array of pointers to host entries */
+   unsigned num_hosts;		/* Number of entries in the list */
+   unsigned num_left;		/* Free entries at the end of helist */
+   host_entry **cursor;		/* Pointer to current host entry ptr */
+   unsigned first_pass;		/* Entries before this position in
+				   helistptr have been sent to */
+   unsigned live_count;		/* Number of entries awaiting reply */
+   uint32_t *host_index;	/* find_host() hash table, see
+				   build_host_index() */
+   unsigned host_index_mask;	/* Hash table size - 1 */
+   host_stats *host_stats;	/* Per-address replies for --hostretry,
+				   see build_host_stats() */
+   unsigned host_stats_mask;	/* Hash table size - 1 */
+   unsigned host_stats_count;	/* Addresses in host_stats */
+/* Results */
+   unsigned responders;		/* Number of hosts which responded */
+   TCP_UINT64 probes_sent;	/* Probes sent including retries */
+   unsigned first_probes;	/* Host entries sent at least once */
+   unsigned open_count;		/* SYN-ACK responses displayed */
+   unsigned closed_count;	/* RST responses displayed */
+   struct timeval first_pass_end;	/* When the last entry was first sent */
+   histogram rtt_hist;		/* RTTs of first replies in ns */
+   double srtt;			/* Smoothed RTT in us */
+   double rttvar;		/* RTT variation in us */
+   unsigned rtt_samples;	/* Number of samples in srtt */
+   TCP_UINT64 retries_skipped;	/* Retries not sent by --hostretry */
+   unsigned max_iter;		/* Max iterations in find_host() */
+   TCP_UINT64 find_host_calls;	/* Calls to find_host() */
+   TCP_UINT64 find_host_iterations;	/* Total find_host() iterations */
+   unsigned replies_delivered;	/* Replies given to reply_fn */
+   unsigned previous_open;	/* Entries open in --previous */
+   unsigned changed_open;	/* Open, and not in --previous */
+   unsigned changed_closed;	/* Closed, and not in --previous */
+   unsigned vanished;		/* In --previous, now no response */
+/* --progress display, see show_progress() */
+   struct timeval progress_time;	/* When it was last displayed */
+   TCP_UINT64 progress_probes;	/* probes_sent when last displayed */
+/* --discover pre-pass, see discover_hosts() */
+   discover_host *discover_list;	/* Targets, sorted by address */
+   unsigned discover_list_len;
+};
+
+/* A decoded TCP option */
+typedef struct {
+   uint8_t kind;		/* Option kind */
+   uint8_t len;			/* Length, 1 for EOL and NOP */
+   uint32_t val1;		/* MSS, window scale or timestamp value */
+   uint32_t val2;		/* Timestamp echo reply */
+} tcp_option;
+
+/* The decoded TCP options from one packet */
+typedef struct {
+   unsigned count;		/* Number of options in opt[] */
+   unsigned flags;		/* TCPOPT_F_* values */
+   tcp_option opt[TCPOPT_MAX_OPTS];
+} tcp_options;
+
+/* Compiled TCP service name database (opaque) */
+typedef struct service_db service_db;
+
+/* pcapng savefile writer (opaque) */
+typedef struct pcapng_writer pcapng_writer;
+typedef struct metrics_server metrics_server;
+
 /* TCP Pseudo Header for checksum calculation */
 typedef struct {
    uint32_t s_addr;
@@ -175,6 +515,154 @@ typedef struct {
    uint16_t len;
 } pseudo_hdr;
 
+/* A probe awaiting its kernel TX timestamp, see read_tx_timestamps() */
+typedef struct {
+   host_entry *he;		/* Host that the probe was sent to */
+   uint32_t key;		/* TX timestamp ID of the probe */
+   unsigned short num_sent;	/* he->num_sent when it was sent */
+} tx_slot;
+
+/* MT19937 random number generator state, see mt19937ar.c */
+typedef struct {
+   unsigned long mt[MT_N];	/* State vector */
+   int mti;			/* Next word of mt[] to use */
+} mt_state;
+
+/*
+ * The engine that runs scans, see libtcpscan.h: the socket, the capture,
+ * the probe settings and everything else that the scans of one
+ * tcp-scan process or one tcpscan_init() call share.  Nothing here is
+ * shared between engines.
+ */
+struct tcpscan_engine {
+/* Probe and capture settings */
+   int snaplen;			/* Pcap snap length */
+   uint32_t seq_no;		/* Initial TCP sequence number */
+   uint32_t ack_no;		/* TCP acknowledgement number */
+   int seq_no_flag;
+   int ack_no_flag;
+   uint16_t source_port;	/* TCP Source Port */
+   int source_port_flag;
+   uint16_t window;		/* TCP Window size */
+   uint16_t mss;		/* TCP MSS. 0=Don't use MSS option */
+   int wscale_flag;		/* Add wscale=0 TCP option? */
+   int sack_flag;		/* Add SACKOK TCP option? */
+   int timestamp_flag;		/* Add TIMESTAMP TCP option? */
+   int ip_ttl;			/* IP TTL */
+   char *if_name;		/* Interface name, e.g. "eth0" */
+   int df_flag;			/* IP DF Flag */
+   int ip_tos;			/* IP TOS Field */
+   int tcp_flags_flag;		/* Specify outbound TCP flags */
+   tcp_flags_struct tcp_flags;	/* Specified TCP flags */
+   int ipv6_flag;		/* IPv6 */
+   int fingerprint_flag;	/* Display TCP stack fingerprint */
+   int autotimeout_flag;	/* Set timeout from measured RTT */
+   int verbose;			/* Verbose level */
+   int debug;			/* Debug flag */
+/* Ports */
+   service_db *services;	/* Service names for --portname */
+   char service_file[MAXLINE];	/* TCP Service file name */
+   uint16_t *port_list;
+   int port_list_weighted;	/* --servicefile has frequencies */
+   unsigned top_ports;		/* Ports given by --top-ports */
+   unsigned *port_rank;		/* --priority position of each port */
+/* The socket and the capture */
+   int sockfd;			/* Raw socket from tcpscan_init() */
+   int running;			/* tcpscan_run() is using the socket */
+   pcap_t *pcap_handle;		/* pcap handle */
+   int pcap_fd;			/* pcap File Descriptor */
+   size_t ip_offset;		/* Offset to IP header in pcap pkt */
+   int pcap_tstamp_nano;	/* Capture timestamps are in ns */
+   int pcap_linktype;		/* Datalink type of pcap_handle */
+   uint32_t source_address;	/* Source IP Address */
+   int tx_sock;			/* Socket with TX timestamps enabled */
+   uint32_t tx_key;		/* TX timestamp ID of next probe */
+   unsigned tx_stamped;		/* Kernel TX timestamps used */
+   tx_slot tx_ring[TX_RING_SIZE];	/* Probes awaiting a TX timestamp */
+   mt_state rng;		/* Random numbers for the probes */
+/* Command line targets */
+   char filename[MAXLINE];
+   int filename_flag;
+   char *stdin_targets;		/* --file=- read by start_workers() */
+   size_t stdin_targets_len;
+/* --shard, --seed and --workers */
+   unsigned shard_index;	/* --shard node number, from 1 */
+   unsigned shard_count;	/* --shard number of nodes */
+   int seed_flag;		/* --seed given */
+   unsigned long seed;		/* --seed value */
+   unsigned workers;		/* --workers processes */
+   unsigned worker_no;		/* This worker, from 1, or 0 */
+   worker_result *worker_results;	/* Shared with the workers */
+/* --checkpoint, --previous and --discover */
+   char checkpoint_file[MAXLINE];	/* --checkpoint file name */
+   int resume_flag;		/* --resume from checkpoint_file */
+   checkpoint_state resume;	/* Read by read_checkpoint() */
+   unsigned long random_seed;	/* Seed given to init_genrand_r() */
+   char previous_file[MAXLINE];	/* --previous results file name */
+   double sample_rate;		/* --sample fraction */
+   uint16_t *discover_ports;	/* --discover probes, 0 for ICMP */
+   unsigned discover_count;
+   int discover_icmp;		/* --discover sends ICMP echoes */
+   char discover_cache[MAXLINE];	/* --discovercache file name */
+/* --daemon and --submit */
+   char daemon_path[MAXLINE];	/* --daemon UNIX socket path */
+   char submit_path[MAXLINE];	/* --submit UNIX socket path */
+   unsigned daemon_jobs;	/* --jobs run at once by --daemon */
+   tcpscan_ctx **jobs;		/* Running --daemon jobs by slot */
+   int daemon_listen_fd;	/* The --daemon UNIX socket */
+   daemon_client *clients;	/* Connections, see schedule_jobs() */
+   unsigned num_clients;	/* Entries in clients[] */
+   unsigned long client_seq;	/* Arrivals so far */
+   tcpscan_ctx cli_scan;	/* Command line scan and defaults */
+/* Savefiles */
+   char pcap_savefile[MAXLINE];	/* pcap savefile filename */
+   pcapng_writer *pcapng_handle;	/* pcapng savefile writer */
+   unsigned pcapng_recv_if;	/* pcapng interface for replies */
+   unsigned pcapng_sent_if;	/* pcapng interface for probes */
+   TCP_UINT64 pcap_rotate_size;	/* Rotate savefile after n bytes */
+   unsigned pcap_rotate_secs;	/* Rotate savefile after n seconds */
+   int pcap_sent_flag;		/* Save transmitted probes */
+   char *command_line;		/* Command line for savefile comment */
+   char replay_file[MAXLINE];	/* --replay savefile name */
+/* --dryrun network model, see dryrun_send() */
+   int dryrun_flag;		/* Simulate the network with --dryrun */
+   double dryrun_loss;		/* Probability a probe gets no reply */
+   unsigned dryrun_rtt;		/* Minimum round trip time in us */
+   unsigned dryrun_jitter;	/* Maximum extra round trip time in us */
+   double dryrun_open;		/* Fraction of replies that are open */
+   double dryrun_silent;	/* Fraction of ports that never reply */
+   double dryrun_up;		/* Fraction of hosts that are up */
+   dryrun_event *dryrun_queue;	/* Heap of pending responses */
+   unsigned dryrun_queue_len;
+   unsigned dryrun_queue_size;
+   TCP_UINT64 dryrun_probes;	/* Probes sent with --dryrun */
+   TCP_UINT64 dryrun_lost;	/* Probes that got no response */
+   TCP_UINT64 dryrun_responses;	/* Responses delivered */
+   TCP_UINT64 dryrun_interrupt;	/* Raise SIGINT after this probe */
+   int virtual_clock;		/* Set when the clock is simulated */
+   TCP_UINT64 virtual_now_ns;	/* Simulated time in ns */
+/* Statistics */
+   int progress_flag;		/* Display progress on stderr */
+   unsigned progress_interval;	/* Progress interval in s */
+   char stats_file[MAXLINE];	/* --statsfile name */
+   char metrics_spec[MAXLINE];	/* --metrics listen address */
+   metrics_server *metrics;	/* Prometheus metrics listener */
+   TCP_UINT64 metrics_last_ns;	/* When the metrics were last read */
+   TCP_UINT64 metrics_last_probes;	/* probes_sent then */
+   unsigned metrics_last_responders;	/* responders then */
+   TCP_UINT64 scan_start_ns;	/* When the scan started */
+   TCP_UINT64 sendto_errors;	/* Probes dropped by sendto() */
+   TCP_UINT64 sendto_calls;	/* System call counts, see */
+   TCP_UINT64 select_calls;	/* print_syscall_stats() */
+   TCP_UINT64 select_empty;	/* select() timeouts */
+   TCP_UINT64 dispatch_calls;	/* Calls to pcap_dispatch() */
+   TCP_UINT64 dispatch_packets;	/* Packets from pcap_dispatch() */
+   TCP_UINT64 errqueue_reads;	/* TX timestamp recvmsg() calls */
+   int stagetimes_flag;		/* Display --stagetimes at exit */
+   int stage_timing;		/* Record stage_hist[] */
+   histogram stage_hist[STAGE_COUNT];	/* Stage durations in ns */
+};
+
 /* Functions */
 
 #ifndef HAVE_STRLCAT
@@ -189,50 +677,178 @@ void warn_sys(const char *, ...);
 void err_msg(const char *, ...);
 void warn_msg(const char *, ...);
 void err_print(int, const char *, va_list);
-void usage(int, int);
-void add_host(const char *, unsigned);
-int send_packet(int, host_entry *, int, struct timeval *);
-void recvfrom_wto(int, int);
-void remove_host(host_entry **);
+void err_exit(void);
+extern THREAD_LOCAL jmp_buf *error_jump;
+void usage(tcpscan_ctx *, int, int);
+void add_host(tcpscan_ctx *, const char *, unsigned);
+int send_packet(tcpscan_ctx *, int, host_entry *, int, struct timeval *);
+void recvfrom_wto(tcpscan_ctx *, int, int);
+void remove_host(tcpscan_ctx *, host_entry **);
 void timeval_diff(const struct timeval *, const struct timeval *,
                   struct timeval *);
-host_entry *find_host(host_entry **, const struct in_addr *,
+void select_shard(tcpscan_ctx *);
+void select_previous(tcpscan_ctx *);
+void shuffle_hosts(tcpscan_ctx *, unsigned, unsigned);
+void build_port_rank(tcpscan_engine *);
+void sort_by_priority(tcpscan_ctx *, unsigned, unsigned);
+void display_vanished(tcpscan_ctx *, const host_entry *);
+void start_workers(tcpscan_ctx *);
+void merge_worker_output(tcpscan_engine *, const int *);
+void build_host_index(tcpscan_ctx *);
+void check_port_options(tcpscan_ctx *);
+void run_scan(tcpscan_ctx *, int, const struct timeval *, TCP_UINT64);
+void show_summary(tcpscan_ctx *, const struct timeval *);
+void run_daemon(tcpscan_engine *, int);
+int admit_job(tcpscan_engine *, daemon_client *, unsigned);
+void finish_job(tcpscan_engine *, daemon_client *, int);
+void schedule_jobs(tcpscan_engine *, int);
+void accept_client(tcpscan_engine *);
+void read_client(daemon_client *);
+void write_client(daemon_client *);
+void close_client(daemon_client *);
+int client_stalled(daemon_client *, TCP_UINT64);
+int daemon_fd_set(tcpscan_engine *, fd_set *, fd_set *, int);
+void daemon_handle(tcpscan_engine *, const fd_set *, const fd_set *);
+void daemon_poll(tcpscan_engine *, unsigned);
+unsigned job_wait(tcpscan_ctx *, const struct timeval *);
+void reset_job_state(tcpscan_engine *);
+void init_engine(tcpscan_engine *);
+void init_context(tcpscan_ctx *, tcpscan_engine *, const tcpscan_ctx *);
+int open_raw_socket(tcpscan_engine *);
+void prepare_list(tcpscan_ctx *);
+unsigned bandwidth_interval(tcpscan_ctx *, unsigned);
+void scan_loop(tcpscan_ctx *, int, const struct timeval *);
+unsigned scan_step(tcpscan_ctx *, int, const struct timeval *, int *);
+void deliver_reply(tcpscan_ctx *, const host_entry *, const struct in_addr *,
+                   const unsigned char *, size_t, TCP_UINT64);
+int submit_job(tcpscan_engine *, int, char *[]);
+void discard_packet(u_char *, const struct pcap_pkthdr *, const u_char *);
+host_entry *find_host(tcpscan_ctx *, const struct in_addr *,
                       const unsigned char *, unsigned);
-void display_packet(unsigned, const unsigned char *, const host_entry *,
-                    const struct in_addr *);
-void advance_cursor(void);
-void dump_list(void);
+host_entry *lookup_host(tcpscan_ctx *, const struct in_addr *, unsigned);
+void build_host_stats(tcpscan_ctx *);
+host_stats *find_host_stats(tcpscan_ctx *, uint32_t);
+unsigned retry_limit(tcpscan_ctx *, const host_entry *);
+void note_retry_timeout(tcpscan_ctx *, const host_entry *);
+void report_host_stats(tcpscan_ctx *);
+void parse_discover(tcpscan_engine *, const char *);
+void discover_hosts(tcpscan_ctx *, int);
+discover_host *find_discover_host(tcpscan_ctx *, uint32_t);
+void discover_reply(void *, const tcpscan_reply *);
+unsigned read_discover_cache(tcpscan_ctx *);
+void write_discover_cache(tcpscan_ctx *);
+int make_echo_request(tcpscan_ctx *, char *, const host_entry *);
+void echo_reply(tcpscan_ctx *, const unsigned char *, unsigned, TCP_UINT64);
+void display_packet(tcpscan_ctx *, unsigned, const unsigned char *,
+                    const host_entry *, const struct in_addr *, TCP_UINT64);
+void advance_cursor(tcpscan_ctx *);
+void dump_list(tcpscan_ctx *);
 void print_times(void);
-void initialise(void);
-void clean_up(void);
+void initialise(tcpscan_engine *);
+void open_capture(tcpscan_engine *);
+void open_replay(tcpscan_engine *);
+void set_datalink(tcpscan_engine *, int);
+void replay_packets(tcpscan_ctx *);
+void open_dryrun(tcpscan_engine *);
+void set_virtual_clock(tcpscan_engine *, TCP_UINT64);
+void engine_gettimeofday(const tcpscan_engine *, struct timeval *);
+TCP_UINT64 engine_time_ns(const tcpscan_engine *);
+void parse_dryrun_model(tcpscan_engine *, const char *);
+void dryrun_send(tcpscan_ctx *, host_entry *);
+void dryrun_wait(tcpscan_ctx *, int);
+void dryrun_report(tcpscan_ctx *, TCP_UINT64, TCP_UINT64);
+void show_progress(tcpscan_ctx *, const struct timeval *,
+                   const struct timeval *, int);
+void metrics_format(FILE *, void *);
+void print_stage_times(tcpscan_ctx *, FILE *);
+void print_syscall_stats(tcpscan_ctx *);
+void stage_signal(int);
+void checkpoint_signal(int);
+uint32_t list_hash(tcpscan_ctx *);
+void write_checkpoint(tcpscan_ctx *);
+void read_checkpoint(tcpscan_engine *);
+void apply_checkpoint(tcpscan_ctx *);
+void clean_up(tcpscan_engine *);
 void tcp_scan_version(void);
 char *make_message(const char *, ...);
 char *printable(const unsigned char*, size_t);
+int printable_select(int);
 void callback(u_char *, const struct pcap_pkthdr *, const u_char *);
-void process_options(int, char *[]);
+void process_options(tcpscan_ctx *, int, char *[], int);
+int is_job_option(int);
+void open_savefile(tcpscan_ctx *);
+TCP_UINT64 pkthdr_ns(tcpscan_engine *, const struct pcap_pkthdr *);
+void enable_tx_timestamps(tcpscan_engine *, int);
+void read_tx_timestamps(tcpscan_engine *, int);
+void update_rtt(tcpscan_ctx *, TCP_UINT64);
+unsigned auto_timeout(tcpscan_ctx *);
 ip_address *get_host_address(const char *, int, ip_address *, char **);
 const char *my_ntoa(ip_address, int);
 /* Wrappers */
 int Gettimeofday(struct timeval *);
+int Clock_gettime(clockid_t, struct timespec *);
 void *Malloc(size_t);
 void *Realloc(void *, size_t);
+TCP_UINT64 alloc_count(void);
+TCP_UINT64 clock_count(void);
 unsigned long int Strtoul(const char *, int);
 long int Strtol(const char *, int);
 unsigned int hstr_i(const char *);
 uint16_t in_cksum(const uint16_t *, int);
+uint32_t permute_index(uint32_t, uint32_t, TCP_UINT64);
 uint32_t get_source_ip(const char *);
-void add_host_port(const char *, unsigned, unsigned);
-void create_port_list(const char *);
-void process_tcp_flags(const char *);
+void add_host_port(tcpscan_ctx *, const ip_address *, unsigned, unsigned);
+void create_port_list(tcpscan_engine *, const char *);
+void create_top_ports(tcpscan_engine *, unsigned);
+void process_tcp_flags(tcpscan_engine *, const char *);
 unsigned str_to_bandwidth(const char *);
 unsigned str_to_interval(const char *);
+TCP_UINT64 str_to_size(const char *);
+TCP_UINT64 timestamp_ns(void);
 char *dupstr(const char *);
+/* pcapng savefile writer */
+pcapng_writer *pcapng_open(const char *, const char *, TCP_UINT64, unsigned);
+unsigned pcapng_add_interface(pcapng_writer *, int, unsigned, const char *);
+void pcapng_write(pcapng_writer *, unsigned, TCP_UINT64, const unsigned char *,
+                  unsigned, unsigned, int);
+void pcapng_close(pcapng_writer *, int);
+/* Prometheus metrics listener */
+metrics_server *metrics_open(const char *);
+int metrics_fd_set(const metrics_server *, fd_set *, fd_set *, int);
+void metrics_handle(metrics_server *, const fd_set *, const fd_set *,
+                    void (*)(FILE *, void *), void *);
+void metrics_write(FILE *, const char *, const char *, const char *, double);
+void metrics_close(metrics_server *);
+/* Service name database */
+int parse_service_line(const char *, char *, size_t, unsigned *, char *,
+                       size_t);
+double parse_service_weight(const char *);
+service_db *service_db_load(const char *);
+void service_db_save(const service_db *, const char *);
+const char *service_db_lookup(const service_db *, unsigned);
+unsigned service_db_count(const service_db *);
+void service_db_free(service_db *);
+/* TCP option decoder */
+unsigned tcpopt_decode(const unsigned char *, size_t, tcp_options *);
+size_t tcpopt_format(const tcp_options *, char *, size_t);
+TCP_UINT64 tcpopt_fingerprint(const tcp_options *, unsigned, unsigned);
+/* Histograms */
+void hist_init(histogram *);
+void hist_add(histogram *, TCP_UINT64);
+void hist_merge(histogram *, const histogram *);
+TCP_UINT64 hist_percentile(const histogram *, double);
+void hist_print(FILE *, const histogram *, const char *, double, const char *,
+                int);
 /* MT19937 prototypes */
 void init_genrand(unsigned long);
+void init_genrand_r(mt_state *, unsigned long);
 void init_by_array(unsigned long[], int);
 unsigned long genrand_int32(void);
+unsigned long genrand_int32_r(mt_state *);
 long genrand_int31(void);
 double genrand_real1(void);
 double genrand_real2(void);
+double genrand_real2_r(mt_state *);
 double genrand_real3(void);
 double genrand_res53(void);
+double genrand_res53_r(mt_state *);
@@ -0,0 +1,247 @@
+/*
+ * The TCP Scanner (tcp-scan) is Copyright (C) 2003-2013 Roy Hills,
+ * NTA Monitor Ltd.
+ *
+ * This file is part of tcp-scan.
+ *
+ * tcp-scan is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * tcp-scan is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with tcp-scan.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * tcpopt.c -- TCP option decoder for tcp-scan
+ *
+ * This file contains a table-driven decoder for the TCP options in
+ * received packets, a function to format the decoded options for
+ * display, and a function to compute a fingerprint of the option layout.
+ *
+ * The decoder never reads beyond the supplied length and never allocates
+ * memory.  An option with an invalid length byte, including a length of
+ * zero or one for a multi-byte option, ends the decoding.
+ */
+
+#include "tcp-scan.h"
+
+/* How the option value is decoded and displayed */
+#define TCPOPT_FMT_NONE 0		/* No value, e.g. NOP */
+#define TCPOPT_FMT_U8 1			/* 8-bit value, e.g. WSCALE=7 */
+#define TCPOPT_FMT_U16 2		/* 16-bit value, e.g. MSS=1460 */
+#define TCPOPT_FMT_TS 3			/* Two 32-bit values */
+
+/* FNV-1a 64-bit hash parameters */
+#define FNV64_OFFSET 14695981039346656037ULL
+#define FNV64_PRIME 1099511628211ULL
+
+typedef struct {
+   const char *name;	/* Display name, or NULL for unknown options */
+   unsigned char len;	/* Length in bytes, 1 for single-byte options */
+   unsigned char format;	/* TCPOPT_FMT_* value */
+} tcpopt_type;
+
+/*
+ *	Option types that we decode, indexed by option kind.  Any kind that
+ *	is not listed here is displayed as opt-<kind> and skipped using its
+ *	length byte.
+ */
+static const tcpopt_type tcpopt_types[256] = {
+   [TCPOPT_EOL]            = {"EOL", 1, TCPOPT_FMT_NONE},
+   [TCPOPT_NOP]            = {"NOP", 1, TCPOPT_FMT_NONE},
+   [TCPOPT_MAXSEG]         = {"MSS", TCPOLEN_MAXSEG, TCPOPT_FMT_U16},
+   [TCPOPT_WINDOW]         = {"WSCALE", TCPOLEN_WINDOW, TCPOPT_FMT_U8},
+   [TCPOPT_SACK_PERMITTED] = {"SACKOK", TCPOLEN_SACK_PERMITTED,
+                              TCPOPT_FMT_NONE},
+   [TCPOPT_TIMESTAMP]      = {"TIMESTAMP", TCPOLEN_TIMESTAMP, TCPOPT_FMT_TS}
+};
+
+/*
+ *	tcpopt_decode -- Decode TCP options
+ *
+ *	Inputs:
+ *
+ *	data	Pointer to the start of the TCP options
+ *	len	Number of option bytes available
+ *	opts	The decoded options are stored here
+ *
+ *	Returns:
+ *
+ *	The number of options decoded.
+ *
+ *	opts->flags is set to TCPOPT_F_TRUNCATED if the last option runs
+ *	past the end of the data, or TCPOPT_F_BADLEN if an option has an
+ *	invalid length.  An option with a bad length is stored in opts
+ *	with its length byte, and no further options are decoded.
+ */
+unsigned
+tcpopt_decode(const unsigned char *data, size_t len, tcp_options *opts) {
+   size_t pos = 0;
+
+   opts->count = 0;
+   opts->flags = 0;
+
+   while (pos < len && opts->count < TCPOPT_MAX_OPTS) {
+      const tcpopt_type *type = &tcpopt_types[data[pos]];
+      tcp_option *opt = &opts->opt[opts->count];
+      unsigned optlen;
+
+      opt->kind = data[pos];
+      opt->val1 = 0;
+      opt->val2 = 0;
+      if (type->len == 1) {
+         optlen = 1;
+      } else {
+         if (pos + 2 > len) {
+            opts->flags |= TCPOPT_F_TRUNCATED;
+            break;
+         }
+         optlen = data[pos+1];
+         if (optlen < 2 || (type->len && optlen != type->len)) {
+            opt->len = optlen;
+            opts->count++;
+            opts->flags |= TCPOPT_F_BADLEN;
+            break;
+         }
+         if (pos + optlen > len) {
+            opts->flags |= TCPOPT_F_TRUNCATED;
+            break;
+         }
+      }
+      opt->len = optlen;
+      switch (type->format) {
+         case TCPOPT_FMT_U8:
+            opt->val1 = data[pos+2];
+            break;
+         case TCPOPT_FMT_U16:
+            opt->val1 = (uint32_t) data[pos+2] << 8 | data[pos+3];
+            break;
+         case TCPOPT_FMT_TS:
+            opt->val1 = (uint32_t) data[pos+2] << 24 |
+                        (uint32_t) data[pos+3] << 16 |
+                        (uint32_t) data[pos+4] << 8 | data[pos+5];
+            opt->val2 = (uint32_t) data[pos+6] << 24 |
+                        (uint32_t) data[pos+7] << 16 |
+                        (uint32_t) data[pos+8] << 8 | data[pos+9];
+            break;
+      }
+      opts->count++;
+      pos += optlen;
+   }
+   return opts->count;
+}
+
+/*
+ *	tcpopt_format -- Format decoded TCP options for display
+ *
+ *	Inputs:
+ *
+ *	opts	The decoded options
+ *	buf	Buffer for the formatted string
+ *	size	Size of buf.  TCPOPT_STRLEN is always large enough.
+ *
+ *	Returns:
+ *
+ *	The length of the formatted string.
+ *
+ *	The options are displayed as a comma-separated list, e.g.
+ *	"MSS=1460,NOP,WSCALE=7".  An option with a bad length is displayed
+ *	as opt-<kind>(badlen=<len>).  The output is silently truncated if
+ *	buf is too small.
+ */
+size_t
+tcpopt_format(const tcp_options *opts, char *buf, size_t size) {
+   size_t pos = 0;
+   unsigned i;
+
+   if (size == 0)
+      return 0;
+   buf[0] = '\0';
+
+   for (i=0; i<opts->count && pos < size; i++) {
+      const tcp_option *opt = &opts->opt[i];
+      const tcpopt_type *type = &tcpopt_types[opt->kind];
+      const char *sep = i ? "," : "";
+      int n;
+
+      if ((opts->flags & TCPOPT_F_BADLEN) && i == opts->count - 1) {
+         n = snprintf(buf+pos, size-pos, "%sopt-%u(badlen=%u)", sep,
+                      opt->kind, opt->len);
+      } else if (!type->name) {
+         n = snprintf(buf+pos, size-pos, "%sopt-%u", sep, opt->kind);
+      } else {
+         switch (type->format) {
+            case TCPOPT_FMT_U8:
+            case TCPOPT_FMT_U16:
+               n = snprintf(buf+pos, size-pos, "%s%s=%u", sep, type->name,
+                            (unsigned) opt->val1);
+               break;
+            case TCPOPT_FMT_TS:
+               n = snprintf(buf+pos, size-pos, "%s%s=%u,%u", sep, type->name,
+                            (unsigned) opt->val1, (unsigned) opt->val2);
+               break;
+            default:
+               n = snprintf(buf+pos, size-pos, "%s%s", sep, type->name);
+               break;
+         }
+      }
+      if (n < 0)
+         break;
+      pos += n;
+   }
+   if (pos >= size)
+      pos = size - 1;
+   return pos;
+}
+
+/*
+ *	tcpopt_fingerprint -- Compute a fingerprint of a TCP stack
+ *
+ *	Inputs:
+ *
+ *	opts	The decoded options
+ *	window	TCP window size from the packet
+ *	ttl	IP TTL from the packet
+ *
+ *	Returns:
+ *
+ *	64-bit FNV-1a hash of the option layout, window size and TTL.
+ *
+ *	The layout is the kind and length of each option in order, but not
+ *	the option values: the MSS depends on the path and the timestamps
+ *	change with every packet.  The TTL is rounded up to the likely
+ *	initial value of 32, 64, 128 or 255, so the same stack gives the
+ *	same fingerprint regardless of how many hops away it is.
+ */
+TCP_UINT64
+tcpopt_fingerprint(const tcp_options *opts, unsigned window, unsigned ttl) {
+   TCP_UINT64 hash = FNV64_OFFSET;
+   unsigned char bytes[3];
+   unsigned i;
+
+   hash = (hash ^ opts->count) * FNV64_PRIME;
+   for (i=0; i<opts->count; i++) {
+      hash = (hash ^ opts->opt[i].kind) * FNV64_PRIME;
+      hash = (hash ^ opts->opt[i].len) * FNV64_PRIME;
+   }
+   if (ttl <= 32)
+      ttl = 32;
+   else if (ttl <= 64)
+      ttl = 64;
+   else if (ttl <= 128)
+      ttl = 128;
+   else
+      ttl = 255;
+   bytes[0] = (window >> 8) & 0xff;
+   bytes[1] = window & 0xff;
+   bytes[2] = ttl;
+   for (i=0; i<sizeof(bytes); i++)
+      hash = (hash ^ bytes[i]) * FNV64_PRIME;
+
+   return hash;
+}
@@ -0,0 +1,198 @@
+/*
+ * The TCP Scanner (tcp-scan) is Copyright (C) 2003-2013 Roy Hills,
+ * NTA Monitor Ltd.
+ *
+ * This file is part of tcp-scan.
+ *
+ * tcp-scan is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * tcp-scan is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with tcp-scan.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * tcpscan-names.h -- Library names of the tcp-scan internal symbols
+ *
+ * libtcpscan.a is linked into other programs, so every function and
+ * variable in it that is not part of libtcpscan.h is given a tcpscan_
+ * prefix, which keeps them out of the program's namespace.  tcp-scan.h
+ * includes this when TCPSCAN_LIBRARY is defined.  A new external
+ * function or variable must be added here, which check-libtcpscan-names
+ * checks with nm.
+ */
+#ifndef TCPSCAN_NAMES_H
+#define TCPSCAN_NAMES_H 1
+
+#define Clock_gettime			tcpscan_Clock_gettime
+#define Gettimeofday			tcpscan_Gettimeofday
+#define Malloc				tcpscan_Malloc
+#define Realloc				tcpscan_Realloc
+#define Strtol				tcpscan_Strtol
+#define Strtoul				tcpscan_Strtoul
+#define accept_client			tcpscan_accept_client
+#define add_host			tcpscan_add_host
+#define add_host_port			tcpscan_add_host_port
+#define admit_job			tcpscan_admit_job
+#define advance_cursor			tcpscan_advance_cursor
+#define alloc_count			tcpscan_alloc_count
+#define apply_checkpoint		tcpscan_apply_checkpoint
+#define auto_timeout			tcpscan_auto_timeout
+#define bandwidth_interval		tcpscan_bandwidth_interval
+#define build_host_index		tcpscan_build_host_index
+#define build_host_stats		tcpscan_build_host_stats
+#define build_port_rank			tcpscan_build_port_rank
+#define callback			tcpscan_callback
+#define check_port_options		tcpscan_check_port_options
+#define checkpoint_signal		tcpscan_checkpoint_signal
+#define clean_up			tcpscan_clean_up
+#define client_stalled			tcpscan_client_stalled
+#define clock_count			tcpscan_clock_count
+#define close_client			tcpscan_close_client
+#define create_port_list		tcpscan_create_port_list
+#define create_top_ports		tcpscan_create_top_ports
+#define daemon_fd_set			tcpscan_daemon_fd_set
+#define daemon_handle			tcpscan_daemon_handle
+#define daemon_poll			tcpscan_daemon_poll
+#define daemon_proc			tcpscan_daemon_proc
+#define deliver_reply			tcpscan_deliver_reply
+#define discard_packet			tcpscan_discard_packet
+#define discover_hosts			tcpscan_discover_hosts
+#define discover_reply			tcpscan_discover_reply
+#define display_packet			tcpscan_display_packet
+#define display_vanished		tcpscan_display_vanished
+#define dryrun_report			tcpscan_dryrun_report
+#define dryrun_send			tcpscan_dryrun_send
+#define dryrun_wait			tcpscan_dryrun_wait
+#define dump_list			tcpscan_dump_list
+#define dupstr				tcpscan_dupstr
+#define echo_reply			tcpscan_echo_reply
+#define enable_tx_timestamps		tcpscan_enable_tx_timestamps
+#define engine_gettimeofday		tcpscan_engine_gettimeofday
+#define engine_time_ns			tcpscan_engine_time_ns
+#define err_exit			tcpscan_err_exit
+#define err_msg				tcpscan_err_msg
+#define err_print			tcpscan_err_print
+#define err_sys				tcpscan_err_sys
+#define error_jump			tcpscan_error_jump
+#define find_discover_host		tcpscan_find_discover_host
+#define find_host			tcpscan_find_host
+#define find_host_stats			tcpscan_find_host_stats
+#define finish_job			tcpscan_finish_job
+#define genrand_int31			tcpscan_genrand_int31
+#define genrand_int32			tcpscan_genrand_int32
+#define genrand_int32_r			tcpscan_genrand_int32_r
+#define genrand_real1			tcpscan_genrand_real1
+#define genrand_real2			tcpscan_genrand_real2
+#define genrand_real2_r			tcpscan_genrand_real2_r
+#define genrand_real3			tcpscan_genrand_real3
+#define genrand_res53			tcpscan_genrand_res53
+#define genrand_res53_r			tcpscan_genrand_res53_r
+#define get_host_address		tcpscan_get_host_address
+#define get_source_ip			tcpscan_get_source_ip
+#define hist_add			tcpscan_hist_add
+#define hist_init			tcpscan_hist_init
+#define hist_merge			tcpscan_hist_merge
+#define hist_percentile			tcpscan_hist_percentile
+#define hist_print			tcpscan_hist_print
+#define hstr_i				tcpscan_hstr_i
+#define in_cksum			tcpscan_in_cksum
+#define init_by_array			tcpscan_init_by_array
+#define init_context			tcpscan_init_context
+#define init_engine			tcpscan_init_engine
+#define init_genrand			tcpscan_init_genrand
+#define init_genrand_r			tcpscan_init_genrand_r
+#define initialise			tcpscan_initialise
+#define is_job_option			tcpscan_is_job_option
+#define job_wait			tcpscan_job_wait
+#define list_hash			tcpscan_list_hash
+#define lookup_host			tcpscan_lookup_host
+#define make_echo_request		tcpscan_make_echo_request
+#define make_message			tcpscan_make_message
+#define merge_worker_output		tcpscan_merge_worker_output
+#define metrics_close			tcpscan_metrics_close
+#define metrics_fd_set			tcpscan_metrics_fd_set
+#define metrics_format			tcpscan_metrics_format
+#define metrics_handle			tcpscan_metrics_handle
+#define metrics_open			tcpscan_metrics_open
+#define metrics_write			tcpscan_metrics_write
+#define my_ntoa				tcpscan_my_ntoa
+#define note_retry_timeout		tcpscan_note_retry_timeout
+#define open_capture			tcpscan_open_capture
+#define open_dryrun			tcpscan_open_dryrun
+#define open_raw_socket			tcpscan_open_raw_socket
+#define open_replay			tcpscan_open_replay
+#define open_savefile			tcpscan_open_savefile
+#define parse_discover			tcpscan_parse_discover
+#define parse_dryrun_model		tcpscan_parse_dryrun_model
+#define parse_service_line		tcpscan_parse_service_line
+#define parse_service_weight		tcpscan_parse_service_weight
+#define pcapng_add_interface		tcpscan_pcapng_add_interface
+#define pcapng_close			tcpscan_pcapng_close
+#define pcapng_open			tcpscan_pcapng_open
+#define pcapng_write			tcpscan_pcapng_write
+#define permute_index			tcpscan_permute_index
+#define pkthdr_ns			tcpscan_pkthdr_ns
+#define prepare_list			tcpscan_prepare_list
+#define print_stage_times		tcpscan_print_stage_times
+#define print_syscall_stats		tcpscan_print_syscall_stats
+#define print_times			tcpscan_print_times
+#define printable			tcpscan_printable
+#define printable_select		tcpscan_printable_select
+#define process_options			tcpscan_process_options
+#define process_tcp_flags		tcpscan_process_tcp_flags
+#define read_checkpoint			tcpscan_read_checkpoint
+#define read_client			tcpscan_read_client
+#define read_discover_cache		tcpscan_read_discover_cache
+#define read_tx_timestamps		tcpscan_read_tx_timestamps
+#define recvfrom_wto			tcpscan_recvfrom_wto
+#define remove_host			tcpscan_remove_host
+#define replay_packets			tcpscan_replay_packets
+#define report_host_stats		tcpscan_report_host_stats
+#define reset_job_state			tcpscan_reset_job_state
+#define retry_limit			tcpscan_retry_limit
+#define run_daemon			tcpscan_run_daemon
+#define run_scan			tcpscan_run_scan
+#define scan_loop			tcpscan_scan_loop
+#define scan_step			tcpscan_scan_step
+#define schedule_jobs			tcpscan_schedule_jobs
+#define select_previous			tcpscan_select_previous
+#define select_shard			tcpscan_select_shard
+#define send_packet			tcpscan_send_packet
+#define service_db_count		tcpscan_service_db_count
+#define service_db_free			tcpscan_service_db_free
+#define service_db_load			tcpscan_service_db_load
+#define service_db_lookup		tcpscan_service_db_lookup
+#define service_db_save			tcpscan_service_db_save
+#define set_datalink			tcpscan_set_datalink
+#define set_virtual_clock		tcpscan_set_virtual_clock
+#define show_progress			tcpscan_show_progress
+#define show_summary			tcpscan_show_summary
+#define shuffle_hosts			tcpscan_shuffle_hosts
+#define sort_by_priority		tcpscan_sort_by_priority
+#define stage_signal			tcpscan_stage_signal
+#define start_workers			tcpscan_start_workers
+#define str_to_bandwidth		tcpscan_str_to_bandwidth
+#define str_to_interval			tcpscan_str_to_interval
+#define str_to_size			tcpscan_str_to_size
+#define submit_job			tcpscan_submit_job
+#define tcp_scan_version		tcpscan_tcp_scan_version
+#define tcpopt_decode			tcpscan_tcpopt_decode
+#define tcpopt_fingerprint		tcpscan_tcpopt_fingerprint
+#define tcpopt_format			tcpscan_tcpopt_format
+#define timestamp_ns			tcpscan_timestamp_ns
+#define timeval_diff			tcpscan_timeval_diff
+#define update_rtt			tcpscan_update_rtt
+#define usage				tcpscan_usage
+#define warn_msg			tcpscan_warn_msg
+#define warn_sys			tcpscan_warn_sys
+#define write_checkpoint		tcpscan_write_checkpoint
+#define write_client			tcpscan_write_client
+#define write_discover_cache		tcpscan_write_discover_cache
+
+#endif	/* TCPSCAN_NAMES_H */
@@ -0,0 +1,484 @@
+/*
+ * The TCP Scanner (tcp-scan) is Copyright (C) 2003-2013 Roy Hills,
+ * NTA Monitor Ltd.
+ *
+ * This file is part of tcp-scan.
+ *
+ * tcp-scan is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * tcp-scan is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with tcp-scan.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * tunresponder -- Simulated TCP responder on a TUN interface
+ *
+ * Usage: tunresponder [options] <interface> <hosts> <ports> <map-file>
+ *                     <target-file>
+ *
+ * This creates the TUN interface <interface> with the address TUN_LOCAL
+ * on the network 198.18.0.0/15, and answers TCP SYNs to ports 1 to
+ * <ports> on <hosts> addresses starting at TUN_FIRST.  Each port is
+ * given one of four behaviours, chosen by a hash of the address, port
+ * and seed:
+ *
+ *	open	Answer with a SYN-ACK
+ *	closed	Answer with a RST
+ *	silent	Do not answer
+ *	delayed	Answer with a SYN-ACK after the delay given with -d
+ *
+ * The target addresses are written to <target-file>, and the expected
+ * scan results for the ports that answer are written to <map-file> in
+ * the form "<address><tab><port><tab>OPEN|CLOSED", one per line.  The
+ * map file is created last, so its existence shows that the interface
+ * is ready.  The responder exits after -i seconds without a SYN, or when
+ * it receives SIGTERM or SIGINT, and then displays its counters.
+ *
+ * Options:
+ *
+ *	-m <o>,<c>,<s>,<d>	Relative weights of open, closed, silent and
+ *				delayed ports.  Default 20,60,15,5.
+ *	-d <ms>			Delay for delayed ports.  Default 20.
+ *	-i <s>			Idle time before exiting.  Default 10.
+ *	-s <n>			Seed for the port behaviours.  Default 1.
+ *
+ * This program must be run as root, and needs the Linux TUN driver.  It
+ * exits with status 77 if neither is available, which "make check"
+ * treats as a skipped test.
+ */
+
+#include "tcp-scan.h"
+
+#include <poll.h>
+#include <signal.h>
+#include <fcntl.h>
+#include <time.h>
+
+#ifdef HAVE_LINUX_IF_TUN_H
+#include <linux/if_tun.h>
+#endif
+
+#define TUN_LOCAL 0xc613fffe		/* 198.19.255.254 */
+#define TUN_NETMASK 0xfffe0000		/* 198.18.0.0/15 */
+#define TUN_FIRST 0xc6120001		/* 198.18.0.1 */
+#define TUN_MAX_HOSTS 65536
+#define TUN_MTU 1500
+#define DELAY_QUEUE 65536		/* Maximum delayed responses pending */
+#define EXIT_SKIP 77			/* Test skipped status for automake */
+
+enum {BEHAVE_OPEN, BEHAVE_CLOSED, BEHAVE_SILENT, BEHAVE_DELAYED};
+
+typedef struct {
+   TCP_UINT64 due_ns;			/* When to send the response */
+   unsigned len;
+   unsigned char packet[64];
+} delayed_response;
+
+static unsigned weights[4] = {20, 60, 15, 5};
+static unsigned weight_total;
+static uint32_t seed = 1;
+static volatile sig_atomic_t stop_flag = 0;
+
+/*
+ *	now_ns -- Return the monotonic time in nanoseconds
+ */
+static TCP_UINT64
+now_ns(void) {
+   struct timespec ts;
+
+   clock_gettime(CLOCK_MONOTONIC, &ts);
+   return (TCP_UINT64) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void
+stop_handler(int sig ATTRIBUTE_UNUSED) {
+   stop_flag = 1;
+}
+
+/*
+ *	behaviour -- Return the behaviour of a port
+ *
+ *	This is a pure function of the host number, port and seed, so the
+ *	expected results can be written before the scan starts.
+ */
+static unsigned
+behaviour(unsigned host, unsigned port) {
+   TCP_UINT64 x = ((TCP_UINT64) host << 16 | port) ^
+                  ((TCP_UINT64) seed << 40);
+   unsigned r;
+   unsigned b;
+
+   x ^= x >> 33;			/* murmur3 64-bit finaliser */
+   x *= 0xff51afd7ed558ccdULL;
+   x ^= x >> 33;
+   x *= 0xc4ceb9fe1a85ec53ULL;
+   x ^= x >> 33;
+   r = x % weight_total;
+   for (b=0; r >= weights[b]; b++)
+      r -= weights[b];
+   return b;
+}
+
+/*
+ *	put16 and put32 -- Store values in network byte order
+ */
+static void
+put16(unsigned char *p, unsigned v) {
+   p[0] = (v >> 8) & 0xff;
+   p[1] = v & 0xff;
+}
+
+static void
+put32(unsigned char *p, uint32_t v) {
+   put16(p, v >> 16);
+   put16(p+2, v & 0xffff);
+}
+
+/*
+ *	checksum -- Return the Internet checksum of a buffer
+ *
+ *	sum is added to the checksum, so that a pseudo-header can be
+ *	included.
+ */
+static unsigned
+checksum(const unsigned char *p, unsigned len, uint32_t sum) {
+   while (len > 1) {
+      sum += (unsigned) p[0] << 8 | p[1];
+      p += 2;
+      len -= 2;
+   }
+   if (len)
+      sum += (unsigned) p[0] << 8;
+   while (sum >> 16)
+      sum = (sum & 0xffff) + (sum >> 16);
+   return ~sum & 0xffff;
+}
+
+/*
+ *	make_response -- Build the response to a SYN
+ *
+ *	Returns the packet length.
+ */
+static unsigned
+make_response(unsigned char *out, const struct iphdr *iph,
+              const struct tcphdr *tcph, int open) {
+   static const unsigned char options[] = {2, 4, 0x05, 0xb4};	/* MSS */
+   unsigned char *tcp = out + 20;
+   unsigned tcp_len = open ? 20 + sizeof(options) : 20;
+   uint32_t saddr = ntohl(iph->daddr);
+   uint32_t daddr = ntohl(iph->saddr);
+   uint32_t pseudo;
+
+   memset(out, '\0', 20 + tcp_len);
+   out[0] = 0x45;
+   put16(out+2, 20 + tcp_len);
+   put16(out+6, 0x4000);		/* DF */
+   out[8] = 64;				/* TTL */
+   out[9] = IPPROTO_TCP;
+   put32(out+12, saddr);
+   put32(out+16, daddr);
+   put16(out+10, checksum(out, 20, 0));
+
+   put16(tcp, ntohs(tcph->dest));
+   put16(tcp+2, ntohs(tcph->source));
+   put32(tcp+8, ntohl(tcph->seq) + 1);
+   tcp[12] = (tcp_len / 4) << 4;
+   if (open) {
+      put32(tcp+4, saddr ^ 0x5a5a5a5a);
+      tcp[13] = 0x12;			/* SYN, ACK */
+      put16(tcp+14, 64240);
+      memcpy(tcp+20, options, sizeof(options));
+   } else {
+      tcp[13] = 0x14;			/* RST, ACK */
+   }
+   pseudo = (saddr >> 16) + (saddr & 0xffff) + (daddr >> 16) +
+            (daddr & 0xffff) + IPPROTO_TCP + tcp_len;
+   put16(tcp+16, checksum(tcp, tcp_len, pseudo));
+   return 20 + tcp_len;
+}
+
+#ifdef HAVE_LINUX_IF_TUN_H
+/*
+ *	tun_open -- Create and configure the TUN interface
+ *
+ *	Returns the TUN file descriptor, or -1 if the interface cannot be
+ *	created.
+ */
+static int
+tun_open(const char *name) {
+   struct ifreq ifr;
+   struct sockaddr_in *sin;
+   int fd;
+   int sock;
+
+   if ((fd = open("/dev/net/tun", O_RDWR)) < 0)
+      return -1;
+   memset(&ifr, '\0', sizeof(ifr));
+   ifr.ifr_flags = IFF_TUN | IFF_NO_PI;
+   strncpy(ifr.ifr_name, name, IFNAMSIZ-1);
+   if (ioctl(fd, TUNSETIFF, &ifr) < 0) {
+      close(fd);
+      return -1;
+   }
+
+   if ((sock = socket(AF_INET, SOCK_DGRAM, 0)) < 0)
+      err_sys("socket");
+   sin = (struct sockaddr_in *) &ifr.ifr_addr;
+   sin->sin_family = AF_INET;
+   sin->sin_addr.s_addr = htonl(TUN_LOCAL);
+   if (ioctl(sock, SIOCSIFADDR, &ifr) < 0)
+      err_sys("SIOCSIFADDR");
+   sin->sin_addr.s_addr = htonl(TUN_NETMASK);
+   if (ioctl(sock, SIOCSIFNETMASK, &ifr) < 0)
+      err_sys("SIOCSIFNETMASK");
+   ifr.ifr_mtu = TUN_MTU;
+   if (ioctl(sock, SIOCSIFMTU, &ifr) < 0)
+      err_sys("SIOCSIFMTU");
+   if (ioctl(sock, SIOCGIFFLAGS, &ifr) < 0)
+      err_sys("SIOCGIFFLAGS");
+   ifr.ifr_flags |= IFF_UP | IFF_RUNNING;
+   if (ioctl(sock, SIOCSIFFLAGS, &ifr) < 0)
+      err_sys("SIOCSIFFLAGS");
+   close(sock);
+
+   return fd;
+}
+#endif
+
+/*
+ *	write_files -- Write the target and expected results files
+ */
+static void
+write_files(const char *map_file, const char *target_file, unsigned hosts,
+            unsigned ports) {
+   char *tmp_name;
+   FILE *map;
+   FILE *targets;
+   unsigned h;
+   unsigned p;
+
+   if ((targets = fopen(target_file, "w")) == NULL)
+      err_sys("fopen %s", target_file);
+   tmp_name = make_message("%s.tmp", map_file);
+   if ((map = fopen(tmp_name, "w")) == NULL)
+      err_sys("fopen %s", tmp_name);
+   for (h=0; h<hosts; h++) {
+      struct in_addr addr;
+      char *addr_str;
+
+      addr.s_addr = htonl(TUN_FIRST + h);
+      addr_str = inet_ntoa(addr);
+      fprintf(targets, "%s\n", addr_str);
+      for (p=1; p<=ports; p++) {
+         switch (behaviour(h, p)) {
+            case BEHAVE_OPEN:
+            case BEHAVE_DELAYED:
+               fprintf(map, "%s\t%u\tOPEN\n", addr_str, p);
+               break;
+            case BEHAVE_CLOSED:
+               fprintf(map, "%s\t%u\tCLOSED\n", addr_str, p);
+               break;
+         }
+      }
+   }
+   if (fclose(targets))
+      err_sys("fclose %s", target_file);
+   if (fclose(map))
+      err_sys("fclose %s", tmp_name);
+   if (rename(tmp_name, map_file))
+      err_sys("rename %s", tmp_name);
+   free(tmp_name);
+}
+
+static void
+tun_usage(void) {
+   fprintf(stderr, "Usage: tunresponder [-m <o>,<c>,<s>,<d>] [-d <ms>] "
+                   "[-i <s>] [-s <seed>]\n"
+                   "                    <interface> <hosts> <ports> "
+                   "<map-file> <target-file>\n");
+   exit(EXIT_FAILURE);
+}
+
+int
+main(int argc, char *argv[]) {
+#ifdef HAVE_LINUX_IF_TUN_H
+   unsigned hosts;
+   unsigned ports;
+   TCP_UINT64 delay_ns = 20000000;
+   TCP_UINT64 idle_ns = 10000000000ULL;
+   TCP_UINT64 last_syn_ns;
+   unsigned char *seen;		/* Bitmap of ports that have had a SYN */
+   delayed_response *queue;
+   unsigned queue_head = 0;
+   unsigned queue_len = 0;
+   unsigned long count_syn = 0;
+   unsigned long count_dup = 0;
+   unsigned long count_ignored = 0;
+   unsigned long count_behave[4] = {0, 0, 0, 0};
+   unsigned long count_overflow = 0;
+   struct sigaction sa;
+   int fd;
+   int opt;
+
+   while ((opt = getopt(argc, argv, "m:d:i:s:")) != -1) {
+      switch (opt) {
+         case 'm':
+            if (sscanf(optarg, "%u,%u,%u,%u", &weights[0], &weights[1],
+                       &weights[2], &weights[3]) != 4)
+               tun_usage();
+            break;
+         case 'd':
+            delay_ns = (TCP_UINT64) Strtoul(optarg, 10) * 1000000;
+            break;
+         case 'i':
+            idle_ns = (TCP_UINT64) Strtoul(optarg, 10) * 1000000000;
+            break;
+         case 's':
+            seed = Strtoul(optarg, 10);
+            break;
+         default:
+            tun_usage();
+      }
+   }
+   if (argc - optind != 5)
+      tun_usage();
+   hosts = Strtoul(argv[optind+1], 10);
+   ports = Strtoul(argv[optind+2], 10);
+   weight_total = weights[0] + weights[1] + weights[2] + weights[3];
+   if (hosts < 1 || hosts > TUN_MAX_HOSTS || ports < 1 || ports > 65535 ||
+       weight_total == 0)
+      tun_usage();
+
+   if (geteuid() != 0) {
+      printf("tunresponder: not running as root, skipping\n");
+      return EXIT_SKIP;
+   }
+   if ((fd = tun_open(argv[optind])) < 0) {
+      printf("tunresponder: cannot create TUN interface %s: %s, skipping\n",
+             argv[optind], strerror(errno));
+      return EXIT_SKIP;
+   }
+   seen = Malloc(((size_t) hosts * (ports + 1) + 7) / 8);
+   memset(seen, '\0', ((size_t) hosts * (ports + 1) + 7) / 8);
+   queue = Malloc(DELAY_QUEUE * sizeof(delayed_response));
+
+   memset(&sa, '\0', sizeof(sa));
+   sa.sa_handler = stop_handler;
+   sigaction(SIGTERM, &sa, NULL);
+   sigaction(SIGINT, &sa, NULL);
+
+   write_files(argv[optind+3], argv[optind+4], hosts, ports);
+   printf("tunresponder: %s ready, %u hosts x %u ports\n", argv[optind],
+          hosts, ports);
+   fflush(stdout);
+
+   last_syn_ns = now_ns();
+   while (!stop_flag) {
+      unsigned char buf[TUN_MTU];
+      struct pollfd pfd;
+      TCP_UINT64 now = now_ns();
+      TCP_UINT64 wait_ns;
+      const struct iphdr *iph;
+      const struct tcphdr *tcph;
+      unsigned char out[64];
+      unsigned out_len;
+      uint32_t h;
+      unsigned port;
+      size_t bit;
+      unsigned b;
+      ssize_t n;
+/*
+ *	Send any delayed responses that are due.  The delay is the same
+ *	for every response, so the queue is in order of due time.
+ */
+      while (queue_len && queue[queue_head].due_ns <= now) {
+         if (write(fd, queue[queue_head].packet, queue[queue_head].len) < 0)
+            err_sys("write");
+         queue_head = (queue_head + 1) % DELAY_QUEUE;
+         queue_len--;
+      }
+      if (now - last_syn_ns >= idle_ns)
+         break;
+      wait_ns = idle_ns - (now - last_syn_ns);
+      if (queue_len && queue[queue_head].due_ns - now < wait_ns)
+         wait_ns = queue[queue_head].due_ns - now;
+
+      pfd.fd = fd;
+      pfd.events = POLLIN;
+      if (poll(&pfd, 1, (int) ((wait_ns + 999999) / 1000000)) <= 0)
+         continue;			/* Timeout or signal */
+      if ((n = read(fd, buf, sizeof(buf))) < 0) {
+         if (errno == EINTR || errno == EAGAIN)
+            continue;
+         err_sys("read");
+      }
+/*
+ *	Only answer TCP SYNs without ACK to one of our targets.  Everything
+ *	else, including the RSTs that the kernel sends in reply to our
+ *	SYN-ACKs, is ignored.
+ */
+      iph = (const struct iphdr *) buf;
+      if ((size_t) n < sizeof(struct iphdr) || iph->version != 4 ||
+          iph->protocol != IPPROTO_TCP ||
+          (size_t) n < 4 * iph->ihl + sizeof(struct tcphdr))
+         continue;
+      tcph = (const struct tcphdr *) (buf + 4 * iph->ihl);
+      if (!tcph->syn || tcph->ack || tcph->rst)
+         continue;
+      h = ntohl(iph->daddr) - TUN_FIRST;
+      port = ntohs(tcph->dest);
+      if (h >= hosts || port < 1 || port > ports) {
+         count_ignored++;
+         continue;
+      }
+      last_syn_ns = now_ns();
+      count_syn++;
+      bit = (size_t) h * (ports + 1) + port;
+      if (seen[bit / 8] & (1 << (bit % 8))) {
+         count_dup++;
+      } else {
+         seen[bit / 8] |= 1 << (bit % 8);
+         count_behave[behaviour(h, port)]++;
+      }
+      b = behaviour(h, port);
+      if (b == BEHAVE_SILENT)
+         continue;
+      out_len = make_response(out, iph, tcph, b != BEHAVE_CLOSED);
+      if (b == BEHAVE_DELAYED) {
+         delayed_response *d;
+
+         if (queue_len == DELAY_QUEUE) {
+            count_overflow++;
+            continue;
+         }
+         d = &queue[(queue_head + queue_len) % DELAY_QUEUE];
+         d->due_ns = last_syn_ns + delay_ns;
+         d->len = out_len;
+         memcpy(d->packet, out, out_len);
+         queue_len++;
+      } else if (write(fd, out, out_len) < 0) {
+         err_sys("write");
+      }
+   }
+
+   printf("tunresponder: %lu SYNs (%lu retries), %lu ignored; ports probed: "
+          "%lu open, %lu closed, %lu silent, %lu delayed; %lu delayed "
+          "responses dropped\n", count_syn, count_dup, count_ignored,
+          count_behave[BEHAVE_OPEN], count_behave[BEHAVE_CLOSED],
+          count_behave[BEHAVE_SILENT], count_behave[BEHAVE_DELAYED],
+          count_overflow);
+   close(fd);
+   free(queue);
+   free(seen);
+   return 0;
+#else
+   printf("tunresponder: TUN interfaces are not supported, skipping\n");
+   return EXIT_SKIP;
+#endif
+}
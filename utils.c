@@ -25,6 +25,15 @@
 
 #include "tcp-scan.h"
 
+#if defined(__SSE2__) && defined(HAVE_EMMINTRIN_H)
+#include <emmintrin.h>
+#define PRINTABLE_SSE2 1
+#if defined(HAVE_AVX2_DISPATCH) && defined(HAVE_IMMINTRIN_H)
+#include <immintrin.h>
+#define PRINTABLE_AVX2 1
+#endif
+#endif
+
 /*
  *	timeval_diff -- Calculates the difference between two timevals
  *	and returns this difference in a third timeval.
@@ -138,6 +147,237 @@ make_message(const char *fmt, ...) {
    }
 }
 
+/*
+ *	Escape sequences used by printable(), indexed by character.  Each
+ *	entry holds up to four output characters, and printable_len[] gives
+ *	the number that are used: 1 for printable characters, 2 for
+ *	characters with a C-style escape like "\n", and 4 for characters
+ *	that are displayed as a three digit octal escape like "\001".
+ *
+ *	"Printable" means the same as isprint() in the C locale, which is
+ *	the locale that tcp-scan always runs in: 0x20 to 0x7e inclusive.
+ */
+static char printable_table[256][4];
+static unsigned char printable_len[256];
+static size_t (*printable_escape)(char *, const unsigned char *, size_t);
+
+static void
+printable_init_table(void) {
+   static const char octal[] = "01234567";
+   unsigned c;
+
+   for (c=0; c<256; c++) {
+      if (c >= 0x20 && c <= 0x7e) {
+         printable_table[c][0] = c;
+         printable_len[c] = 1;
+         continue;
+      }
+      printable_table[c][0] = '\\';
+      printable_len[c] = 2;
+      switch (c) {
+         case '\b':
+            printable_table[c][1] = 'b';
+            break;
+         case '\f':
+            printable_table[c][1] = 'f';
+            break;
+         case '\n':
+            printable_table[c][1] = 'n';
+            break;
+         case '\r':
+            printable_table[c][1] = 'r';
+            break;
+         case '\t':
+            printable_table[c][1] = 't';
+            break;
+         case '\v':
+            printable_table[c][1] = 'v';
+            break;
+         default:
+            printable_table[c][1] = octal[(c >> 6) & 7];
+            printable_table[c][2] = octal[(c >> 3) & 7];
+            printable_table[c][3] = octal[c & 7];
+            printable_len[c] = 4;
+            break;
+      }
+   }
+}
+
+/*
+ *	The escaping functions below all have the same interface: they
+ *	convert "size" bytes from "src" into "dst", and return the number
+ *	of characters written.  The output is not NUL terminated.
+ *
+ *	The destination must have room for 4 * size characters.  This
+ *	lets the functions copy whole table entries and whole vectors
+ *	without checking how much space is left.
+ */
+static size_t
+printable_escape_scalar(char *dst, const unsigned char *src, size_t size) {
+   char *r = dst;
+   size_t i;
+
+   for (i=0; i<size; i++) {
+      unsigned char c = src[i];
+
+      memcpy(r, printable_table[c], 4);
+      r += printable_len[c];
+   }
+   return r - dst;
+}
+
+#ifdef PRINTABLE_SSE2
+/*
+ *	SSE2 version: check 16 bytes at a time.  Blocks that are entirely
+ *	printable, which is the usual case for banners, are copied with a
+ *	single store.  Otherwise the printable runs between the characters
+ *	that need escaping are copied with memcpy().
+ *
+ *	SSE2 only has signed byte comparisons.  Bytes 0x80-0xff compare as
+ *	negative, so they fail the "greater than 0x1f" test as required.
+ */
+static size_t
+printable_escape_sse2(char *dst, const unsigned char *src, size_t size) {
+   const __m128i low = _mm_set1_epi8(0x1f);
+   const __m128i high = _mm_set1_epi8(0x7f);
+   char *r = dst;
+   size_t i = 0;
+
+   while (i + 16 <= size) {
+      __m128i v = _mm_loadu_si128((const __m128i *) (src + i));
+      __m128i ok = _mm_and_si128(_mm_cmpgt_epi8(v, low),
+                                 _mm_cmplt_epi8(v, high));
+      unsigned escapes = ~_mm_movemask_epi8(ok) & 0xffff;
+      unsigned prev = 0;
+
+      if (!escapes) {
+         _mm_storeu_si128((__m128i *) r, v);
+         r += 16;
+         i += 16;
+         continue;
+      }
+      while (escapes) {
+         unsigned j = __builtin_ctz(escapes);
+         unsigned char c = src[i+j];
+
+         memcpy(r, src + i + prev, j - prev);
+         r += j - prev;
+         memcpy(r, printable_table[c], 4);
+         r += printable_len[c];
+         prev = j + 1;
+         escapes &= escapes - 1;
+      }
+      memcpy(r, src + i + prev, 16 - prev);
+      r += 16 - prev;
+      i += 16;
+   }
+   return (r - dst) + printable_escape_scalar(r, src + i, size - i);
+}
+#endif
+
+#ifdef PRINTABLE_AVX2
+/*
+ *	AVX2 version: the same as the SSE2 version, but 32 bytes at a time.
+ *	This is only used if the CPU supports AVX2.
+ */
+__attribute__((target("avx2")))
+static size_t
+printable_escape_avx2(char *dst, const unsigned char *src, size_t size) {
+   const __m256i low = _mm256_set1_epi8(0x1f);
+   const __m256i high = _mm256_set1_epi8(0x7f);
+   char *r = dst;
+   size_t i = 0;
+
+   while (i + 32 <= size) {
+      __m256i v = _mm256_loadu_si256((const __m256i *) (src + i));
+      __m256i ok = _mm256_and_si256(_mm256_cmpgt_epi8(v, low),
+                                    _mm256_cmpgt_epi8(high, v));
+      uint32_t escapes = ~(uint32_t) _mm256_movemask_epi8(ok);
+      unsigned prev = 0;
+
+      if (!escapes) {
+         _mm256_storeu_si256((__m256i *) r, v);
+         r += 32;
+         i += 32;
+         continue;
+      }
+      while (escapes) {
+         unsigned j = __builtin_ctz(escapes);
+         unsigned char c = src[i+j];
+
+         memcpy(r, src + i + prev, j - prev);
+         r += j - prev;
+         memcpy(r, printable_table[c], 4);
+         r += printable_len[c];
+         prev = j + 1;
+         escapes &= escapes - 1;
+      }
+      memcpy(r, src + i + prev, 32 - prev);
+      r += 32 - prev;
+      i += 32;
+   }
+   return (r - dst) + printable_escape_sse2(r, src + i, size - i);
+}
+#endif
+
+/*
+ *	printable_select -- Select the implementation used by printable()
+ *
+ *	Inputs:
+ *
+ *	impl	One of the PRINTABLE_IMPL_* values.  PRINTABLE_IMPL_AUTO
+ *		selects the fastest version that the CPU supports.
+ *
+ *	Returns:
+ *
+ *	1 if the implementation was selected, or 0 if it is not available
+ *	on this system.
+ *
+ *	This is called automatically by printable(), so it only needs to
+ *	be called directly to test a specific implementation.
+ */
+int
+printable_select(int impl) {
+   if (!printable_len[0])
+      printable_init_table();
+
+   switch (impl) {
+      case PRINTABLE_IMPL_AUTO:
+#ifdef PRINTABLE_AVX2
+         __builtin_cpu_init();
+         if (__builtin_cpu_supports("avx2")) {
+            printable_escape = printable_escape_avx2;
+            break;
+         }
+#endif
+#ifdef PRINTABLE_SSE2
+         printable_escape = printable_escape_sse2;
+#else
+         printable_escape = printable_escape_scalar;
+#endif
+         break;
+      case PRINTABLE_IMPL_SCALAR:
+         printable_escape = printable_escape_scalar;
+         break;
+#ifdef PRINTABLE_SSE2
+      case PRINTABLE_IMPL_SSE2:
+         printable_escape = printable_escape_sse2;
+         break;
+#endif
+#ifdef PRINTABLE_AVX2
+      case PRINTABLE_IMPL_AVX2:
+         __builtin_cpu_init();
+         if (!__builtin_cpu_supports("avx2"))
+            return 0;
+         printable_escape = printable_escape_avx2;
+         break;
+#endif
+      default:
+         return 0;
+   }
+   return 1;
+}
+
 /*
  *      printable -- Convert string to printable form using C-style escapes
  *
@@ -154,9 +394,10 @@ make_message(const char *fmt, ...) {
  *      "\n" for newline.  As a result, the returned string may be longer than
  *      the one supplied.
  *
- *      This function makes two passes through the input string: one to
- *      determine the required output length, then a second to perform the
- *      conversion.
+ *      This function makes a single pass through the input string, using
+ *      SIMD instructions where available to copy runs of printable
+ *      characters.  The output buffer is sized for the worst case, where
+ *      every character needs a four character octal escape.
  *
  *      The pointer returned points to malloc'ed storage which should be
  *      free'ed by the caller when it's no longer needed.
@@ -164,10 +405,7 @@ make_message(const char *fmt, ...) {
 char *
 printable(const unsigned char *string, size_t size) {
    char *result;
-   char *r;
-   const unsigned char *cp;
    size_t outlen;
-   unsigned i;
 /*
  *      If the input string is NULL, return an empty string.
  */
@@ -176,75 +414,16 @@ printable(const unsigned char *string, size_t size) {
       result[0] = '\0';
       return result;
    }
-/*
- *      Determine required size of output string.
- */
+
    if (!size)
       size = strlen((const char *) string);
 
-   outlen = size;
-   cp = string;
-   for (i=0; i<size; i++) {
-      switch (*cp) {
-         case '\b':
-         case '\f':
-         case '\n':
-         case '\r':
-         case '\t':
-         case '\v':
-            outlen++;
-            break;
-         default:
-            if(!isprint(*cp))
-               outlen += 3;
-      }
-      cp++;
-   }
-   outlen++;    /* One more for the ending NULL */
-
-   result = Malloc(outlen);
+   if (!printable_escape)
+      printable_select(PRINTABLE_IMPL_AUTO);
 
-   cp = string;
-   r = result;
-   for (i=0; i<size; i++) {
-      switch (*cp) {
-         case '\b':
-            *r++ = '\\';
-            *r++ = 'b';
-            break;
-         case '\f':
-            *r++ = '\\';
-            *r++ = 'f';
-            break;
-         case '\n':
-            *r++ = '\\';
-            *r++ = 'n';
-            break;
-         case '\r':
-            *r++ = '\\';
-            *r++ = 'r';
-            break;
-         case '\t':
-            *r++ = '\\';
-            *r++ = 't';
-            break;
-         case '\v':
-            *r++ = '\\';
-            *r++ = 'v';
-            break;
-         default:
-            if (isprint(*cp)) {
-               *r++ = *cp;      /* Printable character */
-            } else {
-               *r++ = '\\';
-               sprintf(r, "%.3o", *cp);
-               r += 3;
-            }
-            break;
-      }
-      cp++;
-   }
-   *r = '\0';
+   result = Malloc(4 * size + 1);
+   outlen = printable_escape(result, string, size);
+   result[outlen] = '\0';
 
    return result;
 }
@@ -313,8 +492,8 @@ print_times(void) {
  */
 ip_address *
 get_host_address(const char *name, int af, ip_address *addr, char **error_msg) {
-   static char err[MAXLINE];
-   static ip_address ipa;
+   static THREAD_LOCAL char err[MAXLINE];
+   static THREAD_LOCAL ip_address ipa;
 
    struct addrinfo *res;
    struct addrinfo hints;
@@ -368,7 +547,7 @@ get_host_address(const char *name, int af, ip_address *addr, char **error_msg) {
  */
 const char *
 my_ntoa(ip_address addr, int ipv6_flag) {
-   static char ip_str[MAXLINE];
+   static THREAD_LOCAL char ip_str[MAXLINE];
    const char *cp;
 
    if (ipv6_flag)
@@ -467,6 +646,183 @@ str_to_interval(const char *interval_string) {
    return multiplier * value;
 }
 
+/*
+ *	str_to_size -- Convert a size string to a 64-bit unsigned integer
+ *
+ *	Inputs:
+ *
+ *	size_string	The size string to convert
+ *
+ *	Returns:
+ *
+ *	The size in bytes.
+ *
+ *	The value may have a "K", "M" or "G" suffix, which are binary
+ *	multiples.  So 64K is 65536.
+ */
+TCP_UINT64
+str_to_size(const char *size_string) {
+   char *size_str;
+   size_t size_len;
+   TCP_UINT64 value;
+   TCP_UINT64 multiplier=1;
+   int end_char;
+
+   size_str=dupstr(size_string);	/* Writable copy */
+   size_len=strlen(size_str);
+   end_char = size_str[size_len-1];
+   if (!isdigit(end_char)) {	/* End character is not a digit */
+      size_str[size_len-1] = '\0';	/* Remove last character */
+      switch (end_char) {
+         case 'G':
+         case 'g':
+            multiplier = 1024*1024*1024;
+            break;
+         case 'M':
+         case 'm':
+            multiplier = 1024*1024;
+            break;
+         case 'K':
+         case 'k':
+            multiplier = 1024;
+            break;
+         default:
+            err_msg("ERROR: Unknown size multiplier character: \"%c\"",
+                    end_char);
+            break;
+      }
+   }
+   value=Strtoul(size_str, 10);
+   free(size_str);
+   return multiplier * value;
+}
+
+/*
+ *	timestamp_ns -- Return the system time in nanoseconds
+ *
+ *	Inputs:
+ *
+ *	None.
+ *
+ *	Returns:
+ *
+ *	The current wall-clock time in nanoseconds since the epoch.  This
+ *	is not simulated with --dryrun, so it is used to measure how long
+ *	tcp-scan itself takes.  The scan timing uses engine_time_ns().
+ */
+TCP_UINT64
+timestamp_ns(void) {
+   struct timespec ts;
+
+   Clock_gettime(CLOCK_REALTIME, &ts);
+
+   return (TCP_UINT64)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/*
+ *	in_cksum -- Internet checksum function
+ *
+ *	Inputs:
+ *
+ *	ptr		Pointer to data
+ *	nbytes		Number of bytes
+ *
+ *	Returns:
+ *
+ *	The checksum as a 16-bit unsigned value.
+ *
+ *	This is the standard BSD internet checksum routine.
+ */
+uint16_t
+in_cksum(const uint16_t *ptr, int nbytes) {
+
+   register uint32_t sum;
+   uint16_t oddbyte;
+   register uint16_t answer;
+
+/*
+ * Our algorithm is simple, using a 32-bit accumulator (sum),
+ * we add sequential 16-bit words to it, and at the end, fold back
+ * all the carry bits from the top 16 bits into the lower 16 bits.
+ */
+
+   sum = 0;
+   while (nbytes > 1)  {
+      sum += *ptr++;
+      nbytes -= 2;
+   }
+
+/* mop up an odd byte, if necessary */
+   if (nbytes == 1) {
+      oddbyte = 0;            /* make sure top half is zero */
+      *((u_char *) &oddbyte) = *(u_char *)ptr;   /* one byte only */
+      sum += oddbyte;
+   }
+
+/*
+ * Add back carry outs from top 16 bits to low 16 bits.
+ */
+
+   sum  = (sum >> 16) + (sum & 0xffff);    /* add high-16 to low-16 */
+   sum += (sum >> 16);                     /* add carry */
+   answer = ~sum;          /* ones-complement, then truncate to 16 bits */
+   return(answer);
+}
+
+/*
+ *	permute_index -- Position of an index in a keyed permutation
+ *
+ *	Inputs:
+ *
+ *	index	The index, from 0 to range-1
+ *	range	The number of indexes in the permutation
+ *	key	The permutation key
+ *
+ *	Returns:
+ *
+ *	The position of index in a pseudo-random permutation of 0 to
+ *	range-1 which depends only on range and key.
+ *
+ *	This is a four round Feistel network over the smallest even number
+ *	of bits that covers range.  A result outside the range is put
+ *	through the network again until it falls inside, which keeps the
+ *	mapping one-to-one.  The network covers less than four times the
+ *	range, so this takes fewer than four passes on average.  It needs
+ *	no memory, so any node can find the position of any index.
+ */
+uint32_t
+permute_index(uint32_t index, uint32_t range, TCP_UINT64 key) {
+   unsigned half_bits = 1;
+   uint32_t mask;
+   uint32_t left;
+   uint32_t right;
+   uint32_t temp;
+   TCP_UINT64 h;
+   int round;
+
+   while (half_bits < 16 && ((TCP_UINT64) 1 << (2 * half_bits)) < range)
+      half_bits++;
+   mask = ((uint32_t) 1 << half_bits) - 1;
+   do {
+      left = index >> half_bits;
+      right = index & mask;
+      for (round=0; round<4; round++) {
+         h = (right | (TCP_UINT64) round << 32) ^ key;	/* MurmurHash3 mix */
+         h ^= h >> 33;
+         h *= 0xff51afd7ed558ccdULL;
+         h ^= h >> 33;
+         h *= 0xc4ceb9fe1a85ec53ULL;
+         h ^= h >> 33;
+         temp = right;
+         right = left ^ ((uint32_t) h & mask);
+         left = temp;
+      }
+      index = left << half_bits | right;
+   } while (index >= range);
+
+   return index;
+}
+
 /*
  *	dupstr -- duplicate a string
  *
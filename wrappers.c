@@ -34,6 +34,10 @@
 
 #include "tcp-scan.h"
 
+/* Counted separately in each thread, so that they need no locking */
+static THREAD_LOCAL TCP_UINT64 alloc_calls=0;	/* Malloc() and Realloc() */
+static THREAD_LOCAL TCP_UINT64 clock_calls=0;	/* System clock reads */
+
 /*
  * We omit the timezone arg from this wrapper since it's obsolete and we never
  * use it.
@@ -41,6 +45,7 @@
 int Gettimeofday(struct timeval *tv) {
    int result;
 
+   clock_calls++;
    result = gettimeofday(tv, NULL);
 
    if (result != 0)
@@ -49,9 +54,22 @@ int Gettimeofday(struct timeval *tv) {
    return result;
 }
 
+int Clock_gettime(clockid_t clk_id, struct timespec *tp) {
+   int result;
+
+   clock_calls++;
+   result = clock_gettime(clk_id, tp);
+
+   if (result != 0)
+      err_sys("clock_gettime");
+
+   return result;
+}
+
 void *Malloc(size_t size) {
    void *result;
 
+   alloc_calls++;
    result = malloc(size);
 
    if (result == NULL)
@@ -63,6 +81,7 @@ void *Malloc(size_t size) {
 void *Realloc(void *ptr, size_t size) {
    void *result;
 
+   alloc_calls++;
    result=realloc(ptr, size);
 
    if (result == NULL)
@@ -71,6 +90,25 @@ void *Realloc(void *ptr, size_t size) {
    return result;
 }
 
+/*
+ * Return the number of calls to Malloc() and Realloc() so far in this
+ * thread.  This is used by the --replay benchmark to report allocations
+ * per packet.
+ */
+TCP_UINT64 alloc_count(void) {
+   return alloc_calls;
+}
+
+/*
+ * Return the number of times that Gettimeofday() and Clock_gettime() have
+ * read the system clock in this thread.  These are normally handled by
+ * the vDSO without entering the kernel, but they are counted with the
+ * system calls so that the cost per probe can be seen.
+ */
+TCP_UINT64 clock_count(void) {
+   return clock_calls;
+}
+
 unsigned long int Strtoul(const char *nptr, int base) {
    char *endptr;
    unsigned long int result;